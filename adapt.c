@@ -0,0 +1,107 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "adapt.h"
+#include "plan.h"
+
+static uint64_t adapt_clamp(const adapt_t *adapt, uint64_t step)
+{
+    if (step < adapt->minimum_step)
+    {
+        step = adapt->minimum_step;
+    }
+    if (step > adapt->maximum_step)
+    {
+        step = adapt->maximum_step;
+    }
+    return step - step % adapt->granularity;
+}
+
+static void adapt_start_window(adapt_t *adapt)
+{
+    adapt->window_count = adapt->latency->count;
+    adapt->window_sum = adapt->latency->sum;
+    adapt->window_bytes = 0;
+    adapt->window_submitted = 0;
+    clock_gettime(CLOCK_MONOTONIC, &adapt->window_start);
+}
+
+void adapt_init(adapt_t *adapt, const device_info_t *info, const histogram_t *latency, unsigned int queue_depth)
+{
+    memset(adapt, 0, sizeof(*adapt));
+    adapt->latency = latency;
+    adapt->granularity = plan_granularity(info);
+
+    /* the same limit plan_init() applies to a single command */
+    uint64_t lba_limit = info->maximum_unmap_lba_count;
+    if (lba_limit == 0)
+    {
+        lba_limit = UINT32_MAX;
+    }
+    adapt->maximum_step = lba_limit * info->sector_size;
+    if (adapt->maximum_step < adapt->granularity)
+    {
+        adapt->maximum_step = adapt->granularity;
+    }
+    adapt->minimum_step = ADAPT_MINIMUM_STEP < adapt->maximum_step ? ADAPT_MINIMUM_STEP : adapt->maximum_step;
+    if (adapt->minimum_step < adapt->granularity)
+    {
+        adapt->minimum_step = adapt->granularity;
+    }
+
+    adapt->step = adapt_clamp(adapt, ADAPT_INITIAL_STEP);
+    /* every command of a full queue should have been measured */
+    adapt->window = 2 * (queue_depth ? queue_depth : 1);
+    if (adapt->window < 4)
+    {
+        adapt->window = 4;
+    }
+    adapt_start_window(adapt);
+}
+
+bool adapt_submitted(adapt_t *adapt, uint64_t bytes)
+{
+    adapt->window_bytes += bytes;
+    adapt->window_submitted++;
+
+    uint64_t completed = adapt->latency->count - adapt->window_count;
+    if (completed < adapt->window)
+    {
+        return false;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (now.tv_sec - adapt->window_start.tv_sec) +
+                     (now.tv_nsec - adapt->window_start.tv_nsec) / 1e9;
+    /*
+     * A queue submits much more than completes while it fills up, so the
+     * throughput counts completed commands at the mean submitted size.
+     */
+    double completed_bytes = (double)adapt->window_bytes / adapt->window_submitted * completed;
+    double rate = seconds > 0 ? completed_bytes / seconds : 0;
+    uint64_t mean_latency = (adapt->latency->sum - adapt->window_sum) / completed;
+
+    uint64_t step = adapt->step;
+    if (mean_latency > ADAPT_TARGET_LATENCY || rate < adapt->best_rate * 3 / 4)
+    {
+        /* multiplicative decrease */
+        step = adapt_clamp(adapt, step / 2);
+    }
+    else
+    {
+        /* additive increase */
+        step = adapt_clamp(adapt, step + ADAPT_INITIAL_STEP);
+    }
+    if (rate > adapt->best_rate)
+    {
+        adapt->best_rate = rate;
+    }
+
+    adapt_start_window(adapt);
+
+    bool changed = step != adapt->step;
+    adapt->step = step;
+    return changed;
+}
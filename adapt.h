@@ -0,0 +1,61 @@
+#ifndef ADAPT_H
+#define ADAPT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "utils.h"
+#include "histogram.h"
+
+/* initial bytes per command */
+#define ADAPT_INITIAL_STEP (64ULL << 20)
+/* smallest bytes per command the controller goes down to */
+#define ADAPT_MINIMUM_STEP (1ULL << 20)
+/* mean command latency the controller stays below, in nanoseconds */
+#define ADAPT_TARGET_LATENCY (SG_TIMEOUT * 1000000ULL / 20)
+
+typedef struct adapt
+{
+    const histogram_t *latency;
+    uint64_t step;
+    uint64_t minimum_step;
+    uint64_t maximum_step;
+    uint64_t granularity;
+    /* completed commands between two adjustments */
+    unsigned int window;
+    uint64_t window_count;
+    uint64_t window_sum;
+    uint64_t window_bytes;
+    uint64_t window_submitted;
+    struct timespec window_start;
+    /* best throughput seen so far in byte per second */
+    double best_rate;
+} adapt_t;
+
+/**
+ * @brief start sizing UNMAP commands by their completion latency.
+ *
+ * The bytes per command grow by ADAPT_INITIAL_STEP after every window
+ * that completes below ADAPT_TARGET_LATENCY without losing throughput,
+ * and are halved when the mean latency goes above it or the throughput
+ * drops below three quarters of the best seen.
+ *
+ * @param adapt controller to initialize.
+ * @param info device info.
+ * @param latency histogram the command latencies are recorded in, in
+ *        nanoseconds; it must outlive the controller.
+ * @param queue_depth number of commands in flight.
+ */
+void adapt_init(adapt_t *adapt, const device_info_t *info, const histogram_t *latency, unsigned int queue_depth);
+
+/**
+ * @brief account the bytes of submitted commands and adjust the step.
+ *
+ * @param adapt the controller.
+ * @param bytes bytes just submitted.
+ * @return true if the step changed.
+ */
+bool adapt_submitted(adapt_t *adapt, uint64_t bytes);
+
+#endif /* ADAPT_H */
@@ -0,0 +1,76 @@
+#ifndef BYTEORDER_H
+#define BYTEORDER_H
+
+#include <stdint.h>
+
+static inline void u16_to_big_endian_bytes(uint16_t val, void *p)
+{
+    ((uint8_t *)p)[0] = (uint8_t)(val >> 8);
+    ((uint8_t *)p)[1] = (uint8_t)val;
+}
+
+static inline void u32_to_big_endian_bytes(uint32_t val, void *p)
+{
+    u16_to_big_endian_bytes(val >> 16, p);
+    u16_to_big_endian_bytes(val, (uint8_t *)p + 2);
+}
+
+static inline void u64_to_big_endian_bytes(uint64_t val, void *p)
+{
+    u32_to_big_endian_bytes(val >> 32, p);
+    u32_to_big_endian_bytes(val, (uint8_t *)p + 4);
+}
+
+static inline uint16_t u16_from_big_endian_bytes(const void *p)
+{
+    return ((const uint8_t *)p)[0] << 8 | ((const uint8_t *)p)[1];
+}
+
+static inline uint32_t u32_from_big_endian_bytes(const void *p)
+{
+    return (uint32_t)u16_from_big_endian_bytes(p) << 16 |
+           u16_from_big_endian_bytes((const uint8_t *)p + 2);
+}
+
+static inline uint64_t u64_from_big_endian_bytes(const void *p)
+{
+    return (uint64_t)u32_from_big_endian_bytes(p) << 32 |
+           u32_from_big_endian_bytes((const uint8_t *)p + 4);
+}
+
+static inline void u16_to_little_endian_bytes(uint16_t val, void *p)
+{
+    ((uint8_t *)p)[0] = (uint8_t)val;
+    ((uint8_t *)p)[1] = (uint8_t)(val >> 8);
+}
+
+static inline void u32_to_little_endian_bytes(uint32_t val, void *p)
+{
+    u16_to_little_endian_bytes(val, p);
+    u16_to_little_endian_bytes(val >> 16, (uint8_t *)p + 2);
+}
+
+static inline void u64_to_little_endian_bytes(uint64_t val, void *p)
+{
+    u32_to_little_endian_bytes(val, p);
+    u32_to_little_endian_bytes(val >> 32, (uint8_t *)p + 4);
+}
+
+static inline uint16_t u16_from_little_endian_bytes(const void *p)
+{
+    return ((const uint8_t *)p)[1] << 8 | ((const uint8_t *)p)[0];
+}
+
+static inline uint32_t u32_from_little_endian_bytes(const void *p)
+{
+    return (uint32_t)u16_from_little_endian_bytes((const uint8_t *)p + 2) << 16 |
+           u16_from_little_endian_bytes(p);
+}
+
+static inline uint64_t u64_from_little_endian_bytes(const void *p)
+{
+    return (uint64_t)u32_from_little_endian_bytes((const uint8_t *)p + 4) << 32 |
+           u32_from_little_endian_bytes(p);
+}
+
+#endif /* BYTEORDER_H */
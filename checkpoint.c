@@ -0,0 +1,185 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+#include "byteorder.h"
+
+#define CHECKPOINT_RECORD_LEN 16
+
+static int checkpoint_write_all(int fd, const void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = write(fd, buf, len);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret < 0)
+        {
+            return -1;
+        }
+        buf = (const uint8_t *)buf + ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void checkpoint_header(uint8_t *header, const char *serial, uint64_t capacity)
+{
+    memset(header, 0, CHECKPOINT_HEADER_LEN);
+    memcpy(header, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_LEN);
+    u64_to_little_endian_bytes(capacity, header + CHECKPOINT_MAGIC_LEN);
+    strncpy((char *)header + CHECKPOINT_MAGIC_LEN + 8, serial, CHECKPOINT_SERIAL_LEN);
+}
+
+/* read back the records of an existing journal */
+static int checkpoint_load(int fd, const uint8_t *expected, extent_list_t *done)
+{
+    uint8_t header[CHECKPOINT_HEADER_LEN];
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, expected, sizeof(header)))
+    {
+        errno = ESTALE;
+        return -1;
+    }
+
+    uint8_t records[CHECKPOINT_RECORD_LEN * 256];
+    off_t offset = CHECKPOINT_HEADER_LEN;
+    while (true)
+    {
+        ssize_t len = pread(fd, records, sizeof(records), offset);
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len < 0)
+        {
+            return -1;
+        }
+
+        /* a torn record at the end is the one being written when the run stopped */
+        len -= len % CHECKPOINT_RECORD_LEN;
+        if (len == 0)
+        {
+            break;
+        }
+        for (ssize_t i = 0; i < len; i += CHECKPOINT_RECORD_LEN)
+        {
+            if (extent_list_append(done, u64_from_little_endian_bytes(records + i),
+                                   u64_from_little_endian_bytes(records + i + 8)))
+            {
+                return -1;
+            }
+        }
+        offset += len;
+    }
+
+    /* new records go after the last whole one */
+    if (ftruncate(fd, offset) || lseek(fd, offset, SEEK_SET) < 0)
+    {
+        return -1;
+    }
+
+    extent_list_normalize(done);
+    return 0;
+}
+
+int checkpoint_open(checkpoint_t *checkpoint, const char *path, const char *serial, uint64_t capacity,
+                    extent_list_t *done)
+{
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    checkpoint->path = path;
+    clock_gettime(CLOCK_MONOTONIC, &checkpoint->last_sync);
+
+    uint8_t header[CHECKPOINT_HEADER_LEN];
+    checkpoint_header(header, serial, capacity);
+
+    checkpoint->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (checkpoint->fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat sb;
+    int ret;
+    if (fstat(checkpoint->fd, &sb))
+    {
+        ret = -1;
+    }
+    else if (sb.st_size > 0)
+    {
+        ret = checkpoint_load(checkpoint->fd, header, done);
+    }
+    else
+    {
+        ret = checkpoint_write_all(checkpoint->fd, header, sizeof(header)) || fsync(checkpoint->fd) ? -1 : 0;
+    }
+
+    if (ret)
+    {
+        int saved_errno = errno;
+        close(checkpoint->fd);
+        checkpoint->fd = -1;
+        errno = saved_errno;
+    }
+    return ret;
+}
+
+int checkpoint_record(checkpoint_t *checkpoint, uint64_t offset, uint64_t length)
+{
+    return extent_list_append(&checkpoint->pending, offset, length);
+}
+
+bool checkpoint_due(const checkpoint_t *checkpoint)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - checkpoint->last_sync.tv_sec >= CHECKPOINT_SYNC_INTERVAL;
+}
+
+int checkpoint_sync(checkpoint_t *checkpoint)
+{
+    extent_list_t *pending = &checkpoint->pending;
+    uint8_t record[CHECKPOINT_RECORD_LEN];
+    for (size_t i = 0; i < pending->count; i++)
+    {
+        u64_to_little_endian_bytes(pending->extents[i].offset, record);
+        u64_to_little_endian_bytes(pending->extents[i].length, record + 8);
+        if (checkpoint_write_all(checkpoint->fd, record, sizeof(record)))
+        {
+            return -1;
+        }
+    }
+
+    if (fdatasync(checkpoint->fd))
+    {
+        return -1;
+    }
+
+    pending->count = 0;
+    clock_gettime(CLOCK_MONOTONIC, &checkpoint->last_sync);
+    return 0;
+}
+
+int checkpoint_close(checkpoint_t *checkpoint, bool remove)
+{
+    int ret = 0;
+    if (checkpoint->fd >= 0)
+    {
+        ret = close(checkpoint->fd);
+        checkpoint->fd = -1;
+        if (remove && unlink(checkpoint->path))
+        {
+            ret = -1;
+        }
+    }
+    extent_list_free(&checkpoint->pending);
+    return ret;
+}
@@ -0,0 +1,84 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "extent.h"
+
+/* magic of a checkpoint journal, followed by the capacity and the serial of the device */
+#define CHECKPOINT_MAGIC "SGDCHKPT"
+#define CHECKPOINT_MAGIC_LEN 8
+#define CHECKPOINT_SERIAL_LEN 64
+#define CHECKPOINT_HEADER_LEN (CHECKPOINT_MAGIC_LEN + 8 + CHECKPOINT_SERIAL_LEN)
+/* seconds between two syncs of the journal */
+#define CHECKPOINT_SYNC_INTERVAL 5
+
+typedef struct checkpoint
+{
+    int fd;
+    const char *path;
+    /* discarded extents not yet in the journal */
+    extent_list_t pending;
+    struct timespec last_sync;
+} checkpoint_t;
+
+/**
+ * @brief open or create the journal of completed extents.
+ *
+ * The journal holds a header identifying the device followed by 16-byte
+ * little-endian offset/length records. A journal written for another
+ * device is refused with ESTALE; a torn record at the end is ignored.
+ *
+ * @param checkpoint checkpoint to initialize.
+ * @param path journal file, must outlive the checkpoint.
+ * @param serial unit serial number of the device.
+ * @param capacity size of the device in byte.
+ * @param done extents recorded by earlier runs are appended here, sorted and merged.
+ * @return returns 0 if there is no error.
+ */
+int checkpoint_open(checkpoint_t *checkpoint, const char *path, const char *serial, uint64_t capacity,
+                    extent_list_t *done);
+
+/**
+ * @brief remember a discarded extent.
+ *
+ * @param checkpoint the checkpoint.
+ * @param offset offset in byte.
+ * @param length length in byte.
+ * @return returns 0 if there is no error.
+ */
+int checkpoint_record(checkpoint_t *checkpoint, uint64_t offset, uint64_t length);
+
+/**
+ * @brief check whether the remembered extents should be synced.
+ *
+ * @param checkpoint the checkpoint.
+ * @return true once CHECKPOINT_SYNC_INTERVAL has passed since the last sync.
+ */
+bool checkpoint_due(const checkpoint_t *checkpoint);
+
+/**
+ * @brief append the remembered extents to the journal and sync it.
+ *
+ * The caller must make sure the commands of these extents completed.
+ *
+ * @param checkpoint the checkpoint.
+ * @return returns 0 if there is no error.
+ */
+int checkpoint_sync(checkpoint_t *checkpoint);
+
+/**
+ * @brief close the journal.
+ *
+ * Extents not synced yet are dropped, they are discarded again on the
+ * next run.
+ *
+ * @param checkpoint the checkpoint.
+ * @param remove delete the journal, e.g. once the whole discard is done.
+ * @return returns 0 if there is no error.
+ */
+int checkpoint_close(checkpoint_t *checkpoint, bool remove);
+
+#endif /* CHECKPOINT_H */
@@ -0,0 +1,249 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extent.h"
+
+#define EXTENT_LIST_INITIAL_CAPACITY 64
+
+/*
+ * Make room for one more extent.
+ * Returns	0  success
+ * 		<0 error
+ */
+static int extent_list_reserve(extent_list_t *list)
+{
+    if (list->count == list->capacity)
+    {
+        size_t capacity = list->capacity ? list->capacity * 2 : EXTENT_LIST_INITIAL_CAPACITY;
+        unmap_extent_t *extents = realloc(list->extents, capacity * sizeof(*extents));
+        if (extents == NULL)
+        {
+            return -1;
+        }
+        list->extents = extents;
+        list->capacity = capacity;
+    }
+    return 0;
+}
+
+int extent_list_append(extent_list_t *list, uint64_t offset, uint64_t length)
+{
+    if (length == 0)
+    {
+        return 0;
+    }
+
+    if (list->count > 0)
+    {
+        unmap_extent_t *last = &list->extents[list->count - 1];
+        if (last->offset + last->length == offset)
+        {
+            last->length += length;
+            return 0;
+        }
+    }
+
+    if (extent_list_reserve(list))
+    {
+        return -1;
+    }
+
+    list->extents[list->count].offset = offset;
+    list->extents[list->count].length = length;
+    list->count++;
+    return 0;
+}
+
+int extent_list_insert(extent_list_t *list, uint64_t offset, uint64_t length)
+{
+    if (length == 0)
+    {
+        return 0;
+    }
+    uint64_t end = offset + length;
+
+    /* binary search for the first extent ending at or after offset, the first one the area can touch */
+    size_t low = 0, high = list->count;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (list->extents[mid].offset + list->extents[mid].length < offset)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    /* every extent starting at or before the end of the area merges into it */
+    size_t next = low;
+    while (next < list->count && list->extents[next].offset <= end)
+    {
+        uint64_t extent_end = list->extents[next].offset + list->extents[next].length;
+        if (list->extents[next].offset < offset)
+        {
+            offset = list->extents[next].offset;
+        }
+        if (extent_end > end)
+        {
+            end = extent_end;
+        }
+        next++;
+    }
+
+    if (next > low)
+    {
+        memmove(&list->extents[low + 1], &list->extents[next], (list->count - next) * sizeof(*list->extents));
+        list->count -= next - low - 1;
+    }
+    else
+    {
+        if (extent_list_reserve(list))
+        {
+            return -1;
+        }
+        memmove(&list->extents[low + 1], &list->extents[low], (list->count - low) * sizeof(*list->extents));
+        list->count++;
+    }
+    list->extents[low].offset = offset;
+    list->extents[low].length = end - offset;
+    return 0;
+}
+
+int extent_list_append_aligned(extent_list_t *list, uint64_t offset, uint64_t length, uint32_t alignment)
+{
+    uint64_t start = offset + (alignment - offset % alignment) % alignment;
+    uint64_t end = offset + length;
+    end -= end % alignment;
+
+    return end > start ? extent_list_append(list, start, end - start) : 0;
+}
+
+static int extent_compare(const void *a, const void *b)
+{
+    const unmap_extent_t *x = a, *y = b;
+    if (x->offset != y->offset)
+    {
+        return x->offset < y->offset ? -1 : 1;
+    }
+    return x->length < y->length ? -1 : x->length > y->length;
+}
+
+void extent_list_normalize(extent_list_t *list)
+{
+    if (list->count < 2)
+    {
+        return;
+    }
+
+    qsort(list->extents, list->count, sizeof(*list->extents), extent_compare);
+
+    size_t merged = 0;
+    for (size_t i = 1; i < list->count; i++)
+    {
+        unmap_extent_t *last = &list->extents[merged];
+        const unmap_extent_t *extent = &list->extents[i];
+        uint64_t last_end = last->offset + last->length;
+        if (extent->offset <= last_end)
+        {
+            uint64_t end = extent->offset + extent->length;
+            if (end > last_end)
+            {
+                last->length = end - last->offset;
+            }
+        }
+        else
+        {
+            list->extents[++merged] = *extent;
+        }
+    }
+    list->count = merged + 1;
+}
+
+int extent_list_intersect(const unmap_extent_t *extents, size_t count, const extent_list_t *mask,
+                          extent_list_t *out)
+{
+    size_t i = 0, j = 0;
+    while (i < count && j < mask->count)
+    {
+        uint64_t a_end = extents[i].offset + extents[i].length;
+        uint64_t b_end = mask->extents[j].offset + mask->extents[j].length;
+        uint64_t start = extents[i].offset > mask->extents[j].offset ? extents[i].offset : mask->extents[j].offset;
+        uint64_t end = a_end < b_end ? a_end : b_end;
+
+        if (end > start && extent_list_append(out, start, end - start))
+        {
+            return -1;
+        }
+
+        if (a_end < b_end)
+        {
+            i++;
+        }
+        else
+        {
+            j++;
+        }
+    }
+    return 0;
+}
+
+int extent_list_subtract(const unmap_extent_t *extents, size_t count, const extent_list_t *mask,
+                         extent_list_t *out)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t offset = extents[i].offset;
+        uint64_t end = offset + extents[i].length;
+
+        /* masks ending before this extent cannot touch the later ones either */
+        while (j < mask->count && mask->extents[j].offset + mask->extents[j].length <= offset)
+        {
+            j++;
+        }
+
+        for (size_t k = j; k < mask->count && mask->extents[k].offset < end; k++)
+        {
+            const unmap_extent_t *cut = &mask->extents[k];
+            if (cut->offset > offset && extent_list_append(out, offset, cut->offset - offset))
+            {
+                return -1;
+            }
+            uint64_t cut_end = cut->offset + cut->length;
+            if (cut_end > offset)
+            {
+                offset = cut_end;
+            }
+            if (offset >= end)
+            {
+                break;
+            }
+        }
+
+        if (offset < end && extent_list_append(out, offset, end - offset))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+uint64_t extent_list_bytes(const extent_list_t *list)
+{
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < list->count; i++)
+    {
+        bytes += list->extents[i].length;
+    }
+    return bytes;
+}
+
+void extent_list_free(extent_list_t *list)
+{
+    free(list->extents);
+    memset(list, 0, sizeof(*list));
+}
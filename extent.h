@@ -0,0 +1,100 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+typedef struct extent_list
+{
+    unmap_extent_t *extents;
+    size_t count;
+    size_t capacity;
+} extent_list_t;
+
+/**
+ * @brief append an area to the list.
+ *
+ * The area is merged into the last extent if they touch.
+ *
+ * @param list the list.
+ * @param offset offset in byte.
+ * @param length length in byte, empty areas are ignored.
+ * @return returns 0 if there is no error.
+ */
+int extent_list_append(extent_list_t *list, uint64_t offset, uint64_t length);
+
+/**
+ * @brief insert an area into a sorted list.
+ *
+ * The list stays sorted by offset and free of overlapping or adjacent
+ * extents, the area is merged with every extent it touches. The place
+ * is found by binary search, so inserting costs O(log n) plus moving
+ * the extents behind it.
+ *
+ * @param list the list, sorted and merged like extent_list_normalize() leaves it.
+ * @param offset offset in byte.
+ * @param length length in byte, empty areas are ignored.
+ * @return returns 0 if there is no error.
+ */
+int extent_list_insert(extent_list_t *list, uint64_t offset, uint64_t length);
+
+/**
+ * @brief append the whole aligned blocks of an area to the list.
+ *
+ * @param list the list.
+ * @param offset offset in byte.
+ * @param length length in byte.
+ * @param alignment block size in byte, partial blocks on both ends are dropped.
+ * @return returns 0 if there is no error.
+ */
+int extent_list_append_aligned(extent_list_t *list, uint64_t offset, uint64_t length, uint32_t alignment);
+
+/**
+ * @brief sort the list by offset and merge overlapping or adjacent extents.
+ *
+ * @param list the list.
+ */
+void extent_list_normalize(extent_list_t *list);
+
+/**
+ * @brief keep only the parts of a list of areas covered by a mask.
+ *
+ * @param extents areas, sorted by offset and not overlapping.
+ * @param count number of extents.
+ * @param mask covering list, sorted by offset and not overlapping.
+ * @param out the intersection is appended here.
+ * @return returns 0 if there is no error.
+ */
+int extent_list_intersect(const unmap_extent_t *extents, size_t count, const extent_list_t *mask,
+                          extent_list_t *out);
+
+/**
+ * @brief keep only the parts of a list of areas not covered by a mask.
+ *
+ * @param extents areas, sorted by offset and not overlapping.
+ * @param count number of extents.
+ * @param mask list to cut out, sorted by offset and not overlapping.
+ * @param out the difference is appended here.
+ * @return returns 0 if there is no error.
+ */
+int extent_list_subtract(const unmap_extent_t *extents, size_t count, const extent_list_t *mask,
+                         extent_list_t *out);
+
+/**
+ * @brief get the number of bytes covered by the list.
+ *
+ * @param list the list.
+ * @return sum of all extent lengths.
+ */
+uint64_t extent_list_bytes(const extent_list_t *list);
+
+/**
+ * @brief release the memory of the list.
+ *
+ * @param list the list, empty afterwards.
+ */
+void extent_list_free(extent_list_t *list);
+
+#endif /* EXTENT_H */
@@ -0,0 +1,704 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "fsfree.h"
+#include "byteorder.h"
+
+#define EXT4_SUPERBLOCK_OFFSET 1024
+#define EXT4_SUPERBLOCK_LEN 1024
+#define EXT4_MAGIC 0xef53
+#define EXT4_VALID_FS 0x0001
+#define EXT4_ERROR_FS 0x0002
+#define EXT4_FEATURE_COMPAT_SPARSE_SUPER2 0x0200
+#define EXT4_FEATURE_INCOMPAT_RECOVER 0x0004
+#define EXT4_FEATURE_INCOMPAT_JOURNAL_DEV 0x0008
+#define EXT4_FEATURE_INCOMPAT_META_BG 0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x0080
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT4_FEATURE_RO_COMPAT_BIGALLOC 0x0200
+#define EXT4_BG_BLOCK_UNINIT 0x0002
+#define EXT4_MIN_DESC_SIZE 32
+#define EXT4_MIN_DESC_SIZE_64BIT 64
+#define EXT4_GOOD_OLD_INODE_SIZE 128
+
+#define XFS_SB_MAGIC 0x58465342      /* XFSB */
+#define XFS_AGF_MAGIC 0x58414746     /* XAGF */
+#define XFS_ABTB_MAGIC 0x41425442    /* ABTB */
+#define XFS_ABTB_CRC_MAGIC 0x41423342 /* AB3B */
+#define XFS_SB_VERSION_NUMBITS 0x000f
+#define XFS_SB_VERSION_5 5
+#define XFS_SB_LEN 512
+#define XFS_BTREE_SBLOCK_LEN 16
+#define XFS_BTREE_SBLOCK_CRC_LEN 56
+#define XFS_BTREE_MAXLEVELS 9
+#define XFS_ALLOC_REC_LEN 8
+#define XFS_ALLOC_PTR_LEN 4
+
+#define XLOG_BBSIZE 512
+#define XLOG_HEADER_MAGIC 0xfeedbabe
+#define XLOG_VERSION_2 0x2
+#define XLOG_HEADER_CYCLE_SIZE (32 * 1024)
+#define XLOG_MAX_RECORD_BBLOCKS (2 * 256 * 1024 / XLOG_BBSIZE)
+#define XLOG_UNMOUNT_TRANS 0x20
+
+static int fsfree_read(int fd, uint64_t offset, void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = pread(fd, buf, len, offset);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0)
+        {
+            errno = EIO;
+            return -1;
+        }
+        buf = (uint8_t *)buf + ret;
+        offset += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* emit the runs of clear bits of an allocation bitmap */
+static int fsfree_bitmap_runs(const uint8_t *bitmap, uint64_t bits, uint64_t first_block, uint32_t block_size,
+                              uint64_t start, uint32_t sector_size, extent_list_t *extents, uint64_t *free_bits)
+{
+    uint64_t run_start = 0;
+    bool in_run = false;
+    for (uint64_t bit = 0; bit <= bits; bit++)
+    {
+        bool used = bit == bits || (bitmap[bit / 8] >> (bit % 8) & 1);
+        if (!used && !in_run)
+        {
+            run_start = bit;
+            in_run = true;
+        }
+        else if (used && in_run)
+        {
+            *free_bits += bit - run_start;
+            if (extent_list_append_aligned(extents, start + (first_block + run_start) * block_size,
+                                           (bit - run_start) * block_size, sector_size))
+            {
+                return -1;
+            }
+            in_run = false;
+        }
+    }
+    return 0;
+}
+
+typedef struct ext4_fs
+{
+    uint32_t block_size;
+    uint64_t blocks_count;
+    uint32_t first_data_block;
+    uint32_t blocks_per_group;
+    uint32_t group_count;
+    uint32_t desc_size;
+    uint32_t gdt_blocks;
+    uint32_t reserved_gdt_blocks;
+    uint32_t inode_table_blocks;
+    uint32_t compat;
+    uint32_t ro_compat;
+    uint32_t backup_bgs[2];
+    uint8_t *gdt;
+    extent_list_t metadata;
+} ext4_fs_t;
+
+static bool ext4_is_power_of(uint32_t n, uint32_t base)
+{
+    while (n > 1 && n % base == 0)
+    {
+        n /= base;
+    }
+    return n == 1;
+}
+
+static bool ext4_group_has_super(const ext4_fs_t *fs, uint32_t group)
+{
+    if (group == 0)
+    {
+        return true;
+    }
+    if (fs->compat & EXT4_FEATURE_COMPAT_SPARSE_SUPER2)
+    {
+        return group == fs->backup_bgs[0] || group == fs->backup_bgs[1];
+    }
+    if (!(fs->ro_compat & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER))
+    {
+        return true;
+    }
+    return ext4_is_power_of(group, 3) || ext4_is_power_of(group, 5) || ext4_is_power_of(group, 7);
+}
+
+static uint64_t ext4_desc_field(const ext4_fs_t *fs, uint32_t group, size_t lo, size_t hi)
+{
+    const uint8_t *desc = fs->gdt + (size_t)group * fs->desc_size;
+    uint64_t value = u32_from_little_endian_bytes(desc + lo);
+    if (fs->desc_size >= EXT4_MIN_DESC_SIZE_64BIT)
+    {
+        value |= (uint64_t)u32_from_little_endian_bytes(desc + hi) << 32;
+    }
+    return value;
+}
+
+static uint32_t ext4_desc_free_blocks(const ext4_fs_t *fs, uint32_t group)
+{
+    const uint8_t *desc = fs->gdt + (size_t)group * fs->desc_size;
+    uint32_t value = u16_from_little_endian_bytes(desc + 12);
+    if (fs->desc_size >= EXT4_MIN_DESC_SIZE_64BIT)
+    {
+        value |= (uint32_t)u16_from_little_endian_bytes(desc + 0x2c) << 16;
+    }
+    return value;
+}
+
+static void ext4_mark(uint8_t *bitmap, uint64_t group_start, uint64_t group_len, uint64_t start, uint64_t len)
+{
+    uint64_t end = start + len;
+    if (start < group_start)
+    {
+        start = group_start;
+    }
+    if (end > group_start + group_len)
+    {
+        end = group_start + group_len;
+    }
+    for (uint64_t block = start; block < end; block++)
+    {
+        bitmap[(block - group_start) / 8] |= 1 << ((block - group_start) % 8);
+    }
+}
+
+/* block bitmaps, inode bitmaps and inode tables of all groups, in blocks */
+static int ext4_collect_metadata(ext4_fs_t *fs)
+{
+    for (uint32_t g = 0; g < fs->group_count; g++)
+    {
+        if (extent_list_append(&fs->metadata, ext4_desc_field(fs, g, 0x0, 0x20), 1) ||
+            extent_list_append(&fs->metadata, ext4_desc_field(fs, g, 0x4, 0x24), 1) ||
+            extent_list_append(&fs->metadata, ext4_desc_field(fs, g, 0x8, 0x28), fs->inode_table_blocks))
+        {
+            return -1;
+        }
+    }
+    extent_list_normalize(&fs->metadata);
+    return 0;
+}
+
+/*
+ * Groups flagged BLOCK_UNINIT have no bitmap on disk. Their only used
+ * blocks are the superblock backup with the descriptor table, and group
+ * metadata that flex_bg may have placed there.
+ */
+static int ext4_synthesize_bitmap(ext4_fs_t *fs, uint32_t group, uint64_t group_start,
+                                  uint64_t group_len, uint8_t *bitmap)
+{
+    if (fs->metadata.count == 0 && ext4_collect_metadata(fs))
+    {
+        return -1;
+    }
+
+    memset(bitmap, 0, fs->block_size);
+    if (ext4_group_has_super(fs, group))
+    {
+        ext4_mark(bitmap, group_start, group_len, group_start, 1 + fs->gdt_blocks + fs->reserved_gdt_blocks);
+    }
+
+    /* find the first metadata extent that ends inside or after the group */
+    size_t low = 0, high = fs->metadata.count;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        const unmap_extent_t *extent = &fs->metadata.extents[mid];
+        if (extent->offset + extent->length <= group_start)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    for (size_t i = low; i < fs->metadata.count && fs->metadata.extents[i].offset < group_start + group_len; i++)
+    {
+        ext4_mark(bitmap, group_start, group_len, fs->metadata.extents[i].offset, fs->metadata.extents[i].length);
+    }
+    return 0;
+}
+
+static int ext4_collect(int fd, uint64_t start, uint32_t sector_size, extent_list_t *extents)
+{
+    uint8_t sb[EXT4_SUPERBLOCK_LEN];
+    if (fsfree_read(fd, EXT4_SUPERBLOCK_OFFSET, sb, sizeof(sb)))
+    {
+        return -1;
+    }
+    if (u16_from_little_endian_bytes(sb + 56) != EXT4_MAGIC)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint16_t state = u16_from_little_endian_bytes(sb + 58);
+    uint32_t incompat = u32_from_little_endian_bytes(sb + 96);
+    if (!(state & EXT4_VALID_FS) || (state & EXT4_ERROR_FS) || (incompat & EXT4_FEATURE_INCOMPAT_RECOVER))
+    {
+        errno = EUCLEAN;
+        return -1;
+    }
+
+    ext4_fs_t fs = {0};
+    fs.compat = u32_from_little_endian_bytes(sb + 92);
+    fs.ro_compat = u32_from_little_endian_bytes(sb + 100);
+    if ((incompat & (EXT4_FEATURE_INCOMPAT_JOURNAL_DEV | EXT4_FEATURE_INCOMPAT_META_BG)) ||
+        (fs.ro_compat & EXT4_FEATURE_RO_COMPAT_BIGALLOC))
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    uint32_t inode_size = u32_from_little_endian_bytes(sb + 76) ? u16_from_little_endian_bytes(sb + 88)
+                                                                 : EXT4_GOOD_OLD_INODE_SIZE;
+    fs.block_size = 1024U << u32_from_little_endian_bytes(sb + 24);
+    fs.blocks_count = u32_from_little_endian_bytes(sb + 4);
+    if (incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+    {
+        fs.blocks_count |= (uint64_t)u32_from_little_endian_bytes(sb + 0x150) << 32;
+        fs.desc_size = u16_from_little_endian_bytes(sb + 254);
+        if (fs.desc_size < EXT4_MIN_DESC_SIZE_64BIT)
+        {
+            fs.desc_size = EXT4_MIN_DESC_SIZE_64BIT;
+        }
+    }
+    else
+    {
+        fs.desc_size = EXT4_MIN_DESC_SIZE;
+    }
+    fs.first_data_block = u32_from_little_endian_bytes(sb + 20);
+    fs.blocks_per_group = u32_from_little_endian_bytes(sb + 32);
+    fs.reserved_gdt_blocks = u16_from_little_endian_bytes(sb + 206);
+    fs.backup_bgs[0] = u32_from_little_endian_bytes(sb + 0x24c);
+    fs.backup_bgs[1] = u32_from_little_endian_bytes(sb + 0x250);
+    uint32_t inodes_per_group = u32_from_little_endian_bytes(sb + 40);
+
+    if (fs.block_size > 65536 || fs.blocks_per_group == 0 || fs.blocks_per_group > fs.block_size * 8 ||
+        fs.blocks_count <= fs.first_data_block)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fs.group_count = (fs.blocks_count - fs.first_data_block + fs.blocks_per_group - 1) / fs.blocks_per_group;
+    fs.gdt_blocks = ((uint64_t)fs.group_count * fs.desc_size + fs.block_size - 1) / fs.block_size;
+    fs.inode_table_blocks = ((uint64_t)inodes_per_group * inode_size + fs.block_size - 1) / fs.block_size;
+
+    fs.gdt = malloc((size_t)fs.gdt_blocks * fs.block_size);
+    uint8_t *bitmap = malloc(fs.block_size);
+    int ret = -1;
+    if (fs.gdt == NULL || bitmap == NULL ||
+        fsfree_read(fd, (uint64_t)(fs.first_data_block + 1) * fs.block_size, fs.gdt,
+                    (size_t)fs.gdt_blocks * fs.block_size))
+    {
+        goto out;
+    }
+
+    for (uint32_t group = 0; group < fs.group_count; group++)
+    {
+        uint64_t group_start = fs.first_data_block + (uint64_t)group * fs.blocks_per_group;
+        uint64_t group_len = fs.blocks_count - group_start;
+        if (group_len > fs.blocks_per_group)
+        {
+            group_len = fs.blocks_per_group;
+        }
+
+        uint16_t flags = u16_from_little_endian_bytes(fs.gdt + (size_t)group * fs.desc_size + 18);
+        if (flags & EXT4_BG_BLOCK_UNINIT)
+        {
+            if (ext4_synthesize_bitmap(&fs, group, group_start, group_len, bitmap))
+            {
+                goto out;
+            }
+        }
+        else if (fsfree_read(fd, ext4_desc_field(&fs, group, 0x0, 0x20) * fs.block_size, bitmap, fs.block_size))
+        {
+            goto out;
+        }
+
+        /* skip a group whose bitmap disagrees with its descriptor */
+        extent_list_t group_extents = {0};
+        uint64_t free_blocks = 0;
+        if (fsfree_bitmap_runs(bitmap, group_len, group_start, fs.block_size, start, sector_size,
+                               &group_extents, &free_blocks))
+        {
+            extent_list_free(&group_extents);
+            goto out;
+        }
+        if (free_blocks == ext4_desc_free_blocks(&fs, group))
+        {
+            for (size_t i = 0; i < group_extents.count; i++)
+            {
+                if (extent_list_append(extents, group_extents.extents[i].offset, group_extents.extents[i].length))
+                {
+                    extent_list_free(&group_extents);
+                    goto out;
+                }
+            }
+        }
+        extent_list_free(&group_extents);
+    }
+
+    ret = 0;
+
+out:
+    extent_list_free(&fs.metadata);
+    free(bitmap);
+    free(fs.gdt);
+    return ret;
+}
+
+typedef struct xfs_fs
+{
+    int fd;
+    uint32_t block_size;
+    uint32_t sect_size;
+    uint32_t ag_blocks;
+    uint32_t ag_count;
+    uint8_t ag_blk_log;
+    uint32_t btree_header_len;
+    uint32_t btree_magic;
+    uint8_t *block;
+} xfs_fs_t;
+
+static uint64_t xfs_ag_offset(const xfs_fs_t *fs, uint32_t agno, uint32_t agbno)
+{
+    return ((uint64_t)agno * fs->ag_blocks + agbno) * fs->block_size;
+}
+
+static uint32_t xlog_cycle(int fd, uint64_t log_offset, uint64_t bb, int *err)
+{
+    uint8_t buf[8];
+    if (fsfree_read(fd, log_offset + bb * XLOG_BBSIZE, buf, sizeof(buf)))
+    {
+        *err = -1;
+        return 0;
+    }
+    /* record headers keep their cycle in h_cycle, all other blocks are stamped */
+    if (u32_from_big_endian_bytes(buf) == XLOG_HEADER_MAGIC)
+    {
+        return u32_from_big_endian_bytes(buf + 4);
+    }
+    return u32_from_big_endian_bytes(buf);
+}
+
+/*
+ * A cleanly unmounted log ends with a record holding exactly one
+ * operation, the unmount transaction, and the head of the log is the
+ * block right after it.
+ */
+static int xfs_log_is_clean(const xfs_fs_t *fs, const uint8_t *sb)
+{
+    uint64_t log_start = u64_from_big_endian_bytes(sb + 48);
+    uint32_t log_blocks = u32_from_big_endian_bytes(sb + 96);
+    if (log_start == 0)
+    {
+        /* external log device */
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    uint64_t log_offset = xfs_ag_offset(fs, log_start >> fs->ag_blk_log,
+                                        log_start & ((1ULL << fs->ag_blk_log) - 1));
+    uint64_t log_bbs = (uint64_t)log_blocks * fs->block_size / XLOG_BBSIZE;
+
+    int err = 0;
+    uint32_t first_cycle = xlog_cycle(fs->fd, log_offset, 0, &err);
+    uint32_t last_cycle = xlog_cycle(fs->fd, log_offset, log_bbs - 1, &err);
+
+    /* the head is the first block still carrying the previous cycle */
+    uint64_t head = 0;
+    if (first_cycle != last_cycle)
+    {
+        uint64_t low = 0, high = log_bbs - 1;
+        while (high - low > 1 && err == 0)
+        {
+            uint64_t mid = low + (high - low) / 2;
+            if (xlog_cycle(fs->fd, log_offset, mid, &err) == first_cycle)
+            {
+                low = mid;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+        head = high;
+    }
+    if (err)
+    {
+        return -1;
+    }
+
+    uint8_t header[XLOG_BBSIZE];
+    for (uint64_t distance = 1; distance <= XLOG_MAX_RECORD_BBLOCKS && distance <= log_bbs; distance++)
+    {
+        uint64_t bb = (head + log_bbs - distance) % log_bbs;
+        if (fsfree_read(fs->fd, log_offset + bb * XLOG_BBSIZE, header, sizeof(header)))
+        {
+            return -1;
+        }
+        if (u32_from_big_endian_bytes(header) != XLOG_HEADER_MAGIC)
+        {
+            continue;
+        }
+
+        uint32_t version = u32_from_big_endian_bytes(header + 8);
+        uint32_t len = u32_from_big_endian_bytes(header + 12);
+        uint32_t num_logops = u32_from_big_endian_bytes(header + 40);
+        uint32_t size = u32_from_big_endian_bytes(header + 320);
+        uint64_t header_bbs = 1;
+        if ((version & XLOG_VERSION_2) && size > XLOG_HEADER_CYCLE_SIZE)
+        {
+            header_bbs = (size + XLOG_HEADER_CYCLE_SIZE - 1) / XLOG_HEADER_CYCLE_SIZE;
+        }
+
+        uint64_t data = (bb + header_bbs) % log_bbs;
+        uint64_t after = (data + (len + XLOG_BBSIZE - 1) / XLOG_BBSIZE) % log_bbs;
+        uint8_t op[XLOG_BBSIZE];
+        if (fsfree_read(fs->fd, log_offset + data * XLOG_BBSIZE, op, sizeof(op)))
+        {
+            return -1;
+        }
+
+        if (after == head && num_logops == 1 && (op[9] & XLOG_UNMOUNT_TRANS))
+        {
+            return 0;
+        }
+        break;
+    }
+
+    errno = EUCLEAN;
+    return -1;
+}
+
+static int xfs_walk_bnobt(xfs_fs_t *fs, uint32_t agno, uint32_t agbno, uint32_t level, uint64_t start,
+                          uint32_t sector_size, extent_list_t *extents, uint64_t *free_blocks)
+{
+    if (agbno >= fs->ag_blocks)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (fsfree_read(fs->fd, xfs_ag_offset(fs, agno, agbno), fs->block, fs->block_size))
+    {
+        return -1;
+    }
+
+    uint8_t *block = fs->block;
+    uint32_t numrecs = u16_from_big_endian_bytes(block + 6);
+    if (u32_from_big_endian_bytes(block) != fs->btree_magic || u16_from_big_endian_bytes(block + 4) != level)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (level == 0)
+    {
+        if (numrecs > (fs->block_size - fs->btree_header_len) / XFS_ALLOC_REC_LEN)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        for (uint32_t i = 0; i < numrecs; i++)
+        {
+            const uint8_t *rec = block + fs->btree_header_len + i * XFS_ALLOC_REC_LEN;
+            uint32_t rec_start = u32_from_big_endian_bytes(rec);
+            uint32_t rec_count = u32_from_big_endian_bytes(rec + 4);
+            *free_blocks += rec_count;
+            if (extent_list_append_aligned(extents, start + xfs_ag_offset(fs, agno, rec_start),
+                                           (uint64_t)rec_count * fs->block_size, sector_size))
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    /* node pointers follow the space reserved for the maximum number of keys */
+    uint32_t maxrecs = (fs->block_size - fs->btree_header_len) / (XFS_ALLOC_REC_LEN + XFS_ALLOC_PTR_LEN);
+    if (numrecs > maxrecs)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint32_t *ptrs = malloc(numrecs * sizeof(*ptrs));
+    if (ptrs == NULL)
+    {
+        return -1;
+    }
+    for (uint32_t i = 0; i < numrecs; i++)
+    {
+        ptrs[i] = u32_from_big_endian_bytes(block + fs->btree_header_len + maxrecs * XFS_ALLOC_REC_LEN +
+                                            i * XFS_ALLOC_PTR_LEN);
+    }
+
+    int ret = 0;
+    for (uint32_t i = 0; i < numrecs && ret == 0; i++)
+    {
+        ret = xfs_walk_bnobt(fs, agno, ptrs[i], level - 1, start, sector_size, extents, free_blocks);
+    }
+
+    free(ptrs);
+    return ret;
+}
+
+static int xfs_collect(int fd, uint64_t start, uint32_t sector_size, extent_list_t *extents)
+{
+    uint8_t sb[XFS_SB_LEN];
+    if (fsfree_read(fd, 0, sb, sizeof(sb)))
+    {
+        return -1;
+    }
+    if (u32_from_big_endian_bytes(sb) != XFS_SB_MAGIC)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    xfs_fs_t fs = {0};
+    fs.fd = fd;
+    fs.block_size = u32_from_big_endian_bytes(sb + 4);
+    fs.ag_blocks = u32_from_big_endian_bytes(sb + 84);
+    fs.ag_count = u32_from_big_endian_bytes(sb + 88);
+    fs.sect_size = u16_from_big_endian_bytes(sb + 102);
+    fs.ag_blk_log = sb[124];
+    bool inprogress = sb[126];
+    if ((u16_from_big_endian_bytes(sb + 100) & XFS_SB_VERSION_NUMBITS) == XFS_SB_VERSION_5)
+    {
+        fs.btree_header_len = XFS_BTREE_SBLOCK_CRC_LEN;
+        fs.btree_magic = XFS_ABTB_CRC_MAGIC;
+    }
+    else
+    {
+        fs.btree_header_len = XFS_BTREE_SBLOCK_LEN;
+        fs.btree_magic = XFS_ABTB_MAGIC;
+    }
+
+    if (fs.block_size < XFS_SB_LEN || fs.block_size > 65536 || fs.sect_size < XFS_SB_LEN ||
+        fs.ag_blocks == 0 || fs.ag_count == 0 || fs.ag_blk_log >= 32)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (inprogress)
+    {
+        errno = EUCLEAN;
+        return -1;
+    }
+    if (xfs_log_is_clean(&fs, sb))
+    {
+        return -1;
+    }
+
+    uint8_t *agf = malloc(fs.sect_size);
+    fs.block = malloc(fs.block_size);
+    int ret = -1;
+    if (agf == NULL || fs.block == NULL)
+    {
+        goto out;
+    }
+
+    for (uint32_t agno = 0; agno < fs.ag_count; agno++)
+    {
+        if (fsfree_read(fd, xfs_ag_offset(&fs, agno, 0) + fs.sect_size, agf, fs.sect_size))
+        {
+            goto out;
+        }
+        if (u32_from_big_endian_bytes(agf) != XFS_AGF_MAGIC || u32_from_big_endian_bytes(agf + 8) != agno)
+        {
+            errno = EINVAL;
+            goto out;
+        }
+
+        uint32_t root = u32_from_big_endian_bytes(agf + 16);
+        uint32_t levels = u32_from_big_endian_bytes(agf + 28);
+        uint32_t agf_free_blocks = u32_from_big_endian_bytes(agf + 52);
+        if (levels == 0 || levels > XFS_BTREE_MAXLEVELS)
+        {
+            errno = EINVAL;
+            goto out;
+        }
+
+        /* skip an AG whose tree disagrees with its header */
+        extent_list_t ag_extents = {0};
+        uint64_t free_blocks = 0;
+        if (xfs_walk_bnobt(&fs, agno, root, levels - 1, start, sector_size, &ag_extents, &free_blocks))
+        {
+            extent_list_free(&ag_extents);
+            goto out;
+        }
+        if (free_blocks == agf_free_blocks)
+        {
+            for (size_t i = 0; i < ag_extents.count; i++)
+            {
+                if (extent_list_append(extents, ag_extents.extents[i].offset, ag_extents.extents[i].length))
+                {
+                    extent_list_free(&ag_extents);
+                    goto out;
+                }
+            }
+        }
+        extent_list_free(&ag_extents);
+    }
+
+    ret = 0;
+
+out:
+    free(fs.block);
+    free(agf);
+    return ret;
+}
+
+int fsfree_collect(int fd, const char *type, uint64_t start, uint32_t sector_size, extent_list_t *extents)
+{
+    int ret;
+    if (type == NULL)
+    {
+        /* without libblkid, let the superblock magic decide */
+        if ((ret = ext4_collect(fd, start, sector_size, extents)) && errno == EINVAL)
+        {
+            ret = xfs_collect(fd, start, sector_size, extents);
+        }
+    }
+    else if (strcmp(type, "ext4") == 0 || strcmp(type, "ext3") == 0 || strcmp(type, "ext2") == 0)
+    {
+        ret = ext4_collect(fd, start, sector_size, extents);
+    }
+    else if (strcmp(type, "xfs") == 0)
+    {
+        ret = xfs_collect(fd, start, sector_size, extents);
+    }
+    else
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if (ret == 0)
+    {
+        extent_list_normalize(extents);
+    }
+    return ret;
+}
@@ -0,0 +1,25 @@
+#ifndef FSFREE_H
+#define FSFREE_H
+
+#include <stdint.h>
+
+#include "extent.h"
+
+/**
+ * @brief collect the free blocks of an unmounted filesystem.
+ *
+ * The allocation bitmaps of ext4 or the free space B+trees of XFS are
+ * read straight from the device. Filesystems that are not cleanly
+ * unmounted are refused with EUCLEAN, layouts the readers do not
+ * understand with EOPNOTSUPP.
+ *
+ * @param fd file descriptor of the device holding the filesystem.
+ * @param type filesystem type as reported by libblkid, NULL to detect it.
+ * @param start offset of the device on the whole disk in byte.
+ * @param sector_size logical block size of the disk.
+ * @param extents free areas on the whole disk, sorted and merged.
+ * @return returns 0 if there is no error.
+ */
+int fsfree_collect(int fd, const char *type, uint64_t start, uint32_t sector_size, extent_list_t *extents);
+
+#endif /* FSFREE_H */
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/magic.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+
+#include "fstrim.h"
+#include "sysfs.h"
+
+#define FSTRIM_FIEMAP_EXTENT_COUNT 512
+#define FSTRIM_BALLOON_CHUNK (1ULL << 30)
+#define FSTRIM_BALLOON_NAME ".sgblkdiscard.XXXXXX"
+
+/* extents whose physical location is unknown or not exclusively ours */
+#define FSTRIM_FIEMAP_UNSAFE_FLAGS (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | \
+                                    FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_ENCRYPTED | \
+                                    FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE | \
+                                    FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_SHARED)
+
+/*
+ * FIEMAP reports offsets on the filesystem device only where the
+ * filesystem sits on a single device without remapping.
+ */
+static bool fstrim_supported_fs(const struct statfs *sfs)
+{
+    switch (sfs->f_type)
+    {
+    case EXT4_SUPER_MAGIC:
+    case XFS_SUPER_MAGIC:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int fstrim_balloon_open(const char *mountpoint)
+{
+    int fd = open(mountpoint, O_TMPFILE | O_RDWR | O_EXCL, 0600);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR))
+    {
+        return fd;
+    }
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/" FSTRIM_BALLOON_NAME, mountpoint) >= (int)sizeof(path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((fd = mkstemp(path)) >= 0)
+    {
+        unlink(path);
+    }
+    return fd;
+}
+
+/*
+ * Preallocate the free space, leaving the reserved blocks alone so that
+ * the rest of the system does not run out of space while the balloon
+ * exists.
+ */
+static int fstrim_balloon_fill(int fd, const struct statfs *sfs)
+{
+    uint64_t reserve = (uint64_t)sfs->f_blocks / 100;
+    if ((uint64_t)sfs->f_bavail <= reserve)
+    {
+        return 0;
+    }
+
+    uint64_t target = ((uint64_t)sfs->f_bavail - reserve) * sfs->f_bsize;
+    uint64_t size = 0;
+    while (size < target)
+    {
+        uint64_t chunk = target - size < FSTRIM_BALLOON_CHUNK ? target - size : FSTRIM_BALLOON_CHUNK;
+        if (fallocate(fd, 0, size, chunk))
+        {
+            if (errno == ENOSPC)
+            {
+                break;
+            }
+            return -1;
+        }
+        size += chunk;
+    }
+
+    return fsync(fd);
+}
+
+static int fstrim_map_balloon(fstrim_t *fstrim, uint32_t sector_size)
+{
+    size_t fiemap_len = sizeof(struct fiemap) + FSTRIM_FIEMAP_EXTENT_COUNT * sizeof(struct fiemap_extent);
+    struct fiemap *fiemap = malloc(fiemap_len);
+    if (fiemap == NULL)
+    {
+        return -1;
+    }
+
+    int ret = 0;
+    uint64_t logical = 0;
+    bool last = false;
+    while (!last)
+    {
+        memset(fiemap, 0, fiemap_len);
+        fiemap->fm_start = logical;
+        fiemap->fm_length = FIEMAP_MAX_OFFSET - logical;
+        fiemap->fm_flags = FIEMAP_FLAG_SYNC;
+        fiemap->fm_extent_count = FSTRIM_FIEMAP_EXTENT_COUNT;
+
+        if ((ret = ioctl(fstrim->balloon_fd, FS_IOC_FIEMAP, fiemap)))
+        {
+            break;
+        }
+        if (fiemap->fm_mapped_extents == 0)
+        {
+            break;
+        }
+
+        for (uint32_t i = 0; i < fiemap->fm_mapped_extents; i++)
+        {
+            const struct fiemap_extent *fe = &fiemap->fm_extents[i];
+            logical = fe->fe_logical + fe->fe_length;
+            last = fe->fe_flags & FIEMAP_EXTENT_LAST;
+            if (fe->fe_flags & FSTRIM_FIEMAP_UNSAFE_FLAGS)
+            {
+                continue;
+            }
+
+            if ((ret = extent_list_append_aligned(&fstrim->extents, fstrim->partition_start + fe->fe_physical,
+                                                  fe->fe_length, sector_size)))
+            {
+                break;
+            }
+        }
+        if (ret)
+        {
+            break;
+        }
+    }
+
+    free(fiemap);
+    extent_list_normalize(&fstrim->extents);
+    return ret;
+}
+
+int fstrim_open(fstrim_t *fstrim, const char *mountpoint)
+{
+    memset(fstrim, 0, sizeof(*fstrim));
+    fstrim->balloon_fd = -1;
+
+    struct statfs sfs;
+    struct stat sb;
+    if (statfs(mountpoint, &sfs) || stat(mountpoint, &sb))
+    {
+        return -1;
+    }
+    if (!fstrim_supported_fs(&sfs))
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if (sysfs_whole_disk(sb.st_dev, &fstrim->disk, &fstrim->partition_start) ||
+        sysfs_devname(fstrim->disk, fstrim->disk_path, sizeof(fstrim->disk_path)))
+    {
+        return -1;
+    }
+
+    /* the extents are translated to the disk's LBAs, a stacked device would map them elsewhere */
+    int is_disk = sysfs_is_disk(sb.st_dev);
+    if (is_disk != 1)
+    {
+        if (is_disk == 0)
+        {
+            errno = ENODEV;
+        }
+        return -1;
+    }
+
+    uint64_t sector_size;
+    if (sysfs_read_u64(fstrim->disk, "queue/logical_block_size", &sector_size))
+    {
+        return -1;
+    }
+
+    if ((fstrim->balloon_fd = fstrim_balloon_open(mountpoint)) < 0 ||
+        fstrim_balloon_fill(fstrim->balloon_fd, &sfs) ||
+        fstrim_map_balloon(fstrim, sector_size))
+    {
+        int saved_errno = errno;
+        fstrim_close(fstrim);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+void fstrim_close(fstrim_t *fstrim)
+{
+    if (fstrim->balloon_fd >= 0)
+    {
+        close(fstrim->balloon_fd);
+        fstrim->balloon_fd = -1;
+    }
+    extent_list_free(&fstrim->extents);
+}
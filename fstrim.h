@@ -0,0 +1,41 @@
+#ifndef FSTRIM_H
+#define FSTRIM_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "extent.h"
+
+typedef struct fstrim
+{
+    int balloon_fd;
+    dev_t disk;
+    char disk_path[PATH_MAX];
+    uint64_t partition_start;
+    extent_list_t extents;
+} fstrim_t;
+
+/**
+ * @brief collect the free space of a mounted filesystem.
+ *
+ * The free space is held by an unlinked, preallocated balloon file so the
+ * filesystem cannot hand it out while it is being discarded. Extents are
+ * mapped with FIEMAP and translated to byte offsets on the whole disk.
+ * Filesystems on device-mapper, md or other stacked devices are refused
+ * with ENODEV, their offsets do not address the disk below.
+ *
+ * @param fstrim state to initialize.
+ * @param mountpoint any path on the mounted filesystem.
+ * @return returns 0 if there is no error.
+ */
+int fstrim_open(fstrim_t *fstrim, const char *mountpoint);
+
+/**
+ * @brief give the held free space back to the filesystem.
+ *
+ * @param fstrim the state.
+ */
+void fstrim_close(fstrim_t *fstrim);
+
+#endif /* FSTRIM_H */
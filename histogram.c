@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "histogram.h"
+
+static unsigned int histogram_index(uint64_t value)
+{
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+    {
+        return value;
+    }
+
+    /* keep the top HISTOGRAM_SUB_BUCKET_BITS + 1 bits of the value */
+    unsigned int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BUCKET_BITS;
+    return shift * HISTOGRAM_SUB_BUCKETS + (value >> shift);
+}
+
+static uint64_t histogram_highest_value(unsigned int index)
+{
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS)
+    {
+        return index;
+    }
+
+    unsigned int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub_bucket = index - shift * HISTOGRAM_SUB_BUCKETS;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+void histogram_reset(histogram_t *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->min = UINT64_MAX;
+}
+
+void histogram_record(histogram_t *histogram, uint64_t value)
+{
+    histogram->counts[histogram_index(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value < histogram->min)
+    {
+        histogram->min = value;
+    }
+    if (value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+void histogram_merge(histogram_t *histogram, const histogram_t *other)
+{
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        histogram->counts[i] += other->counts[i];
+    }
+    histogram->count += other->count;
+    histogram->sum += other->sum;
+    if (other->min < histogram->min)
+    {
+        histogram->min = other->min;
+    }
+    if (other->max > histogram->max)
+    {
+        histogram->max = other->max;
+    }
+}
+
+uint64_t histogram_percentile(const histogram_t *histogram, double percentile)
+{
+    if (histogram->count == 0)
+    {
+        return 0;
+    }
+
+    /* rank of the value, counted from 1 */
+    uint64_t rank = (uint64_t)(percentile / 100.0 * histogram->count + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    if (rank > histogram->count)
+    {
+        rank = histogram->count;
+    }
+
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= rank)
+        {
+            uint64_t value = histogram_highest_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
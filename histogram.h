@@ -0,0 +1,55 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/* every power of two is split into this many linear buckets, about 1.6% precision */
+#define HISTOGRAM_SUB_BUCKET_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+} histogram_t;
+
+/**
+ * @brief empty a histogram.
+ *
+ * @param histogram the histogram.
+ */
+void histogram_reset(histogram_t *histogram);
+
+/**
+ * @brief record one value.
+ *
+ * Values are kept with a relative error below 1/HISTOGRAM_SUB_BUCKETS,
+ * like an HDR histogram with two significant digits.
+ *
+ * @param histogram the histogram.
+ * @param value the value, e.g. a latency in nanoseconds.
+ */
+void histogram_record(histogram_t *histogram, uint64_t value);
+
+/**
+ * @brief add the values of one histogram to another.
+ *
+ * @param histogram destination.
+ * @param other source.
+ */
+void histogram_merge(histogram_t *histogram, const histogram_t *other);
+
+/**
+ * @brief get the value below which a share of the recorded values lie.
+ *
+ * @param histogram the histogram.
+ * @param percentile between 0 and 100.
+ * @return highest value equivalent to the percentile, 0 if empty.
+ */
+uint64_t histogram_percentile(const histogram_t *histogram, double percentile);
+
+#endif /* HISTOGRAM_H */
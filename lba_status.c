@@ -0,0 +1,122 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <scsi/sg.h>
+
+#include "lba_status.h"
+#include "byteorder.h"
+
+#define SG_GET_LBA_STATUS_CMD 0x9e
+#define SG_GET_LBA_STATUS_CMD_LEN 16
+#define SG_GET_LBA_STATUS_SERVICE_ACTION 0x12
+#define SG_GET_LBA_STATUS_HEADER_LEN 8
+#define SG_GET_LBA_STATUS_DESCRIPTOR_LEN 16
+#define SG_GET_LBA_STATUS_REPLY_LEN (SG_GET_LBA_STATUS_HEADER_LEN + 4095 * SG_GET_LBA_STATUS_DESCRIPTOR_LEN)
+#define SG_PROVISIONING_STATUS_MASK 0x0f
+#define SG_PROVISIONING_STATUS_DEALLOCATED 0x1
+
+static int sg_get_lba_status_scsi(sg_transport_t *transport, uint64_t lba, uint8_t *reply, uint32_t reply_len,
+                                  sg_result_t *result)
+{
+    uint8_t sense_buffer[SG_SENSE_BUFFER_LEN] = {0};
+    sg_io_hdr_t io_hdr;
+    uint8_t command[SG_GET_LBA_STATUS_CMD_LEN] = {SG_GET_LBA_STATUS_CMD, SG_GET_LBA_STATUS_SERVICE_ACTION};
+    u64_to_big_endian_bytes(lba, command + 2);
+    u32_to_big_endian_bytes(reply_len, command + 10);
+    memset(&io_hdr, 0, sizeof(io_hdr));
+    io_hdr.interface_id = 'S';
+    io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+    io_hdr.cmdp = command;
+    io_hdr.cmd_len = SG_GET_LBA_STATUS_CMD_LEN;
+    io_hdr.dxferp = reply;
+    io_hdr.dxfer_len = reply_len;
+    io_hdr.sbp = sense_buffer;
+    io_hdr.mx_sb_len = sizeof(sense_buffer);
+    io_hdr.timeout = SG_TIMEOUT;
+
+    /* the reply is only meaningful if the command succeeded */
+    if (sg_execute_retry(transport, &io_hdr, result, NULL) != SG_DISPOSITION_OK)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int sg_get_lba_status(sg_transport_t *transport, const device_info_t *info, uint64_t offset, uint64_t length, extent_list_t *mapped,
+                      sg_result_t *result)
+{
+    uint8_t *reply = malloc(SG_GET_LBA_STATUS_REPLY_LEN);
+    if (reply == NULL)
+    {
+        return -1;
+    }
+
+    int ret = 0;
+    uint64_t lba = offset / info->sector_size;
+    uint64_t end_lba = (offset + length) / info->sector_size;
+    while (lba < end_lba)
+    {
+        memset(reply, 0, SG_GET_LBA_STATUS_HEADER_LEN);
+        if ((ret = sg_get_lba_status_scsi(transport, lba, reply, SG_GET_LBA_STATUS_REPLY_LEN, result)))
+        {
+            break;
+        }
+
+        uint32_t data_len = u32_from_big_endian_bytes(reply) + 4;
+        if (data_len > SG_GET_LBA_STATUS_REPLY_LEN)
+        {
+            data_len = SG_GET_LBA_STATUS_REPLY_LEN;
+        }
+        uint32_t descriptor_count = data_len < SG_GET_LBA_STATUS_HEADER_LEN
+                                        ? 0
+                                        : (data_len - SG_GET_LBA_STATUS_HEADER_LEN) / SG_GET_LBA_STATUS_DESCRIPTOR_LEN;
+
+        uint64_t next_lba = lba;
+        for (uint32_t i = 0; i < descriptor_count; i++)
+        {
+            const uint8_t *descriptor = reply + SG_GET_LBA_STATUS_HEADER_LEN + i * SG_GET_LBA_STATUS_DESCRIPTOR_LEN;
+            uint64_t start = u64_from_big_endian_bytes(descriptor);
+            uint64_t end = start + u32_from_big_endian_bytes(descriptor + 8);
+            uint8_t status = descriptor[12] & SG_PROVISIONING_STATUS_MASK;
+
+            /* descriptors must move forward, anything else is a broken reply */
+            if (start > next_lba || end <= next_lba)
+            {
+                break;
+            }
+            if (end > end_lba)
+            {
+                end = end_lba;
+            }
+
+            /* anything not known to be deallocated is unmapped again */
+            if (status != SG_PROVISIONING_STATUS_DEALLOCATED &&
+                (ret = extent_list_append(mapped, next_lba * info->sector_size, (end - next_lba) * info->sector_size)))
+            {
+                break;
+            }
+            next_lba = end;
+            if (next_lba == end_lba)
+            {
+                break;
+            }
+        }
+
+        if (ret)
+        {
+            break;
+        }
+        if (next_lba == lba)
+        {
+            /* no progress, treat the rest as mapped */
+            ret = extent_list_append(mapped, lba * info->sector_size, (end_lba - lba) * info->sector_size);
+            break;
+        }
+        lba = next_lba;
+    }
+
+    free(reply);
+    return ret;
+}
@@ -0,0 +1,24 @@
+#ifndef LBA_STATUS_H
+#define LBA_STATUS_H
+
+#include <stdint.h>
+
+#include "utils.h"
+#include "extent.h"
+
+/**
+ * @brief find the mapped parts of an area with GET LBA STATUS.
+ *
+ * @param transport SCSI transport.
+ * @param info device info.
+ * @param offset offset in byte.
+ * @param length length in byte.
+ * @param mapped mapped areas are appended here, offset and length in byte.
+ * @param result if not NULL, receives the decoded result of the last command;
+ *        its status fields are all zero if that command could not be delivered.
+ * @return returns 0 if there is no error.
+ */
+int sg_get_lba_status(sg_transport_t *transport, const device_info_t *info, uint64_t offset, uint64_t length, extent_list_t *mapped,
+                      sg_result_t *result);
+
+#endif /* LBA_STATUS_H */
@@ -0,0 +1,1009 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <scsi/sg.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "mock.h"
+#include "utils.h"
+#include "byteorder.h"
+
+#define SG_MOCK_TEST_UNIT_READY_CMD 0x00
+#define SG_MOCK_INQUIRY_CMD 0x12
+#define SG_MOCK_UNMAP_CMD 0x42
+#define SG_MOCK_WRITE_SAME16_CMD 0x93
+#define SG_MOCK_WRITE_SAME_UNMAP 0x08
+#define SG_MOCK_WRITE_SAME_NDOB 0x01
+#define SG_MOCK_WRITE16_CMD 0x8a
+#define SG_MOCK_SERVICE_ACTION_IN_CMD 0x9e
+#define SG_MOCK_READ_CAPACITY16_SERVICE_ACTION 0x10
+#define SG_MOCK_SUPPORTED_VPD_PAGE_CODE 0x00
+#define SG_MOCK_UNIT_SERIAL_NUMBER_VPD_PAGE_CODE 0x80
+#define SG_MOCK_SERIAL "SGDMOCK0001"
+#define SG_MOCK_BLOCK_LIMITS_VPD_PAGE_CODE 0xb0
+#define SG_MOCK_LOGICAL_BLOCK_PROVISIONING_VPD_PAGE_CODE 0xb2
+
+#define SG_MOCK_STATUS_CHECK_CONDITION 0x02
+#define SG_MOCK_DRIVER_SENSE 0x08
+#define SG_MOCK_DID_ERROR 0x07
+#define SG_MOCK_SENSE_LEN 18
+#define SG_MOCK_SKSV 0x80
+#define SG_MOCK_SKS_CDB 0x40
+/* NUMBER OF LOGICAL BLOCKS of WRITE SAME(16) and WRITE(16) */
+#define SG_MOCK_BLOCKS_FIELD 10
+#define SG_MOCK_ILLEGAL_REQUEST 0x05
+#define SG_MOCK_UNIT_ATTENTION 0x06
+#define SG_MOCK_ASC_POWER_ON_RESET 0x29
+#define SG_MOCK_ASC_INVALID_OPCODE 0x20
+#define SG_MOCK_ASC_LBA_OUT_OF_RANGE 0x21
+#define SG_MOCK_ASC_INVALID_FIELD_IN_CDB 0x24
+#define SG_MOCK_ASC_INVALID_FIELD_IN_PARAMETER_LIST 0x26
+
+#define NVME_MOCK_NSID 1
+#define NVME_MOCK_MODEL "sgdiscard mock"
+#define NVME_MOCK_SC_INVALID_OPCODE 0x01
+#define NVME_MOCK_SC_INVALID_NS 0x0b
+
+typedef struct sg_mock_command
+{
+    sg_io_hdr_t io_hdr;
+    /* the command if the target is an NVMe controller */
+    nvme_command_t *nvme_command;
+    struct timespec due;
+    bool busy;
+} sg_mock_command_t;
+
+typedef struct sg_mock
+{
+    sg_transport_t transport;
+    /* the same target as an NVMe controller, see nvme_mock_open() */
+    nvme_device_t nvme;
+    sg_mock_config_t config;
+    /* submitted commands, they complete in the order they are due */
+    sg_mock_command_t *pending;
+    unsigned int count;
+    /* commands processed, for config.unit_attention_interval */
+    uint64_t processed;
+    /* deallocations done, for config.drop_interval */
+    uint64_t deallocations;
+} sg_mock_t;
+
+void sg_mock_default_config(sg_mock_config_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->capacity = 1ULL << 40;
+    config->sector_size = 512;
+    config->latency = 100;
+    config->depth = SG_MAX_QUEUE;
+    config->maximum_transfer_length = 0xffff;
+    config->maximum_unmap_lba_count = 0x400000;
+    config->maximum_unmap_block_descriptor_count = 64;
+    config->optimal_unmap_granularity = 8;
+    config->maximum_write_same_length = 0x400000;
+    config->lbpme = true;
+    config->write_same = true;
+    config->ndob = true;
+}
+
+static int sg_mock_set(sg_mock_config_t *config, const char *key, size_t key_len, const char *value)
+{
+    uint64_t number;
+    if (strtosize(value, &number))
+    {
+        return -1;
+    }
+
+#define SG_MOCK_KEY(_name) (key_len == strlen(_name) && strncmp(key, _name, key_len) == 0)
+    if (SG_MOCK_KEY("capacity"))
+    {
+        config->capacity = number;
+        return 0;
+    }
+    if (SG_MOCK_KEY("unmap-rate"))
+    {
+        config->unmap_rate = number;
+        return 0;
+    }
+    if (SG_MOCK_KEY("lbpme"))
+    {
+        config->lbpme = number != 0;
+        return 0;
+    }
+    if (SG_MOCK_KEY("write-same"))
+    {
+        config->write_same = number != 0;
+        return 0;
+    }
+    if (SG_MOCK_KEY("nvme"))
+    {
+        config->nvme = number != 0;
+        return 0;
+    }
+    if (SG_MOCK_KEY("ndob"))
+    {
+        config->ndob = number != 0;
+        return 0;
+    }
+    if (SG_MOCK_KEY("fill"))
+    {
+        config->fill = number;
+        return 0;
+    }
+
+    /* everything else is a 32 bit field */
+    if (number > UINT32_MAX)
+    {
+        errno = ERANGE;
+        return -1;
+    }
+
+    if (SG_MOCK_KEY("sector-size"))
+        config->sector_size = number;
+    else if (SG_MOCK_KEY("latency"))
+        config->latency = number;
+    else if (SG_MOCK_KEY("depth"))
+        config->depth = number;
+    else if (SG_MOCK_KEY("max-transfer"))
+        config->maximum_transfer_length = number;
+    else if (SG_MOCK_KEY("max-unmap-lba"))
+        config->maximum_unmap_lba_count = number;
+    else if (SG_MOCK_KEY("max-unmap-descriptors"))
+        config->maximum_unmap_block_descriptor_count = number;
+    else if (SG_MOCK_KEY("granularity"))
+        config->optimal_unmap_granularity = number;
+    else if (SG_MOCK_KEY("alignment"))
+        config->unmap_granularity_alignment = number;
+    else if (SG_MOCK_KEY("max-write-same"))
+        config->maximum_write_same_length = number;
+    else if (SG_MOCK_KEY("real-max-unmap-lba"))
+        config->real_maximum_unmap_lba_count = number;
+    else if (SG_MOCK_KEY("real-max-unmap-descriptors"))
+        config->real_maximum_unmap_block_descriptor_count = number;
+    else if (SG_MOCK_KEY("unit-attention"))
+        config->unit_attention_interval = number;
+    else if (SG_MOCK_KEY("drop-unmap"))
+        config->drop_interval = number;
+    else
+    {
+        errno = EINVAL;
+        return -1;
+    }
+#undef SG_MOCK_KEY
+
+    return 0;
+}
+
+int sg_mock_parse_config(const char *params, sg_mock_config_t *config)
+{
+    char value[64];
+    const char *p = params;
+
+    while (p && *p)
+    {
+        const char *end = strchrnul(p, ',');
+        const char *equal = memchr(p, '=', end - p);
+        if (equal == NULL || equal == p || (size_t)(end - equal - 1) >= sizeof(value))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        memcpy(value, equal + 1, end - equal - 1);
+        value[end - equal - 1] = '\0';
+        if (sg_mock_set(config, p, equal - p, value))
+        {
+            return -1;
+        }
+
+        p = *end ? end + 1 : end;
+    }
+
+    /* the same limits a real disk would never violate */
+    if (config->sector_size < 512 || (config->sector_size & (config->sector_size - 1)) ||
+        config->capacity < config->sector_size || config->capacity % config->sector_size ||
+        config->depth == 0 || config->depth > SG_MAX_QUEUE || config->fill % config->sector_size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void sg_mock_check_condition(sg_io_hdr_t *io_hdr, uint8_t key, uint8_t asc)
+{
+    io_hdr->status = SG_MOCK_STATUS_CHECK_CONDITION;
+    io_hdr->masked_status = SG_MOCK_STATUS_CHECK_CONDITION >> 1;
+    io_hdr->driver_status = SG_MOCK_DRIVER_SENSE;
+    io_hdr->info |= SG_INFO_CHECK;
+    io_hdr->resid = io_hdr->dxfer_len;
+
+    /* fixed format sense data */
+    uint8_t sense[SG_MOCK_SENSE_LEN] = {0x70, 0, key, 0, 0, 0, 0, SG_MOCK_SENSE_LEN - 8};
+    sense[12] = asc;
+    io_hdr->sb_len_wr = io_hdr->mx_sb_len < sizeof(sense) ? io_hdr->mx_sb_len : sizeof(sense);
+    if (io_hdr->sbp)
+    {
+        memcpy(io_hdr->sbp, sense, io_hdr->sb_len_wr);
+    }
+}
+
+/* INVALID FIELD IN CDB with the field pointer naming the offending byte */
+static void sg_mock_invalid_field(sg_io_hdr_t *io_hdr, uint16_t field)
+{
+    sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_INVALID_FIELD_IN_CDB);
+    if (io_hdr->sbp && io_hdr->sb_len_wr >= SG_MOCK_SENSE_LEN)
+    {
+        uint8_t *sense = io_hdr->sbp;
+        sense[15] = SG_MOCK_SKSV | SG_MOCK_SKS_CDB;
+        u16_to_big_endian_bytes(field, sense + 16);
+    }
+}
+
+static void sg_mock_reply(sg_io_hdr_t *io_hdr, const uint8_t *reply, uint32_t reply_len, uint32_t allocation_len)
+{
+    uint32_t len = reply_len;
+    if (len > allocation_len)
+    {
+        len = allocation_len;
+    }
+    if (len > io_hdr->dxfer_len)
+    {
+        len = io_hdr->dxfer_len;
+    }
+
+    if (len)
+    {
+        memcpy(io_hdr->dxferp, reply, len);
+    }
+    io_hdr->resid = io_hdr->dxfer_len - len;
+}
+
+static void sg_mock_inquiry(sg_mock_t *mock, sg_io_hdr_t *io_hdr)
+{
+    const uint8_t *command = io_hdr->cmdp;
+    const sg_mock_config_t *config = &mock->config;
+    uint16_t allocation_len = u16_from_big_endian_bytes(command + 3);
+    uint8_t reply[64] = {0};
+
+    if (!(command[1] & 1))
+    {
+        if (command[2])
+        {
+            sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_INVALID_FIELD_IN_CDB);
+            return;
+        }
+        /* standard data, direct access block device */
+        reply[2] = 0x06;
+        reply[3] = 0x02;
+        reply[4] = 36 - 5;
+        memcpy(reply + 8, "SGDMOCK MOCK TARGET     0.1 ", 28);
+        sg_mock_reply(io_hdr, reply, 36, allocation_len);
+        return;
+    }
+
+    reply[1] = command[2];
+    switch (command[2])
+    {
+    case SG_MOCK_SUPPORTED_VPD_PAGE_CODE:
+        reply[3] = 4;
+        reply[4] = SG_MOCK_SUPPORTED_VPD_PAGE_CODE;
+        reply[5] = SG_MOCK_UNIT_SERIAL_NUMBER_VPD_PAGE_CODE;
+        reply[6] = SG_MOCK_BLOCK_LIMITS_VPD_PAGE_CODE;
+        reply[7] = SG_MOCK_LOGICAL_BLOCK_PROVISIONING_VPD_PAGE_CODE;
+        sg_mock_reply(io_hdr, reply, 8, allocation_len);
+        break;
+    case SG_MOCK_UNIT_SERIAL_NUMBER_VPD_PAGE_CODE:
+        reply[3] = sizeof(SG_MOCK_SERIAL) - 1;
+        memcpy(reply + 4, SG_MOCK_SERIAL, sizeof(SG_MOCK_SERIAL) - 1);
+        sg_mock_reply(io_hdr, reply, 4 + sizeof(SG_MOCK_SERIAL) - 1, allocation_len);
+        break;
+    case SG_MOCK_BLOCK_LIMITS_VPD_PAGE_CODE:
+        u16_to_big_endian_bytes(0x3c, reply + 2);
+        u32_to_big_endian_bytes(config->maximum_transfer_length, reply + 8);
+        u32_to_big_endian_bytes(config->maximum_unmap_lba_count, reply + 20);
+        u32_to_big_endian_bytes(config->maximum_unmap_block_descriptor_count, reply + 24);
+        u32_to_big_endian_bytes(config->optimal_unmap_granularity, reply + 28);
+        if (config->unmap_granularity_alignment)
+        {
+            u32_to_big_endian_bytes(config->unmap_granularity_alignment | 0x80000000, reply + 32);
+        }
+        u64_to_big_endian_bytes(config->maximum_write_same_length, reply + 36);
+        sg_mock_reply(io_hdr, reply, 64, allocation_len);
+        break;
+    case SG_MOCK_LOGICAL_BLOCK_PROVISIONING_VPD_PAGE_CODE:
+        reply[3] = 4;
+        /* LBPU, LBPWS */
+        reply[5] = (config->maximum_unmap_lba_count ? 0x80 : 0) | (config->write_same ? 0x40 : 0);
+        sg_mock_reply(io_hdr, reply, 8, allocation_len);
+        break;
+    default:
+        sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_INVALID_FIELD_IN_CDB);
+        break;
+    }
+}
+
+static void sg_mock_read_capacity16(sg_mock_t *mock, sg_io_hdr_t *io_hdr)
+{
+    const uint8_t *command = io_hdr->cmdp;
+    const sg_mock_config_t *config = &mock->config;
+    uint8_t reply[32] = {0};
+
+    u64_to_big_endian_bytes(config->capacity / config->sector_size - 1, reply);
+    u32_to_big_endian_bytes(config->sector_size, reply + 8);
+    /* holes of the backing file read back as zeroes */
+    if (config->lbpme)
+    {
+        reply[14] = 0x80 | 0x40;
+    }
+    sg_mock_reply(io_hdr, reply, sizeof(reply), u32_from_big_endian_bytes(command + 10));
+}
+
+/* deallocate blocks of the backing file, returns the time it took in microseconds */
+static uint64_t sg_mock_deallocate(sg_mock_t *mock, uint64_t lba, uint64_t blocks)
+{
+    const sg_mock_config_t *config = &mock->config;
+    /* a bridge that drops the command still answers GOOD */
+    bool drop = config->drop_interval && ++mock->deallocations % config->drop_interval == 0;
+    if (blocks && !drop)
+    {
+        fallocate(mock->transport.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  lba * config->sector_size, blocks * config->sector_size);
+    }
+
+    if (config->unmap_rate == 0)
+    {
+        return 0;
+    }
+    return (double)blocks * config->sector_size * 1000000 / config->unmap_rate;
+}
+
+/* returns the time deallocating took in microseconds */
+static uint64_t sg_mock_write_same16(sg_mock_t *mock, sg_io_hdr_t *io_hdr)
+{
+    const uint8_t *command = io_hdr->cmdp;
+    const sg_mock_config_t *config = &mock->config;
+    uint64_t lba = u64_from_big_endian_bytes(command + 2);
+    uint32_t blocks = u32_from_big_endian_bytes(command + 10);
+    uint64_t block_count = config->capacity / config->sector_size;
+
+    if (!config->write_same)
+    {
+        sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_INVALID_OPCODE);
+        return 0;
+    }
+    /* the only data WRITE SAME stores is zeroes, which a hole reads back as */
+    bool ndob = command[1] & SG_MOCK_WRITE_SAME_NDOB;
+    const uint8_t *block = io_hdr->dxferp;
+    if ((ndob && !config->ndob) ||
+        (!ndob && (io_hdr->dxfer_len < config->sector_size ||
+                   (!(command[1] & SG_MOCK_WRITE_SAME_UNMAP) &&
+                    (block[0] || memcmp(block, block + 1, config->sector_size - 1))))))
+    {
+        sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_INVALID_FIELD_IN_CDB);
+        return 0;
+    }
+    if (config->maximum_write_same_length && blocks > config->maximum_write_same_length)
+    {
+        sg_mock_invalid_field(io_hdr, SG_MOCK_BLOCKS_FIELD);
+        return 0;
+    }
+    if (lba > block_count || blocks > block_count - lba)
+    {
+        sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_LBA_OUT_OF_RANGE);
+        return 0;
+    }
+
+    return sg_mock_deallocate(mock, lba, blocks);
+}
+
+static void sg_mock_write16(sg_mock_t *mock, sg_io_hdr_t *io_hdr)
+{
+    const uint8_t *command = io_hdr->cmdp;
+    const sg_mock_config_t *config = &mock->config;
+    uint64_t lba = u64_from_big_endian_bytes(command + 2);
+    uint32_t blocks = u32_from_big_endian_bytes(command + 10);
+    uint64_t block_count = config->capacity / config->sector_size;
+
+    if (config->maximum_transfer_length && blocks > config->maximum_transfer_length)
+    {
+        sg_mock_invalid_field(io_hdr, SG_MOCK_BLOCKS_FIELD);
+        return;
+    }
+    if (io_hdr->dxfer_len != (uint64_t)blocks * config->sector_size)
+    {
+        sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_INVALID_FIELD_IN_CDB);
+        return;
+    }
+    if (lba > block_count || blocks > block_count - lba)
+    {
+        sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_LBA_OUT_OF_RANGE);
+        return;
+    }
+
+    if (pwrite(mock->transport.fd, io_hdr->dxferp, io_hdr->dxfer_len, lba * config->sector_size) !=
+        (ssize_t)io_hdr->dxfer_len)
+    {
+        io_hdr->host_status = SG_MOCK_DID_ERROR;
+    }
+}
+
+/* returns the time deallocating took in microseconds */
+static uint64_t sg_mock_unmap(sg_mock_t *mock, sg_io_hdr_t *io_hdr)
+{
+    const uint8_t *command = io_hdr->cmdp;
+    const sg_mock_config_t *config = &mock->config;
+    const uint8_t *parameter = io_hdr->dxferp;
+    uint16_t parameter_len = u16_from_big_endian_bytes(command + 7);
+
+    if (config->maximum_unmap_lba_count == 0)
+    {
+        sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_INVALID_OPCODE);
+        return 0;
+    }
+    if (parameter_len == 0)
+    {
+        return 0;
+    }
+    if (parameter_len < SG_UNMAP_PARAMETER_HEADER_LEN || parameter_len > io_hdr->dxfer_len)
+    {
+        sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_INVALID_FIELD_IN_CDB);
+        return 0;
+    }
+
+    uint16_t descriptor_len = u16_from_big_endian_bytes(parameter + 2);
+    uint32_t descriptor_count = descriptor_len / SG_UNMAP_BLOCK_DESCRIPTOR_LEN;
+    uint32_t descriptor_limit = config->real_maximum_unmap_block_descriptor_count
+                                    ? config->real_maximum_unmap_block_descriptor_count
+                                    : config->maximum_unmap_block_descriptor_count;
+    if (SG_UNMAP_PARAMETER_LEN(descriptor_count) > parameter_len || descriptor_count > descriptor_limit)
+    {
+        sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_INVALID_FIELD_IN_PARAMETER_LIST);
+        return 0;
+    }
+
+    /* the whole list is checked before anything is unmapped */
+    uint64_t block_count = config->capacity / config->sector_size;
+    uint64_t lba_count = 0;
+    for (uint32_t i = 0; i < descriptor_count; i++)
+    {
+        const uint8_t *descriptor = parameter + SG_UNMAP_PARAMETER_LEN(i);
+        uint64_t lba = u64_from_big_endian_bytes(descriptor);
+        uint32_t length = u32_from_big_endian_bytes(descriptor + 8);
+        if (lba > block_count || length > block_count - lba)
+        {
+            sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_LBA_OUT_OF_RANGE);
+            return 0;
+        }
+        lba_count += length;
+    }
+    uint32_t lba_limit = config->real_maximum_unmap_lba_count ? config->real_maximum_unmap_lba_count
+                                                               : config->maximum_unmap_lba_count;
+    if (lba_limit != UINT32_MAX && lba_count > lba_limit)
+    {
+        sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_INVALID_FIELD_IN_PARAMETER_LIST);
+        return 0;
+    }
+
+    uint64_t elapsed = 0;
+    for (uint32_t i = 0; i < descriptor_count; i++)
+    {
+        const uint8_t *descriptor = parameter + SG_UNMAP_PARAMETER_LEN(i);
+        elapsed += sg_mock_deallocate(mock, u64_from_big_endian_bytes(descriptor),
+                                      u32_from_big_endian_bytes(descriptor + 8));
+    }
+    return elapsed;
+}
+
+/* returns the time the command takes in microseconds */
+static uint64_t sg_mock_process(sg_mock_t *mock, sg_io_hdr_t *io_hdr)
+{
+    const uint8_t *command = io_hdr->cmdp;
+    uint64_t latency = mock->config.latency;
+
+    io_hdr->status = 0;
+    io_hdr->masked_status = 0;
+    io_hdr->host_status = 0;
+    io_hdr->driver_status = 0;
+    io_hdr->sb_len_wr = 0;
+    io_hdr->resid = 0;
+    io_hdr->info = 0;
+
+    mock->processed++;
+    if (mock->config.unit_attention_interval && mock->processed % mock->config.unit_attention_interval == 0)
+    {
+        sg_mock_check_condition(io_hdr, SG_MOCK_UNIT_ATTENTION, SG_MOCK_ASC_POWER_ON_RESET);
+        io_hdr->duration = latency / 1000;
+        return latency;
+    }
+
+    switch (io_hdr->cmd_len ? command[0] : 0xff)
+    {
+    case SG_MOCK_TEST_UNIT_READY_CMD:
+        break;
+    case SG_MOCK_INQUIRY_CMD:
+        sg_mock_inquiry(mock, io_hdr);
+        break;
+    case SG_MOCK_UNMAP_CMD:
+        latency += sg_mock_unmap(mock, io_hdr);
+        break;
+    case SG_MOCK_WRITE_SAME16_CMD:
+        latency += sg_mock_write_same16(mock, io_hdr);
+        break;
+    case SG_MOCK_WRITE16_CMD:
+        sg_mock_write16(mock, io_hdr);
+        break;
+    case SG_MOCK_SERVICE_ACTION_IN_CMD:
+        if ((command[1] & 0x1f) == SG_MOCK_READ_CAPACITY16_SERVICE_ACTION)
+        {
+            sg_mock_read_capacity16(mock, io_hdr);
+            break;
+        }
+        sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_INVALID_FIELD_IN_CDB);
+        break;
+    default:
+        sg_mock_check_condition(io_hdr, SG_MOCK_ILLEGAL_REQUEST, SG_MOCK_ASC_INVALID_OPCODE);
+        break;
+    }
+
+    io_hdr->duration = latency / 1000;
+    return latency;
+}
+
+static void sg_mock_timespec_add_us(struct timespec *ts, uint64_t us)
+{
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += (us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static void sg_mock_sleep_until(const struct timespec *due)
+{
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, due, NULL) == EINTR)
+        ;
+}
+
+static int sg_mock_execute(sg_transport_t *transport, sg_io_hdr_t *io_hdr)
+{
+    sg_mock_t *mock = (sg_mock_t *)transport;
+    struct timespec due;
+
+    clock_gettime(CLOCK_MONOTONIC, &due);
+    sg_mock_timespec_add_us(&due, sg_mock_process(mock, io_hdr));
+    sg_mock_sleep_until(&due);
+    return 0;
+}
+
+/* a free entry for a submitted command, NULL with errno set if the queue is full */
+static sg_mock_command_t *sg_mock_slot(sg_mock_t *mock)
+{
+    if (mock->count == mock->config.depth)
+    {
+        /* what the sg driver answers once its queue is full */
+        errno = EDOM;
+        return NULL;
+    }
+
+    sg_mock_command_t *pending = mock->pending;
+    while (pending->busy)
+    {
+        pending++;
+    }
+    return pending;
+}
+
+/*
+ * Wait for the submitted command that is due first.
+ * Returns	1  completed, the entry is free again
+ * 		0  timeout
+ * 		<0 nothing is in flight
+ */
+static int sg_mock_complete(sg_mock_t *mock, int timeout, sg_mock_command_t **completed)
+{
+    if (mock->count == 0)
+    {
+        /* nothing would ever complete */
+        if (timeout < 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        return 0;
+    }
+
+    sg_mock_command_t *pending = NULL;
+    for (unsigned int i = 0; i < mock->config.depth; i++)
+    {
+        sg_mock_command_t *command = &mock->pending[i];
+        if (command->busy &&
+            (pending == NULL || command->due.tv_sec < pending->due.tv_sec ||
+             (command->due.tv_sec == pending->due.tv_sec && command->due.tv_nsec < pending->due.tv_nsec)))
+        {
+            pending = command;
+        }
+    }
+
+    if (timeout >= 0)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        sg_mock_timespec_add_us(&deadline, (uint64_t)timeout * 1000);
+        if (deadline.tv_sec < pending->due.tv_sec ||
+            (deadline.tv_sec == pending->due.tv_sec && deadline.tv_nsec < pending->due.tv_nsec))
+        {
+            sg_mock_sleep_until(&deadline);
+            return 0;
+        }
+    }
+
+    sg_mock_sleep_until(&pending->due);
+    pending->busy = false;
+    mock->count--;
+    *completed = pending;
+    return 1;
+}
+
+static int sg_mock_submit(sg_transport_t *transport, sg_io_hdr_t *io_hdr)
+{
+    sg_mock_t *mock = (sg_mock_t *)transport;
+    sg_mock_command_t *pending = sg_mock_slot(mock);
+    if (pending == NULL)
+    {
+        return -1;
+    }
+
+    /* commands run concurrently, each one takes the full latency */
+    clock_gettime(CLOCK_MONOTONIC, &pending->due);
+    sg_mock_timespec_add_us(&pending->due, sg_mock_process(mock, io_hdr));
+    pending->io_hdr = *io_hdr;
+    pending->busy = true;
+    mock->count++;
+    return 0;
+}
+
+static int sg_mock_receive(sg_transport_t *transport, sg_io_hdr_t *io_hdr, int timeout)
+{
+    sg_mock_command_t *pending;
+    int ret = sg_mock_complete((sg_mock_t *)transport, timeout, &pending);
+    if (ret > 0)
+    {
+        *io_hdr = pending->io_hdr;
+    }
+    return ret;
+}
+
+static void sg_mock_close(sg_transport_t *transport)
+{
+    sg_mock_t *mock = (sg_mock_t *)transport;
+    if (transport->fd >= 0)
+    {
+        close(transport->fd);
+    }
+    free(mock->pending);
+    free(mock);
+}
+
+static const sg_transport_ops_t sg_mock_ops = {
+    .name = "mock",
+    .execute = sg_mock_execute,
+    .submit = sg_mock_submit,
+    .receive = sg_mock_receive,
+    .close = sg_mock_close,
+};
+
+/* give the emulated disk some data to keep */
+static int sg_mock_fill(sg_mock_t *mock)
+{
+    const sg_mock_config_t *config = &mock->config;
+    uint8_t *sector = malloc(config->sector_size);
+    if (sector == NULL)
+    {
+        return -1;
+    }
+    memset(sector, 0xa5, config->sector_size);
+
+    int ret = 0;
+    for (uint64_t offset = 0; offset < config->capacity; offset += config->fill)
+    {
+        if (pwrite(mock->transport.fd, sector, config->sector_size, offset) != (ssize_t)config->sector_size)
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    free(sector);
+    return ret;
+}
+
+sg_transport_t *sg_mock_open(const sg_mock_config_t *config)
+{
+    sg_mock_t *mock = calloc(1, sizeof(*mock));
+    if (mock == NULL)
+    {
+        return NULL;
+    }
+
+    mock->config = *config;
+    mock->transport.ops = &sg_mock_ops;
+    mock->transport.depth = config->depth;
+    mock->transport.fd = memfd_create("sgdiscard-mock", MFD_CLOEXEC);
+    if (mock->transport.fd < 0 || ftruncate(mock->transport.fd, config->capacity) ||
+        (mock->pending = calloc(config->depth, sizeof(*mock->pending))) == NULL)
+    {
+        int saved_errno = errno;
+        sg_mock_close(&mock->transport);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    if (config->fill && sg_mock_fill(mock))
+    {
+        int saved_errno = errno;
+        sg_mock_close(&mock->transport);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    return &mock->transport;
+}
+
+#define nvme_mock_of(_nvme) ((sg_mock_t *)((char *)(_nvme) - offsetof(sg_mock_t, nvme)))
+
+/* copy a space padded string into an Identify field */
+static void nvme_mock_string(uint8_t *field, size_t len, const char *value)
+{
+    memset(field, ' ', len);
+    memcpy(field, value, strlen(value) < len ? strlen(value) : len);
+}
+
+static int nvme_mock_identify(sg_mock_t *mock, nvme_command_t *command)
+{
+    const sg_mock_config_t *config = &mock->config;
+    struct nvme_uring_cmd *cmd = &command->cmd;
+    uint8_t *data = (uint8_t *)(uintptr_t)cmd->addr;
+    uint64_t block_count = config->capacity / config->sector_size;
+
+    if (cmd->data_len < NVME_IDENTIFY_LEN)
+    {
+        return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+    }
+
+    memset(data, 0, NVME_IDENTIFY_LEN);
+    switch (cmd->cdw10 & 0xff)
+    {
+    case NVME_IDENTIFY_CNS_CONTROLLER:
+        nvme_mock_string(data + 4, 20, SG_MOCK_SERIAL);
+        nvme_mock_string(data + 24, 40, NVME_MOCK_MODEL);
+        nvme_mock_string(data + 64, 8, "1.0");
+        /* ONCS: Dataset Management, Write Zeroes */
+        u16_to_little_endian_bytes((config->maximum_unmap_lba_count ? 1 << 2 : 0) | (config->write_same ? 1 << 3 : 0),
+                                   data + 520);
+        /* NN */
+        u32_to_little_endian_bytes(NVME_MOCK_NSID, data + 516);
+        return 0;
+    case NVME_IDENTIFY_CNS_NAMESPACE:
+        if (cmd->nsid != NVME_MOCK_NSID)
+        {
+            return NVME_MOCK_SC_INVALID_NS | NVME_STATUS_DNR;
+        }
+        /* NSZE, NCAP */
+        u64_to_little_endian_bytes(block_count, data);
+        u64_to_little_endian_bytes(block_count, data + 8);
+        /* NSFEAT: thin provisioning, optimal performance fields */
+        data[24] = (config->lbpme ? 1 << 0 : 0) | (config->optimal_unmap_granularity ? 1 << 4 : 0);
+        /* DLFEAT: deallocated blocks read as zeroes, Write Zeroes may deallocate */
+        data[33] = 0x01 | (config->write_same ? 1 << 3 : 0);
+        /* NPDG, NPDA */
+        if (config->optimal_unmap_granularity)
+        {
+            u16_to_little_endian_bytes(config->optimal_unmap_granularity - 1, data + 68);
+            u16_to_little_endian_bytes(config->optimal_unmap_granularity - 1, data + 70);
+        }
+        /* LBA format 0 */
+        data[128 + 2] = __builtin_ctz(config->sector_size);
+        return 0;
+    default:
+        return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+    }
+}
+
+/* returns the NVMe status, *elapsed grows by the time deallocating took in microseconds */
+static int nvme_mock_dsm(sg_mock_t *mock, nvme_command_t *command, uint64_t *elapsed)
+{
+    const sg_mock_config_t *config = &mock->config;
+    struct nvme_uring_cmd *cmd = &command->cmd;
+    const uint8_t *ranges = (const uint8_t *)(uintptr_t)cmd->addr;
+    uint32_t range_count = (cmd->cdw10 & 0xff) + 1;
+    uint64_t block_count = config->capacity / config->sector_size;
+
+    if (config->maximum_unmap_lba_count == 0)
+    {
+        return NVME_MOCK_SC_INVALID_OPCODE | NVME_STATUS_DNR;
+    }
+    if (cmd->data_len < range_count * NVME_DSM_RANGE_LEN ||
+        (config->real_maximum_unmap_block_descriptor_count &&
+         range_count > config->real_maximum_unmap_block_descriptor_count))
+    {
+        return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+    }
+    /* only deallocation changes anything */
+    if (!(cmd->cdw11 & NVME_DSM_ATTRIBUTE_DEALLOCATE))
+    {
+        return 0;
+    }
+
+    /* the whole list is checked before anything is deallocated */
+    uint64_t lba_count = 0;
+    for (uint32_t i = 0; i < range_count; i++)
+    {
+        const uint8_t *range = ranges + i * NVME_DSM_RANGE_LEN;
+        uint32_t length = u32_from_little_endian_bytes(range + 4);
+        uint64_t lba = u64_from_little_endian_bytes(range + 8);
+        if (lba > block_count || length > block_count - lba)
+        {
+            return NVME_SC_LBA_RANGE | NVME_STATUS_DNR;
+        }
+        lba_count += length;
+    }
+    if (config->real_maximum_unmap_lba_count && lba_count > config->real_maximum_unmap_lba_count)
+    {
+        return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+    }
+
+    for (uint32_t i = 0; i < range_count; i++)
+    {
+        const uint8_t *range = ranges + i * NVME_DSM_RANGE_LEN;
+        *elapsed += sg_mock_deallocate(mock, u64_from_little_endian_bytes(range + 8),
+                                       u32_from_little_endian_bytes(range + 4));
+    }
+    return 0;
+}
+
+/* returns the NVMe status, *elapsed grows by the time deallocating took in microseconds */
+static int nvme_mock_write_zeroes(sg_mock_t *mock, nvme_command_t *command, uint64_t *elapsed)
+{
+    const sg_mock_config_t *config = &mock->config;
+    struct nvme_uring_cmd *cmd = &command->cmd;
+    uint64_t lba = (uint64_t)cmd->cdw11 << 32 | cmd->cdw10;
+    uint32_t blocks = (cmd->cdw12 & 0xffff) + 1;
+    uint64_t block_count = config->capacity / config->sector_size;
+
+    if (!config->write_same)
+    {
+        return NVME_MOCK_SC_INVALID_OPCODE | NVME_STATUS_DNR;
+    }
+    if (config->maximum_write_same_length && blocks > config->maximum_write_same_length)
+    {
+        return NVME_SC_INVALID_FIELD | NVME_STATUS_DNR;
+    }
+    if (lba > block_count || blocks > block_count - lba)
+    {
+        return NVME_SC_LBA_RANGE | NVME_STATUS_DNR;
+    }
+
+    /* zeroes are stored as holes, with or without the DEAC bit */
+    *elapsed += sg_mock_deallocate(mock, lba, blocks);
+    return 0;
+}
+
+/* returns the time the command takes in microseconds */
+static uint64_t nvme_mock_process(sg_mock_t *mock, nvme_command_t *command)
+{
+    struct nvme_uring_cmd *cmd = &command->cmd;
+    uint64_t latency = mock->config.latency;
+
+    command->result = 0;
+    mock->processed++;
+    if (mock->config.unit_attention_interval && mock->processed % mock->config.unit_attention_interval == 0)
+    {
+        /* the closest NVMe has to a UNIT ATTENTION, worth a retry */
+        command->status = NVME_SC_NS_NOT_READY;
+        return latency;
+    }
+
+    if (command->admin)
+    {
+        command->status = cmd->opcode == NVME_ADMIN_IDENTIFY ? nvme_mock_identify(mock, command)
+                                                             : NVME_MOCK_SC_INVALID_OPCODE | NVME_STATUS_DNR;
+        return latency;
+    }
+    if (cmd->nsid != NVME_MOCK_NSID)
+    {
+        command->status = NVME_MOCK_SC_INVALID_NS | NVME_STATUS_DNR;
+        return latency;
+    }
+
+    switch (cmd->opcode)
+    {
+    case NVME_CMD_DSM:
+        command->status = nvme_mock_dsm(mock, command, &latency);
+        break;
+    case NVME_CMD_WRITE_ZEROES:
+        command->status = nvme_mock_write_zeroes(mock, command, &latency);
+        break;
+    default:
+        command->status = NVME_MOCK_SC_INVALID_OPCODE | NVME_STATUS_DNR;
+        break;
+    }
+    return latency;
+}
+
+static int nvme_mock_execute(nvme_device_t *nvme, nvme_command_t *command)
+{
+    sg_mock_t *mock = nvme_mock_of(nvme);
+    struct timespec due;
+
+    clock_gettime(CLOCK_MONOTONIC, &due);
+    sg_mock_timespec_add_us(&due, nvme_mock_process(mock, command));
+    sg_mock_sleep_until(&due);
+    return 0;
+}
+
+static int nvme_mock_submit(nvme_device_t *nvme, nvme_command_t *command)
+{
+    sg_mock_t *mock = nvme_mock_of(nvme);
+    sg_mock_command_t *pending = sg_mock_slot(mock);
+    if (pending == NULL)
+    {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &pending->due);
+    sg_mock_timespec_add_us(&pending->due, nvme_mock_process(mock, command));
+    pending->nvme_command = command;
+    pending->busy = true;
+    mock->count++;
+    return 0;
+}
+
+static int nvme_mock_receive(nvme_device_t *nvme, nvme_command_t **command, int timeout)
+{
+    sg_mock_command_t *pending;
+    int ret = sg_mock_complete(nvme_mock_of(nvme), timeout, &pending);
+    if (ret > 0)
+    {
+        *command = pending->nvme_command;
+    }
+    return ret;
+}
+
+static void nvme_mock_close(nvme_device_t *nvme)
+{
+    sg_mock_close(&nvme_mock_of(nvme)->transport);
+}
+
+static const nvme_device_ops_t nvme_mock_ops = {
+    .name = "mock",
+    .execute = nvme_mock_execute,
+    .submit = nvme_mock_submit,
+    .receive = nvme_mock_receive,
+    .close = nvme_mock_close,
+};
+
+nvme_device_t *nvme_mock_open(const sg_mock_config_t *config)
+{
+    sg_transport_t *transport = sg_mock_open(config);
+    if (transport == NULL)
+    {
+        return NULL;
+    }
+
+    sg_mock_t *mock = (sg_mock_t *)transport;
+    mock->nvme.ops = &nvme_mock_ops;
+    mock->nvme.fd = transport->fd;
+    mock->nvme.nsid = NVME_MOCK_NSID;
+    mock->nvme.depth = config->depth;
+    return &mock->nvme;
+}
@@ -0,0 +1,106 @@
+#ifndef MOCK_H
+#define MOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "transport.h"
+#include "nvme.h"
+
+typedef struct sg_mock_config
+{
+    /* size of the emulated disk in byte */
+    uint64_t capacity;
+    uint32_t sector_size;
+    /* time every command takes in microseconds */
+    uint32_t latency;
+    /* bytes per second UNMAP deallocates on top of the latency, 0 for no limit */
+    uint64_t unmap_rate;
+    /* number of commands that may be in flight */
+    unsigned int depth;
+    uint32_t maximum_transfer_length;
+    uint32_t maximum_unmap_lba_count;
+    uint32_t maximum_unmap_block_descriptor_count;
+    uint32_t optimal_unmap_granularity;
+    uint32_t unmap_granularity_alignment;
+    /* blocks in one WRITE SAME command, 0 for no limit */
+    uint32_t maximum_write_same_length;
+    bool lbpme;
+    /* WRITE SAME(16) with the UNMAP bit deallocates */
+    bool write_same;
+    /* WRITE SAME(16) takes NDOB */
+    bool ndob;
+    /*
+     * Limits UNMAP really accepts, larger commands fail with ILLEGAL
+     * REQUEST although the Block Limits page advertises more. 0 uses
+     * the advertised ones.
+     */
+    uint32_t real_maximum_unmap_lba_count;
+    uint32_t real_maximum_unmap_block_descriptor_count;
+    /* every n-th command reports a UNIT ATTENTION, 0 never */
+    uint32_t unit_attention_interval;
+    /* every n-th deallocation succeeds without deallocating, 0 never */
+    uint32_t drop_interval;
+    /* the target is an NVMe controller, see nvme_mock_open() */
+    bool nvme;
+    /* the first sector of every fill bytes holds data, 0 for an empty disk */
+    uint64_t fill;
+} sg_mock_config_t;
+
+/**
+ * @brief fill a mock configuration with the defaults.
+ *
+ * The defaults describe a 1 TiB disk with 512 byte sectors that takes
+ * 100 microseconds per command and accepts 16 commands in flight.
+ *
+ * @param config configuration to fill.
+ */
+void sg_mock_default_config(sg_mock_config_t *config);
+
+/**
+ * @brief override a mock configuration from "key=value,..." pairs.
+ *
+ * Known keys are capacity, sector-size, latency, unmap-rate, depth, max-transfer,
+ * max-unmap-lba, max-unmap-descriptors, granularity, alignment,
+ * max-write-same, lbpme, write-same, real-max-unmap-lba,
+ * real-max-unmap-descriptors, unit-attention, drop-unmap, nvme, ndob and
+ * fill. max-unmap-lba=0 makes a target that only deallocates through
+ * WRITE SAME. Sizes accept the suffixes of strtosize().
+ *
+ * @param params the pairs, NULL or "" keeps the configuration.
+ * @param config configuration to update.
+ * @return returns 0 if there is no error.
+ */
+int sg_mock_parse_config(const char *params, sg_mock_config_t *config);
+
+/**
+ * @brief create an in-process SCSI target.
+ *
+ * The target answers INQUIRY, the Unit Serial Number, Block Limits and
+ * Logical Block Provisioning VPD pages, READ CAPACITY(16), TEST UNIT
+ * READY, UNMAP, WRITE SAME(16) with the UNMAP bit or of zeroes, and WRITE(16),
+ * and rejects everything else
+ * with ILLEGAL REQUEST. The fd of the transport is a sparse memory file
+ * of the emulated capacity; unmapped ranges read back as zeroes.
+ *
+ * @param config target configuration.
+ * @return the transport, NULL on error.
+ */
+sg_transport_t *sg_mock_open(const sg_mock_config_t *config);
+
+/**
+ * @brief create an in-process NVMe controller with one namespace.
+ *
+ * The controller answers Identify Controller and Identify Namespace and
+ * deallocates with Dataset Management and Write Zeroes, which it offers
+ * if max-unmap-lba is not 0 and write-same is set. The real-max-* keys
+ * limit the ranges and blocks of one Dataset Management command, and
+ * unit-attention makes every n-th command fail with Namespace Not Ready.
+ * The fd of the device is a sparse memory file like for sg_mock_open().
+ *
+ * @param config controller configuration.
+ * @return the device, NULL on error.
+ */
+nvme_device_t *nvme_mock_open(const sg_mock_config_t *config);
+
+#endif /* MOCK_H */
@@ -0,0 +1,377 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "nvme.h"
+#include "sysfs.h"
+
+typedef struct nvme_uring
+{
+    nvme_device_t nvme;
+    int ring_fd;
+    /* submission ring */
+    void *sq_ring;
+    size_t sq_ring_len;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    /* 128 byte entries, the NVMe command lives in their cmd area */
+    uint8_t *sqes;
+    size_t sqes_len;
+    /* completion ring, shares the mapping with the submission ring if the kernel can */
+    void *cq_ring;
+    size_t cq_ring_len;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    /* 32 byte entries */
+    uint8_t *cqes;
+} nvme_uring_t;
+
+#define NVME_URING_SQE_LEN 128
+#define NVME_URING_CQE_LEN 32
+
+uint32_t nvme_namespace_id(int fd)
+{
+    int nsid = ioctl(fd, NVME_IOCTL_ID);
+    return nsid > 0 ? (uint32_t)nsid : 0;
+}
+
+static int nvme_ioctl_execute(nvme_device_t *nvme, nvme_command_t *command)
+{
+    struct nvme_passthru_cmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = command->cmd.opcode;
+    cmd.flags = command->cmd.flags;
+    cmd.nsid = command->cmd.nsid;
+    cmd.cdw2 = command->cmd.cdw2;
+    cmd.cdw3 = command->cmd.cdw3;
+    cmd.metadata = command->cmd.metadata;
+    cmd.addr = command->cmd.addr;
+    cmd.metadata_len = command->cmd.metadata_len;
+    cmd.data_len = command->cmd.data_len;
+    cmd.cdw10 = command->cmd.cdw10;
+    cmd.cdw11 = command->cmd.cdw11;
+    cmd.cdw12 = command->cmd.cdw12;
+    cmd.cdw13 = command->cmd.cdw13;
+    cmd.cdw14 = command->cmd.cdw14;
+    cmd.cdw15 = command->cmd.cdw15;
+    cmd.timeout_ms = command->cmd.timeout_ms;
+
+    /* a positive return is the NVMe status of a command that reached the controller */
+    int ret = ioctl(nvme->fd, command->admin ? NVME_IOCTL_ADMIN_CMD : NVME_IOCTL_IO_CMD, &cmd);
+    if (ret < 0)
+    {
+        return -1;
+    }
+
+    command->status = ret;
+    command->result = cmd.result;
+    return 0;
+}
+
+static int nvme_ioctl_submit(nvme_device_t *nvme, nvme_command_t *command)
+{
+    (void)nvme;
+    (void)command;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+static int nvme_ioctl_receive(nvme_device_t *nvme, nvme_command_t **command, int timeout)
+{
+    (void)nvme;
+    (void)command;
+    (void)timeout;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+static void nvme_ioctl_close(nvme_device_t *nvme)
+{
+    close(nvme->fd);
+    free(nvme);
+}
+
+static const nvme_device_ops_t nvme_ioctl_ops = {
+    .name = "nvme",
+    .execute = nvme_ioctl_execute,
+    .submit = nvme_ioctl_submit,
+    .receive = nvme_ioctl_receive,
+    .close = nvme_ioctl_close,
+};
+
+nvme_device_t *nvme_device_wrap(int fd, uint32_t nsid)
+{
+    nvme_device_t *nvme = calloc(1, sizeof(*nvme));
+    if (nvme == NULL)
+    {
+        return NULL;
+    }
+
+    nvme->ops = &nvme_ioctl_ops;
+    nvme->fd = fd;
+    nvme->nsid = nsid;
+    return nvme;
+}
+
+static int nvme_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags,
+                            const void *arg, size_t arg_len)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, arg, arg_len);
+}
+
+static int nvme_uring_submit(nvme_device_t *nvme, nvme_command_t *command)
+{
+    nvme_uring_t *uring = (nvme_uring_t *)nvme;
+    if (command->admin)
+    {
+        /* admin commands only go through execute */
+        errno = EINVAL;
+        return -1;
+    }
+
+    unsigned int tail = *uring->sq_tail;
+    if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) > *uring->sq_mask)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    unsigned int index = tail & *uring->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)(uring->sqes + (size_t)index * NVME_URING_SQE_LEN);
+    memset(sqe, 0, NVME_URING_SQE_LEN);
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = nvme->fd;
+    sqe->cmd_op = NVME_URING_CMD_IO;
+    sqe->user_data = (uintptr_t)command;
+    memcpy(sqe->cmd, &command->cmd, sizeof(command->cmd));
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    int ret;
+    do
+    {
+        ret = nvme_uring_enter(uring->ring_fd, 1, 0, 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -1 : 0;
+}
+
+static int nvme_uring_receive(nvme_device_t *nvme, nvme_command_t **command, int timeout)
+{
+    nvme_uring_t *uring = (nvme_uring_t *)nvme;
+    unsigned int head = *uring->cq_head;
+
+    while (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        if (timeout == 0)
+        {
+            return 0;
+        }
+
+        int ret;
+        if (timeout < 0)
+        {
+            ret = nvme_uring_enter(uring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        }
+        else
+        {
+            struct __kernel_timespec ts = {timeout / 1000, (timeout % 1000) * 1000000LL};
+            struct io_uring_getevents_arg arg = {.ts = (uintptr_t)&ts};
+            ret = nvme_uring_enter(uring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                                   &arg, sizeof(arg));
+            if (ret < 0 && errno == ETIME)
+            {
+                timeout = 0;
+                continue;
+            }
+        }
+        if (ret < 0 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+
+    const struct io_uring_cqe *cqe =
+        (const struct io_uring_cqe *)(uring->cqes + (size_t)(head & *uring->cq_mask) * NVME_URING_CQE_LEN);
+    nvme_command_t *done = (nvme_command_t *)(uintptr_t)cqe->user_data;
+    if (cqe->res < 0)
+    {
+        /* never reached the controller */
+        done->status = -1;
+        done->result = cqe->res;
+    }
+    else
+    {
+        done->status = cqe->res;
+        /* the first extra dword of a big completion is the command result */
+        done->result = (uint32_t)cqe->big_cqe[0];
+    }
+    __atomic_store_n(uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    *command = done;
+    return 1;
+}
+
+static void nvme_uring_close(nvme_device_t *nvme)
+{
+    nvme_uring_t *uring = (nvme_uring_t *)nvme;
+    if (uring->sqes && uring->sqes != MAP_FAILED)
+    {
+        munmap(uring->sqes, uring->sqes_len);
+    }
+    if (uring->cq_ring && uring->cq_ring != MAP_FAILED && uring->cq_ring != uring->sq_ring)
+    {
+        munmap(uring->cq_ring, uring->cq_ring_len);
+    }
+    if (uring->sq_ring && uring->sq_ring != MAP_FAILED)
+    {
+        munmap(uring->sq_ring, uring->sq_ring_len);
+    }
+    if (uring->ring_fd >= 0)
+    {
+        close(uring->ring_fd);
+    }
+    if (nvme->fd >= 0)
+    {
+        close(nvme->fd);
+    }
+    free(uring);
+}
+
+static const nvme_device_ops_t nvme_uring_ops = {
+    .name = "nvme-uring",
+    .execute = nvme_ioctl_execute,
+    .submit = nvme_uring_submit,
+    .receive = nvme_uring_receive,
+    .close = nvme_uring_close,
+};
+
+/*
+ * Map the rings of a new io_uring instance.
+ * Returns	0  success
+ * 		<0 error
+ */
+static int nvme_uring_map(nvme_uring_t *uring, const struct io_uring_params *params)
+{
+    uring->sq_ring_len = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+    uring->cq_ring_len = params->cq_off.cqes + params->cq_entries * NVME_URING_CQE_LEN;
+    if (params->features & IORING_FEAT_SINGLE_MMAP && uring->cq_ring_len > uring->sq_ring_len)
+    {
+        uring->sq_ring_len = uring->cq_ring_len;
+    }
+
+    uring->sq_ring = mmap(NULL, uring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          uring->ring_fd, IORING_OFF_SQ_RING);
+    if (uring->sq_ring == MAP_FAILED)
+    {
+        return -1;
+    }
+    if (params->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        uring->cq_ring = uring->sq_ring;
+    }
+    else if ((uring->cq_ring = mmap(NULL, uring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                    uring->ring_fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    uring->sqes_len = params->sq_entries * NVME_URING_SQE_LEN;
+    uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       uring->ring_fd, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    uint8_t *sq = uring->sq_ring;
+    uring->sq_head = (unsigned int *)(sq + params->sq_off.head);
+    uring->sq_tail = (unsigned int *)(sq + params->sq_off.tail);
+    uring->sq_mask = (unsigned int *)(sq + params->sq_off.ring_mask);
+    uring->sq_array = (unsigned int *)(sq + params->sq_off.array);
+
+    uint8_t *cq = uring->cq_ring;
+    uring->cq_head = (unsigned int *)(cq + params->cq_off.head);
+    uring->cq_tail = (unsigned int *)(cq + params->cq_off.tail);
+    uring->cq_mask = (unsigned int *)(cq + params->cq_off.ring_mask);
+    uring->cqes = cq + params->cq_off.cqes;
+    return 0;
+}
+
+nvme_device_t *nvme_device_open_uring(const char *path)
+{
+    nvme_uring_t *uring = calloc(1, sizeof(*uring));
+    if (uring == NULL)
+    {
+        return NULL;
+    }
+
+    uring->nvme.ops = &nvme_uring_ops;
+    uring->ring_fd = -1;
+    uring->nvme.fd = open(path, O_RDWR);
+    if (uring->nvme.fd < 0 || (uring->nvme.nsid = nvme_namespace_id(uring->nvme.fd)) == 0)
+    {
+        goto err;
+    }
+
+    /* NVMe commands need the big entries */
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SQE128 | IORING_SETUP_CQE32;
+    uring->ring_fd = syscall(__NR_io_uring_setup, NVME_URING_DEPTH, &params);
+    if (uring->ring_fd < 0 || nvme_uring_map(uring, &params))
+    {
+        goto err;
+    }
+
+    uring->nvme.depth = params.sq_entries < NVME_URING_DEPTH ? params.sq_entries : NVME_URING_DEPTH;
+    return &uring->nvme;
+
+err:
+    {
+        int saved_errno = errno;
+        nvme_uring_close(&uring->nvme);
+        errno = saved_errno;
+    }
+    return NULL;
+}
+
+int nvme_generic_path(dev_t devno, char *path, size_t len)
+{
+    dev_t disk;
+    uint64_t start;
+    char disk_path[PATH_MAX];
+    unsigned int controller, namespace;
+
+    if (sysfs_whole_disk(devno, &disk, &start) || sysfs_devname(disk, disk_path, sizeof(disk_path)))
+    {
+        return -1;
+    }
+    /* the generic node of /dev/nvmeXnY is /dev/ngXnY */
+    if (sscanf(disk_path, "/dev/nvme%un%u", &controller, &namespace) != 2)
+    {
+        errno = ENODEV;
+        return -1;
+    }
+    if (snprintf(path, len, "/dev/ng%un%u", controller, namespace) >= (int)len)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    return access(path, F_OK);
+}
@@ -0,0 +1,154 @@
+#ifndef NVME_H
+#define NVME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/nvme_ioctl.h>
+
+#include "transport.h"
+
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_IDENTIFY_CNS_NAMESPACE 0x00
+#define NVME_IDENTIFY_CNS_CONTROLLER 0x01
+#define NVME_IDENTIFY_LEN 4096
+#define NVME_CMD_WRITE_ZEROES 0x08
+#define NVME_CMD_DSM 0x09
+/* ranges in one Dataset Management command */
+#define NVME_DSM_MAX_RANGES 256
+#define NVME_DSM_RANGE_LEN 16
+/* cdw11 attribute of Dataset Management */
+#define NVME_DSM_ATTRIBUTE_DEALLOCATE (1 << 2)
+/* cdw12 of Write Zeroes */
+#define NVME_WRITE_ZEROES_DEALLOCATE (1 << 25)
+/* blocks in one Write Zeroes command, the count field is 16 bits wide */
+#define NVME_WRITE_ZEROES_MAX_BLOCKS 0x10000
+
+/* status of a completed command */
+#define NVME_STATUS_CODE(_status) ((_status) & 0xff)
+#define NVME_STATUS_TYPE(_status) (((_status) >> 8) & 0x7)
+#define NVME_STATUS_DNR 0x4000
+#define NVME_SC_INVALID_FIELD 0x02
+#define NVME_SC_ABORT_REQUESTED 0x07
+#define NVME_SC_LBA_RANGE 0x80
+#define NVME_SC_NS_NOT_READY 0x82
+#define NVME_SCT_MEDIA_ERROR 0x2
+
+/* commands in flight on a generic node */
+#define NVME_URING_DEPTH 64
+
+typedef struct nvme_device nvme_device_t;
+
+typedef struct nvme_command
+{
+    /* the submission queue entry, as io_uring takes it */
+    struct nvme_uring_cmd cmd;
+    /* goes to the admin queue */
+    bool admin;
+    /* dword 0 of the completion */
+    uint32_t result;
+    /* completion status, 0 on success */
+    int status;
+    void *usr_ptr;
+} nvme_command_t;
+
+typedef struct nvme_device_ops
+{
+    const char *name;
+    /* run one command to completion */
+    int (*execute)(nvme_device_t *nvme, nvme_command_t *command);
+    /* start one I/O command */
+    int (*submit)(nvme_device_t *nvme, nvme_command_t *command);
+    /* collect one completed command, like sg_transport_receive() */
+    int (*receive)(nvme_device_t *nvme, nvme_command_t **command, int timeout);
+    void (*close)(nvme_device_t *nvme);
+} nvme_device_ops_t;
+
+struct nvme_device
+{
+    const nvme_device_ops_t *ops;
+    /* file descriptor for everything that is not a command, e.g. pread() */
+    int fd;
+    /* namespace the I/O commands go to */
+    uint32_t nsid;
+    /* number of commands that may be submitted at once, 0 if only execute works */
+    unsigned int depth;
+};
+
+/**
+ * @brief get the namespace of an NVMe block device or generic node.
+ *
+ * @param fd open device.
+ * @return namespace id, 0 if the device is not an NVMe namespace.
+ */
+uint32_t nvme_namespace_id(int fd);
+
+/**
+ * @brief issue NVMe commands with the passthrough ioctls on an open namespace.
+ *
+ * The device takes over the file descriptor and closes it. It has no
+ * queue, only execute is used on it.
+ *
+ * @param fd NVMe block device or generic node.
+ * @param nsid namespace id, see nvme_namespace_id().
+ * @return the device, NULL on error.
+ */
+nvme_device_t *nvme_device_wrap(int fd, uint32_t nsid);
+
+/**
+ * @brief open a generic node for synchronous and queued commands.
+ *
+ * Queued commands are io_uring URING_CMD submissions, which need Linux
+ * 5.19 or later.
+ *
+ * @param path NVMe generic node, e.g. "/dev/ng0n1".
+ * @return the device, NULL on error.
+ */
+nvme_device_t *nvme_device_open_uring(const char *path);
+
+/**
+ * @brief find the generic node of an NVMe block device.
+ *
+ * @param devno device number of the namespace or one of its partitions.
+ * @param path buffer for the path, e.g. "/dev/ng0n1".
+ * @param len size of the buffer.
+ * @return returns 0 if there is no error.
+ */
+int nvme_generic_path(dev_t devno, char *path, size_t len);
+
+/**
+ * @brief speak SCSI to an NVMe namespace.
+ *
+ * The transport identifies the controller and the namespace once and
+ * translates INQUIRY, READ CAPACITY(16), TEST UNIT READY, UNMAP and
+ * WRITE SAME(16) with the UNMAP bit or a zero block to Identify,
+ * Dataset Management and Write Zeroes. NVMe errors come back as
+ * CHECK CONDITION with matching sense data.
+ *
+ * @param nvme the namespace, owned by the new transport on success.
+ * @return the transport, NULL on error.
+ */
+sg_transport_t *sg_transport_nvme(nvme_device_t *nvme);
+
+static inline int nvme_device_execute(nvme_device_t *nvme, nvme_command_t *command)
+{
+    return nvme->ops->execute(nvme, command);
+}
+
+static inline int nvme_device_submit(nvme_device_t *nvme, nvme_command_t *command)
+{
+    return nvme->ops->submit(nvme, command);
+}
+
+static inline int nvme_device_receive(nvme_device_t *nvme, nvme_command_t **command, int timeout)
+{
+    return nvme->ops->receive(nvme, command, timeout);
+}
+
+static inline void nvme_device_close(nvme_device_t *nvme)
+{
+    nvme->ops->close(nvme);
+}
+
+#endif /* NVME_H */
@@ -0,0 +1,638 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <scsi/sg.h>
+
+#include "nvme.h"
+#include "sense.h"
+#include "utils.h"
+#include "byteorder.h"
+
+#define SNTL_TEST_UNIT_READY_CMD 0x00
+#define SNTL_INQUIRY_CMD 0x12
+#define SNTL_UNMAP_CMD 0x42
+#define SNTL_WRITE_SAME16_CMD 0x93
+#define SNTL_WRITE_SAME_NDOB 0x01
+#define SNTL_WRITE_SAME_UNMAP 0x08
+#define SNTL_SERVICE_ACTION_IN_CMD 0x9e
+#define SNTL_READ_CAPACITY16_SERVICE_ACTION 0x10
+#define SNTL_SUPPORTED_VPD_PAGE_CODE 0x00
+#define SNTL_UNIT_SERIAL_NUMBER_VPD_PAGE_CODE 0x80
+#define SNTL_BLOCK_LIMITS_VPD_PAGE_CODE 0xb0
+#define SNTL_LOGICAL_BLOCK_PROVISIONING_VPD_PAGE_CODE 0xb2
+
+#define SNTL_DRIVER_SENSE 0x08
+#define SNTL_DID_ERROR 0x07
+#define SNTL_SENSE_LEN 18
+#define SNTL_ASC_WRITE_ERROR 0x0c
+#define SNTL_ASC_INVALID_OPCODE 0x20
+#define SNTL_ASC_LBA_OUT_OF_RANGE 0x21
+#define SNTL_ASC_INVALID_FIELD_IN_CDB 0x24
+#define SNTL_ASC_INVALID_FIELD_IN_PARAMETER_LIST 0x26
+#define SNTL_ASC_LOGICAL_UNIT_NOT_READY 0x04
+#define SNTL_ASC_INTERNAL_TARGET_FAILURE 0x44
+
+/* Identify Controller */
+#define NVME_ID_CTRL_SN 4
+#define NVME_ID_CTRL_SN_LEN 20
+#define NVME_ID_CTRL_MN 24
+#define NVME_ID_CTRL_FR 64
+#define NVME_ID_CTRL_ONCS 520
+#define NVME_ONCS_DSM (1 << 2)
+#define NVME_ONCS_WRITE_ZEROES (1 << 3)
+/* Identify Namespace */
+#define NVME_ID_NS_NSZE 0
+#define NVME_ID_NS_NSFEAT 24
+#define NVME_NSFEAT_THIN_PROVISIONING (1 << 0)
+#define NVME_NSFEAT_OPTIMAL_PERFORMANCE (1 << 4)
+#define NVME_ID_NS_FLBAS 26
+#define NVME_ID_NS_DLFEAT 33
+#define NVME_DLFEAT_WRITE_ZEROES_DEALLOCATE (1 << 3)
+#define NVME_DLFEAT_READ_BEHAVIOR_MASK 0x7
+#define NVME_DLFEAT_READ_ZEROES 0x1
+#define NVME_ID_NS_NPDG 68
+#define NVME_ID_NS_LBAF 128
+
+typedef struct sntl_command
+{
+    /* first, a completed NVMe command leads back to its context */
+    nvme_command_t nvme;
+    sg_io_hdr_t io_hdr;
+    /* answered without the controller, waiting to be received */
+    bool local;
+    bool busy;
+    uint8_t ranges[NVME_DSM_MAX_RANGES * NVME_DSM_RANGE_LEN];
+} sntl_command_t;
+
+typedef struct sntl_transport
+{
+    sg_transport_t transport;
+    nvme_device_t *nvme;
+    sntl_command_t *commands;
+    /* what Identify told about the controller and the namespace */
+    char serial[NVME_ID_CTRL_SN_LEN];
+    char model[16];
+    char revision[4];
+    uint16_t oncs;
+    uint64_t block_count;
+    uint32_t block_size;
+    uint8_t nsfeat;
+    uint8_t dlfeat;
+    uint32_t deallocate_granularity;
+} sntl_transport_t;
+
+static void sntl_check_condition(sg_io_hdr_t *io_hdr, uint8_t key, uint8_t asc, uint8_t ascq)
+{
+    io_hdr->status = SG_STATUS_CHECK_CONDITION;
+    io_hdr->masked_status = SG_STATUS_CHECK_CONDITION >> 1;
+    io_hdr->driver_status = SNTL_DRIVER_SENSE;
+    io_hdr->info |= SG_INFO_CHECK;
+
+    /* fixed format sense data */
+    uint8_t sense[SNTL_SENSE_LEN] = {0x70, 0, key, 0, 0, 0, 0, SNTL_SENSE_LEN - 8};
+    sense[12] = asc;
+    sense[13] = ascq;
+    io_hdr->sb_len_wr = io_hdr->mx_sb_len < sizeof(sense) ? io_hdr->mx_sb_len : sizeof(sense);
+    if (io_hdr->sb_len_wr)
+    {
+        memcpy(io_hdr->sbp, sense, io_hdr->sb_len_wr);
+    }
+}
+
+static void sntl_reply(sg_io_hdr_t *io_hdr, const uint8_t *reply, uint32_t reply_len, uint32_t allocation_len)
+{
+    uint32_t len = reply_len;
+    if (len > allocation_len)
+    {
+        len = allocation_len;
+    }
+    if (len > io_hdr->dxfer_len)
+    {
+        len = io_hdr->dxfer_len;
+    }
+
+    if (len)
+    {
+        memcpy(io_hdr->dxferp, reply, len);
+    }
+    io_hdr->resid = io_hdr->dxfer_len - len;
+}
+
+static void sntl_inquiry(sntl_transport_t *sntl, sg_io_hdr_t *io_hdr)
+{
+    const uint8_t *command = io_hdr->cmdp;
+    uint16_t allocation_len = u16_from_big_endian_bytes(command + 3);
+    bool dsm = sntl->oncs & NVME_ONCS_DSM;
+    bool write_zeroes = sntl->oncs & NVME_ONCS_WRITE_ZEROES;
+    uint8_t reply[64] = {0};
+
+    if (!(command[1] & 1))
+    {
+        if (command[2])
+        {
+            sntl_check_condition(io_hdr, SG_SENSE_KEY_ILLEGAL_REQUEST, SNTL_ASC_INVALID_FIELD_IN_CDB, 0);
+            return;
+        }
+        /* standard data, direct access block device */
+        reply[2] = 0x06;
+        reply[3] = 0x02;
+        reply[4] = 36 - 5;
+        memcpy(reply + 8, "NVMe    ", 8);
+        memcpy(reply + 16, sntl->model, sizeof(sntl->model));
+        memcpy(reply + 32, sntl->revision, sizeof(sntl->revision));
+        sntl_reply(io_hdr, reply, 36, allocation_len);
+        return;
+    }
+
+    reply[1] = command[2];
+    switch (command[2])
+    {
+    case SNTL_SUPPORTED_VPD_PAGE_CODE:
+        reply[3] = 4;
+        reply[4] = SNTL_SUPPORTED_VPD_PAGE_CODE;
+        reply[5] = SNTL_UNIT_SERIAL_NUMBER_VPD_PAGE_CODE;
+        reply[6] = SNTL_BLOCK_LIMITS_VPD_PAGE_CODE;
+        reply[7] = SNTL_LOGICAL_BLOCK_PROVISIONING_VPD_PAGE_CODE;
+        sntl_reply(io_hdr, reply, 8, allocation_len);
+        break;
+    case SNTL_UNIT_SERIAL_NUMBER_VPD_PAGE_CODE:
+        reply[3] = sizeof(sntl->serial);
+        memcpy(reply + 4, sntl->serial, sizeof(sntl->serial));
+        sntl_reply(io_hdr, reply, 4 + sizeof(sntl->serial), allocation_len);
+        break;
+    case SNTL_BLOCK_LIMITS_VPD_PAGE_CODE:
+        u16_to_big_endian_bytes(0x3c, reply + 2);
+        /* one range of Dataset Management is 32 bits long, the command has no total limit */
+        u32_to_big_endian_bytes(dsm ? UINT32_MAX : 0, reply + 20);
+        u32_to_big_endian_bytes(dsm ? NVME_DSM_MAX_RANGES : 0, reply + 24);
+        u32_to_big_endian_bytes(sntl->deallocate_granularity, reply + 28);
+        u64_to_big_endian_bytes(write_zeroes ? NVME_WRITE_ZEROES_MAX_BLOCKS : 0, reply + 36);
+        sntl_reply(io_hdr, reply, 64, allocation_len);
+        break;
+    case SNTL_LOGICAL_BLOCK_PROVISIONING_VPD_PAGE_CODE:
+        reply[3] = 4;
+        /* LBPU, LBPWS */
+        reply[5] = (dsm ? 0x80 : 0) |
+                   (write_zeroes && (sntl->dlfeat & NVME_DLFEAT_WRITE_ZEROES_DEALLOCATE) ? 0x40 : 0);
+        sntl_reply(io_hdr, reply, 8, allocation_len);
+        break;
+    default:
+        sntl_check_condition(io_hdr, SG_SENSE_KEY_ILLEGAL_REQUEST, SNTL_ASC_INVALID_FIELD_IN_CDB, 0);
+        break;
+    }
+}
+
+static void sntl_read_capacity16(sntl_transport_t *sntl, sg_io_hdr_t *io_hdr)
+{
+    const uint8_t *command = io_hdr->cmdp;
+    uint8_t reply[32] = {0};
+
+    u64_to_big_endian_bytes(sntl->block_count - 1, reply);
+    u32_to_big_endian_bytes(sntl->block_size, reply + 8);
+    if (sntl->nsfeat & NVME_NSFEAT_THIN_PROVISIONING)
+    {
+        reply[14] = 0x80;
+    }
+    /* LBPRZ */
+    if ((sntl->dlfeat & NVME_DLFEAT_READ_BEHAVIOR_MASK) == NVME_DLFEAT_READ_ZEROES)
+    {
+        reply[14] |= 0x40;
+    }
+    sntl_reply(io_hdr, reply, sizeof(reply), u32_from_big_endian_bytes(command + 10));
+}
+
+/*
+ * Turn an UNMAP parameter list into a Dataset Management command.
+ * Returns	1  the command goes to the controller
+ * 		0  answered already
+ */
+static int sntl_unmap(sntl_transport_t *sntl, sntl_command_t *context)
+{
+    sg_io_hdr_t *io_hdr = &context->io_hdr;
+    const uint8_t *command = io_hdr->cmdp;
+    const uint8_t *parameter = io_hdr->dxferp;
+    uint16_t parameter_len = u16_from_big_endian_bytes(command + 7);
+
+    if (!(sntl->oncs & NVME_ONCS_DSM))
+    {
+        sntl_check_condition(io_hdr, SG_SENSE_KEY_ILLEGAL_REQUEST, SNTL_ASC_INVALID_OPCODE, 0);
+        return 0;
+    }
+    if (parameter_len < SG_UNMAP_PARAMETER_HEADER_LEN || parameter_len > io_hdr->dxfer_len)
+    {
+        if (parameter_len)
+        {
+            sntl_check_condition(io_hdr, SG_SENSE_KEY_ILLEGAL_REQUEST, SNTL_ASC_INVALID_FIELD_IN_CDB, 0);
+        }
+        return 0;
+    }
+
+    uint32_t descriptor_count = u16_from_big_endian_bytes(parameter + 2) / SG_UNMAP_BLOCK_DESCRIPTOR_LEN;
+    if (SG_UNMAP_PARAMETER_LEN(descriptor_count) > parameter_len || descriptor_count > NVME_DSM_MAX_RANGES)
+    {
+        sntl_check_condition(io_hdr, SG_SENSE_KEY_ILLEGAL_REQUEST, SNTL_ASC_INVALID_FIELD_IN_PARAMETER_LIST, 0);
+        return 0;
+    }
+
+    uint32_t range_count = 0;
+    for (uint32_t i = 0; i < descriptor_count; i++)
+    {
+        const uint8_t *descriptor = parameter + SG_UNMAP_PARAMETER_LEN(i);
+        uint32_t length = u32_from_big_endian_bytes(descriptor + 8);
+        if (length == 0)
+        {
+            continue;
+        }
+
+        /* context attributes, length in logical blocks, starting LBA */
+        uint8_t *range = context->ranges + range_count++ * NVME_DSM_RANGE_LEN;
+        u32_to_little_endian_bytes(0, range);
+        u32_to_little_endian_bytes(length, range + 4);
+        u64_to_little_endian_bytes(u64_from_big_endian_bytes(descriptor), range + 8);
+    }
+    if (range_count == 0)
+    {
+        return 0;
+    }
+
+    struct nvme_uring_cmd *cmd = &context->nvme.cmd;
+    cmd->opcode = NVME_CMD_DSM;
+    cmd->nsid = sntl->nvme->nsid;
+    cmd->addr = (uintptr_t)context->ranges;
+    cmd->data_len = range_count * NVME_DSM_RANGE_LEN;
+    cmd->cdw10 = range_count - 1;
+    cmd->cdw11 = NVME_DSM_ATTRIBUTE_DEALLOCATE;
+    return 1;
+}
+
+/*
+ * Turn WRITE SAME(16) of zeroes into Write Zeroes.
+ * Returns	1  the command goes to the controller
+ * 		0  answered already
+ */
+static int sntl_write_same16(sntl_transport_t *sntl, sntl_command_t *context)
+{
+    sg_io_hdr_t *io_hdr = &context->io_hdr;
+    const uint8_t *command = io_hdr->cmdp;
+    uint64_t lba = u64_from_big_endian_bytes(command + 2);
+    uint32_t blocks = u32_from_big_endian_bytes(command + 10);
+    bool unmap = command[1] & SNTL_WRITE_SAME_UNMAP;
+
+    if (!(sntl->oncs & NVME_ONCS_WRITE_ZEROES))
+    {
+        sntl_check_condition(io_hdr, SG_SENSE_KEY_ILLEGAL_REQUEST, SNTL_ASC_INVALID_OPCODE, 0);
+        return 0;
+    }
+
+    /* Write Zeroes can only repeat a block of zeroes */
+    bool zeroes = command[1] & SNTL_WRITE_SAME_NDOB;
+    if (!zeroes && io_hdr->dxfer_len >= sntl->block_size)
+    {
+        const uint8_t *block = io_hdr->dxferp;
+        zeroes = block[0] == 0 && memcmp(block, block + 1, sntl->block_size - 1) == 0;
+    }
+    if (!zeroes || blocks == 0 || blocks > NVME_WRITE_ZEROES_MAX_BLOCKS)
+    {
+        sntl_check_condition(io_hdr, SG_SENSE_KEY_ILLEGAL_REQUEST, SNTL_ASC_INVALID_FIELD_IN_CDB, 0);
+        return 0;
+    }
+
+    struct nvme_uring_cmd *cmd = &context->nvme.cmd;
+    cmd->opcode = NVME_CMD_WRITE_ZEROES;
+    cmd->nsid = sntl->nvme->nsid;
+    cmd->cdw10 = (uint32_t)lba;
+    cmd->cdw11 = (uint32_t)(lba >> 32);
+    cmd->cdw12 = (blocks - 1) | (unmap ? NVME_WRITE_ZEROES_DEALLOCATE : 0);
+    return 1;
+}
+
+/*
+ * Translate the SCSI command of a context.
+ * Returns	1  the NVMe command of the context goes to the controller
+ * 		0  answered already
+ */
+static int sntl_translate(sntl_transport_t *sntl, sntl_command_t *context)
+{
+    sg_io_hdr_t *io_hdr = &context->io_hdr;
+    const uint8_t *command = io_hdr->cmdp;
+
+    memset(&context->nvme, 0, sizeof(context->nvme));
+    io_hdr->status = 0;
+    io_hdr->masked_status = 0;
+    io_hdr->host_status = 0;
+    io_hdr->driver_status = 0;
+    io_hdr->sb_len_wr = 0;
+    io_hdr->resid = 0;
+    io_hdr->info = 0;
+    io_hdr->duration = 0;
+
+    switch (io_hdr->cmd_len ? command[0] : 0xff)
+    {
+    case SNTL_TEST_UNIT_READY_CMD:
+        return 0;
+    case SNTL_INQUIRY_CMD:
+        sntl_inquiry(sntl, io_hdr);
+        return 0;
+    case SNTL_UNMAP_CMD:
+        return sntl_unmap(sntl, context);
+    case SNTL_WRITE_SAME16_CMD:
+        return sntl_write_same16(sntl, context);
+    case SNTL_SERVICE_ACTION_IN_CMD:
+        if ((command[1] & 0x1f) == SNTL_READ_CAPACITY16_SERVICE_ACTION)
+        {
+            sntl_read_capacity16(sntl, io_hdr);
+            return 0;
+        }
+        sntl_check_condition(io_hdr, SG_SENSE_KEY_ILLEGAL_REQUEST, SNTL_ASC_INVALID_FIELD_IN_CDB, 0);
+        return 0;
+    default:
+        sntl_check_condition(io_hdr, SG_SENSE_KEY_ILLEGAL_REQUEST, SNTL_ASC_INVALID_OPCODE, 0);
+        return 0;
+    }
+}
+
+/* map the NVMe status of a completed command onto the SCSI status and sense data */
+static void sntl_complete(sg_io_hdr_t *io_hdr, const nvme_command_t *command)
+{
+    int status = command->status;
+    if (status == 0)
+    {
+        return;
+    }
+    if (status < 0)
+    {
+        /* the command never reached the controller */
+        io_hdr->host_status = SNTL_DID_ERROR;
+        io_hdr->info |= SG_INFO_CHECK;
+        return;
+    }
+
+    bool retryable = !(status & NVME_STATUS_DNR);
+    if (NVME_STATUS_TYPE(status) == 0)
+    {
+        switch (NVME_STATUS_CODE(status))
+        {
+        case NVME_SC_INVALID_FIELD:
+            sntl_check_condition(io_hdr, SG_SENSE_KEY_ILLEGAL_REQUEST, SNTL_ASC_INVALID_FIELD_IN_CDB, 0);
+            return;
+        case NVME_SC_LBA_RANGE:
+            sntl_check_condition(io_hdr, SG_SENSE_KEY_ILLEGAL_REQUEST, SNTL_ASC_LBA_OUT_OF_RANGE, 0);
+            return;
+        case NVME_SC_NS_NOT_READY:
+            /* becoming ready while it may be retried */
+            sntl_check_condition(io_hdr, SG_SENSE_KEY_NOT_READY, SNTL_ASC_LOGICAL_UNIT_NOT_READY, retryable ? 1 : 0);
+            return;
+        default:
+            break;
+        }
+    }
+    else if (NVME_STATUS_TYPE(status) == NVME_SCT_MEDIA_ERROR)
+    {
+        sntl_check_condition(io_hdr, SG_SENSE_KEY_MEDIUM_ERROR, SNTL_ASC_WRITE_ERROR, 0);
+        return;
+    }
+
+    if (retryable)
+    {
+        sntl_check_condition(io_hdr, SG_SENSE_KEY_ABORTED_COMMAND, 0, 0);
+    }
+    else
+    {
+        sntl_check_condition(io_hdr, SG_SENSE_KEY_HARDWARE_ERROR, SNTL_ASC_INTERNAL_TARGET_FAILURE, 0);
+    }
+}
+
+static int sntl_execute(sg_transport_t *transport, sg_io_hdr_t *io_hdr)
+{
+    sntl_transport_t *sntl = (sntl_transport_t *)transport;
+    sntl_command_t *context = malloc(sizeof(*context));
+    if (context == NULL)
+    {
+        return -1;
+    }
+
+    int ret = 0;
+    context->io_hdr = *io_hdr;
+    if (sntl_translate(sntl, context))
+    {
+        context->nvme.cmd.timeout_ms = io_hdr->timeout;
+        if ((ret = nvme_device_execute(sntl->nvme, &context->nvme)) == 0)
+        {
+            sntl_complete(&context->io_hdr, &context->nvme);
+        }
+    }
+    if (ret == 0)
+    {
+        /* the caller's buffers were filled through the copied pointers */
+        *io_hdr = context->io_hdr;
+    }
+
+    free(context);
+    return ret;
+}
+
+static int sntl_submit(sg_transport_t *transport, sg_io_hdr_t *io_hdr)
+{
+    sntl_transport_t *sntl = (sntl_transport_t *)transport;
+    sntl_command_t *context = NULL;
+    for (unsigned int i = 0; i < transport->depth; i++)
+    {
+        if (!sntl->commands[i].busy)
+        {
+            context = &sntl->commands[i];
+            break;
+        }
+    }
+    if (context == NULL)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    context->io_hdr = *io_hdr;
+    context->local = sntl_translate(sntl, context) == 0;
+    if (!context->local)
+    {
+        context->nvme.cmd.timeout_ms = io_hdr->timeout;
+        if (nvme_device_submit(sntl->nvme, &context->nvme))
+        {
+            return -1;
+        }
+    }
+
+    context->busy = true;
+    return 0;
+}
+
+static int sntl_receive(sg_transport_t *transport, sg_io_hdr_t *io_hdr, int timeout)
+{
+    sntl_transport_t *sntl = (sntl_transport_t *)transport;
+    sntl_command_t *context = NULL;
+    bool in_flight = false;
+
+    for (unsigned int i = 0; i < transport->depth; i++)
+    {
+        if (sntl->commands[i].busy && sntl->commands[i].local)
+        {
+            context = &sntl->commands[i];
+            break;
+        }
+        in_flight |= sntl->commands[i].busy;
+    }
+
+    if (context == NULL)
+    {
+        if (!in_flight && timeout < 0)
+        {
+            /* nothing would ever complete */
+            errno = EAGAIN;
+            return -1;
+        }
+
+        nvme_command_t *command;
+        int ret = nvme_device_receive(sntl->nvme, &command, timeout);
+        if (ret <= 0)
+        {
+            return ret;
+        }
+        context = (sntl_command_t *)command;
+        sntl_complete(&context->io_hdr, &context->nvme);
+    }
+
+    *io_hdr = context->io_hdr;
+    context->busy = false;
+    return 1;
+}
+
+static void sntl_close(sg_transport_t *transport)
+{
+    sntl_transport_t *sntl = (sntl_transport_t *)transport;
+    nvme_device_close(sntl->nvme);
+    free(sntl->commands);
+    free(sntl);
+}
+
+static const sg_transport_ops_t sntl_ops = {
+    .name = "nvme",
+    .execute = sntl_execute,
+    .submit = sntl_submit,
+    .receive = sntl_receive,
+    .close = sntl_close,
+};
+
+/*
+ * Run one Identify command, repeating it while the controller allows.
+ * Returns	0  success
+ * 		<0 error
+ */
+static int sntl_identify(nvme_device_t *nvme, uint32_t nsid, uint8_t cns, uint8_t *data)
+{
+    nvme_command_t command;
+    memset(&command, 0, sizeof(command));
+    command.admin = true;
+    command.cmd.opcode = NVME_ADMIN_IDENTIFY;
+    command.cmd.nsid = nsid;
+    command.cmd.addr = (uintptr_t)data;
+    command.cmd.data_len = NVME_IDENTIFY_LEN;
+    command.cmd.cdw10 = cns;
+    command.cmd.timeout_ms = SG_TIMEOUT;
+
+    for (unsigned int attempt = 0;; attempt++)
+    {
+        if (nvme_device_execute(nvme, &command))
+        {
+            return -1;
+        }
+        if (command.status == 0)
+        {
+            return 0;
+        }
+        if (command.status < 0 || (command.status & NVME_STATUS_DNR) || attempt == SG_RETRY_LIMIT)
+        {
+            errno = EIO;
+            return -1;
+        }
+        sg_retry_backoff(attempt);
+    }
+}
+
+/*
+ * Read what the translation needs from Identify.
+ * Returns	0  success
+ * 		<0 error
+ */
+static int sntl_load_identify(sntl_transport_t *sntl)
+{
+    uint8_t *data;
+    if (posix_memalign((void **)&data, NVME_IDENTIFY_LEN, NVME_IDENTIFY_LEN))
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int ret = -1;
+    memset(data, 0, NVME_IDENTIFY_LEN);
+    if (sntl_identify(sntl->nvme, 0, NVME_IDENTIFY_CNS_CONTROLLER, data))
+    {
+        goto out;
+    }
+    memcpy(sntl->serial, data + NVME_ID_CTRL_SN, sizeof(sntl->serial));
+    memcpy(sntl->model, data + NVME_ID_CTRL_MN, sizeof(sntl->model));
+    memcpy(sntl->revision, data + NVME_ID_CTRL_FR, sizeof(sntl->revision));
+    sntl->oncs = u16_from_little_endian_bytes(data + NVME_ID_CTRL_ONCS);
+
+    memset(data, 0, NVME_IDENTIFY_LEN);
+    if (sntl_identify(sntl->nvme, sntl->nvme->nsid, NVME_IDENTIFY_CNS_NAMESPACE, data))
+    {
+        goto out;
+    }
+    sntl->block_count = u64_from_little_endian_bytes(data + NVME_ID_NS_NSZE);
+    sntl->nsfeat = data[NVME_ID_NS_NSFEAT];
+    sntl->dlfeat = data[NVME_ID_NS_DLFEAT];
+    const uint8_t *lba_format = data + NVME_ID_NS_LBAF + (data[NVME_ID_NS_FLBAS] & 0x0f) * 4;
+    uint8_t lbads = lba_format[2];
+    if (sntl->block_count == 0 || lbads < 9 || lbads > 31)
+    {
+        errno = ENODEV;
+        goto out;
+    }
+    sntl->block_size = 1U << lbads;
+    /* NPDG is only valid with the optimal performance fields */
+    if (sntl->nsfeat & NVME_NSFEAT_OPTIMAL_PERFORMANCE)
+    {
+        sntl->deallocate_granularity = u16_from_little_endian_bytes(data + NVME_ID_NS_NPDG) + 1;
+    }
+
+    ret = 0;
+
+out:
+    free(data);
+    return ret;
+}
+
+sg_transport_t *sg_transport_nvme(nvme_device_t *nvme)
+{
+    sntl_transport_t *sntl = calloc(1, sizeof(*sntl));
+    if (sntl == NULL)
+    {
+        return NULL;
+    }
+
+    sntl->transport.ops = &sntl_ops;
+    sntl->transport.fd = nvme->fd;
+    sntl->transport.depth = nvme->depth;
+    sntl->nvme = nvme;
+    if ((nvme->depth > 0 && (sntl->commands = calloc(nvme->depth, sizeof(*sntl->commands))) == NULL) ||
+        sntl_load_identify(sntl))
+    {
+        int saved_errno = errno;
+        free(sntl->commands);
+        free(sntl);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    return &sntl->transport;
+}
@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef HAVE_LIBBLKID
+#include <blkid/blkid.h>
+#endif
+
+#include "partmap.h"
+
+/* libblkid reports partitions in 512-byte sectors whatever the disk uses */
+#define PARTMAP_SECTOR_SIZE 512
+
+int partmap_read(int fd, partition_map_t *map)
+{
+    memset(map, 0, sizeof(*map));
+
+#ifdef HAVE_LIBBLKID
+    int ret = -1;
+    blkid_probe pr = blkid_new_probe();
+    if (!pr || blkid_probe_set_device(pr, fd, 0, 0))
+    {
+        errno = EIO;
+        goto out;
+    }
+
+    blkid_probe_enable_superblocks(pr, false);
+    blkid_probe_enable_partitions(pr, true);
+
+    blkid_partlist list = blkid_probe_get_partitions(pr);
+    blkid_parttable table = list ? blkid_partlist_get_table(list) : NULL;
+    if (table == NULL)
+    {
+        errno = ENODATA;
+        goto out;
+    }
+    const char *type = blkid_parttable_get_type(table);
+    strncpy(map->type, type ? type : "unknown", sizeof(map->type) - 1);
+
+    int count = blkid_partlist_numof_partitions(list);
+    if (count > 0 && (map->partitions = calloc(count, sizeof(*map->partitions))) == NULL)
+    {
+        goto out;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        blkid_partition part = blkid_partlist_get_partition(list, i);
+        if (part == NULL)
+        {
+            errno = EIO;
+            goto out;
+        }
+        partition_t *partition = &map->partitions[map->count++];
+        partition->number = blkid_partition_get_partno(part);
+        partition->offset = (uint64_t)blkid_partition_get_start(part) * PARTMAP_SECTOR_SIZE;
+        partition->length = (uint64_t)blkid_partition_get_size(part) * PARTMAP_SECTOR_SIZE;
+        partition->container = blkid_partition_is_extended(part);
+    }
+
+    ret = 0;
+
+out:
+    if (ret)
+    {
+        int saved_errno = errno;
+        partmap_free(map);
+        errno = saved_errno;
+    }
+    blkid_free_probe(pr);
+    return ret;
+#else
+    (void)fd;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif /* HAVE_LIBBLKID */
+}
+
+static const partition_t *partmap_find(const partition_map_t *map, unsigned int number)
+{
+    for (size_t i = 0; i < map->count; i++)
+    {
+        if (map->partitions[i].number == number)
+        {
+            return &map->partitions[i];
+        }
+    }
+    return NULL;
+}
+
+int partmap_plan(const partition_map_t *map, uint64_t device_size, uint32_t sector_size, bool gaps,
+                 const unsigned int *numbers, size_t count, extent_list_t *extents)
+{
+    extent_list_t allocated = {0};
+    extent_list_t areas = {0};
+    int ret = -1;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const partition_t *partition = partmap_find(map, numbers[i]);
+        if (partition == NULL || partition->container)
+        {
+            errno = partition ? EISDIR : ENOENT;
+            goto out;
+        }
+        /* a table that does not fit the disk is not one to trust */
+        if (partition->offset + partition->length > device_size)
+        {
+            errno = ERANGE;
+            goto out;
+        }
+        if (extent_list_append_aligned(&areas, partition->offset, partition->length, sector_size))
+        {
+            goto out;
+        }
+    }
+
+    if (gaps && device_size > 2 * PARTMAP_RESERVED_BYTES)
+    {
+        for (size_t i = 0; i < map->count; i++)
+        {
+            if (extent_list_append(&allocated, map->partitions[i].offset, map->partitions[i].length))
+            {
+                goto out;
+            }
+        }
+        extent_list_normalize(&allocated);
+
+        extent_list_t free_space = {0};
+        unmap_extent_t usable = {PARTMAP_RESERVED_BYTES, device_size - 2 * PARTMAP_RESERVED_BYTES};
+        if (extent_list_subtract(&usable, 1, &allocated, &free_space))
+        {
+            extent_list_free(&free_space);
+            goto out;
+        }
+        for (size_t i = 0; i < free_space.count; i++)
+        {
+            if (extent_list_append_aligned(&areas, free_space.extents[i].offset, free_space.extents[i].length,
+                                           sector_size))
+            {
+                extent_list_free(&free_space);
+                goto out;
+            }
+        }
+        extent_list_free(&free_space);
+    }
+
+    /* the partitions and the gaps between them go out as one pass */
+    extent_list_normalize(&areas);
+    for (size_t i = 0; i < areas.count; i++)
+    {
+        if (extent_list_append(extents, areas.extents[i].offset, areas.extents[i].length))
+        {
+            goto out;
+        }
+    }
+
+    ret = 0;
+
+out:
+    extent_list_free(&allocated);
+    extent_list_free(&areas);
+    return ret;
+}
+
+void partmap_free(partition_map_t *map)
+{
+    free(map->partitions);
+    map->partitions = NULL;
+    map->count = 0;
+}
@@ -0,0 +1,68 @@
+#ifndef PARTMAP_H
+#define PARTMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "extent.h"
+
+/* space kept at both ends of a disk with a partition table, it holds the GPT and its backup */
+#define PARTMAP_RESERVED_BYTES (1 << 20)
+
+typedef struct partition
+{
+    unsigned int number;
+    /* offset and length on the disk in byte */
+    uint64_t offset;
+    uint64_t length;
+    /* an MBR extended partition, it holds the tables of the logical ones */
+    bool container;
+} partition_t;
+
+typedef struct partition_map
+{
+    /* "gpt", "dos", ... as libblkid names it */
+    char type[16];
+    partition_t *partitions;
+    size_t count;
+} partition_map_t;
+
+/**
+ * @brief read the partition table of a whole disk.
+ *
+ * @param fd file descriptor of the disk.
+ * @param map the partitions.
+ * @return returns 0 if there is no error, errno is ENODATA without a
+ *         partition table and EOPNOTSUPP when built without libblkid.
+ */
+int partmap_read(int fd, partition_map_t *map);
+
+/**
+ * @brief collect the areas to discard on a partitioned disk.
+ *
+ * Everything outside the partitions except PARTMAP_RESERVED_BYTES at both
+ * ends is unallocated. Extended partitions count as allocated as a whole.
+ *
+ * @param map the partitions.
+ * @param device_size size of the disk in byte.
+ * @param sector_size logical block size, partial blocks are dropped.
+ * @param gaps collect the unallocated areas.
+ * @param numbers partitions to discard as well.
+ * @param count number of partitions.
+ * @param extents the areas, sorted and merged.
+ * @return returns 0 if there is no error, errno is ENOENT for a partition
+ *         that does not exist, EISDIR for an extended partition and ERANGE
+ *         for one behind the end of the disk.
+ */
+int partmap_plan(const partition_map_t *map, uint64_t device_size, uint32_t sector_size, bool gaps,
+                 const unsigned int *numbers, size_t count, extent_list_t *extents);
+
+/**
+ * @brief release the partitions of a map.
+ *
+ * @param map the map.
+ */
+void partmap_free(partition_map_t *map);
+
+#endif /* PARTMAP_H */
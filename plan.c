@@ -0,0 +1,112 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "plan.h"
+
+uint64_t plan_granularity(const device_info_t *info)
+{
+    uint64_t granularity = info->optimal_unmap_granularity;
+    if (granularity == 0)
+    {
+        granularity = 1;
+    }
+    return granularity * info->sector_size;
+}
+
+void plan_init(plan_t *plan, const device_info_t *info, const unmap_extent_t *extents, size_t count,
+               uint64_t step, bool skip_edges)
+{
+    memset(plan, 0, sizeof(*plan));
+    plan->extents = extents;
+    plan->count = count;
+    plan->skip_edges = skip_edges;
+    plan->granularity = plan_granularity(info);
+    plan->alignment = ((uint64_t)info->unmap_granularity_alignment * info->sector_size) % plan->granularity;
+
+    /* one body should fit in a single UNMAP command */
+    uint64_t lba_limit = info->maximum_unmap_lba_count;
+    if (lba_limit == 0 || lba_limit == UINT32_MAX)
+    {
+        lba_limit = UINT32_MAX;
+    }
+    plan->max_chunk = lba_limit * info->sector_size;
+    plan_set_step(plan, step);
+}
+
+void plan_set_step(plan_t *plan, uint64_t step)
+{
+    uint64_t chunk = plan->max_chunk;
+    if (step > 0 && step < chunk)
+    {
+        chunk = step;
+    }
+
+    chunk -= chunk % plan->granularity;
+    plan->chunk = chunk ? chunk : plan->granularity;
+}
+
+/* first granularity boundary at or after offset */
+static uint64_t plan_align_up(const plan_t *plan, uint64_t offset)
+{
+    if (offset <= plan->alignment)
+    {
+        return plan->alignment;
+    }
+
+    uint64_t remainder = (offset - plan->alignment) % plan->granularity;
+    return remainder ? offset + plan->granularity - remainder : offset;
+}
+
+/* last granularity boundary at or before offset */
+static uint64_t plan_align_down(const plan_t *plan, uint64_t offset)
+{
+    if (offset < plan->alignment)
+    {
+        return 0;
+    }
+
+    return offset - (offset - plan->alignment) % plan->granularity;
+}
+
+bool plan_next(plan_t *plan, unmap_extent_t *extent)
+{
+    while (true)
+    {
+        if (plan->offset >= plan->end_offset)
+        {
+            if (plan->index == plan->count)
+            {
+                return false;
+            }
+            plan->offset = plan->extents[plan->index].offset;
+            plan->end_offset = plan->offset + plan->extents[plan->index].length;
+            plan->index++;
+            continue;
+        }
+
+        extent->offset = plan->offset;
+
+        uint64_t head_end = plan_align_up(plan, plan->offset);
+        uint64_t body_end = plan_align_down(plan, plan->end_offset);
+        if (head_end > plan->offset || body_end <= plan->offset)
+        {
+            /* head or tail, cut at the next boundary or the end of the area */
+            uint64_t edge_end = head_end > plan->offset && head_end < plan->end_offset ? head_end : plan->end_offset;
+            extent->length = edge_end - plan->offset;
+            plan->offset = edge_end;
+            if (plan->skip_edges)
+            {
+                continue;
+            }
+            return true;
+        }
+
+        extent->length = body_end - plan->offset;
+        if (extent->length > plan->chunk)
+        {
+            extent->length = plan->chunk;
+        }
+        plan->offset += extent->length;
+        return true;
+    }
+}
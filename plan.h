@@ -0,0 +1,66 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+typedef struct plan
+{
+    const unmap_extent_t *extents;
+    size_t count;
+    size_t index;
+    uint64_t offset;
+    uint64_t end_offset;
+    uint64_t granularity;
+    uint64_t alignment;
+    uint64_t chunk;
+    uint64_t max_chunk;
+    bool skip_edges;
+} plan_t;
+
+/**
+ * @brief plan how a list of areas is split into UNMAP requests.
+ *
+ * Every area is split into an unaligned head, bodies of whole unmap
+ * granularities and an unaligned tail. Bodies are at most step bytes, or
+ * as large as one UNMAP command allows if step is 0, and never cross a
+ * granularity boundary on their ends.
+ *
+ * @param plan plan to initialize.
+ * @param info device info, must outlive the plan.
+ * @param extents areas to discard, must outlive the plan.
+ * @param count number of extents.
+ * @param step preferred size of each body, 0 for no preference.
+ * @param skip_edges do not discard partial granularities.
+ */
+void plan_init(plan_t *plan, const device_info_t *info, const unmap_extent_t *extents, size_t count,
+               uint64_t step, bool skip_edges);
+
+/**
+ * @brief change the preferred body size of the areas still to come.
+ *
+ * @param plan the plan.
+ * @param step preferred size of each body, 0 for no preference.
+ */
+void plan_set_step(plan_t *plan, uint64_t step);
+
+/**
+ * @brief get the next area to unmap.
+ *
+ * @param plan the plan.
+ * @param extent the area, offset and length in byte.
+ * @return false once the plan is complete.
+ */
+bool plan_next(plan_t *plan, unmap_extent_t *extent);
+
+/**
+ * @brief get the unmap granularity of a device.
+ *
+ * @param info device info.
+ * @return granularity in byte, never less than the sector size.
+ */
+uint64_t plan_granularity(const device_info_t *info);
+
+#endif /* PLAN_H */
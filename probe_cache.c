@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+
+#include "probe_cache.h"
+
+static int probe_entry_set(probe_entry_t *entry, const char *key, size_t key_len, const char *value)
+{
+#define PROBE_KEY(_name) (key_len == strlen(_name) && strncmp(key, _name, key_len) == 0)
+    if (PROBE_KEY("method"))
+    {
+        if (strcmp(value, "unmap") == 0)
+        {
+            entry->method = SG_DEALLOCATE_UNMAP;
+        }
+        else if (strcmp(value, "write-same") == 0)
+        {
+            entry->method = SG_DEALLOCATE_WRITE_SAME;
+        }
+        else
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        entry->method_valid = true;
+        return 0;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    uint64_t number = strtoull(value, &end, 10);
+    if (errno || end == value || *end)
+    {
+        errno = errno ? errno : EINVAL;
+        return -1;
+    }
+
+    if (PROBE_KEY("capacity"))
+        entry->capacity = number;
+    else if (PROBE_KEY("lba-limit"))
+        entry->lba_limit = number;
+    else if (PROBE_KEY("write-same-limit"))
+        entry->write_same_limit = number;
+    else if (PROBE_KEY("step"))
+        entry->step = number;
+    else if (number > UINT32_MAX)
+    {
+        errno = ERANGE;
+        return -1;
+    }
+    else if (PROBE_KEY("descriptor-limit"))
+        entry->descriptor_limit = number;
+    else if (PROBE_KEY("descriptors"))
+        entry->descriptors = number;
+    else if (PROBE_KEY("queue-depth"))
+        entry->queue_depth = number;
+    else
+    {
+        errno = EINVAL;
+        return -1;
+    }
+#undef PROBE_KEY
+
+    return 0;
+}
+
+/*
+ * Parse one line of the cache.
+ * Returns	0  success
+ * 		<0 error
+ */
+static int probe_entry_parse(char *line, probe_entry_t *entry)
+{
+    memset(entry, 0, sizeof(*entry));
+
+    char *tab = strchr(line, '\t');
+    if (tab == NULL || tab == line || (size_t)(tab - line) > PROBE_CACHE_SERIAL_LEN)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(entry->serial, line, tab - line);
+
+    char *p = tab + 1;
+    while (*p)
+    {
+        char *end = strchrnul(p, ',');
+        char *equal = memchr(p, '=', end - p);
+        if (equal == NULL || equal == p)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        bool last = *end == '\0';
+        *end = '\0';
+        if (probe_entry_set(entry, p, equal - p, equal + 1))
+        {
+            return -1;
+        }
+        p = last ? end : end + 1;
+    }
+
+    if (entry->capacity == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int probe_cache_load(probe_cache_t *cache, const char *path)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->path = path;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        /* nothing learned yet */
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    int ret = 0;
+    char *line = NULL;
+    size_t line_len = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_len, file)) >= 0)
+    {
+        if (len > 0 && line[len - 1] == '\n')
+        {
+            line[len - 1] = '\0';
+        }
+
+        /* a damaged line only costs probing that device again */
+        probe_entry_t entry;
+        if (probe_entry_parse(line, &entry))
+        {
+            continue;
+        }
+        if (probe_cache_store(cache, &entry))
+        {
+            ret = -1;
+            break;
+        }
+    }
+    if (ret == 0 && ferror(file))
+    {
+        errno = EIO;
+        ret = -1;
+    }
+
+    free(line);
+    fclose(file);
+    if (ret)
+    {
+        int saved_errno = errno;
+        probe_cache_free(cache);
+        errno = saved_errno;
+    }
+    return ret;
+}
+
+const probe_entry_t *probe_cache_find(const probe_cache_t *cache, const char *serial, uint64_t capacity)
+{
+    for (size_t i = 0; i < cache->count; i++)
+    {
+        if (strcmp(cache->entries[i].serial, serial) == 0)
+        {
+            return cache->entries[i].capacity == capacity ? &cache->entries[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+int probe_cache_store(probe_cache_t *cache, const probe_entry_t *entry)
+{
+    if (entry->serial[0] == '\0' || strpbrk(entry->serial, "\t\n"))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < cache->count; i++)
+    {
+        if (strcmp(cache->entries[i].serial, entry->serial) == 0)
+        {
+            cache->entries[i] = *entry;
+            return 0;
+        }
+    }
+
+    probe_entry_t *entries = realloc(cache->entries, (cache->count + 1) * sizeof(*entries));
+    if (entries == NULL)
+    {
+        return -1;
+    }
+    cache->entries = entries;
+    cache->entries[cache->count++] = *entry;
+    return 0;
+}
+
+static void probe_entry_print(FILE *out, const probe_entry_t *entry)
+{
+    fprintf(out, "%s\tcapacity=%" PRIu64, entry->serial, entry->capacity);
+    if (entry->lba_limit)
+    {
+        fprintf(out, ",lba-limit=%" PRIu64, entry->lba_limit);
+    }
+    if (entry->descriptor_limit)
+    {
+        fprintf(out, ",descriptor-limit=%" PRIu32, entry->descriptor_limit);
+    }
+    if (entry->write_same_limit)
+    {
+        fprintf(out, ",write-same-limit=%" PRIu64, entry->write_same_limit);
+    }
+    if (entry->method_valid)
+    {
+        fprintf(out, ",method=%s", entry->method == SG_DEALLOCATE_UNMAP ? "unmap" : "write-same");
+    }
+    if (entry->step)
+    {
+        fprintf(out, ",step=%" PRIu64, entry->step);
+    }
+    if (entry->descriptors)
+    {
+        fprintf(out, ",descriptors=%u", entry->descriptors);
+    }
+    if (entry->queue_depth)
+    {
+        fprintf(out, ",queue-depth=%u", entry->queue_depth);
+    }
+    fputc('\n', out);
+}
+
+int probe_cache_save(const probe_cache_t *cache)
+{
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", cache->path, (long)getpid()) >= (int)sizeof(tmp_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    FILE *out = fdopen(fd, "w");
+    if (out == NULL)
+    {
+        int saved_errno = errno;
+        close(fd);
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+
+    for (size_t i = 0; i < cache->count; i++)
+    {
+        probe_entry_print(out, &cache->entries[i]);
+    }
+    int ret = ferror(out) ? -1 : 0;
+    if (fclose(out))
+    {
+        ret = -1;
+    }
+    if (ret == 0 && rename(tmp_path, cache->path))
+    {
+        ret = -1;
+    }
+    if (ret)
+    {
+        int saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+    }
+    return ret;
+}
+
+void probe_cache_free(probe_cache_t *cache)
+{
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->count = 0;
+}
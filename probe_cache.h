@@ -0,0 +1,87 @@
+#ifndef PROBE_CACHE_H
+#define PROBE_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+#define PROBE_CACHE_SERIAL_LEN 64
+
+/* what earlier runs learned about one device */
+typedef struct probe_entry
+{
+    char serial[PROBE_CACHE_SERIAL_LEN + 1];
+    /* size of the device in byte, a resized device is probed again */
+    uint64_t capacity;
+    /* command limits the device accepted, 0 if unknown */
+    uint64_t lba_limit;
+    uint32_t descriptor_limit;
+    uint64_t write_same_limit;
+    /* the faster method when the device has both */
+    bool method_valid;
+    sg_deallocate_t method;
+    /* fastest combination of the last benchmark, 0 if unknown */
+    uint64_t step;
+    unsigned int descriptors;
+    unsigned int queue_depth;
+} probe_entry_t;
+
+typedef struct probe_cache
+{
+    const char *path;
+    probe_entry_t *entries;
+    size_t count;
+} probe_cache_t;
+
+/**
+ * @brief read the probe cache.
+ *
+ * The cache is a text file with one line per device: the serial, a tab
+ * and "key=value,..." pairs. Lines that cannot be parsed are dropped, a
+ * missing file is an empty cache.
+ *
+ * @param cache cache to initialize.
+ * @param path the file, must outlive the cache.
+ * @return returns 0 if there is no error.
+ */
+int probe_cache_load(probe_cache_t *cache, const char *path);
+
+/**
+ * @brief find the entry of a device.
+ *
+ * @param cache the cache.
+ * @param serial unit serial number of the device.
+ * @param capacity size of the device in byte.
+ * @return the entry, NULL if the device is not in the cache.
+ */
+const probe_entry_t *probe_cache_find(const probe_cache_t *cache, const char *serial, uint64_t capacity);
+
+/**
+ * @brief add or replace the entry of a device.
+ *
+ * @param cache the cache.
+ * @param entry the entry, its serial must not contain tabs or newlines.
+ * @return returns 0 if there is no error.
+ */
+int probe_cache_store(probe_cache_t *cache, const probe_entry_t *entry);
+
+/**
+ * @brief write the cache back to its file.
+ *
+ * The file is replaced atomically.
+ *
+ * @param cache the cache.
+ * @return returns 0 if there is no error.
+ */
+int probe_cache_save(const probe_cache_t *cache);
+
+/**
+ * @brief release the entries of the cache.
+ *
+ * @param cache the cache.
+ */
+void probe_cache_free(probe_cache_t *cache);
+
+#endif /* PROBE_CACHE_H */
@@ -0,0 +1,269 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <inttypes.h>
+
+#include "progress.h"
+
+static double progress_seconds(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void progress_init(progress_t *progress, const char *device)
+{
+    memset(progress, 0, sizeof(*progress));
+    progress->device = device;
+    progress->state = PROGRESS_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &progress->started);
+    progress->last = progress->started;
+}
+
+void progress_update(progress_t *progress, uint64_t done_bytes, uint64_t commands, uint64_t retries,
+                     const histogram_t *latency)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double interval = progress_seconds(&progress->last, &now);
+    if (interval > 0)
+    {
+        progress->rate = (done_bytes - progress->last_bytes) / interval;
+    }
+    progress->last = now;
+    progress->last_bytes = done_bytes;
+    progress->elapsed = progress_seconds(&progress->started, &now);
+
+    progress->done_bytes = done_bytes;
+    progress->commands = commands;
+    progress->retries = retries;
+    if (latency && latency->count)
+    {
+        progress->latency_p50 = histogram_percentile(latency, 50);
+        progress->latency_p99 = histogram_percentile(latency, 99);
+        progress->latency_p999 = histogram_percentile(latency, 99.9);
+    }
+}
+
+double progress_eta(const progress_t *progress)
+{
+    if (progress->state != PROGRESS_RUNNING)
+    {
+        return 0;
+    }
+    if (progress->total_bytes == 0 || progress->done_bytes == 0 || progress->elapsed <= 0)
+    {
+        return -1;
+    }
+
+    uint64_t left = progress->total_bytes > progress->done_bytes ? progress->total_bytes - progress->done_bytes : 0;
+    return left / (progress->done_bytes / progress->elapsed);
+}
+
+static const char *progress_state_name(progress_state_t state)
+{
+    switch (state)
+    {
+    case PROGRESS_DONE:
+        return "done";
+    case PROGRESS_FAILED:
+        return "failed";
+    default:
+        return "running";
+    }
+}
+
+/* write a string with the escapes JSON and the exposition format share */
+static void progress_print_escaped(FILE *out, const char *str)
+{
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            fprintf(out, "\\%c", *p);
+        }
+        else if (*p == '\n')
+        {
+            fputs("\\n", out);
+        }
+        else if (*p < 0x20)
+        {
+            /* device paths never hold these, a placeholder keeps both formats valid */
+            fputc('?', out);
+        }
+        else
+        {
+            fputc(*p, out);
+        }
+    }
+}
+
+int progress_print_json(const progress_t *progress, FILE *out)
+{
+    double average = progress->elapsed > 0 ? progress->done_bytes / progress->elapsed : 0;
+    double eta = progress_eta(progress);
+
+    fputs("{\"device\":\"", out);
+    progress_print_escaped(out, progress->device);
+    fprintf(out, "\",\"state\":\"%s\",\"elapsed\":%.3f", progress_state_name(progress->state), progress->elapsed);
+    fprintf(out, ",\"bytes\":%" PRIu64 ",\"total_bytes\":%" PRIu64, progress->done_bytes, progress->total_bytes);
+    fprintf(out, ",\"rate\":%.0f,\"average_rate\":%.0f", progress->rate, average);
+    if (eta >= 0)
+    {
+        fprintf(out, ",\"eta\":%.1f", eta);
+    }
+    else
+    {
+        fputs(",\"eta\":null", out);
+    }
+    fprintf(out, ",\"commands\":%" PRIu64 ",\"retries\":%" PRIu64, progress->commands, progress->retries);
+    fprintf(out, ",\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p99.9\":%.1f}}\n",
+            progress->latency_p50 / 1e3, progress->latency_p99 / 1e3, progress->latency_p999 / 1e3);
+
+    return ferror(out) ? -1 : 0;
+}
+
+static void progress_print_metric(FILE *out, const char *name, const char *type, const char *help)
+{
+    fprintf(out, "# HELP sgblkdiscard_%s %s\n# TYPE sgblkdiscard_%s %s\n", name, help, name, type);
+}
+
+static void progress_print_labels(FILE *out, const char *name, const progress_t *progress, const char *extra)
+{
+    fprintf(out, "sgblkdiscard_%s{device=\"", name);
+    progress_print_escaped(out, progress->device);
+    fprintf(out, "\"%s} ", extra ? extra : "");
+}
+
+static void progress_print_textfile(FILE *out, const progress_t *const *progress, size_t count)
+{
+    progress_print_metric(out, "discarded_bytes_total", "counter", "Bytes discarded so far.");
+    for (size_t i = 0; i < count; i++)
+    {
+        progress_print_labels(out, "discarded_bytes_total", progress[i], NULL);
+        fprintf(out, "%" PRIu64 "\n", progress[i]->done_bytes);
+    }
+
+    progress_print_metric(out, "target_bytes", "gauge", "Bytes the job is going to discard.");
+    for (size_t i = 0; i < count; i++)
+    {
+        progress_print_labels(out, "target_bytes", progress[i], NULL);
+        fprintf(out, "%" PRIu64 "\n", progress[i]->total_bytes);
+    }
+
+    progress_print_metric(out, "rate_bytes_per_second", "gauge", "Bytes per second since the previous update.");
+    for (size_t i = 0; i < count; i++)
+    {
+        progress_print_labels(out, "rate_bytes_per_second", progress[i], NULL);
+        fprintf(out, "%.0f\n", progress[i]->rate);
+    }
+
+    progress_print_metric(out, "eta_seconds", "gauge", "Estimated seconds until the job is done.");
+    for (size_t i = 0; i < count; i++)
+    {
+        double eta = progress_eta(progress[i]);
+        if (eta >= 0)
+        {
+            progress_print_labels(out, "eta_seconds", progress[i], NULL);
+            fprintf(out, "%.1f\n", eta);
+        }
+    }
+
+    progress_print_metric(out, "elapsed_seconds", "gauge", "Seconds since the job started.");
+    for (size_t i = 0; i < count; i++)
+    {
+        progress_print_labels(out, "elapsed_seconds", progress[i], NULL);
+        fprintf(out, "%.3f\n", progress[i]->elapsed);
+    }
+
+    progress_print_metric(out, "commands_total", "counter", "Deallocation commands sent.");
+    for (size_t i = 0; i < count; i++)
+    {
+        progress_print_labels(out, "commands_total", progress[i], NULL);
+        fprintf(out, "%" PRIu64 "\n", progress[i]->commands);
+    }
+
+    progress_print_metric(out, "retries_total", "counter", "Commands repeated after a transient failure.");
+    for (size_t i = 0; i < count; i++)
+    {
+        progress_print_labels(out, "retries_total", progress[i], NULL);
+        fprintf(out, "%" PRIu64 "\n", progress[i]->retries);
+    }
+
+    progress_print_metric(out, "command_latency_seconds", "gauge", "Command latency percentiles.");
+    for (size_t i = 0; i < count; i++)
+    {
+        progress_print_labels(out, "command_latency_seconds", progress[i], ",quantile=\"0.5\"");
+        fprintf(out, "%.9f\n", progress[i]->latency_p50 / 1e9);
+        progress_print_labels(out, "command_latency_seconds", progress[i], ",quantile=\"0.99\"");
+        fprintf(out, "%.9f\n", progress[i]->latency_p99 / 1e9);
+        progress_print_labels(out, "command_latency_seconds", progress[i], ",quantile=\"0.999\"");
+        fprintf(out, "%.9f\n", progress[i]->latency_p999 / 1e9);
+    }
+
+    progress_print_metric(out, "state", "gauge", "1 for the state the job is in.");
+    for (size_t i = 0; i < count; i++)
+    {
+        static const progress_state_t states[] = {PROGRESS_RUNNING, PROGRESS_DONE, PROGRESS_FAILED};
+        for (size_t s = 0; s < sizeof(states) / sizeof(states[0]); s++)
+        {
+            char extra[32];
+            snprintf(extra, sizeof(extra), ",state=\"%s\"", progress_state_name(states[s]));
+            progress_print_labels(out, "state", progress[i], extra);
+            fprintf(out, "%d\n", progress[i]->state == states[s]);
+        }
+    }
+
+    progress_print_metric(out, "last_update_timestamp_seconds", "gauge", "Time of the last update.");
+    fprintf(out, "sgblkdiscard_last_update_timestamp_seconds %lld\n", (long long)time(NULL));
+}
+
+int progress_write_textfile(const char *path, const progress_t *const *progress, size_t count)
+{
+    /* node_exporter only reads *.prom, the temporary name is skipped */
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid()) >= (int)sizeof(tmp_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    FILE *out = fdopen(fd, "w");
+    if (out == NULL)
+    {
+        int saved_errno = errno;
+        close(fd);
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+
+    progress_print_textfile(out, progress, count);
+    int ret = ferror(out) ? -1 : 0;
+    if (fclose(out))
+    {
+        ret = -1;
+    }
+    if (ret == 0 && rename(tmp_path, path))
+    {
+        ret = -1;
+    }
+    if (ret)
+    {
+        int saved_errno = errno;
+        unlink(tmp_path);
+        errno = saved_errno;
+    }
+    return ret;
+}
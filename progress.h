@@ -0,0 +1,93 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "histogram.h"
+
+typedef enum progress_state
+{
+    PROGRESS_RUNNING,
+    PROGRESS_DONE,
+    PROGRESS_FAILED,
+} progress_state_t;
+
+typedef struct progress
+{
+    /* the device the numbers belong to */
+    const char *device;
+    progress_state_t state;
+    /* bytes the job is going to discard, 0 while unknown */
+    uint64_t total_bytes;
+    uint64_t done_bytes;
+    /* deallocation commands sent and repeated after transient failures */
+    uint64_t commands;
+    uint64_t retries;
+    /* command latency percentiles in nanoseconds, 0 without measurements */
+    uint64_t latency_p50;
+    uint64_t latency_p99;
+    uint64_t latency_p999;
+    /* seconds since progress_init() */
+    double elapsed;
+    /* bytes per second since the previous update */
+    double rate;
+    struct timespec started;
+    struct timespec last;
+    uint64_t last_bytes;
+} progress_t;
+
+/**
+ * @brief start tracking the progress of a job.
+ *
+ * @param progress progress to initialize.
+ * @param device name of the device, must outlive the progress.
+ */
+void progress_init(progress_t *progress, const char *device);
+
+/**
+ * @brief take the latest numbers of a job.
+ *
+ * @param progress the progress.
+ * @param done_bytes bytes discarded so far.
+ * @param commands commands sent so far.
+ * @param retries commands repeated so far.
+ * @param latency command latencies in nanoseconds, NULL if not measured.
+ */
+void progress_update(progress_t *progress, uint64_t done_bytes, uint64_t commands, uint64_t retries,
+                     const histogram_t *latency);
+
+/**
+ * @brief estimate the time left from the average rate.
+ *
+ * @param progress the progress.
+ * @return seconds, negative if unknown.
+ */
+double progress_eta(const progress_t *progress);
+
+/**
+ * @brief print the progress as one line of JSON.
+ *
+ * @param progress the progress.
+ * @param out stream to print to.
+ * @return returns 0 if there is no error.
+ */
+int progress_print_json(const progress_t *progress, FILE *out);
+
+/**
+ * @brief replace a node_exporter textfile with the progress of some jobs.
+ *
+ * The file is written next to its final name and renamed, so the
+ * collector never reads half of it.
+ *
+ * @param path the textfile, e.g. "/var/lib/node_exporter/sgblkdiscard.prom".
+ * @param progress the jobs.
+ * @param count number of jobs.
+ * @return returns 0 if there is no error.
+ */
+int progress_write_textfile(const char *path, const progress_t *const *progress, size_t count);
+
+#endif /* PROGRESS_H */
@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "quirks.h"
+
+/* one 512-byte ATA TRIM payload holds 64 ranges of at most 65535 blocks */
+#define QUIRK_TRIM_BLOCKS (64 * 65535)
+#define QUIRK_TRIM_RANGES 64
+
+/*
+ * SATA bridges translate UNMAP into DATA SET MANAGEMENT but often report
+ * an empty Block Limits page, so nothing would be discarded at all.
+ */
+static const quirk_t quirk_builtin[] = {
+    /* ASMedia ASM1051E/ASM1153E */
+    {
+        .usb_vendor = 0x174c,
+        .usb_product = 0x55aa,
+        .maximum_unmap_lba_count = QUIRK_TRIM_BLOCKS,
+        .maximum_unmap_block_descriptor_count = QUIRK_TRIM_RANGES,
+    },
+    /* JMicron JMS578 */
+    {
+        .usb_vendor = 0x152d,
+        .usb_product = 0x0578,
+        .maximum_unmap_lba_count = QUIRK_TRIM_BLOCKS,
+        .maximum_unmap_block_descriptor_count = QUIRK_TRIM_RANGES,
+    },
+};
+
+static int quirk_set(quirk_t *quirk, const char *key, size_t key_len, const char *value)
+{
+#define QUIRK_KEY(_name) (key_len == strlen(_name) && strncmp(key, _name, key_len) == 0)
+    if (QUIRK_KEY("vendor") || QUIRK_KEY("product"))
+    {
+        char *field = QUIRK_KEY("vendor") ? quirk->vendor : quirk->product;
+        size_t size = QUIRK_KEY("vendor") ? sizeof(quirk->vendor) : sizeof(quirk->product);
+        if (*value == '\0' || strlen(value) >= size)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        strcpy(field, value);
+        return 0;
+    }
+    if (QUIRK_KEY("usb"))
+    {
+        unsigned int vendor, product;
+        int len = 0;
+        if (sscanf(value, "%4x:%4x%n", &vendor, &product, &len) != 2 || value[len] || vendor == 0 || product == 0)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        quirk->usb_vendor = vendor;
+        quirk->usb_product = product;
+        return 0;
+    }
+    if (QUIRK_KEY("method"))
+    {
+        if (strcmp(value, "unmap") == 0)
+        {
+            quirk->method = SG_DEALLOCATE_UNMAP;
+        }
+        else if (strcmp(value, "write-same") == 0)
+        {
+            quirk->method = SG_DEALLOCATE_WRITE_SAME;
+        }
+        else
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        quirk->method_valid = true;
+        return 0;
+    }
+
+    uint64_t number;
+    if (strtosize(value, &number))
+    {
+        return -1;
+    }
+    if (QUIRK_KEY("step"))
+    {
+        quirk->step = number;
+        return 0;
+    }
+    if (QUIRK_KEY("max-write-same"))
+    {
+        quirk->maximum_write_same_length = number;
+        return 0;
+    }
+    if (QUIRK_KEY("no-unmap") || QUIRK_KEY("no-write-same"))
+    {
+        unsigned int flag = QUIRK_KEY("no-unmap") ? QUIRK_NO_UNMAP : QUIRK_NO_WRITE_SAME;
+        quirk->flags = number ? quirk->flags | flag : quirk->flags & ~flag;
+        return 0;
+    }
+
+    /* everything else is a 32 bit field */
+    if (number > UINT32_MAX)
+    {
+        errno = ERANGE;
+        return -1;
+    }
+
+    if (QUIRK_KEY("max-unmap-lba"))
+        quirk->maximum_unmap_lba_count = number;
+    else if (QUIRK_KEY("max-unmap-descriptors"))
+        quirk->maximum_unmap_block_descriptor_count = number;
+    else if (QUIRK_KEY("descriptors"))
+        quirk->descriptors = number;
+    else if (QUIRK_KEY("queue-depth"))
+        quirk->queue_depth = number;
+    else
+    {
+        errno = EINVAL;
+        return -1;
+    }
+#undef QUIRK_KEY
+
+    return 0;
+}
+
+/*
+ * Parse the pairs of one line into a quirk.
+ * Returns	0  success
+ * 		<0 error
+ */
+static int quirk_parse(char *line, quirk_t *quirk)
+{
+    memset(quirk, 0, sizeof(*quirk));
+
+    char *p = line;
+    while (*p)
+    {
+        char *end = strchrnul(p, ',');
+        char *equal = memchr(p, '=', end - p);
+        if (equal == NULL || equal == p)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* vendors and products contain blanks, the value is used as it is */
+        bool last = *end == '\0';
+        *end = '\0';
+        if (quirk_set(quirk, p, equal - p, equal + 1))
+        {
+            return -1;
+        }
+
+        p = last ? end : end + 1;
+    }
+
+    /* a quirk for every device is a configuration mistake */
+    if (!quirk->vendor[0] && !quirk->product[0] && !quirk->usb_vendor)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int quirk_table_load(quirk_table_t *table, const char *path, size_t *line)
+{
+    *line = 0;
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    int ret = 0;
+    char *buf = NULL;
+    size_t buf_len = 0;
+    size_t line_number = 0;
+    while (getline(&buf, &buf_len, file) >= 0)
+    {
+        line_number++;
+
+        char *start = buf;
+        while (isspace((unsigned char)*start))
+        {
+            start++;
+        }
+        size_t len = strlen(start);
+        while (len > 0 && isspace((unsigned char)start[len - 1]))
+        {
+            start[--len] = '\0';
+        }
+        if (len == 0 || *start == '#')
+        {
+            continue;
+        }
+
+        quirk_t quirk;
+        if (quirk_parse(start, &quirk))
+        {
+            *line = line_number;
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+
+        quirk_t *quirks = realloc(table->quirks, (table->count + 1) * sizeof(*quirks));
+        if (quirks == NULL)
+        {
+            ret = -1;
+            break;
+        }
+        table->quirks = quirks;
+        table->quirks[table->count++] = quirk;
+    }
+    if (ret == 0 && ferror(file))
+    {
+        errno = EIO;
+        ret = -1;
+    }
+
+    free(buf);
+    fclose(file);
+    return ret;
+}
+
+void quirk_table_free(quirk_table_t *table)
+{
+    free(table->quirks);
+    table->quirks = NULL;
+    table->count = 0;
+}
+
+static bool quirk_matches(const quirk_t *quirk, const sg_inquiry_t *inquiry, uint16_t usb_vendor,
+                          uint16_t usb_product)
+{
+    if (quirk->usb_vendor && (quirk->usb_vendor != usb_vendor || quirk->usb_product != usb_product))
+    {
+        return false;
+    }
+    return strncmp(inquiry->vendor, quirk->vendor, strlen(quirk->vendor)) == 0 &&
+           strncmp(inquiry->product, quirk->product, strlen(quirk->product)) == 0;
+}
+
+const quirk_t *quirk_lookup(const quirk_table_t *table, const sg_inquiry_t *inquiry, uint16_t usb_vendor,
+                            uint16_t usb_product)
+{
+    for (size_t i = 0; table && i < table->count; i++)
+    {
+        if (quirk_matches(&table->quirks[i], inquiry, usb_vendor, usb_product))
+        {
+            return &table->quirks[i];
+        }
+    }
+    for (size_t i = 0; i < sizeof(quirk_builtin) / sizeof(quirk_builtin[0]); i++)
+    {
+        if (quirk_matches(&quirk_builtin[i], inquiry, usb_vendor, usb_product))
+        {
+            return &quirk_builtin[i];
+        }
+    }
+    return NULL;
+}
+
+void quirk_apply(const quirk_t *quirk, device_info_t *info)
+{
+    if (quirk->maximum_unmap_lba_count)
+    {
+        info->maximum_unmap_lba_count = quirk->maximum_unmap_lba_count;
+        info->support_unmap = true;
+    }
+    if (quirk->maximum_unmap_block_descriptor_count)
+    {
+        info->maximum_unmap_block_descriptor_count = quirk->maximum_unmap_block_descriptor_count;
+    }
+    if (quirk->maximum_write_same_length)
+    {
+        info->maximum_write_same_length = quirk->maximum_write_same_length;
+    }
+    if (quirk->flags & QUIRK_NO_UNMAP)
+    {
+        info->support_unmap = false;
+    }
+    if (quirk->flags & QUIRK_NO_WRITE_SAME)
+    {
+        info->support_write_same = false;
+    }
+}
+
+void quirk_describe(const quirk_t *quirk, char *buf, size_t len)
+{
+    int used = 0;
+    if (quirk->usb_vendor)
+    {
+        used = snprintf(buf, len, "usb=%04x:%04x", quirk->usb_vendor, quirk->usb_product);
+    }
+    if (quirk->vendor[0] && used >= 0 && (size_t)used < len)
+    {
+        used += snprintf(buf + used, len - used, "%svendor=%s", used ? "," : "", quirk->vendor);
+    }
+    if (quirk->product[0] && used >= 0 && (size_t)used < len)
+    {
+        snprintf(buf + used, len - used, "%sproduct=%s", used ? "," : "", quirk->product);
+    }
+}
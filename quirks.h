@@ -0,0 +1,105 @@
+#ifndef QUIRKS_H
+#define QUIRKS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/* quirks file read when no other one is named, a missing file is no error */
+#define QUIRKS_DEFAULT_PATH "/etc/sgblkdiscard/quirks"
+
+/* the device fails UNMAP or WRITE SAME(16) with the UNMAP bit whatever it reports */
+#define QUIRK_NO_UNMAP (1 << 0)
+#define QUIRK_NO_WRITE_SAME (1 << 1)
+
+typedef struct quirk
+{
+    /* prefixes of the INQUIRY vendor and product, empty matches anything */
+    char vendor[9];
+    char product[17];
+    /* USB ids of the bridge, 0 matches anything */
+    uint16_t usb_vendor;
+    uint16_t usb_product;
+    /* limits replacing the ones of the Block Limits page, 0 keeps the reported one */
+    uint32_t maximum_unmap_lba_count;
+    uint32_t maximum_unmap_block_descriptor_count;
+    uint64_t maximum_write_same_length;
+    /* QUIRK_* */
+    unsigned int flags;
+    /* settings known to be fast, 0 for no recommendation */
+    uint64_t step;
+    unsigned int descriptors;
+    unsigned int queue_depth;
+    bool method_valid;
+    sg_deallocate_t method;
+} quirk_t;
+
+typedef struct quirk_table
+{
+    quirk_t *quirks;
+    size_t count;
+} quirk_table_t;
+
+/**
+ * @brief read a quirks file.
+ *
+ * Every line holds "key=value,..." pairs like the mock backend takes.
+ * The keys vendor, product and usb (e.g. "174c:55aa") select the
+ * devices, max-unmap-lba, max-unmap-descriptors, max-write-same,
+ * no-unmap and no-write-same correct the limits and step, descriptors,
+ * queue-depth and method (unmap or write-same) are the settings to use
+ * when the command line does not name them. Empty lines and lines
+ * starting with '#' are skipped.
+ *
+ * @param table quirks are appended here.
+ * @param path the file.
+ * @param line number of the offending line if the file is invalid, 0 otherwise.
+ * @return returns 0 if there is no error, errno is EINVAL for an invalid file.
+ */
+int quirk_table_load(quirk_table_t *table, const char *path, size_t *line);
+
+/**
+ * @brief release the quirks of a table.
+ *
+ * @param table the table.
+ */
+void quirk_table_free(quirk_table_t *table);
+
+/**
+ * @brief find the quirk of a device.
+ *
+ * The first matching quirk of the table wins, the built-in quirks are
+ * only looked at if none matches.
+ *
+ * @param table quirks read from a file, NULL for the built-in ones only.
+ * @param inquiry identification of the device.
+ * @param usb_vendor USB vendor id, 0 if the device is not on USB.
+ * @param usb_product USB product id.
+ * @return the quirk, NULL if there is none.
+ */
+const quirk_t *quirk_lookup(const quirk_table_t *table, const sg_inquiry_t *inquiry, uint16_t usb_vendor,
+                            uint16_t usb_product);
+
+/**
+ * @brief correct the device info with the limits of a quirk.
+ *
+ * A maximum UNMAP LBA count in the quirk enables UNMAP even if the
+ * device reports no support, the bridge is known to pass it through.
+ *
+ * @param quirk the quirk.
+ * @param info device info to correct.
+ */
+void quirk_apply(const quirk_t *quirk, device_info_t *info);
+
+/**
+ * @brief describe the devices a quirk selects.
+ *
+ * @param quirk the quirk.
+ * @param buf buffer for the description, e.g. "usb=174c:55aa".
+ * @param len size of the buffer.
+ */
+void quirk_describe(const quirk_t *quirk, char *buf, size_t len);
+
+#endif /* QUIRKS_H */
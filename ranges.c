@@ -0,0 +1,135 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+#include <ctype.h>
+
+#include "ranges.h"
+#include "byteorder.h"
+
+#define RANGES_READ_CHUNK (64 * 1024)
+#define RANGES_BINARY_RECORD_LEN 16
+#define RANGES_ERRMESG_MAX 256
+
+/* slurp the whole input, NUL-terminated so the text parser can use it in place */
+static char *ranges_read_all(FILE *file, const char *path, size_t *len)
+{
+    char *buf = NULL;
+    size_t capacity = 0;
+    *len = 0;
+    do
+    {
+        if (capacity - *len < RANGES_READ_CHUNK + 1)
+        {
+            capacity = capacity ? capacity * 2 : RANGES_READ_CHUNK * 2;
+            if ((buf = realloc(buf, capacity)) == NULL)
+            {
+                err(EXIT_FAILURE, "%s: cannot store ranges", path);
+            }
+        }
+        *len += fread(buf + *len, 1, RANGES_READ_CHUNK, file);
+    } while (!feof(file) && !ferror(file));
+
+    if (ferror(file))
+    {
+        err(EXIT_FAILURE, "%s: read failed", path);
+    }
+
+    buf[*len] = '\0';
+    return buf;
+}
+
+static void ranges_parse_binary(const uint8_t *buf, size_t len, const char *path, extent_list_t *list)
+{
+    if (len % RANGES_BINARY_RECORD_LEN)
+    {
+        errx(EXIT_FAILURE, "%s: truncated binary range record", path);
+    }
+
+    for (size_t i = 0; i < len; i += RANGES_BINARY_RECORD_LEN)
+    {
+        uint64_t offset = u64_from_little_endian_bytes(buf + i);
+        uint64_t length = u64_from_little_endian_bytes(buf + i + 8);
+        if (offset + length < offset)
+        {
+            errx(EXIT_FAILURE, "%s: record %zu exceeds 64 bits", path, i / RANGES_BINARY_RECORD_LEN);
+        }
+        if (extent_list_append(list, offset, length))
+        {
+            err(EXIT_FAILURE, "%s: cannot store ranges", path);
+        }
+    }
+}
+
+static void ranges_parse_text(char *buf, const char *path, extent_list_t *list)
+{
+    char errmesg[RANGES_ERRMESG_MAX];
+    size_t line_number = 0;
+    char *line_end;
+    for (char *line = buf; line != NULL; line = line_end ? line_end + 1 : NULL)
+    {
+        line_number++;
+        if ((line_end = strchr(line, '\n')) != NULL)
+        {
+            *line_end = '\0';
+        }
+
+        char *p = line;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        char *saveptr = NULL;
+        char *offset_str = strtok_r(p, " \t\r,", &saveptr);
+        char *length_str = strtok_r(NULL, " \t\r,", &saveptr);
+        if (offset_str == NULL || length_str == NULL || strtok_r(NULL, " \t\r,", &saveptr) != NULL)
+        {
+            errx(EXIT_FAILURE, "%s:%zu: expected \"<offset> <length>\"", path, line_number);
+        }
+
+        snprintf(errmesg, sizeof(errmesg), "%s:%zu: failed to parse offset", path, line_number);
+        uint64_t offset = strtosize_or_err(offset_str, errmesg);
+        snprintf(errmesg, sizeof(errmesg), "%s:%zu: failed to parse length", path, line_number);
+        uint64_t length = strtosize_or_err(length_str, errmesg);
+
+        if (offset + length < offset)
+        {
+            errx(EXIT_FAILURE, "%s:%zu: range exceeds 64 bits", path, line_number);
+        }
+        if (extent_list_append(list, offset, length))
+        {
+            err(EXIT_FAILURE, "%s: cannot store ranges", path);
+        }
+    }
+}
+
+void ranges_read_or_err(const char *path, extent_list_t *list)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (file == NULL)
+    {
+        err(EXIT_FAILURE, "cannot open %s", path);
+    }
+
+    size_t len;
+    char *buf = ranges_read_all(file, path, &len);
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+
+    if (len >= RANGES_BINARY_MAGIC_LEN && memcmp(buf, RANGES_BINARY_MAGIC, RANGES_BINARY_MAGIC_LEN) == 0)
+    {
+        ranges_parse_binary((const uint8_t *)buf + RANGES_BINARY_MAGIC_LEN, len - RANGES_BINARY_MAGIC_LEN,
+                            path, list);
+    }
+    else
+    {
+        ranges_parse_text(buf, path, list);
+    }
+
+    free(buf);
+    extent_list_normalize(list);
+}
@@ -0,0 +1,26 @@
+#ifndef RANGES_H
+#define RANGES_H
+
+#include "extent.h"
+
+/* magic of the binary range list, followed by little-endian u64 offset/length pairs */
+#define RANGES_BINARY_MAGIC "SGDRANGE"
+#define RANGES_BINARY_MAGIC_LEN 8
+
+/**
+ * @brief read a list of areas to discard.
+ *
+ * The text format has one "<offset> <length>" pair per line, separated by
+ * blanks or a comma, with the same size suffixes as the command line.
+ * Empty lines and lines starting with '#' are ignored. A file starting
+ * with RANGES_BINARY_MAGIC holds 16-byte little-endian offset/length
+ * records instead.
+ *
+ * Exits with an error message on malformed input.
+ *
+ * @param path file to read, "-" for stdin.
+ * @param list areas are appended here, sorted and merged.
+ */
+void ranges_read_or_err(const char *path, extent_list_t *list);
+
+#endif /* RANGES_H */
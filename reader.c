@@ -0,0 +1,177 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+
+#include "reader.h"
+
+/* glibc has no wrappers for the kernel AIO calls */
+static int io_setup(unsigned int nr_events, aio_context_t *context)
+{
+    return syscall(__NR_io_setup, nr_events, context);
+}
+
+static int io_destroy(aio_context_t context)
+{
+    return syscall(__NR_io_destroy, context);
+}
+
+static int io_submit(aio_context_t context, long nr, struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, context, nr, iocbs);
+}
+
+static int io_getevents(aio_context_t context, long min_nr, long nr, struct io_event *events)
+{
+    return syscall(__NR_io_getevents, context, min_nr, nr, events, NULL);
+}
+
+int reader_open(reader_t *reader, int fd, size_t chunk_size, unsigned int depth)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = fd;
+    reader->chunk_size = chunk_size;
+    reader->depth = depth;
+
+    if (chunk_size == 0 || depth == 0 || depth > READER_MAX_DEPTH)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (unsigned int i = 0; i < depth; i++)
+    {
+        void *buffer;
+        int ret = posix_memalign(&buffer, page_size > 0 ? page_size : 4096, chunk_size);
+        if (ret)
+        {
+            reader_close(reader);
+            errno = ret;
+            return -1;
+        }
+        reader->slots[i].buffer = buffer;
+    }
+
+    if (io_setup(depth, &reader->context))
+    {
+        int saved_errno = errno;
+        reader->context = 0;
+        reader_close(reader);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+int reader_submit(reader_t *reader, uint64_t offset, size_t length)
+{
+    if (length == 0 || length > reader->chunk_size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (reader->count == reader->depth)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    unsigned int index = (reader->head + reader->count) % reader->depth;
+    reader_slot_t *slot = &reader->slots[index];
+    slot->offset = offset;
+    slot->length = length;
+    slot->result = 0;
+    slot->done = false;
+
+    memset(&slot->iocb, 0, sizeof(slot->iocb));
+    slot->iocb.aio_data = index;
+    slot->iocb.aio_lio_opcode = IOCB_CMD_PREAD;
+    slot->iocb.aio_fildes = reader->fd;
+    slot->iocb.aio_buf = (uintptr_t)slot->buffer;
+    slot->iocb.aio_nbytes = length;
+    slot->iocb.aio_offset = offset;
+
+    struct iocb *iocb = &slot->iocb;
+    int ret = io_submit(reader->context, 1, &iocb);
+    if (ret != 1)
+    {
+        if (ret == 0)
+        {
+            errno = EAGAIN;
+        }
+        return -1;
+    }
+
+    reader->count++;
+    return 0;
+}
+
+int reader_next(reader_t *reader, const uint8_t **data, uint64_t *offset, size_t *length)
+{
+    if (reader->count == 0)
+    {
+        return 0;
+    }
+
+    reader_slot_t *slot = &reader->slots[reader->head];
+    while (!slot->done)
+    {
+        struct io_event events[READER_MAX_DEPTH];
+        int ret = io_getevents(reader->context, 1, reader->depth, events);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        for (int i = 0; i < ret; i++)
+        {
+            reader_slot_t *completed = &reader->slots[events[i].data];
+            completed->result = events[i].res;
+            completed->done = true;
+        }
+    }
+
+    reader->head = (reader->head + 1) % reader->depth;
+    reader->count--;
+
+    if (slot->result < 0)
+    {
+        errno = -slot->result;
+        return -1;
+    }
+
+    *data = slot->buffer;
+    *offset = slot->offset;
+    *length = slot->result;
+    return 1;
+}
+
+unsigned int reader_pending(const reader_t *reader)
+{
+    return reader->count;
+}
+
+void reader_close(reader_t *reader)
+{
+    /* destroying the context waits for the reads still in flight */
+    if (reader->context)
+    {
+        io_destroy(reader->context);
+        reader->context = 0;
+    }
+    for (unsigned int i = 0; i < READER_MAX_DEPTH; i++)
+    {
+        free(reader->slots[i].buffer);
+        reader->slots[i].buffer = NULL;
+    }
+    reader->count = 0;
+}
@@ -0,0 +1,92 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/aio_abi.h>
+
+/* reads in flight at most */
+#define READER_MAX_DEPTH 64
+
+typedef struct reader_slot
+{
+    struct iocb iocb;
+    uint8_t *buffer;
+    uint64_t offset;
+    size_t length;
+    /* bytes read or -errno once the read completed */
+    int64_t result;
+    bool done;
+} reader_slot_t;
+
+/*
+ * Reads a block device in chunks with kernel AIO. Reads complete in any
+ * order but are handed out in the order they were submitted.
+ */
+typedef struct reader
+{
+    int fd;
+    aio_context_t context;
+    size_t chunk_size;
+    unsigned int depth;
+    reader_slot_t slots[READER_MAX_DEPTH];
+    /* oldest read in flight and number of reads in flight */
+    unsigned int head;
+    unsigned int count;
+} reader_t;
+
+/**
+ * @brief set up a reader.
+ *
+ * The buffers are aligned to the page size, so fd may be opened with
+ * O_DIRECT as long as offsets and lengths are multiples of the logical
+ * block size.
+ *
+ * @param reader reader to initialize.
+ * @param fd the device, stays owned by the caller.
+ * @param chunk_size largest read in byte.
+ * @param depth reads in flight at most, up to READER_MAX_DEPTH.
+ * @return returns 0 if there is no error.
+ */
+int reader_open(reader_t *reader, int fd, size_t chunk_size, unsigned int depth);
+
+/**
+ * @brief queue a read.
+ *
+ * The buffer of the read last returned by reader_next() may be reused.
+ *
+ * @param reader the reader.
+ * @param offset offset of the read in byte.
+ * @param length length of the read, at most the chunk size.
+ * @return returns 0 if there is no error, errno is EBUSY if depth reads are in flight.
+ */
+int reader_submit(reader_t *reader, uint64_t offset, size_t length);
+
+/**
+ * @brief wait for the oldest read.
+ *
+ * @param reader the reader.
+ * @param data the data read, valid until the next reader_submit().
+ * @param offset offset of the read.
+ * @param length bytes read, less than asked for at the end of the device.
+ * @return 1 for a read, 0 if none is in flight, <0 on error.
+ */
+int reader_next(reader_t *reader, const uint8_t **data, uint64_t *offset, size_t *length);
+
+/**
+ * @brief get the number of reads in flight.
+ *
+ * @param reader the reader.
+ * @return number of reads.
+ */
+unsigned int reader_pending(const reader_t *reader);
+
+/**
+ * @brief cancel the reads in flight and release the buffers.
+ *
+ * @param reader the reader.
+ */
+void reader_close(reader_t *reader);
+
+#endif /* READER_H */
@@ -0,0 +1,374 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "sense.h"
+#include "byteorder.h"
+
+#define SG_SENSE_RESPONSE_CODE_MASK 0x7f
+#define SG_SENSE_FIXED_CURRENT 0x70
+#define SG_SENSE_FIXED_DEFERRED 0x71
+#define SG_SENSE_DESCRIPTOR_CURRENT 0x72
+#define SG_SENSE_DESCRIPTOR_DEFERRED 0x73
+#define SG_SENSE_INFORMATION_DESCRIPTOR 0x00
+#define SG_SENSE_KEY_SPECIFIC_DESCRIPTOR 0x02
+/* sense key specific bytes of ILLEGAL REQUEST: SKSV, C/D and the field pointer */
+#define SG_SENSE_SKSV 0x80
+#define SG_SENSE_SKS_CDB 0x40
+
+#define SG_ASC_LOGICAL_UNIT_NOT_READY 0x04
+#define SG_ASCQ_BECOMING_READY 0x01
+#define SG_ASCQ_OPERATION_IN_PROGRESS 0x07
+#define SG_ASC_PARAMETER_LIST_LENGTH_ERROR 0x1a
+#define SG_ASC_INVALID_OPCODE 0x20
+#define SG_ASC_INVALID_FIELD_IN_CDB 0x24
+#define SG_ASC_INVALID_FIELD_IN_PARAMETER_LIST 0x26
+
+/* host_status values of the Linux SCSI midlayer */
+#define SG_DID_BUS_BUSY 0x02
+#define SG_DID_TIME_OUT 0x03
+#define SG_DID_SOFT_ERROR 0x0b
+#define SG_DID_IMM_RETRY 0x0c
+#define SG_DID_REQUEUE 0x0d
+#define SG_DID_TRANSPORT_DISRUPTED 0x0e
+
+/* driver_status */
+#define SG_DRIVER_SENSE 0x08
+#define SG_DRIVER_STATUS_MASK 0x0f
+#define SG_DRIVER_TIMEOUT 0x06
+
+/* retries never wait longer than this in milliseconds */
+#define SG_RETRY_BACKOFF_MAX 1000
+
+static const char *const sg_sense_key_names[16] = {
+    "NO SENSE",
+    "RECOVERED ERROR",
+    "NOT READY",
+    "MEDIUM ERROR",
+    "HARDWARE ERROR",
+    "ILLEGAL REQUEST",
+    "UNIT ATTENTION",
+    "DATA PROTECT",
+    "BLANK CHECK",
+    "VENDOR SPECIFIC",
+    "COPY ABORTED",
+    "ABORTED COMMAND",
+    "RESERVED",
+    "VOLUME OVERFLOW",
+    "MISCOMPARE",
+    "COMPLETED",
+};
+
+static const struct
+{
+    uint8_t asc;
+    uint8_t ascq;
+    const char *text;
+} sg_asc_names[] = {
+    {0x04, 0x00, "logical unit not ready, cause not reportable"},
+    {0x04, 0x01, "logical unit is in process of becoming ready"},
+    {0x04, 0x02, "logical unit not ready, initializing command required"},
+    {0x04, 0x07, "logical unit not ready, operation in progress"},
+    {0x1a, 0x00, "parameter list length error"},
+    {0x20, 0x00, "invalid command operation code"},
+    {0x21, 0x00, "logical block address out of range"},
+    {0x24, 0x00, "invalid field in cdb"},
+    {0x26, 0x00, "invalid field in parameter list"},
+    {0x27, 0x00, "write protected"},
+    {0x28, 0x00, "not ready to ready change, medium may have changed"},
+    {0x29, 0x00, "power on, reset, or bus device reset occurred"},
+    {0x2a, 0x01, "mode parameters changed"},
+    {0x2a, 0x09, "capacity data has changed"},
+    {0x3f, 0x0e, "reported luns data has changed"},
+    {0x47, 0x00, "scsi parity error"},
+    {0x4b, 0x00, "data phase error"},
+};
+
+/* field pointer of the three sense key specific bytes, if it points into the CDB */
+static void sg_sense_decode_key_specific(const uint8_t *sks, sg_result_t *result)
+{
+    if (result->sense_key == SG_SENSE_KEY_ILLEGAL_REQUEST && (sks[0] & SG_SENSE_SKSV) &&
+        (sks[0] & SG_SENSE_SKS_CDB))
+    {
+        result->field_pointer_valid = true;
+        result->field_pointer = u16_from_big_endian_bytes(sks + 1);
+    }
+}
+
+/* fixed format sense data */
+static void sg_sense_decode_fixed(const uint8_t *sense, size_t len, sg_result_t *result)
+{
+    if (len < 3)
+    {
+        return;
+    }
+
+    result->sense_valid = true;
+    result->sense_key = sense[2] & 0x0f;
+    if (len >= 7 && (sense[0] & 0x80))
+    {
+        result->information_valid = true;
+        result->information = u32_from_big_endian_bytes(sense + 3);
+    }
+    if (len >= 14)
+    {
+        result->asc = sense[12];
+        result->ascq = sense[13];
+    }
+    if (len >= 18 && sense[7] >= 10)
+    {
+        sg_sense_decode_key_specific(sense + 15, result);
+    }
+}
+
+/* descriptor format sense data */
+static void sg_sense_decode_descriptor(const uint8_t *sense, size_t len, sg_result_t *result)
+{
+    if (len < 4)
+    {
+        return;
+    }
+
+    result->sense_valid = true;
+    result->sense_key = sense[1] & 0x0f;
+    result->asc = sense[2];
+    result->ascq = sense[3];
+
+    size_t end = len < 8 ? len : 8 + (size_t)sense[7];
+    if (end > len)
+    {
+        end = len;
+    }
+    for (size_t offset = 8; offset + 2 <= end; offset += 2 + sense[offset + 1])
+    {
+        const uint8_t *descriptor = sense + offset;
+        if (descriptor[0] == SG_SENSE_INFORMATION_DESCRIPTOR && offset + 12 <= end && (descriptor[2] & 0x80))
+        {
+            result->information_valid = true;
+            result->information = u64_from_big_endian_bytes(descriptor + 4);
+        }
+        if (descriptor[0] == SG_SENSE_KEY_SPECIFIC_DESCRIPTOR && offset + 8 <= end)
+        {
+            sg_sense_decode_key_specific(descriptor + 4, result);
+        }
+    }
+}
+
+void sg_result_decode(const sg_io_hdr_t *io_hdr, sg_result_t *result)
+{
+    memset(result, 0, sizeof(*result));
+    result->status = io_hdr->status;
+    result->host_status = io_hdr->host_status;
+    result->driver_status = io_hdr->driver_status;
+
+    const uint8_t *sense = io_hdr->sbp;
+    size_t len = io_hdr->sb_len_wr;
+    if (sense == NULL || len == 0)
+    {
+        return;
+    }
+
+    switch (sense[0] & SG_SENSE_RESPONSE_CODE_MASK)
+    {
+    case SG_SENSE_FIXED_CURRENT:
+    case SG_SENSE_FIXED_DEFERRED:
+        sg_sense_decode_fixed(sense, len, result);
+        break;
+    case SG_SENSE_DESCRIPTOR_CURRENT:
+    case SG_SENSE_DESCRIPTOR_DEFERRED:
+        sg_sense_decode_descriptor(sense, len, result);
+        break;
+    default:
+        break;
+    }
+}
+
+static sg_disposition_t sg_sense_disposition(const sg_result_t *result)
+{
+    switch (result->sense_key)
+    {
+    case SG_SENSE_KEY_NO_SENSE:
+    case SG_SENSE_KEY_RECOVERED_ERROR:
+        return SG_DISPOSITION_OK;
+    case SG_SENSE_KEY_UNIT_ATTENTION:
+    case SG_SENSE_KEY_ABORTED_COMMAND:
+        return SG_DISPOSITION_RETRY;
+    case SG_SENSE_KEY_NOT_READY:
+        if (result->asc == SG_ASC_LOGICAL_UNIT_NOT_READY &&
+            (result->ascq == SG_ASCQ_BECOMING_READY || result->ascq == SG_ASCQ_OPERATION_IN_PROGRESS))
+        {
+            return SG_DISPOSITION_RETRY;
+        }
+        return SG_DISPOSITION_FATAL;
+    case SG_SENSE_KEY_ILLEGAL_REQUEST:
+        if (result->asc == SG_ASC_INVALID_FIELD_IN_CDB || result->asc == SG_ASC_INVALID_FIELD_IN_PARAMETER_LIST ||
+            result->asc == SG_ASC_PARAMETER_LIST_LENGTH_ERROR)
+        {
+            return SG_DISPOSITION_REJECTED;
+        }
+        return SG_DISPOSITION_FATAL;
+    default:
+        return SG_DISPOSITION_FATAL;
+    }
+}
+
+bool sg_result_unsupported(const sg_result_t *result)
+{
+    return result->sense_valid && result->sense_key == SG_SENSE_KEY_ILLEGAL_REQUEST &&
+           result->asc == SG_ASC_INVALID_OPCODE;
+}
+
+bool sg_result_length_rejected(const sg_result_t *result, unsigned int offset, unsigned int len)
+{
+    if (!result->sense_valid || result->sense_key != SG_SENSE_KEY_ILLEGAL_REQUEST)
+    {
+        return false;
+    }
+    if (result->asc == SG_ASC_PARAMETER_LIST_LENGTH_ERROR)
+    {
+        return true;
+    }
+    return result->asc == SG_ASC_INVALID_FIELD_IN_CDB && result->field_pointer_valid &&
+           result->field_pointer >= offset && result->field_pointer < offset + len;
+}
+
+sg_disposition_t sg_result_disposition(const sg_result_t *result)
+{
+    switch (result->host_status)
+    {
+    case 0:
+        break;
+    case SG_DID_BUS_BUSY:
+    case SG_DID_TIME_OUT:
+    case SG_DID_SOFT_ERROR:
+    case SG_DID_IMM_RETRY:
+    case SG_DID_REQUEUE:
+    case SG_DID_TRANSPORT_DISRUPTED:
+        return SG_DISPOSITION_RETRY;
+    default:
+        return SG_DISPOSITION_FATAL;
+    }
+
+    if ((result->driver_status & SG_DRIVER_STATUS_MASK) == SG_DRIVER_TIMEOUT)
+    {
+        return SG_DISPOSITION_RETRY;
+    }
+
+    switch (result->status & 0x3e)
+    {
+    case SG_STATUS_GOOD:
+        return SG_DISPOSITION_OK;
+    case SG_STATUS_BUSY:
+    case SG_STATUS_TASK_SET_FULL:
+        return SG_DISPOSITION_RETRY;
+    case SG_STATUS_CHECK_CONDITION:
+        break;
+    default:
+        return SG_DISPOSITION_FATAL;
+    }
+
+    /* CHECK CONDITION without sense data tells nothing */
+    if (!result->sense_valid)
+    {
+        return SG_DISPOSITION_FATAL;
+    }
+    return sg_sense_disposition(result);
+}
+
+const char *sg_result_describe(const sg_result_t *result, char *buf, size_t len)
+{
+    if (result->host_status)
+    {
+        snprintf(buf, len, "host status 0x%02x", result->host_status);
+        return buf;
+    }
+    if (!result->sense_valid)
+    {
+        if ((result->driver_status & SG_DRIVER_STATUS_MASK) && !(result->driver_status & SG_DRIVER_SENSE))
+        {
+            snprintf(buf, len, "driver status 0x%02x", result->driver_status);
+        }
+        else
+        {
+            snprintf(buf, len, "SCSI status 0x%02x", result->status);
+        }
+        return buf;
+    }
+
+    const char *asc_text = NULL;
+    for (size_t i = 0; i < sizeof(sg_asc_names) / sizeof(sg_asc_names[0]); i++)
+    {
+        if (sg_asc_names[i].asc == result->asc && sg_asc_names[i].ascq == result->ascq)
+        {
+            asc_text = sg_asc_names[i].text;
+            break;
+        }
+    }
+
+    int n;
+    if (asc_text)
+    {
+        n = snprintf(buf, len, "%s, %s", sg_sense_key_names[result->sense_key], asc_text);
+    }
+    else
+    {
+        n = snprintf(buf, len, "%s, asc 0x%02x ascq 0x%02x", sg_sense_key_names[result->sense_key],
+                     result->asc, result->ascq);
+    }
+    if (result->information_valid && n >= 0 && (size_t)n < len)
+    {
+        snprintf(buf + n, len - n, " at 0x%llx", (unsigned long long)result->information);
+    }
+    return buf;
+}
+
+void sg_retry_backoff(unsigned int attempt)
+{
+    unsigned int ms = SG_RETRY_BACKOFF_MAX;
+    if (attempt < 16 && (SG_RETRY_BACKOFF << attempt) < SG_RETRY_BACKOFF_MAX)
+    {
+        ms = SG_RETRY_BACKOFF << attempt;
+    }
+
+    struct timespec delay = {ms / 1000, (ms % 1000) * 1000000L};
+    while (nanosleep(&delay, &delay) && errno == EINTR)
+        ;
+}
+
+sg_disposition_t sg_execute_retry(sg_transport_t *transport, sg_io_hdr_t *io_hdr, sg_result_t *result,
+                                  uint64_t *retries)
+{
+    sg_result_t local;
+    if (result == NULL)
+    {
+        result = &local;
+    }
+
+    for (unsigned int attempt = 0;; attempt++)
+    {
+        if (sg_transport_execute(transport, io_hdr))
+        {
+            memset(result, 0, sizeof(*result));
+            return SG_DISPOSITION_FATAL;
+        }
+
+        sg_result_decode(io_hdr, result);
+        sg_disposition_t disposition = sg_result_disposition(result);
+        if (disposition != SG_DISPOSITION_RETRY || attempt == SG_RETRY_LIMIT)
+        {
+            if (disposition != SG_DISPOSITION_OK)
+            {
+                errno = EIO;
+            }
+            return disposition;
+        }
+
+        if (retries)
+        {
+            (*retries)++;
+        }
+        sg_retry_backoff(attempt);
+    }
+}
@@ -0,0 +1,140 @@
+#ifndef SENSE_H
+#define SENSE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <scsi/sg.h>
+
+#include "transport.h"
+
+#define SG_SENSE_KEY_NO_SENSE 0x00
+#define SG_SENSE_KEY_RECOVERED_ERROR 0x01
+#define SG_SENSE_KEY_NOT_READY 0x02
+#define SG_SENSE_KEY_MEDIUM_ERROR 0x03
+#define SG_SENSE_KEY_HARDWARE_ERROR 0x04
+#define SG_SENSE_KEY_ILLEGAL_REQUEST 0x05
+#define SG_SENSE_KEY_UNIT_ATTENTION 0x06
+#define SG_SENSE_KEY_DATA_PROTECT 0x07
+#define SG_SENSE_KEY_ABORTED_COMMAND 0x0b
+
+#define SG_STATUS_GOOD 0x00
+#define SG_STATUS_CHECK_CONDITION 0x02
+#define SG_STATUS_BUSY 0x08
+#define SG_STATUS_RESERVATION_CONFLICT 0x18
+#define SG_STATUS_TASK_SET_FULL 0x28
+
+/* number of times a command is repeated after a transient failure */
+#define SG_RETRY_LIMIT 5
+/* wait before the first retry in milliseconds, doubled for every further one */
+#define SG_RETRY_BACKOFF 10
+
+typedef enum sg_disposition
+{
+    /* the command succeeded */
+    SG_DISPOSITION_OK,
+    /* a transient condition, the same command may succeed later */
+    SG_DISPOSITION_RETRY,
+    /* the device refused the command as it was built, e.g. too large */
+    SG_DISPOSITION_REJECTED,
+    /* anything else */
+    SG_DISPOSITION_FATAL,
+} sg_disposition_t;
+
+typedef struct sg_result
+{
+    uint8_t status;
+    uint16_t host_status;
+    uint16_t driver_status;
+    /* sense data was returned and could be decoded */
+    bool sense_valid;
+    uint8_t sense_key;
+    uint8_t asc;
+    uint8_t ascq;
+    /* the INFORMATION field, e.g. the first failing LBA */
+    bool information_valid;
+    uint64_t information;
+    /* the sense key specific field pointer, the first CDB byte of an invalid field */
+    bool field_pointer_valid;
+    uint16_t field_pointer;
+} sg_result_t;
+
+/**
+ * @brief decode the status and the sense data of a completed command.
+ *
+ * Fixed (70h/71h) and descriptor (72h/73h) format sense data are understood.
+ *
+ * @param io_hdr the completed command.
+ * @param result decoded result.
+ */
+void sg_result_decode(const sg_io_hdr_t *io_hdr, sg_result_t *result);
+
+/**
+ * @brief check whether the device does not implement a command.
+ *
+ * @param result decoded result.
+ * @return true for ILLEGAL REQUEST with INVALID COMMAND OPERATION CODE.
+ */
+bool sg_result_unsupported(const sg_result_t *result);
+
+/**
+ * @brief check whether the device refused a command for its length.
+ *
+ * INVALID FIELD IN CDB only counts if the field pointer names the
+ * length field, without it the device may as well refuse a flag.
+ *
+ * @param result decoded result.
+ * @param offset first CDB byte of the length field.
+ * @param len size of the length field.
+ * @return true for ILLEGAL REQUEST with PARAMETER LIST LENGTH ERROR, or
+ *         with INVALID FIELD IN CDB pointing into the length field.
+ */
+bool sg_result_length_rejected(const sg_result_t *result, unsigned int offset, unsigned int len);
+
+/**
+ * @brief decide what to do about a completed command.
+ *
+ * UNIT ATTENTION, ABORTED COMMAND, BUSY, TASK SET FULL, a device that
+ * is becoming ready and transient host errors are retried. ILLEGAL
+ * REQUEST complaining about the CDB or the parameter list means the
+ * command may be accepted in smaller pieces.
+ *
+ * @param result decoded result.
+ * @return the disposition.
+ */
+sg_disposition_t sg_result_disposition(const sg_result_t *result);
+
+/**
+ * @brief describe a decoded result for humans.
+ *
+ * @param result decoded result.
+ * @param buf buffer for the text.
+ * @param len size of the buffer.
+ * @return buf.
+ */
+const char *sg_result_describe(const sg_result_t *result, char *buf, size_t len);
+
+/**
+ * @brief run one command, repeating it after transient failures.
+ *
+ * The command is repeated up to SG_RETRY_LIMIT times with exponential
+ * backoff starting at SG_RETRY_BACKOFF milliseconds.
+ *
+ * @param transport SCSI transport.
+ * @param io_hdr command, status and sense are filled in on return.
+ * @param result decoded result of the last attempt, may be NULL.
+ * @param retries incremented for every repetition, may be NULL.
+ * @return the disposition of the last attempt, SG_DISPOSITION_FATAL with
+ *         errno set if the command could not be delivered.
+ */
+sg_disposition_t sg_execute_retry(sg_transport_t *transport, sg_io_hdr_t *io_hdr, sg_result_t *result,
+                                  uint64_t *retries);
+
+/**
+ * @brief sleep before a retry.
+ *
+ * @param attempt number of retries so far, starting at 0.
+ */
+void sg_retry_backoff(unsigned int attempt);
+
+#endif /* SENSE_H */
@@ -0,0 +1,597 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include <scsi/sg.h>
+#include <sys/sysmacros.h>
+
+#include "sg_queue.h"
+
+/* alignment of the parameter lists in the arena */
+#define SG_QUEUE_ALIGN 64
+
+typedef enum sg_queue_kind
+{
+    SG_QUEUE_UNMAP,
+    /* WRITE SAME(16) with the UNMAP bit */
+    SG_QUEUE_WRITE_SAME,
+    /* a command of sg_zero_t */
+    SG_QUEUE_ZERO,
+} sg_queue_kind_t;
+
+typedef struct sg_queue_slot
+{
+    sg_io_hdr_t io_hdr;
+    uint8_t command[SG_WRITE_SAME16_CMD_LEN];
+    uint8_t sense_buffer[SG_SENSE_BUFFER_LEN];
+    /* a part of the arena of the queue or a mapped reserved buffer */
+    uint8_t *parameter;
+    /* the parameter list is a reserved buffer of the transport */
+    bool mapped;
+    uint32_t descriptor_count;
+    /* the command the slot is set up for, all but UNMAP cover blocks from lba */
+    sg_queue_kind_t kind;
+    uint64_t lba;
+    uint32_t blocks;
+    /* retries of the command in the slot */
+    unsigned int attempts;
+    bool busy;
+} sg_queue_slot_t;
+
+struct sg_queue
+{
+    sg_transport_t *transport;
+    const device_info_t *info;
+    sg_unmap_state_t *state;
+    /* limits of a queue opened without a state */
+    sg_unmap_state_t own_state;
+    unsigned int depth;
+    unsigned int in_flight;
+    int error;
+    sg_queue_slot_t *slots;
+    /* parameter lists of the slots without a mapped buffer */
+    uint8_t *arena;
+    /* data-out block of every WRITE SAME, allocated on first use */
+    uint8_t *zero_block;
+    /* method and buffer of the last sg_queue_zero_extents() */
+    sg_zero_t *zero_method;
+    const uint8_t *zero_buffer;
+};
+
+static int sg_generic_lookup(const char *dir_path, char *path, size_t len)
+{
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+
+    int ret = -1;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+        {
+            continue;
+        }
+        if (snprintf(path, len, "/dev/%s", entry->d_name) < (int)len)
+        {
+            ret = 0;
+        }
+        break;
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+int sg_generic_path(dev_t devno, char *path, size_t len)
+{
+    char dir_path[PATH_MAX];
+
+    snprintf(dir_path, sizeof(dir_path), "/sys/dev/block/%u:%u/device/scsi_generic",
+             major(devno), minor(devno));
+    if (sg_generic_lookup(dir_path, path, len) == 0)
+    {
+        return 0;
+    }
+
+    /* partitions share the scsi device of their parent disk */
+    snprintf(dir_path, sizeof(dir_path), "/sys/dev/block/%u:%u/../device/scsi_generic",
+             major(devno), minor(devno));
+    return sg_generic_lookup(dir_path, path, len);
+}
+
+/* set a slot up for UNMAP, later commands only patch the lengths */
+static void sg_queue_slot_format(sg_queue_slot_t *slot, unsigned int index)
+{
+    sg_unmap_prepare(&slot->io_hdr, slot->command, slot->sense_buffer, slot->parameter, 0);
+    slot->io_hdr.pack_id = (int)index;
+    slot->io_hdr.usr_ptr = slot;
+    if (slot->mapped)
+    {
+        slot->io_hdr.flags |= SG_FLAG_MMAP_IO;
+    }
+    slot->kind = SG_QUEUE_UNMAP;
+}
+
+sg_queue_t *sg_queue_open(sg_transport_t *transport, const device_info_t *info, sg_unmap_state_t *state,
+                          unsigned int depth)
+{
+    if (depth == 0 || depth > transport->depth)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    sg_queue_t *queue = calloc(1, sizeof(*queue));
+    if (queue == NULL)
+    {
+        return NULL;
+    }
+
+    queue->transport = transport;
+    queue->info = info;
+    queue->depth = depth;
+    if (state == NULL)
+    {
+        sg_unmap_state_init(&queue->own_state, info);
+        state = &queue->own_state;
+    }
+    queue->state = state;
+
+    size_t parameter_len = SG_UNMAP_PARAMETER_LEN(sg_unmap_block_descriptor_limit(info));
+    queue->slots = calloc(depth, sizeof(*queue->slots));
+    if (queue->slots == NULL)
+    {
+        goto err;
+    }
+
+    /* parameter lists the kernel does not copy where the transport has them */
+    unsigned int unmapped = 0;
+    for (unsigned int i = 0; i < depth; i++)
+    {
+        sg_queue_slot_t *slot = &queue->slots[i];
+        slot->parameter = sg_transport_map(transport, parameter_len);
+        slot->mapped = slot->parameter != NULL;
+        unmapped += !slot->mapped;
+    }
+
+    /* one allocation for the rest, every list on its own cache lines */
+    size_t stride = (parameter_len + SG_QUEUE_ALIGN - 1) / SG_QUEUE_ALIGN * SG_QUEUE_ALIGN;
+    if (unmapped && posix_memalign((void **)&queue->arena, SG_QUEUE_ALIGN, unmapped * stride))
+    {
+        queue->arena = NULL;
+        goto err;
+    }
+
+    uint8_t *arena = queue->arena;
+    for (unsigned int i = 0; i < depth; i++)
+    {
+        sg_queue_slot_t *slot = &queue->slots[i];
+        if (!slot->mapped)
+        {
+            slot->parameter = arena;
+            arena += stride;
+        }
+        sg_queue_slot_format(slot, i);
+    }
+
+    return queue;
+
+err:
+    sg_queue_close(queue);
+    errno = ENOMEM;
+    return NULL;
+}
+
+/*
+ * Send the range of a command the device rejected again in smaller commands.
+ * They are issued synchronously, rejections are rare and the limits only
+ * shrink a few times per run.
+ * Returns	0  the range is unmapped
+ * 		<0 error
+ */
+static int sg_queue_split(sg_queue_t *queue, sg_queue_slot_t *slot)
+{
+    unmap_extent_t *extents = malloc(slot->descriptor_count * sizeof(*extents));
+    if (extents == NULL)
+    {
+        return -1;
+    }
+
+    sg_unmap_parameter_extents(queue->info, slot->parameter, slot->descriptor_count, extents);
+    queue->state->splits++;
+    /* the parameter list of the slot is free for reuse now */
+    int ret = sg_unmap_extents_buffered(queue->transport, queue->info, queue->state, extents,
+                                        slot->descriptor_count, slot->parameter);
+
+    free(extents);
+    return ret;
+}
+
+/*
+ * Send the range of a WRITE SAME the device rejected again in smaller commands.
+ * Returns	0  the range is deallocated
+ * 		<0 error
+ */
+static int sg_queue_split_write_same(sg_queue_t *queue, sg_queue_slot_t *slot)
+{
+    const device_info_t *info = queue->info;
+    unmap_extent_t extent = {slot->lba * info->sector_size, (uint64_t)slot->blocks * info->sector_size};
+
+    queue->state->splits++;
+    return sg_write_same_extents_buffered(queue->transport, info, queue->state, &extent, 1, queue->zero_block);
+}
+
+/*
+ * Write the zeroes of a command the device refused again synchronously,
+ * in smaller commands or with the next method.
+ * Returns	0  the range is zeroed
+ * 		<0 error
+ */
+static int sg_queue_split_zero(sg_queue_t *queue, sg_queue_slot_t *slot)
+{
+    const device_info_t *info = queue->info;
+    unmap_extent_t extent = {slot->lba * info->sector_size, (uint64_t)slot->blocks * info->sector_size};
+
+    queue->state->splits++;
+    return sg_zero_extents_buffered(queue->transport, info, queue->state, queue->zero_method, &extent, 1,
+                                    queue->zero_buffer);
+}
+
+/*
+ * Reap one completed command.
+ * Returns	1  a command completed, its slot may have been resubmitted
+ * 		0  timeout
+ * 		<0 error
+ */
+static int sg_queue_reap(sg_queue_t *queue, int timeout)
+{
+    sg_io_hdr_t io_hdr;
+    int ret = sg_transport_receive(queue->transport, &io_hdr, timeout);
+    if (ret <= 0)
+    {
+        return ret;
+    }
+
+    sg_queue_slot_t *slot = io_hdr.usr_ptr;
+    /* the sense data went to the buffer of the slot */
+    io_hdr.sbp = slot->sense_buffer;
+
+    sg_result_t result;
+    sg_result_decode(&io_hdr, &result);
+    sg_disposition_t disposition = sg_result_disposition(&result);
+
+    if (disposition == SG_DISPOSITION_RETRY && slot->attempts < SG_RETRY_LIMIT && queue->error == 0)
+    {
+        sg_retry_backoff(slot->attempts++);
+        queue->state->retries++;
+        if (sg_transport_submit(queue->transport, &slot->io_hdr) == 0)
+        {
+            return 1;
+        }
+        disposition = SG_DISPOSITION_FATAL;
+        memset(&result, 0, sizeof(result));
+    }
+
+    slot->busy = false;
+    queue->in_flight--;
+
+    if (slot->kind == SG_QUEUE_ZERO && queue->error == 0 &&
+        (disposition == SG_DISPOSITION_REJECTED || sg_result_unsupported(&result)))
+    {
+        if (sg_queue_split_zero(queue, slot) == 0)
+        {
+            return 1;
+        }
+        queue->error = errno ? errno : EIO;
+        return 1;
+    }
+
+    bool write_same = slot->kind == SG_QUEUE_WRITE_SAME;
+    if (disposition == SG_DISPOSITION_REJECTED && queue->error == 0 &&
+        (write_same ? sg_write_same_state_shrink(queue->state, queue->info, slot->blocks)
+                    : sg_unmap_state_shrink(queue->state, queue->info, slot->parameter, slot->descriptor_count)) == 0)
+    {
+        if ((write_same ? sg_queue_split_write_same(queue, slot) : sg_queue_split(queue, slot)) == 0)
+        {
+            return 1;
+        }
+        queue->error = errno ? errno : EIO;
+        return 1;
+    }
+
+    if (disposition == SG_DISPOSITION_OK)
+    {
+        if (slot->kind == SG_QUEUE_UNMAP)
+        {
+            sg_unmap_state_accepted(queue->state, queue->info, slot->parameter, slot->descriptor_count);
+        }
+    }
+    else if (queue->error == 0)
+    {
+        queue->error = EIO;
+        if (result.status || result.host_status || result.driver_status)
+        {
+            queue->state->failure_valid = true;
+            queue->state->failure = result;
+        }
+    }
+
+    return 1;
+}
+
+int sg_queue_unmap_extents(sg_queue_t *queue, const unmap_extent_t *extents, size_t count)
+{
+    unmap_cursor_t cursor;
+    unmap_cursor_init(&cursor, queue->info, queue->state, extents, count);
+
+    unsigned int next = 0;
+    while (queue->error == 0)
+    {
+        /* a retried command keeps its slot */
+        while (queue->in_flight == queue->depth)
+        {
+            if (sg_queue_reap(queue, -1) < 0)
+            {
+                return -1;
+            }
+        }
+
+        while (queue->slots[next].busy)
+        {
+            next = (next + 1) % queue->depth;
+        }
+        sg_queue_slot_t *slot = &queue->slots[next];
+
+        uint32_t descriptor_count = unmap_cursor_fill(&cursor, slot->parameter);
+        if (descriptor_count == 0)
+        {
+            return 0;
+        }
+
+        if (slot->kind != SG_QUEUE_UNMAP)
+        {
+            sg_queue_slot_format(slot, next);
+        }
+        sg_unmap_patch(&slot->io_hdr, descriptor_count);
+        slot->descriptor_count = descriptor_count;
+        slot->attempts = 0;
+
+        if (sg_transport_submit(queue->transport, &slot->io_hdr))
+        {
+            return -1;
+        }
+
+        slot->busy = true;
+        queue->in_flight++;
+        queue->state->commands++;
+    }
+
+    errno = queue->error;
+    return -1;
+}
+
+int sg_queue_write_same_extents(sg_queue_t *queue, const unmap_extent_t *extents, size_t count)
+{
+    const device_info_t *info = queue->info;
+    if (queue->zero_block == NULL && (queue->zero_block = calloc(1, info->sector_size)) == NULL)
+    {
+        return -1;
+    }
+
+    unsigned int next = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t lba = extents[i].offset / info->sector_size;
+        uint64_t end_lba = lba + extents[i].length / info->sector_size;
+        while (lba < end_lba)
+        {
+            if (queue->error)
+            {
+                errno = queue->error;
+                return -1;
+            }
+
+            /* a retried command keeps its slot */
+            while (queue->in_flight == queue->depth)
+            {
+                if (sg_queue_reap(queue, -1) < 0)
+                {
+                    return -1;
+                }
+            }
+
+            while (queue->slots[next].busy)
+            {
+                next = (next + 1) % queue->depth;
+            }
+            sg_queue_slot_t *slot = &queue->slots[next];
+
+            uint64_t blocks = end_lba - lba;
+            if (blocks > queue->state->write_same_limit)
+            {
+                blocks = queue->state->write_same_limit;
+            }
+
+            if (slot->kind == SG_QUEUE_WRITE_SAME)
+            {
+                sg_write_same_patch(&slot->io_hdr, lba, blocks);
+            }
+            else
+            {
+                /* the zero block is no mapped buffer, it is copied */
+                sg_write_same_prepare(&slot->io_hdr, slot->command, slot->sense_buffer, queue->zero_block,
+                                      info->sector_size, lba, blocks);
+                slot->io_hdr.pack_id = (int)next;
+                slot->io_hdr.usr_ptr = slot;
+                slot->kind = SG_QUEUE_WRITE_SAME;
+            }
+            slot->lba = lba;
+            slot->blocks = blocks;
+            slot->attempts = 0;
+
+            if (sg_transport_submit(queue->transport, &slot->io_hdr))
+            {
+                return -1;
+            }
+
+            slot->busy = true;
+            queue->in_flight++;
+            queue->state->commands++;
+            lba += blocks;
+        }
+    }
+
+    if (queue->error)
+    {
+        errno = queue->error;
+        return -1;
+    }
+    return 0;
+}
+
+int sg_queue_zero_extents(sg_queue_t *queue, sg_zero_t *method, const unmap_extent_t *extents, size_t count,
+                          const uint8_t *buffer)
+{
+    const device_info_t *info = queue->info;
+    queue->zero_method = method;
+    queue->zero_buffer = buffer;
+
+    unsigned int next = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t lba = extents[i].offset / info->sector_size;
+        uint64_t end_lba = lba + extents[i].length / info->sector_size;
+        while (lba < end_lba)
+        {
+            if (queue->error)
+            {
+                errno = queue->error;
+                return -1;
+            }
+
+            /* a retried command keeps its slot */
+            while (queue->in_flight == queue->depth)
+            {
+                if (sg_queue_reap(queue, -1) < 0)
+                {
+                    return -1;
+                }
+            }
+
+            while (queue->slots[next].busy)
+            {
+                next = (next + 1) % queue->depth;
+            }
+            sg_queue_slot_t *slot = &queue->slots[next];
+
+            /* the method may have changed while the slot was in flight */
+            uint64_t blocks = end_lba - lba;
+            if (blocks > sg_zero_limit(queue->state, *method))
+            {
+                blocks = sg_zero_limit(queue->state, *method);
+            }
+            sg_zero_prepare(&slot->io_hdr, slot->command, slot->sense_buffer, *method, buffer, info->sector_size, lba,
+                            blocks);
+            slot->io_hdr.pack_id = (int)next;
+            slot->io_hdr.usr_ptr = slot;
+            slot->kind = SG_QUEUE_ZERO;
+            slot->lba = lba;
+            slot->blocks = blocks;
+            slot->attempts = 0;
+
+            if (sg_transport_submit(queue->transport, &slot->io_hdr))
+            {
+                return -1;
+            }
+
+            slot->busy = true;
+            queue->in_flight++;
+            queue->state->commands++;
+            lba += blocks;
+        }
+    }
+
+    if (queue->error)
+    {
+        errno = queue->error;
+        return -1;
+    }
+    return 0;
+}
+
+int sg_queue_unmap(sg_queue_t *queue, uint64_t offset, uint64_t length)
+{
+    unmap_extent_t extent = {offset, length};
+    return sg_queue_unmap_extents(queue, &extent, 1);
+}
+
+int sg_queue_drain(sg_queue_t *queue)
+{
+    while (queue->in_flight > 0)
+    {
+        if (sg_queue_reap(queue, -1) < 0)
+        {
+            return -1;
+        }
+    }
+
+    if (queue->error)
+    {
+        errno = queue->error;
+        return -1;
+    }
+
+    return 0;
+}
+
+int sg_queue_poll(sg_queue_t *queue, int timeout)
+{
+    while (queue->in_flight > 0)
+    {
+        int ret = sg_queue_reap(queue, timeout);
+        if (ret < 0)
+        {
+            return -1;
+        }
+        if (ret == 0)
+        {
+            break;
+        }
+        /* only the first completion may be waited for */
+        timeout = 0;
+    }
+
+    if (queue->error)
+    {
+        errno = queue->error;
+        return -1;
+    }
+
+    return queue->in_flight;
+}
+
+unsigned int sg_queue_depth(const sg_queue_t *queue)
+{
+    return queue->depth;
+}
+
+int sg_queue_close(sg_queue_t *queue)
+{
+    int ret = sg_queue_drain(queue);
+
+    /* mapped buffers go with the transport */
+    free(queue->arena);
+    free(queue->slots);
+    free(queue->zero_block);
+
+    free(queue);
+    return ret;
+}
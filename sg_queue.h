@@ -0,0 +1,130 @@
+#ifndef SG_QUEUE_H
+#define SG_QUEUE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "utils.h"
+
+typedef struct sg_queue sg_queue_t;
+
+/**
+ * @brief find the scsi generic node of a block device.
+ *
+ * @param devno device number of the disk or one of its partitions.
+ * @param path buffer for the path, e.g. "/dev/sg2".
+ * @param len size of the buffer.
+ * @return returns 0 if there is no error.
+ */
+int sg_generic_path(dev_t devno, char *path, size_t len);
+
+/**
+ * @brief open an asynchronous UNMAP queue on a transport.
+ *
+ * Commands are submitted and reaped through the transport, so up to
+ * depth commands are in flight at the same time.
+ *
+ * Commands failing with a transient condition are resubmitted; the
+ * range of a command the device rejects as too large is sent again in
+ * smaller commands, see sg_unmap_extents_buffered().
+ *
+ * @param transport transport with a queue, must outlive the queue.
+ * @param info device info, must outlive the queue.
+ * @param state command limits and statistics shared with synchronous
+ *        commands, NULL for limits of the queue's own; must outlive the queue.
+ * @param depth number of commands in flight, at most the depth of the transport.
+ * @return the queue, NULL on error.
+ */
+sg_queue_t *sg_queue_open(sg_transport_t *transport, const device_info_t *info, sg_unmap_state_t *state,
+                          unsigned int depth);
+
+/**
+ * @brief queue UNMAP commands for a list of areas.
+ *
+ * Blocks only while all slots are busy. The extents may be released
+ * once this returns.
+ *
+ * @param queue the queue.
+ * @param extents areas to unmap, offset and length in byte.
+ * @param count number of extents.
+ * @return returns 0 if there is no error.
+ */
+int sg_queue_unmap_extents(sg_queue_t *queue, const unmap_extent_t *extents, size_t count);
+
+/**
+ * @brief queue WRITE SAME(16) commands with the UNMAP bit for a list of areas.
+ *
+ * Every area takes one or more commands of at most the WRITE SAME limit
+ * of the queue state. Blocks only while all slots are busy.
+ *
+ * @param queue the queue.
+ * @param extents areas to deallocate, offset and length in byte.
+ * @param count number of extents.
+ * @return returns 0 if there is no error.
+ */
+int sg_queue_write_same_extents(sg_queue_t *queue, const unmap_extent_t *extents, size_t count);
+
+/**
+ * @brief queue commands writing zeroes for a list of areas.
+ *
+ * A command the device refuses is sent again synchronously, see
+ * sg_zero_extents_buffered(), which may switch the method for the
+ * commands queued after it. Blocks only while all slots are busy.
+ *
+ * @param queue the queue.
+ * @param method method of the commands, must outlive the queued commands.
+ * @param extents areas to zero, offset and length in byte.
+ * @param count number of extents.
+ * @param buffer zeroes, see sg_zero_extents_buffered(); must outlive the queued commands.
+ * @return returns 0 if there is no error.
+ */
+int sg_queue_zero_extents(sg_queue_t *queue, sg_zero_t *method, const unmap_extent_t *extents, size_t count,
+                          const uint8_t *buffer);
+
+/**
+ * @brief queue UNMAP commands for one area.
+ *
+ * @param queue the queue.
+ * @param offset offset in byte.
+ * @param length length in byte.
+ * @return returns 0 if there is no error.
+ */
+int sg_queue_unmap(sg_queue_t *queue, uint64_t offset, uint64_t length);
+
+/**
+ * @brief wait for all queued commands to complete.
+ *
+ * @param queue the queue.
+ * @return returns 0 if every command completed without error.
+ */
+int sg_queue_drain(sg_queue_t *queue);
+
+/**
+ * @brief reap the commands that have completed.
+ *
+ * @param queue the queue.
+ * @param timeout milliseconds to wait for the first completion, -1 to
+ *        wait until one arrives, 0 to not wait at all.
+ * @return number of commands still in flight, -1 on error.
+ */
+int sg_queue_poll(sg_queue_t *queue, int timeout);
+
+/**
+ * @brief get the number of command slots of the queue.
+ *
+ * @param queue the queue.
+ * @return queue depth.
+ */
+unsigned int sg_queue_depth(const sg_queue_t *queue);
+
+/**
+ * @brief drain and close the queue.
+ *
+ * The transport stays open.
+ *
+ * @param queue the queue.
+ * @return returns 0 if every command completed without error.
+ */
+int sg_queue_close(sg_queue_t *queue);
+
+#endif /* SG_QUEUE_H */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <err.h>
 #include <stdlib.h>
@@ -13,6 +14,9 @@
 #include <linux/fs.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
 
 #ifdef HAVE_LIBBLKID
 #include <blkid/blkid.h>
@@ -20,6 +24,25 @@
 
 #include "sgblkdiscard_config.h"
 #include "utils.h"
+#include "sgdiscard.h"
+#include "plan.h"
+#include "fstrim.h"
+#include "fsfree.h"
+#include "sysfs.h"
+#include "lba_status.h"
+#include "ranges.h"
+#include "histogram.h"
+#include "adapt.h"
+#include "throttle.h"
+#include "checkpoint.h"
+#include "nvme.h"
+#include "progress.h"
+#include "quirks.h"
+#include "probe_cache.h"
+#include "partmap.h"
+#include "reader.h"
+#include "zero.h"
+#include "verify.h"
 
 static void print_stats(char *path, uint64_t trim_start_offset, uint64_t trimmed_bytes)
 {
@@ -31,18 +54,77 @@ static void usage(const char *program_name)
 {
     FILE *out = stdout;
     fputs(USAGE_HEADER, out);
-    fprintf(out, " %s [options] <device>\n", program_name);
+    fprintf(out, " %s [options] <device>...\n", program_name);
+    fprintf(out, " %s [options] --fstrim <mountpoint>\n", program_name);
 
     fputs(USAGE_SEPARATOR, out);
-    fputs("Discard the content of sectors on a device.\n", out);
+    fputs("Discard the content of sectors on one or more devices.\n", out);
 
     fputs(USAGE_OPTIONS, out);
+    fputs(" -a, --aligned-only  skip partial unmap granularities at the edges\n", out);
+    fputs(" -b, --backend <name>\n"
+          "                     sg (default), or mock[:key=value,...] to discard\n"
+          "                     an in-process emulated disk instead of <device>,\n"
+          "                     mock:nvme=1 emulates an NVMe namespace\n", out);
+    fputs(" -B, --bench         measure commands/s, GiB/s and latency percentiles\n"
+          "                     for every step, descriptor count and queue depth\n"
+          "                     not fixed by -p, -d and -q, over --length or 1 GiB\n", out);
+    fputs(" -c, --checkpoint <file>\n"
+          "                     journal discarded ranges to the file and skip the\n"
+          "                     ones it lists, the file is removed once done\n", out);
+    fputs(" -d, --descriptors <num>\n"
+          "                     number of step sized pieces packed into one UNMAP\n"
+          "                     command\n", out);
     fputs(" -f, --force         disable all checking\n", out);
+    fputs(" -F, --free-only     discard only the free blocks of an unmounted\n"
+          "                     ext4 or XFS filesystem on the device\n", out);
+    fputs(" -g, --gaps          discard the space no partition of the disk's\n"
+          "                     partition table uses\n", out);
     fputs(" -i, --interactive   interactive mode\n", out);
+    fputs(" -I, --idle          send UNMAP commands only while the disk has no\n"
+          "                     other I/O, pausing while it is busy\n", out);
+    fputs(" -m, --method <name> unmap, write-same (WRITE SAME(16) with the UNMAP bit)\n"
+          "                     or auto (default) to measure which one is faster\n", out);
     fputs(" -o, --offset <num>  offset in bytes to discard from\n", out);
+    fputs(" -j, --jobs <num>    number of devices discarded at the same time\n", out);
     fputs(" -l, --length <num>  length of bytes to discard from the offset\n", out);
-    fputs(" -p, --step <num>    size of the discard iterations within the offset\n", out);
+    fputs("     --probe-cache <file>\n"
+          "                     remember the method, the limits and the benchmark\n"
+          "                     results of every device by serial number\n", out);
+    fputs("     --progress-format text|json\n"
+          "                     text (default) prints progress with -v and -p, json\n"
+          "                     prints one JSON object per device and second\n", out);
+    fputs(" -P, --partition <num>[,<num>...]\n"
+          "                     discard these partitions of the disk, together\n"
+          "                     with the gaps of --gaps in one pass\n", out);
+    fputs(" -p, --step <num>|auto\n"
+          "                     size of the discard iterations within the offset,\n"
+          "                     auto sizes every command by the measured latency\n", out);
+    fputs("     --quirks <file>\n"
+          "                     limits and settings of devices that misreport\n"
+          "                     theirs, default " QUIRKS_DEFAULT_PATH "\n", out);
+    fputs(" -q, --queue-depth <num>\n"
+          "                     number of UNMAP commands in flight, at most 16 on\n"
+          "                     SCSI and 64 on NVMe devices\n", out);
+    fputs(" -R, --rate <num>    discard at most <num> bytes per second per device\n", out);
+    fputs("     --reclaim-zeros read the device and discard only the unmap\n"
+          "                     granularity sized blocks that hold nothing but\n"
+          "                     zeroes, keeping all data\n", out);
+    fputs(" -r, --ranges <file> discard the \"<offset> <length>\" pairs listed in the\n"
+          "                     file, - for stdin\n", out);
+    fputs(" -s, --skip-unmapped skip ranges GET LBA STATUS reports as deallocated\n", out);
+    fputs("     --textfile <file>\n"
+          "                     write the progress of every device as node_exporter\n"
+          "                     metrics to the file every second\n", out);
+    fputs(" -t, --fstrim <mountpoint>\n"
+          "                     discard the free space of a mounted filesystem\n", out);
     fputs(" -v, --verbose       print aligned length and offset\n", out);
+    fputs("     --verify[=<num>]\n"
+          "                     read back <num> (default 16) random blocks of every\n"
+          "                     discarded extent and fail unless they hold zeroes\n", out);
+    fputs(" -z, --zero          write zeroes instead of deallocating, with WRITE\n"
+          "                     SAME(16) or WRITE(16) if the device has no other\n"
+          "                     way\n", out);
 
     fputs(USAGE_SEPARATOR, out);
     printf(USAGE_HELP_OPTIONS(21));
@@ -94,7 +176,1770 @@ out:
     blkid_free_probe(pr);
     return ret;
 }
+
+/*
+ * Get the filesystem type on the open fd
+ * Returns	0  type found
+ * 		<0 error or no filesystem
+ */
+static int probe_fstype(int fd, char *type_buf, size_t len)
+{
+    const char *type;
+    blkid_probe pr = NULL;
+    int ret = -1;
+
+    pr = blkid_new_probe();
+    if (!pr || blkid_probe_set_device(pr, fd, 0, 0))
+        return ret;
+
+    blkid_probe_enable_superblocks(pr, true);
+
+    if (blkid_do_safeprobe(pr) == 0 && !blkid_probe_lookup_value(pr, "TYPE", &type, NULL) &&
+        strlen(type) < len)
+    {
+        strcpy(type_buf, type);
+        ret = 0;
+    }
+
+    blkid_free_probe(pr);
+    return ret;
+}
+#endif /* HAVE_LIBBLKID */
+
+typedef struct discard_options
+{
+    bool force;
+    bool verbose;
+    bool interactive;
+    bool aligned_only;
+    bool free_only;
+    /* discard by the partition table of the disk */
+    bool gaps;
+    unsigned int *partitions;
+    size_t partition_count;
+    bool skip_unmapped;
+    /* discard only the blocks that read back as zeroes */
+    bool reclaim_zeros;
+    /* write zeroes instead of deallocating */
+    bool zero;
+    /* blocks read back per extent, 0 for no verification */
+    unsigned int verify_samples;
+    bool bench;
+    bool step_auto;
+    bool idle;
+    /* pick the faster of UNMAP and WRITE SAME when the device has both */
+    bool method_auto;
+    sg_deallocate_t method;
+    uint64_t rate;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t step;
+    unsigned int queue_depth;
+    unsigned int descriptors;
+    const char *backend;
+    const char *fstrim_path;
+    const char *ranges_path;
+    const char *checkpoint_path;
+    /* progress as JSON lines instead of sentences */
+    bool progress_json;
+    const char *textfile_path;
+    quirk_table_t quirks;
+    /* NULL unless --probe-cache, guarded by probe_cache_lock */
+    probe_cache_t *probe_cache;
+    extent_list_t ranges;
+} discard_options_t;
+
+typedef struct discard_job
+{
+    const discard_options_t *options;
+    struct discard_pool *pool;
+    char *path;
+    int status;
+    uint64_t discarded_bytes;
+    struct timeval started;
+    struct timeval finished;
+    /* published with --progress-format json and --textfile, guarded by progress_lock */
+    progress_t progress;
+    bool progress_started;
+} discard_job_t;
+
+typedef struct discard_pool
+{
+    pthread_mutex_t lock;
+    discard_job_t *jobs;
+    size_t job_count;
+    size_t next_job;
+    /* the jobs that have started, for the textfile */
+    const progress_t **progress;
+} discard_pool_t;
+
+typedef struct discard_run
+{
+    discard_job_t *job;
+    sgd_device_t *device;
+    /* command latencies, NULL unless --bench or --step auto */
+    histogram_t *latency;
+    /* pacing, NULL unless --rate or --idle */
+    throttle_t *throttle;
+    /* journal of completed extents, NULL unless --checkpoint */
+    checkpoint_t *checkpoint;
+    /* what the probe and the benchmark learn, NULL unless --probe-cache */
+    probe_entry_t *tuned;
+} discard_run_t;
+
+/* prompts of devices set up in parallel must not interleave */
+static pthread_mutex_t prompt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool ask_for_yn_locked(const char *path, const char *message)
+{
+    pthread_mutex_lock(&prompt_lock);
+    printf("%s: ", path);
+    bool ret = ask_for_yn(message);
+    pthread_mutex_unlock(&prompt_lock);
+    return ret;
+}
+
+/* jobs share the probe cache */
+static pthread_mutex_t probe_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* JSON lines and the textfile carry the progress of every job */
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool progress_enabled(const discard_options_t *options)
+{
+    return options->progress_json || options->textfile_path;
+}
+
+/* start publishing the progress of a job that discards total_bytes */
+static void start_progress(discard_job_t *job, uint64_t total_bytes)
+{
+    pthread_mutex_lock(&progress_lock);
+    progress_init(&job->progress, job->path);
+    job->progress.total_bytes = total_bytes;
+    job->progress_started = true;
+    pthread_mutex_unlock(&progress_lock);
+}
+
+/* print and write the latest numbers of a job as the options ask */
+static void report_progress(discard_job_t *job, const sgd_device_t *device, const histogram_t *latency,
+                            progress_state_t state)
+{
+    const discard_options_t *options = job->options;
+    static bool textfile_warned;
+
+    if (!progress_enabled(options) || !job->progress_started)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&progress_lock);
+    const sg_unmap_state_t *unmap_state = sgd_unmap_state(device);
+    job->progress.state = state;
+    progress_update(&job->progress, job->discarded_bytes, unmap_state->commands, unmap_state->retries, latency);
+
+    if (options->progress_json)
+    {
+        progress_print_json(&job->progress, stdout);
+        fflush(stdout);
+    }
+    if (options->textfile_path)
+    {
+        discard_pool_t *pool = job->pool;
+        size_t count = 0;
+        for (size_t i = 0; i < pool->job_count; i++)
+        {
+            if (pool->jobs[i].progress_started)
+            {
+                pool->progress[count++] = &pool->jobs[i].progress;
+            }
+        }
+        /* one complaint is enough, the discard goes on */
+        if (progress_write_textfile(options->textfile_path, pool->progress, count) && !textfile_warned)
+        {
+            warn("%s: cannot write metrics", options->textfile_path);
+            textfile_warned = true;
+        }
+    }
+    pthread_mutex_unlock(&progress_lock);
+}
+
+/* report a failed discard with the decoded status of the failing command if there is one */
+static void warn_unmap(const char *path, const sgd_device_t *device)
+{
+    const sg_unmap_state_t *state = sgd_unmap_state(device);
+    char description[128];
+
+    if (state->failure_valid)
+    {
+        warnx("%s: unmap failed: %s", path, sg_result_describe(&state->failure, description, sizeof(description)));
+    }
+    else
+    {
+        warn("%s: unmap failed", path);
+    }
+}
+
+/*
+ * Discard a list of areas once, packing up to descriptors pieces into one command.
+ * With --step auto the latency histogram drives the bytes per command,
+ * and descriptors 0 packs as many pieces as fit.
+ * Returns	0  success
+ * 		<0 error, already reported
+ */
+static int discard_extents(const discard_run_t *run, const unmap_extent_t *extents, size_t extent_count,
+                           uint64_t step, unsigned int descriptors, bool verbose)
+{
+    discard_job_t *job = run->job;
+    sgd_device_t *device = run->device;
+    checkpoint_t *checkpoint = run->checkpoint;
+    const char *path = job->path;
+    const device_info_t *info = sgd_info(device);
+    int ret = -1;
+
+    if (descriptors == 0)
+    {
+        descriptors = sg_unmap_block_descriptor_limit(info);
+    }
+
+    unmap_extent_t *batch = calloc(descriptors, sizeof(*batch));
+    if (batch == NULL)
+    {
+        warn("%s: cannot allocate block descriptors", path);
+        return ret;
+    }
+
+    adapt_t adapt;
+    bool step_auto = job->options->step_auto;
+    if (step_auto)
+    {
+        adapt_init(&adapt, info, run->latency, sgd_queue_depth(device));
+        step = adapt.step;
+    }
+
+    plan_t plan;
+    plan_init(&plan, info, extents, extent_count, step, job->options->aligned_only);
+
+    uint64_t trim_start_offset = 0;
+    uint64_t trimmed_bytes = 0;
+
+    struct timeval now = {0}, last = {0};
+    gettime_monotonic(&last);
+
+    size_t batch_count = 0;
+    uint64_t batch_bytes = 0;
+    while (true)
+    {
+        bool more = plan_next(&plan, &batch[batch_count]);
+        if (more)
+        {
+            batch_bytes += batch[batch_count++].length;
+            /* an adaptive step is the budget of the whole command */
+            if (batch_count < descriptors && (!step_auto || batch_bytes < adapt.step))
+            {
+                continue;
+            }
+        }
+        if (batch_count == 0)
+        {
+            break;
+        }
+
+        if (run->throttle && throttle_wait(run->throttle, batch_bytes))
+        {
+            warn("%s: cannot read the I/O statistics", path);
+            goto out;
+        }
+
+        if ((job->options->zero ? sgd_zero : sgd_submit_batch)(device, batch, batch_count))
+        {
+            warn_unmap(path, device);
+            goto out;
+        }
+
+        for (size_t i = 0; i < batch_count; i++)
+        {
+            if (trimmed_bytes == 0)
+            {
+                trim_start_offset = batch[i].offset;
+            }
+            trimmed_bytes += batch[i].length;
+            job->discarded_bytes += batch[i].length;
+            if (checkpoint && checkpoint_record(checkpoint, batch[i].offset, batch[i].length))
+            {
+                warn("%s: cannot remember discarded extents", path);
+                goto out;
+            }
+        }
+
+        /* only completed commands go into the journal */
+        if (checkpoint && checkpoint_due(checkpoint))
+        {
+            if (sgd_drain(device))
+            {
+                warn_unmap(path, device);
+                goto out;
+            }
+            if (checkpoint_sync(checkpoint))
+            {
+                warn("%s: cannot write checkpoint", checkpoint->path);
+                goto out;
+            }
+        }
+
+        if (step_auto && adapt_submitted(&adapt, batch_bytes))
+        {
+            plan_set_step(&plan, adapt.step);
+        }
+        batch_count = 0;
+        batch_bytes = 0;
+
+        /* reporting progress at most once per second */
+        bool print = verbose && (step || step_auto) && !job->options->progress_json;
+        if (print || progress_enabled(job->options))
+        {
+            gettime_monotonic(&now);
+            if (now.tv_sec > last.tv_sec &&
+                (now.tv_usec >= last.tv_usec || now.tv_sec - last.tv_sec > 1))
+            {
+                if (print)
+                {
+                    print_stats(job->path, trim_start_offset, trimmed_bytes);
+                    trimmed_bytes = 0;
+                }
+                report_progress(job, device, run->latency, PROGRESS_RUNNING);
+                last = now;
+            }
+        }
+
+        if (!more)
+        {
+            break;
+        }
+    }
+
+    if (sgd_drain(device))
+    {
+        warn_unmap(path, device);
+        goto out;
+    }
+    if (checkpoint && checkpoint_sync(checkpoint))
+    {
+        warn("%s: cannot write checkpoint", checkpoint->path);
+        goto out;
+    }
+
+    if (verbose && trimmed_bytes && !job->options->progress_json)
+    {
+        print_stats(job->path, trim_start_offset, trimmed_bytes);
+    }
+    if (verbose && step_auto)
+    {
+        printf("%s: adaptive step settled at %" PRIu64 " bytes per command\n", path, adapt.step);
+    }
+    if (verbose)
+    {
+        const sg_unmap_state_t *state = sgd_unmap_state(device);
+        if (state->retries)
+        {
+            printf("%s: %" PRIu64 " commands were retried\n", path, state->retries);
+        }
+        if (state->splits)
+        {
+            if (state->lba_limit == UINT64_MAX)
+            {
+                printf("%s: the device rejected larger commands, now sending at most %" PRIu32
+                       " descriptors per command\n",
+                       path, state->descriptor_limit);
+            }
+            else
+            {
+                printf("%s: the device rejected larger commands, now sending at most %" PRIu32
+                       " descriptors and %" PRIu64 " bytes per command\n",
+                       path, state->descriptor_limit, state->lba_limit * info->sector_size);
+            }
+        }
+    }
+
+    ret = 0;
+
+out:
+    free(batch);
+    return ret;
+}
+
+/* bytes read at once and reads in flight while looking for zeroes */
+#define RECLAIM_CHUNK (4U << 20)
+#define RECLAIM_DEPTH 8
+/* long zero runs are discarded in pieces, so commands go out while the scan goes on */
+#define RECLAIM_BATCH_BYTES (256ULL << 20)
+
+typedef struct zero_scan
+{
+    /* zero runs waiting for a command */
+    unmap_extent_t *batch;
+    size_t batch_count;
+    uint64_t batch_bytes;
+    uint32_t descriptors;
+    /* the run the scan is in, empty after a block with data */
+    uint64_t run_offset;
+    uint64_t run_length;
+} zero_scan_t;
+
+/*
+ * Discard and journal the zero runs found so far
+ * Returns	0  success
+ * 		<0 error, already reported
+ */
+static int flush_zero_runs(const discard_run_t *run, zero_scan_t *scan)
+{
+    discard_job_t *job = run->job;
+    sgd_device_t *device = run->device;
+    checkpoint_t *checkpoint = run->checkpoint;
+
+    if (scan->batch_count == 0)
+    {
+        return 0;
+    }
+    if (run->throttle && throttle_wait(run->throttle, scan->batch_bytes))
+    {
+        warn("%s: cannot read the I/O statistics", job->path);
+        return -1;
+    }
+    if (sgd_submit_batch(device, scan->batch, scan->batch_count))
+    {
+        warn_unmap(job->path, device);
+        return -1;
+    }
+
+    job->discarded_bytes += scan->batch_bytes;
+    for (size_t i = 0; checkpoint && i < scan->batch_count; i++)
+    {
+        if (checkpoint_record(checkpoint, scan->batch[i].offset, scan->batch[i].length))
+        {
+            warn("%s: cannot remember discarded extents", job->path);
+            return -1;
+        }
+    }
+    if (checkpoint && checkpoint_due(checkpoint))
+    {
+        if (sgd_drain(device))
+        {
+            warn_unmap(job->path, device);
+            return -1;
+        }
+        if (checkpoint_sync(checkpoint))
+        {
+            warn("%s: cannot write checkpoint", checkpoint->path);
+            return -1;
+        }
+    }
+
+    scan->batch_count = 0;
+    scan->batch_bytes = 0;
+    return 0;
+}
+
+/*
+ * Close the current zero run, a full batch is discarded
+ * Returns	0  success
+ * 		<0 error, already reported
+ */
+static int end_zero_run(const discard_run_t *run, zero_scan_t *scan)
+{
+    if (scan->run_length == 0)
+    {
+        return 0;
+    }
+
+    scan->batch[scan->batch_count].offset = scan->run_offset;
+    scan->batch[scan->batch_count++].length = scan->run_length;
+    scan->batch_bytes += scan->run_length;
+    scan->run_length = 0;
+
+    if (scan->batch_count == scan->descriptors || scan->batch_bytes >= RECLAIM_BATCH_BYTES)
+    {
+        return flush_zero_runs(run, scan);
+    }
+    return 0;
+}
+
+/*
+ * Read a list of areas and discard the unmap granularity sized blocks
+ * that hold only zeroes. The next chunks are read while the commands for
+ * the zero runs found so far are in flight.
+ * Returns	0  success
+ * 		<0 error, already reported
+ */
+static int discard_zeros(const discard_run_t *run, int read_fd, const unmap_extent_t *extents, size_t extent_count,
+                         bool verbose)
+{
+    discard_job_t *job = run->job;
+    sgd_device_t *device = run->device;
+    const char *path = job->path;
+    const device_info_t *info = sgd_info(device);
+    uint64_t granularity = plan_granularity(info);
+    uint64_t alignment = ((uint64_t)info->unmap_granularity_alignment * info->sector_size) % granularity;
+    int ret = -1;
+
+    zero_scan_t scan = {.descriptors = sg_unmap_block_descriptor_limit(info)};
+    scan.batch = calloc(scan.descriptors, sizeof(*scan.batch));
+    if (scan.batch == NULL)
+    {
+        warn("%s: cannot allocate block descriptors", path);
+        return ret;
+    }
+
+    reader_t reader;
+    if (reader_open(&reader, read_fd, RECLAIM_CHUNK, RECLAIM_DEPTH))
+    {
+        warn("%s: cannot set up reading", path);
+        free(scan.batch);
+        return ret;
+    }
+
+    uint64_t scanned_bytes = 0;
+    size_t extent_index = 0;
+    uint64_t read_offset = extent_count ? extents[0].offset : 0;
+
+    struct timeval now = {0}, last = {0};
+    gettime_monotonic(&last);
+
+    while (true)
+    {
+        /* keep the reader busy */
+        while (reader_pending(&reader) < RECLAIM_DEPTH && extent_index < extent_count)
+        {
+            uint64_t end = extents[extent_index].offset + extents[extent_index].length;
+            uint64_t length = end - read_offset < RECLAIM_CHUNK ? end - read_offset : RECLAIM_CHUNK;
+            if (length && reader_submit(&reader, read_offset, length))
+            {
+                warn("%s: cannot read at offset %" PRIu64, path, read_offset);
+                goto out;
+            }
+            read_offset += length;
+            if (read_offset == end && ++extent_index < extent_count)
+            {
+                read_offset = extents[extent_index].offset;
+            }
+        }
+
+        const uint8_t *data;
+        uint64_t chunk_offset;
+        size_t chunk_length;
+        int next = reader_next(&reader, &data, &chunk_offset, &chunk_length);
+        if (next < 0)
+        {
+            warn("%s: cannot read", path);
+            goto out;
+        }
+        if (next == 0)
+        {
+            break;
+        }
+        if (chunk_length % info->sector_size)
+        {
+            warnx("%s: short read at offset %" PRIu64, path, chunk_offset);
+            goto out;
+        }
+        scanned_bytes += chunk_length;
+
+        /* a run does not bridge the holes between the areas */
+        if (scan.run_offset + scan.run_length != chunk_offset && end_zero_run(run, &scan))
+        {
+            goto out;
+        }
+
+        uint64_t chunk_end = chunk_offset + chunk_length;
+        for (uint64_t pos = chunk_offset, piece_end; pos < chunk_end; pos = piece_end)
+        {
+            /* pieces end at unmap granularity boundaries */
+            piece_end = pos + granularity - (pos + granularity - alignment) % granularity;
+            if (piece_end > chunk_end)
+            {
+                piece_end = chunk_end;
+            }
+
+            if (!zero_check(data + (pos - chunk_offset), piece_end - pos))
+            {
+                if (end_zero_run(run, &scan))
+                {
+                    goto out;
+                }
+                continue;
+            }
+
+            if (scan.run_length == 0)
+            {
+                scan.run_offset = pos;
+            }
+            scan.run_length += piece_end - pos;
+            if (scan.run_length >= RECLAIM_BATCH_BYTES && end_zero_run(run, &scan))
+            {
+                goto out;
+            }
+        }
+
+        if (progress_enabled(job->options))
+        {
+            gettime_monotonic(&now);
+            if (now.tv_sec > last.tv_sec && (now.tv_usec >= last.tv_usec || now.tv_sec - last.tv_sec > 1))
+            {
+                report_progress(job, device, run->latency, PROGRESS_RUNNING);
+                last = now;
+            }
+        }
+    }
+
+    if (end_zero_run(run, &scan) || flush_zero_runs(run, &scan))
+    {
+        goto out;
+    }
+    if (sgd_drain(device))
+    {
+        warn_unmap(path, device);
+        goto out;
+    }
+    if (run->checkpoint && checkpoint_sync(run->checkpoint))
+    {
+        warn("%s: cannot write checkpoint", run->checkpoint->path);
+        goto out;
+    }
+
+    if (verbose)
+    {
+        printf("%s: read %" PRIu64 " bytes, discarded %" PRIu64 " bytes of zeroes (%s zero check)\n", path,
+               scanned_bytes, job->discarded_bytes, zero_check_kernel());
+    }
+    ret = 0;
+
+out:
+    reader_close(&reader);
+    free(scan.batch);
+    return ret;
+}
+
+#define ARRAY_SIZE(_array) (sizeof(_array) / sizeof((_array)[0]))
+
+/* bytes discarded with each method to find the faster one */
+#define PROBE_BYTES (128ULL << 20)
+/* WRITE SAME replaces UNMAP only if it is this much faster */
+#define PROBE_MARGIN 1.1
+
+/*
+ * Move the first bytes of a list of areas to head and the rest to tail.
+ * Areas are only cut at unmap granularity boundaries, so head may get a
+ * little more.
+ * Returns	0  success
+ * 		<0 error
+ */
+static int split_extents(const device_info_t *info, const unmap_extent_t *extents, size_t extent_count,
+                         uint64_t bytes, extent_list_t *head, extent_list_t *tail)
+{
+    uint64_t granularity = plan_granularity(info);
+    uint64_t alignment = ((uint64_t)info->unmap_granularity_alignment * info->sector_size) % granularity;
+
+    for (size_t i = 0; i < extent_count; i++)
+    {
+        uint64_t offset = extents[i].offset;
+        uint64_t end = offset + extents[i].length;
+        uint64_t cut = offset;
+        if (bytes > 0)
+        {
+            cut = offset + bytes;
+            if (cut > alignment && (cut - alignment) % granularity)
+            {
+                cut += granularity - (cut - alignment) % granularity;
+            }
+            if (cut > end)
+            {
+                cut = end;
+            }
+            bytes -= cut - offset < bytes ? cut - offset : bytes;
+        }
+
+        if (extent_list_append(head, offset, cut - offset) || extent_list_append(tail, cut, end - cut))
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Discard the first areas with UNMAP and the next ones with WRITE SAME
+ * and keep the faster method for the rest, which is left in remaining
+ * Returns	0  success
+ * 		<0 error, already reported
+ */
+static int discard_probe(const discard_run_t *run, const unmap_extent_t *extents, size_t extent_count,
+                         uint64_t step, unsigned int descriptors, bool verbose, extent_list_t *remaining)
+{
+    static const sg_deallocate_t methods[] = {SG_DEALLOCATE_UNMAP, SG_DEALLOCATE_WRITE_SAME};
+    static const char *const method_names[] = {"unmap", "write same"};
+    sgd_device_t *device = run->device;
+    const char *path = run->job->path;
+    const device_info_t *info = sgd_info(device);
+    double rates[ARRAY_SIZE(methods)] = {0};
+    extent_list_t rest = {0};
+    int ret = -1;
+
+    for (size_t m = 0; m < ARRAY_SIZE(methods); m++)
+    {
+        extent_list_t probe = {0};
+        extent_list_t tail = {0};
+        if (split_extents(info, extents, extent_count, PROBE_BYTES, &probe, &tail))
+        {
+            warn("%s: failed to split the ranges", path);
+            extent_list_free(&probe);
+            extent_list_free(&tail);
+            goto out;
+        }
+        extent_list_free(&rest);
+        rest = tail;
+        extents = rest.extents;
+        extent_count = rest.count;
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int probe_ret = sgd_set_method(device, methods[m]) ||
+                        discard_extents(run, probe.extents, probe.count, step, descriptors, false);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        uint64_t probe_bytes = extent_list_bytes(&probe);
+        extent_list_free(&probe);
+        if (probe_ret)
+        {
+            goto out;
+        }
+
+        double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        rates[m] = elapsed > 0 ? probe_bytes / elapsed : 0;
+    }
+
+    /*
+     * UNMAP packs many ranges into one command, so WRITE SAME has to be
+     * clearly faster; too little to measure keeps UNMAP as well.
+     */
+    size_t best = rates[0] > 0 && rates[1] > rates[0] * PROBE_MARGIN ? 1 : 0;
+    if (sgd_set_method(device, methods[best]))
+    {
+        warn_unmap(path, device);
+        goto out;
+    }
+    if (verbose)
+    {
+        printf("%s: unmap %.1f MiB/s, write same %.1f MiB/s, deallocating with %s\n", path,
+               rates[0] / (1 << 20), rates[1] / (1 << 20), method_names[best]);
+    }
+    if (run->tuned)
+    {
+        run->tuned->method_valid = true;
+        run->tuned->method = methods[best];
+    }
+
+    *remaining = rest;
+    rest = (extent_list_t){0};
+    ret = 0;
+
+out:
+    extent_list_free(&rest);
+    return ret;
+}
+
+static const uint64_t bench_steps[] = {1 << 20, 16 << 20, 256 << 20};
+static const unsigned int bench_descriptors[] = {1, 8, 64};
+static const unsigned int bench_queue_depths[] = {1, 4, 16};
+
+/*
+ * Discard the areas once for every combination of step, descriptors
+ * per command and queue depth that is not fixed by an option
+ * Returns	0  success
+ * 		<0 error, already reported
+ */
+static int discard_bench(const discard_run_t *run, const unmap_extent_t *extents, size_t extent_count)
+{
+    discard_job_t *job = run->job;
+    sgd_device_t *device = run->device;
+    histogram_t *latency = run->latency;
+    const discard_options_t *options = job->options;
+    const char *path = job->path;
+
+    bool step_fixed = options->step || options->step_auto;
+    const uint64_t *steps = step_fixed ? &options->step : bench_steps;
+    size_t step_count = step_fixed ? 1 : ARRAY_SIZE(bench_steps);
+    const unsigned int *descriptors = options->descriptors ? &options->descriptors : bench_descriptors;
+    size_t descriptors_count = options->descriptors ? 1 : ARRAY_SIZE(bench_descriptors);
+    const unsigned int *queue_depths = options->queue_depth ? &options->queue_depth : bench_queue_depths;
+    size_t queue_depth_count = options->queue_depth ? 1 : ARRAY_SIZE(bench_queue_depths);
+    uint32_t descriptor_limit = sg_unmap_block_descriptor_limit(sgd_info(device));
+    double best_rate = 0;
+    uint64_t best_step = 0;
+    unsigned int best_descriptors = 0;
+    unsigned int best_queue_depth = 0;
+
+    printf("%s: %12s %5s %5s %10s %12s %8s %10s %10s %10s\n", path,
+           "STEP", "DESC", "QD", "COMMANDS", "COMMANDS/S", "GIB/S", "P50(us)", "P99(us)", "P999(us)");
+
+    for (size_t q = 0; q < queue_depth_count; q++)
+    {
+        if (sgd_set_queue_depth(device, queue_depths[q]))
+        {
+            warn_unmap(path, device);
+            return -1;
+        }
+        if (sgd_queue_depth(device) != queue_depths[q])
+        {
+            warnx("%s: queue depth %u is not available, skipped", path, queue_depths[q]);
+            continue;
+        }
+
+        for (size_t p = 0; p < step_count; p++)
+        {
+            for (size_t d = 0; d < descriptors_count; d++)
+            {
+                /* more pieces than one command takes would only measure a larger batch */
+                if (descriptors[d] > descriptor_limit && !options->descriptors)
+                {
+                    continue;
+                }
+
+                histogram_reset(latency);
+                uint64_t discarded_bytes = job->discarded_bytes;
+                struct timeval started, finished;
+                gettime_monotonic(&started);
+                if (discard_extents(run, extents, extent_count, steps[p], descriptors[d], false))
+                {
+                    return -1;
+                }
+                gettime_monotonic(&finished);
+
+                double seconds = (finished.tv_sec - started.tv_sec) +
+                                 (finished.tv_usec - started.tv_usec) / 1e6;
+                if (seconds <= 0)
+                {
+                    seconds = 1e-6;
+                }
+                double rate = (job->discarded_bytes - discarded_bytes) / seconds;
+                if (rate > best_rate)
+                {
+                    best_rate = rate;
+                    best_step = options->step_auto ? 0 : steps[p];
+                    best_descriptors = descriptors[d];
+                    best_queue_depth = queue_depths[q];
+                }
+                char step[24];
+                if (options->step_auto)
+                {
+                    strcpy(step, "auto");
+                }
+                else
+                {
+                    snprintf(step, sizeof(step), "%" PRIu64, steps[p]);
+                }
+                printf("%s: %12s %5u %5u %10" PRIu64 " %12.0f %8.2f %10.1f %10.1f %10.1f\n", path,
+                       step, descriptors[d], queue_depths[q], latency->count,
+                       latency->count / seconds, rate / (1 << 30),
+                       histogram_percentile(latency, 50) / 1e3,
+                       histogram_percentile(latency, 99) / 1e3,
+                       histogram_percentile(latency, 99.9) / 1e3);
+            }
+        }
+    }
+
+    if (best_rate > 0)
+    {
+        printf("%s: fastest with step %" PRIu64 ", %u descriptors and queue depth %u\n", path,
+               best_step, best_descriptors, best_queue_depth);
+        if (run->tuned)
+        {
+            run->tuned->step = best_step;
+            run->tuned->descriptors = best_descriptors;
+            run->tuned->queue_depth = best_queue_depth;
+        }
+    }
+
+    return 0;
+}
+
+/* sampled blocks read at once by --verify */
+#define VERIFY_DEPTH 32
+
+/*
+ * Open the whole disk for reading past the page cache, the offsets of
+ * the commands address it and not a partition node.
+ * Returns	>=0 the fd, the one of the device itself for the mock
+ * 		<0  error, already reported
+ */
+static int open_whole_disk(const char *path, const sgd_device_t *device)
+{
+    dev_t devno = sgd_devno(device);
+    if (devno == 0)
+    {
+        return sgd_fd(device);
+    }
+
+    dev_t disk;
+    uint64_t start;
+    char disk_path[PATH_MAX];
+    if (sysfs_whole_disk(devno, &disk, &start) || sysfs_devname(disk, disk_path, sizeof(disk_path)))
+    {
+        warn("%s: cannot find the whole disk", path);
+        return -1;
+    }
+    int fd = open(disk_path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (fd < 0)
+    {
+        warn("%s: cannot open %s for reading", path, disk_path);
+    }
+    return fd;
+}
+
+/*
+ * Read back a random sample of the discarded blocks.
+ * Returns	0  every sampled block holds zeroes
+ * 		<0 error or blocks still holding data, already reported
+ */
+static int verify_discard(const discard_run_t *run, int read_fd, const unmap_extent_t *extents, size_t extent_count,
+                          bool verbose)
+{
+    discard_job_t *job = run->job;
+    const char *path = job->path;
+    const device_info_t *info = sgd_info(run->device);
+    uint64_t granularity = plan_granularity(info);
+    uint64_t alignment = (uint64_t)info->unmap_granularity_alignment * info->sector_size;
+
+    /* written zeroes cover the partial granularities too */
+    if (job->options->zero)
+    {
+        granularity = info->sector_size;
+        alignment = 0;
+    }
+
+    verify_extent_t *per_extent = calloc(extent_count ? extent_count : 1, sizeof(*per_extent));
+    if (per_extent == NULL)
+    {
+        warn("%s: cannot allocate the verification", path);
+        return -1;
+    }
+
+    verify_result_t result;
+    if (verify_extents(read_fd, info, extents, extent_count, granularity, alignment, job->options->verify_samples,
+                       VERIFY_DEPTH, per_extent, &result))
+    {
+        warn("%s: cannot read back the discarded blocks", path);
+        free(per_extent);
+        return -1;
+    }
+
+    for (size_t i = 0; verbose && i < extent_count; i++)
+    {
+        if (per_extent[i].failures)
+        {
+            printf("%s: %u of %u sampled blocks in %" PRIu64 "+%" PRIu64 " hold data\n", path,
+                   per_extent[i].failures, per_extent[i].samples, extents[i].offset, extents[i].length);
+        }
+    }
+    free(per_extent);
+
+    if (result.failed_samples)
+    {
+        warnx("%s: verification failed, %zu of %zu extents (%.1f%%) hold data in %" PRIu64 " of %" PRIu64
+              " sampled blocks",
+              path, result.failed_extents, result.extents, 100.0 * result.failed_extents / result.extents,
+              result.failed_samples, result.samples);
+        return -1;
+    }
+    if (!job->options->progress_json)
+    {
+        printf("%s: verified, %" PRIu64 " sampled blocks in %zu extents read back as zeroes\n", path,
+               result.samples, result.extents);
+    }
+    return 0;
+}
+
+/* store what this run learned about the device in the probe cache */
+static void remember_device(const discard_job_t *job, const sgd_device_t *device, probe_entry_t *tuned)
+{
+    const sg_unmap_state_t *state = sgd_unmap_state(device);
+    tuned->capacity = sgd_info(device)->device_size;
+    tuned->lba_limit = state->lba_limit;
+    tuned->descriptor_limit = state->descriptor_limit;
+    tuned->write_same_limit = state->write_same_limit;
+
+    pthread_mutex_lock(&probe_cache_lock);
+    if (probe_cache_store(job->options->probe_cache, tuned))
+    {
+        warn("%s: cannot remember the device", job->path);
+    }
+    pthread_mutex_unlock(&probe_cache_lock);
+}
+
+/*
+ * Discard one device
+ * Returns	0  success
+ * 		<0 error, already reported
+ */
+static int discard_device(discard_job_t *job)
+{
+    const discard_options_t *options = job->options;
+    bool verbose = options->verbose;
+    bool interactive = options->interactive;
+    bool force = options->force;
+    uint64_t offset = options->offset;
+    uint64_t length = options->length;
+    uint64_t step = options->step;
+    unsigned int descriptors = options->descriptors;
+    unsigned int queue_depth = options->queue_depth;
+    int ret = -1;
+
+    sgd_device_t *device = NULL;
+    histogram_t *latency = NULL;
+    fstrim_t fstrim = {.balloon_fd = -1};
+    extent_list_t free_extents = {0};
+    extent_list_t mapped_extents = {0};
+    checkpoint_t checkpoint;
+    bool checkpoint_opened = false;
+    extent_list_t done_extents = {0};
+    extent_list_t remaining_extents = {0};
+    extent_list_t probed_extents = {0};
+    extent_list_t table_extents = {0};
+    extent_list_t node_extents = {0};
+    char serial[CHECKPOINT_SERIAL_LEN + 1];
+    bool serial_valid = false;
+    probe_entry_t tuned = {0};
+    bool method_known = false;
+    int read_fd = -1;
+
+    char *path = job->path;
+    if (options->fstrim_path)
+    {
+        /* the filesystem stays mounted, so the disk cannot be opened exclusively */
+        if (fstrim_open(&fstrim, options->fstrim_path))
+        {
+            if (errno == ENODEV)
+            {
+                warnx("%s: not on a SCSI or NVMe disk, stacked devices like device-mapper or md are not supported",
+                      options->fstrim_path);
+            }
+            else
+            {
+                warn("%s: cannot collect free space", options->fstrim_path);
+            }
+            goto out;
+        }
+        path = job->path = fstrim.disk_path;
+    }
+
+    /*
+     * The filesystem stays mounted for --fstrim. --free-only relies on the
+     * filesystem not being mounted, so it never gives up the exclusive open.
+     * The gaps of a partition table are not used by the mounted partitions.
+     * Zeroes found by --reclaim-zeros must not be overwritten before they
+     * are discarded, so nothing else may have the device open.
+     */
+    if (options->bench || options->step_auto || progress_enabled(options))
+    {
+        if ((latency = malloc(sizeof(*latency))) == NULL)
+        {
+            warn("%s: cannot allocate the latency histogram", path);
+            goto out;
+        }
+        histogram_reset(latency);
+    }
+
+    sgd_options_t device_options = {
+        .exclusive = options->reclaim_zeros || !((force && !options->free_only) || options->fstrim_path ||
+                                                 (options->gaps && options->partition_count == 0)),
+        .queue_depth = options->bench ? 1 : options->queue_depth,
+        .backend = options->backend,
+        .latency = latency,
+        .quirks = &options->quirks,
+    };
+    int device_ret = sgd_open(&device, path, &device_options);
+    if (device_ret)
+    {
+        warn("%s: %s", path, sgd_strerror(device_ret));
+        goto out;
+    }
+
+    const device_info_t *info = sgd_info(device);
+    int fd = sgd_fd(device);
+
+    /* every device takes WRITE(16) */
+    if (!options->zero && !info->support_unmap && !info->support_write_same)
+    {
+        warnx("%s: not support unmap", path);
+        goto out;
+    }
+    if (!options->zero && !options->method_auto && sgd_set_method(device, options->method))
+    {
+        warnx("%s: not support %s", path,
+              options->method == SG_DEALLOCATE_UNMAP ? "unmap" : "write same with unmap");
+        goto out;
+    }
+
+    const quirk_t *quirk = sgd_quirk(device);
+    if (verbose && quirk)
+    {
+        char description[64];
+        quirk_describe(quirk, description, sizeof(description));
+        printf("%s: using the quirks for %s\n", path, description);
+    }
+
+    if (options->checkpoint_path || options->probe_cache)
+    {
+        serial_valid = sg_get_serial(sgd_transport(device), serial, sizeof(serial)) == 0;
+        if (!serial_valid && options->checkpoint_path)
+        {
+            warn("%s: cannot read the serial number for the checkpoint", path);
+            goto out;
+        }
+    }
+    if (options->probe_cache && serial_valid)
+    {
+        pthread_mutex_lock(&probe_cache_lock);
+        const probe_entry_t *entry = probe_cache_find(options->probe_cache, serial, info->device_size);
+        if (entry)
+        {
+            tuned = *entry;
+        }
+        pthread_mutex_unlock(&probe_cache_lock);
+
+        if (entry)
+        {
+            sgd_restore_limits(device, tuned.lba_limit, tuned.descriptor_limit, tuned.write_same_limit);
+            if (verbose)
+            {
+                printf("%s: using what earlier runs learned about %s\n", path, serial);
+            }
+        }
+        strcpy(tuned.serial, serial);
+    }
+
+    /* the command line goes first, then what a benchmark measured, then the quirks */
+    if (!options->bench)
+    {
+        if (!step && !options->step_auto)
+        {
+            step = tuned.step ? tuned.step : quirk ? quirk->step : 0;
+            /* an unaligned step is ignored */
+            if (step % info->sector_size)
+            {
+                step = 0;
+            }
+        }
+        if (!descriptors && !options->step_auto)
+        {
+            descriptors = tuned.descriptors ? tuned.descriptors : quirk && quirk->descriptors ? quirk->descriptors : 1;
+        }
+        if (!queue_depth)
+        {
+            queue_depth = tuned.queue_depth ? tuned.queue_depth : quirk && quirk->queue_depth ? quirk->queue_depth : 1;
+            if (queue_depth > NVME_URING_DEPTH)
+            {
+                queue_depth = NVME_URING_DEPTH;
+            }
+            if (queue_depth != sgd_queue_depth(device) && sgd_set_queue_depth(device, queue_depth))
+            {
+                warn_unmap(path, device);
+                goto out;
+            }
+        }
+    }
+    if (!options->bench && sgd_queue_depth(device) < queue_depth)
+    {
+        warnx("%s: queue depth limited to %u", path, sgd_queue_depth(device));
+    }
+
+    /* a method learned before or known for the device saves the probe */
+    if (options->method_auto && info->support_unmap && info->support_write_same &&
+        (tuned.method_valid || (quirk && quirk->method_valid)))
+    {
+        method_known = sgd_set_method(device, tuned.method_valid ? tuned.method : quirk->method) == 0;
+    }
+
+    /* blocks that held zeroes, or are verified, have to read back as zeroes after the discard */
+    if ((options->reclaim_zeros || options->verify_samples) && !options->zero && !info->lbprz)
+    {
+        if (info->support_write_same && (options->method_auto || options->method == SG_DEALLOCATE_WRITE_SAME))
+        {
+            /* WRITE SAME writes the zeroes it deallocates */
+            if (sgd_set_method(device, SG_DEALLOCATE_WRITE_SAME))
+            {
+                warn_unmap(path, device);
+                goto out;
+            }
+            method_known = true;
+        }
+        else if (!force)
+        {
+            warnx("%s: unmapped blocks may not read back as zeroes. "
+                  "Use the -f option to override.",
+                  path);
+            goto out;
+        }
+    }
+
+    unmap_extent_t range = {0};
+    const unmap_extent_t *extents = &range;
+    size_t extent_count = 1;
+    if (options->free_only)
+    {
+        dev_t disk;
+        uint64_t start;
+        if (sysfs_whole_disk(sgd_devno(device), &disk, &start))
+        {
+            warn("%s: cannot find the whole disk", path);
+            goto out;
+        }
+
+        const char *fstype = NULL;
+#ifdef HAVE_LIBBLKID
+        char fstype_buf[32];
+        if (probe_fstype(fd, fstype_buf, sizeof(fstype_buf)) == 0)
+        {
+            fstype = fstype_buf;
+        }
+#endif /* HAVE_LIBBLKID */
+
+        if (fsfree_collect(fd, fstype, start, info->sector_size, &free_extents))
+        {
+            warn("%s: cannot read the free space of the filesystem", path);
+            goto out;
+        }
+
+        extents = free_extents.extents;
+        extent_count = free_extents.count;
+        if (verbose)
+        {
+            printf("%s: %" PRIu64 " bytes free in %zu extents\n",
+                   path, extent_list_bytes(&free_extents), extent_count);
+        }
+    }
+    else if (options->fstrim_path)
+    {
+        extents = fstrim.extents.extents;
+        extent_count = fstrim.extents.count;
+        if (verbose)
+        {
+            printf("%s: %" PRIu64 " bytes free in %zu extents on %s\n",
+                   options->fstrim_path, extent_list_bytes(&fstrim.extents), extent_count, path);
+        }
+    }
+    else if (options->gaps || options->partition_count)
+    {
+        dev_t devno = sgd_devno(device);
+        dev_t disk;
+        uint64_t start;
+        if (devno && sysfs_whole_disk(devno, &disk, &start))
+        {
+            warn("%s: cannot find the whole disk", path);
+            goto out;
+        }
+        if (devno && disk != devno)
+        {
+            warnx("%s: is a partition, the partition table is on the whole disk", path);
+            goto out;
+        }
+
+        partition_map_t map;
+        if (partmap_read(fd, &map))
+        {
+            if (errno == ENODATA)
+            {
+                warnx("%s: no partition table found", path);
+            }
+            else
+            {
+                warn("%s: cannot read the partition table", path);
+            }
+            goto out;
+        }
+        int plan_ret = partmap_plan(&map, info->device_size, info->sector_size, options->gaps, options->partitions,
+                                    options->partition_count, &table_extents);
+        if (plan_ret)
+        {
+            warn("%s: cannot select the areas of the %s partition table", path, map.type);
+        }
+        else if (verbose)
+        {
+            printf("%s: %" PRIu64 " bytes in %zu extents of the %s partition table\n",
+                   path, extent_list_bytes(&table_extents), table_extents.count, map.type);
+        }
+        partmap_free(&map);
+        if (plan_ret)
+        {
+            goto out;
+        }
+        extents = table_extents.extents;
+        extent_count = table_extents.count;
+
+        /* the gaps hold no data, partitions do */
+        if (options->partition_count && !force && !options->reclaim_zeros)
+        {
+            if (interactive)
+            {
+                if (!ask_for_yn_locked(path, "The partitions will be discarded, data will be lost! Continue?"))
+                {
+                    goto out;
+                }
+            }
+            else
+            {
+                warnx("%s: Discarding partitions destroys their data. "
+                      "Use the -f option to override.",
+                      path);
+                goto out;
+            }
+        }
+    }
+    else
+    {
+        /*
+         * commands address the whole disk, a partition node only covers its part of it;
+         * sgd_open refused stacked devices, so any other node is the disk itself
+         */
+        dev_t devno = sgd_devno(device);
+        uint64_t node_start = 0;
+        uint64_t node_size = info->device_size;
+        dev_t disk;
+        if (devno && sysfs_whole_disk(devno, &disk, &node_start))
+        {
+            warn("%s: cannot find the whole disk", path);
+            goto out;
+        }
+        if (devno && disk != devno && sysfs_size(devno, &node_size))
+        {
+            warn("%s: cannot read the size of the partition", path);
+            goto out;
+        }
+
+        if (options->ranges_path)
+        {
+            const extent_list_t *ranges = &options->ranges;
+            for (size_t i = 0; i < ranges->count; i++)
+            {
+                const unmap_extent_t *extent = &ranges->extents[i];
+                if (extent->offset % info->sector_size || extent->length % info->sector_size)
+                {
+                    warnx("%s: range %" PRIu64 "+%" PRIu64 " is not aligned "
+                          "to sector size %i",
+                          path, extent->offset, extent->length, info->sector_size);
+                    goto out;
+                }
+                if (extent->offset + extent->length > node_size)
+                {
+                    warnx("%s: range %" PRIu64 "+%" PRIu64 " is behind the end of the device",
+                          path, extent->offset, extent->length);
+                    goto out;
+                }
+            }
+
+            if (step % info->sector_size)
+            {
+                warnx("%s: step %" PRIu64 " is not aligned "
+                      "to sector size %i",
+                      path, step, info->sector_size);
+                goto out;
+            }
+
+            extents = ranges->extents;
+            extent_count = ranges->count;
+            if (node_start)
+            {
+                for (size_t i = 0; i < ranges->count; i++)
+                {
+                    if (extent_list_append(&node_extents, node_start + ranges->extents[i].offset,
+                                           ranges->extents[i].length))
+                    {
+                        warn("%s: cannot store ranges", path);
+                        goto out;
+                    }
+                }
+                extents = node_extents.extents;
+            }
+            if (verbose)
+            {
+                printf("%s: %" PRIu64 " bytes in %zu extents from %s\n",
+                       path, extent_list_bytes(ranges), extent_count, options->ranges_path);
+            }
+        }
+        else
+        {
+            /* check offset alignment to the sector size */
+            if (offset % info->sector_size)
+            {
+                warnx("%s: offset %" PRIu64 " is not aligned "
+                      "to sector size %i",
+                      path, offset, info->sector_size);
+                goto out;
+            }
+
+            /* is the range end behind the end of the device ?*/
+            if (offset > node_size)
+            {
+                warnx("%s: offset is greater than device size", path);
+                goto out;
+            }
+            uint64_t end_offset = offset + length;
+            if (end_offset < offset || end_offset > node_size)
+            {
+                end_offset = node_size;
+            }
+
+            length = (step > 0) ? step : end_offset - offset;
+
+            /* check length alignment to the sector size */
+            if (length % info->sector_size)
+            {
+                warnx("%s: length %" PRIu64 " is not aligned "
+                      "to sector size %i",
+                      path, length, info->sector_size);
+                goto out;
+            }
+
+            range.offset = node_start + offset;
+            range.length = end_offset - offset;
+        }
+
+#ifdef HAVE_LIBBLKID
+        if (options->reclaim_zeros)
+        {
+            /* only blocks holding nothing but zeroes are discarded */
+        }
+        else if (force)
+        {
+            warnx("%s: Operation forced, data will be lost!", path);
+        }
+        else
+        {
+            /* Check for existing signatures on the device */
+            switch (probe_device(fd, path))
+            {
+            case 0: /* signature detected */
+                if (interactive)
+                {
+                    if (!ask_for_yn_locked(path, "This is destructive operation, data will be lost! Continue?"))
+                    {
+                        goto out;
+                    }
+                }
+                else
+                {
+                    warnx("%s: This is destructive operation, data will "
+                          "be lost! Use the -f option to override.",
+                          path);
+                    goto out;
+                }
+
+                break;
+            case 1: /* no signature */
+                break;
+            default: /* error */
+                warn("%s: Failed to probe the device.", path);
+                goto out;
+            }
+        }
 #endif /* HAVE_LIBBLKID */
+    }
+
+    if (options->skip_unmapped && extent_count > 0)
+    {
+        const unmap_extent_t *last_extent = &extents[extent_count - 1];
+        uint64_t span_start = extents[0].offset;
+        uint64_t span_end = last_extent->offset + last_extent->length;
+        extent_list_t mapped = {0};
+        sg_result_t status_result = {0};
+
+        if (!info->lbpme)
+        {
+            warnx("%s: logical block provisioning is not enabled, discarding every range", path);
+        }
+        else if (sg_get_lba_status(sgd_transport(device), info, span_start, span_end - span_start, &mapped,
+                                   &status_result))
+        {
+            char description[128];
+            if (status_result.status || status_result.host_status || status_result.driver_status)
+            {
+                warnx("%s: GET LBA STATUS failed: %s, discarding every range", path,
+                      sg_result_describe(&status_result, description, sizeof(description)));
+            }
+            else
+            {
+                warn("%s: GET LBA STATUS failed, discarding every range", path);
+            }
+        }
+        else if (extent_list_intersect(extents, extent_count, &mapped, &mapped_extents))
+        {
+            warn("%s: failed to skip unmapped ranges", path);
+            extent_list_free(&mapped);
+            goto out;
+        }
+        else
+        {
+            if (verbose)
+            {
+                printf("%s: %" PRIu64 " bytes still mapped in %zu extents\n",
+                       path, extent_list_bytes(&mapped_extents), mapped_extents.count);
+            }
+            extents = mapped_extents.extents;
+            extent_count = mapped_extents.count;
+        }
+
+        extent_list_free(&mapped);
+    }
+
+    if (verbose && info->optimal_unmap_granularity > 1)
+    {
+        printf("%s: unmap granularity %" PRIu64 " bytes, aligned at %" PRIu64 " bytes\n",
+               path, plan_granularity(info), (uint64_t)info->unmap_granularity_alignment * info->sector_size);
+    }
+
+    throttle_t throttle;
+    if (options->rate || options->idle)
+    {
+        dev_t disk = 0;
+        uint64_t start;
+        if (options->idle && sysfs_whole_disk(sgd_devno(device), &disk, &start))
+        {
+            warn("%s: cannot find the whole disk to watch", path);
+            goto out;
+        }
+        if (throttle_init(&throttle, options->rate, options->idle, disk))
+        {
+            warn("%s: cannot read the I/O statistics", path);
+            goto out;
+        }
+    }
+
+    if (options->checkpoint_path)
+    {
+        if (checkpoint_open(&checkpoint, options->checkpoint_path, serial, info->device_size, &done_extents))
+        {
+            if (errno == ESTALE)
+            {
+                warnx("%s: checkpoint was written for another device", options->checkpoint_path);
+            }
+            else
+            {
+                warn("%s: cannot use checkpoint", options->checkpoint_path);
+            }
+            goto out;
+        }
+        checkpoint_opened = true;
+
+        if (done_extents.count > 0)
+        {
+            if (extent_list_subtract(extents, extent_count, &done_extents, &remaining_extents))
+            {
+                warn("%s: failed to skip discarded ranges", path);
+                goto out;
+            }
+            if (verbose)
+            {
+                printf("%s: resuming, %" PRIu64 " bytes were discarded before\n",
+                       path, extent_list_bytes(&done_extents));
+            }
+            extents = remaining_extents.extents;
+            extent_count = remaining_extents.count;
+        }
+    }
+
+    if (progress_enabled(options))
+    {
+        uint64_t total_bytes = 0;
+        for (size_t i = 0; i < extent_count; i++)
+        {
+            total_bytes += extents[i].length;
+        }
+        start_progress(job, total_bytes);
+        report_progress(job, device, latency, PROGRESS_RUNNING);
+    }
+
+    discard_run_t run = {
+        .job = job,
+        .device = device,
+        .latency = latency,
+        .throttle = options->rate || options->idle ? &throttle : NULL,
+        .checkpoint = checkpoint_opened ? &checkpoint : NULL,
+        .tuned = options->probe_cache && serial_valid ? &tuned : NULL,
+    };
+
+    /* the probe discards some of them already, all of them are verified */
+    const unmap_extent_t *discarded_extents = extents;
+    size_t discarded_count = extent_count;
+
+    /* the probe discards the first ranges for real, only the rest is left */
+    if (options->method_auto && !method_known && !options->bench && !options->reclaim_zeros && !options->zero &&
+        info->support_unmap && info->support_write_same)
+    {
+        if (discard_probe(&run, extents, extent_count, step, descriptors, verbose, &probed_extents))
+        {
+            goto out;
+        }
+        extents = probed_extents.extents;
+        extent_count = probed_extents.count;
+    }
+
+    if (options->bench)
+    {
+        if (discard_bench(&run, extents, extent_count))
+        {
+            goto out;
+        }
+    }
+    else if (options->reclaim_zeros)
+    {
+        if ((read_fd = open_whole_disk(path, device)) < 0)
+        {
+            goto out;
+        }
+        if (discard_zeros(&run, read_fd, extents, extent_count, verbose))
+        {
+            goto out;
+        }
+    }
+    else if (discard_extents(&run, extents, extent_count, step, descriptors, verbose))
+    {
+        goto out;
+    }
+    if (options->zero && verbose && extent_count > 0)
+    {
+        static const char *const zero_methods[] = {
+            [SG_ZERO_WRITE_SAME_NDOB] = "WRITE SAME(16) with NDOB",
+            [SG_ZERO_WRITE_SAME] = "WRITE SAME(16)",
+            [SG_ZERO_WRITE] = "WRITE(16)",
+        };
+        printf("%s: zeroes written with %s\n", path, zero_methods[sgd_zero_method(device)]);
+    }
+
+    if (options->verify_samples)
+    {
+        if ((read_fd = open_whole_disk(path, device)) < 0)
+        {
+            goto out;
+        }
+        if (verify_discard(&run, read_fd, discarded_extents, discarded_count, verbose))
+        {
+            goto out;
+        }
+    }
+
+    if (run.tuned)
+    {
+        remember_device(job, device, run.tuned);
+    }
+    ret = 0;
+
+out:
+    if (read_fd >= 0 && read_fd != sgd_fd(device))
+    {
+        close(read_fd);
+    }
+    if (device)
+    {
+        report_progress(job, device, latency, ret ? PROGRESS_FAILED : PROGRESS_DONE);
+        sgd_close(device);
+    }
+    free(latency);
+    /* a finished discard needs no resume */
+    if (checkpoint_opened && checkpoint_close(&checkpoint, ret == 0))
+    {
+        warn("%s: cannot close checkpoint", options->checkpoint_path);
+    }
+    extent_list_free(&done_extents);
+    extent_list_free(&remaining_extents);
+    extent_list_free(&probed_extents);
+    extent_list_free(&table_extents);
+    extent_list_free(&node_extents);
+    /* the path of an --fstrim job lives in the fstrim state */
+    if (options->fstrim_path)
+    {
+        job->path = (char *)options->fstrim_path;
+    }
+    fstrim_close(&fstrim);
+    extent_list_free(&free_extents);
+    extent_list_free(&mapped_extents);
+    return ret;
+}
+
+static void *discard_worker(void *arg)
+{
+    discard_pool_t *pool = arg;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool->lock);
+        size_t index = pool->next_job++;
+        pthread_mutex_unlock(&pool->lock);
+        if (index >= pool->job_count)
+        {
+            break;
+        }
+
+        discard_job_t *job = &pool->jobs[index];
+        gettime_monotonic(&job->started);
+        job->status = discard_device(job) ? EXIT_FAILURE : EXIT_SUCCESS;
+        gettime_monotonic(&job->finished);
+    }
+
+    return NULL;
+}
+
+static void print_summary(const discard_job_t *jobs, size_t job_count)
+{
+    printf("\n%-24s %-8s %20s %10s\n", "DEVICE", "STATUS", "BYTES", "SECONDS");
+    for (size_t i = 0; i < job_count; i++)
+    {
+        const discard_job_t *job = &jobs[i];
+        double seconds = (job->finished.tv_sec - job->started.tv_sec) +
+                         (job->finished.tv_usec - job->started.tv_usec) / 1e6;
+        printf("%-24s %-8s %20" PRIu64 " %10.1f\n", job->path,
+               job->status == EXIT_SUCCESS ? "ok" : "failed", job->discarded_bytes, seconds);
+    }
+}
+
+/* append the partition numbers of a --partition argument */
+static void parse_partitions_or_err(const char *arg, discard_options_t *options)
+{
+    const char *p = arg;
+    while (true)
+    {
+        char *end = NULL;
+        errno = 0;
+        unsigned long number = strtoul(p, &end, 10);
+        if (errno || end == p || number == 0 || number > UINT_MAX || (*end && *end != ','))
+        {
+            errx(EXIT_FAILURE, "invalid partition list: '%s'", arg);
+        }
+
+        unsigned int *partitions = realloc(options->partitions,
+                                           (options->partition_count + 1) * sizeof(*partitions));
+        if (partitions == NULL)
+        {
+            err(EXIT_FAILURE, "cannot store partitions");
+        }
+        options->partitions = partitions;
+        options->partitions[options->partition_count++] = number;
+
+        if (*end == '\0')
+        {
+            break;
+        }
+        p = end + 1;
+    }
+}
+
+/* options without a short form */
+enum
+{
+    OPT_PROGRESS_FORMAT = CHAR_MAX + 1,
+    OPT_TEXTFILE,
+    OPT_QUIRKS,
+    OPT_PROBE_CACHE,
+    OPT_RECLAIM_ZEROS,
+    OPT_VERIFY,
+};
 
 int main(int argc, char **argv)
 {
@@ -109,41 +1954,187 @@ int main(int argc, char **argv)
         {"step", required_argument, NULL, 'p'},
         {"verbose", no_argument, NULL, 'v'},
         {"interactive", no_argument, NULL, 'i'},
+        {"queue-depth", required_argument, NULL, 'q'},
+        {"aligned-only", no_argument, NULL, 'a'},
+        {"fstrim", required_argument, NULL, 't'},
+        {"free-only", no_argument, NULL, 'F'},
+        {"gaps", no_argument, NULL, 'g'},
+        {"partition", required_argument, NULL, 'P'},
+        {"skip-unmapped", no_argument, NULL, 's'},
+        {"ranges", required_argument, NULL, 'r'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"backend", required_argument, NULL, 'b'},
+        {"bench", no_argument, NULL, 'B'},
+        {"descriptors", required_argument, NULL, 'd'},
+        {"rate", required_argument, NULL, 'R'},
+        {"checkpoint", required_argument, NULL, 'c'},
+        {"method", required_argument, NULL, 'm'},
+        {"idle", no_argument, NULL, 'I'},
+        {"progress-format", required_argument, NULL, OPT_PROGRESS_FORMAT},
+        {"textfile", required_argument, NULL, OPT_TEXTFILE},
+        {"quirks", required_argument, NULL, OPT_QUIRKS},
+        {"probe-cache", required_argument, NULL, OPT_PROBE_CACHE},
+        {"reclaim-zeros", no_argument, NULL, OPT_RECLAIM_ZEROS},
+        {"zero", no_argument, NULL, 'z'},
+        {"verify", optional_argument, NULL, OPT_VERIFY},
         {NULL, 0, NULL, 0}};
 
     setlocale(LC_ALL, "");
 
-    bool force = false;
-    bool verbose = false;
-    bool interactive = false;
-    uint64_t offset = 0;
-    uint64_t length = UINT64_MAX;
-    uint64_t step = 0;
+    discard_options_t options = {0};
+    options.length = UINT64_MAX;
+    options.method_auto = true;
+    unsigned int max_jobs = 0;
+    const char *quirks_path = NULL;
+    const char *probe_cache_path = NULL;
     int c;
-    while ((c = getopt_long(argc, argv, "hfVvio:l:p:", longopts, NULL)) != -1)
+    while ((c = getopt_long(argc, argv, "haBfFgIsVvizb:c:d:m:o:l:p:P:q:r:R:t:j:", longopts, NULL)) != -1)
     {
         switch (c)
         {
+        case 'a':
+            options.aligned_only = true;
+            break;
+        case 'b':
+            options.backend = optarg;
+            break;
+        case 'B':
+            options.bench = true;
+            break;
+        case 'c':
+            options.checkpoint_path = optarg;
+            break;
+        case 'm':
+            if (strcmp(optarg, "auto") == 0)
+            {
+                options.method_auto = true;
+            }
+            else if (strcmp(optarg, "unmap") == 0)
+            {
+                options.method_auto = false;
+                options.method = SG_DEALLOCATE_UNMAP;
+            }
+            else if (strcmp(optarg, "write-same") == 0)
+            {
+                options.method_auto = false;
+                options.method = SG_DEALLOCATE_WRITE_SAME;
+            }
+            else
+            {
+                errx(EXIT_FAILURE, "invalid method: '%s'", optarg);
+            }
+            break;
+        case 'd':
+            options.descriptors = strtosize_or_err(optarg, "failed to parse descriptors");
+            if (options.descriptors == 0 || options.descriptors > UINT16_MAX)
+            {
+                errx(EXIT_FAILURE, "descriptors must be between 1 and %d", UINT16_MAX);
+            }
+            break;
         case 'f':
-            force = true;
+            options.force = true;
+            break;
+        case 'F':
+            options.free_only = true;
+            break;
+        case 'g':
+            options.gaps = true;
+            break;
+        case 'I':
+            options.idle = true;
+            break;
+        case OPT_PROGRESS_FORMAT:
+            if (strcmp(optarg, "text") == 0)
+            {
+                options.progress_json = false;
+            }
+            else if (strcmp(optarg, "json") == 0)
+            {
+                options.progress_json = true;
+            }
+            else
+            {
+                errx(EXIT_FAILURE, "invalid progress format: '%s'", optarg);
+            }
+            break;
+        case OPT_TEXTFILE:
+            options.textfile_path = optarg;
+            break;
+        case OPT_QUIRKS:
+            quirks_path = optarg;
+            break;
+        case OPT_PROBE_CACHE:
+            probe_cache_path = optarg;
+            break;
+        case OPT_RECLAIM_ZEROS:
+            options.reclaim_zeros = true;
+            break;
+        case OPT_VERIFY:
+            options.verify_samples =
+                optarg ? strtosize_or_err(optarg, "failed to parse verify samples") : VERIFY_DEFAULT_SAMPLES;
+            if (options.verify_samples == 0)
+            {
+                errx(EXIT_FAILURE, "verify samples must be at least 1");
+            }
+            break;
+        case 'j':
+            max_jobs = strtosize_or_err(optarg, "failed to parse jobs");
+            if (max_jobs == 0)
+            {
+                errx(EXIT_FAILURE, "jobs must be at least 1");
+            }
             break;
         case 'l':
-            length = strtosize_or_err(optarg, "failed to parse length");
+            options.length = strtosize_or_err(optarg, "failed to parse length");
             break;
         case 'o':
-            offset = strtosize_or_err(optarg, "failed to parse offset");
+            options.offset = strtosize_or_err(optarg, "failed to parse offset");
             break;
         case 'p':
-            step = strtosize_or_err(optarg, "failed to parse step");
+            if (strcmp(optarg, "auto") == 0)
+            {
+                options.step_auto = true;
+                options.step = 0;
+            }
+            else
+            {
+                options.step = strtosize_or_err(optarg, "failed to parse step");
+                options.step_auto = false;
+            }
+            break;
+        case 'P':
+            parse_partitions_or_err(optarg, &options);
+            break;
+        case 'q':
+            options.queue_depth = strtosize_or_err(optarg, "failed to parse queue depth");
+            if (options.queue_depth == 0 || options.queue_depth > NVME_URING_DEPTH)
+            {
+                errx(EXIT_FAILURE, "queue depth must be between 1 and %d", NVME_URING_DEPTH);
+            }
+            break;
+        case 'r':
+            options.ranges_path = optarg;
+            break;
+        case 'R':
+            options.rate = strtosize_or_err(optarg, "failed to parse rate");
+            break;
+        case 's':
+            options.skip_unmapped = true;
+            break;
+        case 't':
+            options.fstrim_path = optarg;
             break;
         case 'v':
-            verbose = true;
+            options.verbose = true;
+            break;
+        case 'z':
+            options.zero = true;
             break;
         case 'h':
             usage(program_name);
             break;
         case 'i':
-            interactive = true;
+            options.interactive = true;
             break;
         case 'V':
             printf("%s version %d.%d", PROJECT_NAME, PROJECT_VERSION_MAJOR, PROJECT_VERSION_MINOR);
@@ -154,171 +2145,175 @@ int main(int argc, char **argv)
         }
     }
 
-    if (force)
+    if (options.force)
     {
-        interactive = false;
+        options.interactive = false;
     }
 
-    if (optind == argc)
-        errx(EXIT_FAILURE, "no device specified");
+    /*
+     * A benchmark sweeps whatever is left unset. Otherwise the devices fill
+     * it in from the probe cache and the quirks; an adaptive step packs as
+     * many pieces as its budget allows.
+     */
+    if (options.bench && options.length == UINT64_MAX)
+    {
+        options.length = 1 << 30;
+    }
 
-    char *path = argv[optind++];
+    /* only a missing default quirks file is fine */
+    size_t quirks_line;
+    if (quirk_table_load(&options.quirks, quirks_path ? quirks_path : QUIRKS_DEFAULT_PATH, &quirks_line) &&
+        (quirks_path || errno != ENOENT))
+    {
+        if (quirks_line)
+        {
+            errx(EXIT_FAILURE, "%s:%zu: invalid quirk", quirks_path ? quirks_path : QUIRKS_DEFAULT_PATH,
+                 quirks_line);
+        }
+        err(EXIT_FAILURE, "%s: cannot read quirks", quirks_path ? quirks_path : QUIRKS_DEFAULT_PATH);
+    }
 
-    if (optind != argc)
+    probe_cache_t probe_cache;
+    if (probe_cache_path)
     {
-        warnx("unexpected number of arguments");
-        errtryhelp(program_name, EXIT_FAILURE);
+        if (probe_cache_load(&probe_cache, probe_cache_path))
+        {
+            err(EXIT_FAILURE, "%s: cannot read the probe cache", probe_cache_path);
+        }
+        options.probe_cache = &probe_cache;
     }
 
-    int fd = open(path, O_RDWR | (force ? 0 : O_EXCL));
-    if (fd < 0)
+    bool partition_table = options.gaps || options.partition_count;
+    if ((options.fstrim_path != NULL) + options.free_only + (options.ranges_path != NULL) + partition_table > 1)
     {
-        err(EXIT_FAILURE, "cannot open %s", path);
+        errx(EXIT_FAILURE, "--fstrim, --free-only, --ranges and --gaps/--partition are mutually exclusive");
     }
 
-    struct stat sb;
-    if (fstat(fd, &sb) == -1)
+    size_t job_count;
+    if (options.fstrim_path)
     {
-        err(EXIT_FAILURE, "stat of %s failed", path);
+        if (optind != argc)
+        {
+            warnx("unexpected number of arguments");
+            errtryhelp(program_name, EXIT_FAILURE);
+        }
+        job_count = 1;
     }
-    if (!S_ISBLK(sb.st_mode))
+    else
     {
-        errx(EXIT_FAILURE, "%s: not a block device", path);
+        if (optind == argc)
+            errx(EXIT_FAILURE, "no device specified");
+
+        job_count = argc - optind;
     }
 
-    device_info_t info = {0};
-    if (sg_get_device_info(fd, &info))
+    /* free space is discarded whatever it holds */
+    if (options.reclaim_zeros && (options.fstrim_path || options.free_only || options.bench))
     {
-        err(EXIT_FAILURE, "%s: failed to get device info", path);
+        errx(EXIT_FAILURE, "--reclaim-zeros cannot be combined with --fstrim, --free-only or --bench");
     }
 
-    if (!info.support_unmap)
+    /* deallocated blocks need not read back as zeroes, so nothing is skipped or measured */
+    if (options.zero && (options.reclaim_zeros || options.skip_unmapped || options.bench || !options.method_auto))
     {
-        errx(EXIT_FAILURE, "%s: not support unmap", path);
+        errx(EXIT_FAILURE, "--zero cannot be combined with --reclaim-zeros, --skip-unmapped, --bench or --method");
     }
 
-    /* check offset alignment to the sector size */
-    if (offset % info.sector_size)
+    /* the blocks of a mounted filesystem or not discarded at all may hold data */
+    if (options.verify_samples && (options.fstrim_path || options.reclaim_zeros || options.bench))
     {
-        errx(EXIT_FAILURE, "%s: offset %" PRIu64 " is not aligned "
-                           "to sector size %i",
-             path, offset, info.sector_size);
+        errx(EXIT_FAILURE, "--verify cannot be combined with --fstrim, --reclaim-zeros or --bench");
     }
 
-    /* is the range end behind the end of the device ?*/
-    if (offset > info.device_size)
+    /* the journal describes a single device */
+    if (options.checkpoint_path && (job_count > 1 || options.bench))
     {
-        errx(EXIT_FAILURE, "%s: offset is greater than device size", path);
+        errx(EXIT_FAILURE, "--checkpoint needs exactly one device and no --bench");
     }
-    uint64_t end_offset = offset + length;
-    if (end_offset < offset || end_offset > info.device_size)
+
+    /* the range list is read once and shared by every device */
+    if (options.ranges_path)
     {
-        end_offset = info.device_size;
+        ranges_read_or_err(options.ranges_path, &options.ranges);
     }
 
-    length = (step > 0) ? step : end_offset - offset;
-
-    /* check length alignment to the sector size */
-    if (length % info.sector_size)
+    discard_job_t *jobs = calloc(job_count, sizeof(*jobs));
+    if (jobs == NULL)
+    {
+        err(EXIT_FAILURE, "cannot allocate jobs");
+    }
+    for (size_t i = 0; i < job_count; i++)
     {
-        errx(EXIT_FAILURE, "%s: length %" PRIu64 " is not aligned "
-                           "to sector size %i",
-             path, length, info.sector_size);
+        jobs[i].options = &options;
+        jobs[i].path = options.fstrim_path ? NULL : argv[optind + i];
+        jobs[i].status = EXIT_FAILURE;
     }
 
-    char last_char = path[strlen(path) - 1];
-    if (isdigit(last_char))
+    discard_pool_t pool = {.jobs = jobs, .job_count = job_count};
+    pthread_mutex_init(&pool.lock, NULL);
+    if (options.textfile_path && (pool.progress = calloc(job_count, sizeof(*pool.progress))) == NULL)
     {
-        if (interactive)
-        {
-            if (!ask_for_yn("Operation is applied to disk instead of partition. Continue?"))
-            {
-                exit(EXIT_FAILURE);
-            }
-        }
-        else
-        {
-            errx(EXIT_FAILURE,
-                 "Operation is applied to disk instead of partition. "
-                 "Use the -f option to override.");
-        }
+        err(EXIT_FAILURE, "cannot allocate jobs");
+    }
+    for (size_t i = 0; i < job_count; i++)
+    {
+        jobs[i].pool = &pool;
     }
 
-#ifdef HAVE_LIBBLKID
-    if (force)
+    size_t thread_count = max_jobs && max_jobs < job_count ? max_jobs : job_count;
+    if (thread_count == 1)
     {
-        warnx("Operation forced, data will be lost!");
+        discard_worker(&pool);
     }
     else
     {
-        /* Check for existing signatures on the device */
-        switch (probe_device(fd, path))
+        pthread_t *threads = calloc(thread_count, sizeof(*threads));
+        if (threads == NULL)
         {
-        case 0: /* signature detected */
-            if (interactive)
-            {
-                if (!ask_for_yn("This is destructive operation, data will be lost! Continue?"))
-                {
-                    exit(EXIT_FAILURE);
-                }
-            }
-            else
+            err(EXIT_FAILURE, "cannot allocate workers");
+        }
+        for (size_t i = 0; i < thread_count; i++)
+        {
+            if ((errno = pthread_create(&threads[i], NULL, discard_worker, &pool)))
             {
-                errx(EXIT_FAILURE,
-                     "This is destructive operation, data will "
-                     "be lost! Use the -f option to override.");
+                err(EXIT_FAILURE, "cannot start worker");
             }
-
-            break;
-        case 1: /* no signature */
-            break;
-        default: /* error */
-            err(EXIT_FAILURE, "Failed to probe the device.");
-            break;
         }
-    }
-#endif /* HAVE_LIBBLKID */
-
-    uint64_t trim_start_offset = offset;
-    uint64_t trimmed_bytes = 0;
-
-    struct timeval now = {0}, last = {0};
-    gettime_monotonic(&last);
-
-    for (/* nothing */; offset < end_offset; offset += length)
-    {
-        if (offset + length > end_offset)
+        for (size_t i = 0; i < thread_count; i++)
         {
-            length = end_offset - offset;
+            pthread_join(threads[i], NULL);
         }
+        free(threads);
+    }
 
-        if (sg_unmap(fd, &info, offset, length))
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < job_count; i++)
+    {
+        if (jobs[i].status != EXIT_SUCCESS)
         {
-            err(EXIT_FAILURE, "%s: unmap failed", path);
+            status = EXIT_FAILURE;
         }
+    }
 
-        trimmed_bytes += length;
-
-        /* reporting progress at most once per second */
-        if (verbose && step)
-        {
-            gettime_monotonic(&now);
-            if (now.tv_sec > last.tv_sec &&
-                (now.tv_usec >= last.tv_usec || now.tv_sec - last.tv_sec > 1))
-            {
-                print_stats(path, trim_start_offset, trimmed_bytes);
-                trim_start_offset += trimmed_bytes;
-                trimmed_bytes = 0;
-                last = now;
-            }
-        }
+    if (job_count > 1)
+    {
+        print_summary(jobs, job_count);
     }
 
-    if (verbose && trimmed_bytes)
+    if (options.probe_cache)
     {
-        print_stats(path, trim_start_offset, trimmed_bytes);
+        if (probe_cache_save(options.probe_cache))
+        {
+            warn("%s: cannot write the probe cache", probe_cache_path);
+        }
+        probe_cache_free(options.probe_cache);
     }
 
-    close(fd);
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.progress);
+    free(jobs);
+    quirk_table_free(&options.quirks);
+    free(options.partitions);
+    extent_list_free(&options.ranges);
+    return status;
+}
@@ -0,0 +1,806 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <err.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <locale.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "sgblkdiscard_config.h"
+#include "utils.h"
+#include "sgdiscard.h"
+#include "plan.h"
+#include "extent.h"
+#include "sysfs.h"
+#include "sense.h"
+#include "nvme.h"
+
+#define DAEMON_NAME "sgblkdiscardd"
+/* bytes merged per device before they are sent without waiting */
+#define DAEMON_DEFAULT_FLUSH_BYTES (64ULL << 20)
+/* time the first request of a batch waits for others to join it */
+#define DAEMON_DEFAULT_FLUSH_INTERVAL 100
+#define DAEMON_MAX_CLIENTS 256
+#define DAEMON_ID_LEN 64
+#define DAEMON_LINE_LEN (PATH_MAX + DAEMON_ID_LEN + 64)
+/* a client with this many replies unread is not read from until it catches up */
+#define DAEMON_REPLY_BACKLOG (1U << 20)
+
+typedef struct daemon_options
+{
+    const char *backend;
+    unsigned int queue_depth;
+    uint64_t flush_bytes;
+    /* milliseconds */
+    unsigned int flush_interval;
+    bool verbose;
+} daemon_options_t;
+
+/* a request answered once its batch is sent */
+typedef struct daemon_waiter
+{
+    uint64_t client;
+    char id[DAEMON_ID_LEN + 1];
+} daemon_waiter_t;
+
+typedef struct daemon_device
+{
+    char *path;
+    sgd_device_t *device;
+    /* where the node starts on the whole disk and how large it is */
+    uint64_t node_start;
+    uint64_t node_size;
+    unmap_extent_t *batch;
+    unsigned int descriptors;
+    /* the merged requests, sorted by offset */
+    extent_list_t pending;
+    /* bytes requested since the last flush, overlaps counted twice */
+    uint64_t pending_bytes;
+    struct timeval deadline;
+    daemon_waiter_t *waiters;
+    size_t waiter_count;
+    size_t waiter_capacity;
+} daemon_device_t;
+
+typedef struct daemon_client
+{
+    int fd;
+    /* replies find their client by serial, the slot may be reused */
+    uint64_t serial;
+    char line[DAEMON_LINE_LEN];
+    size_t line_len;
+    /* replies the socket did not take yet */
+    char *out;
+    size_t out_len;
+    size_t out_capacity;
+} daemon_client_t;
+
+typedef struct discard_daemon
+{
+    const daemon_options_t *options;
+    int listen_fd;
+    daemon_client_t clients[DAEMON_MAX_CLIENTS];
+    size_t client_count;
+    uint64_t next_serial;
+    daemon_device_t *devices;
+    size_t device_count;
+} discard_daemon_t;
+
+static volatile sig_atomic_t stop_requested;
+
+static void usage(const char *program_name)
+{
+    FILE *out = stdout;
+    fputs(USAGE_HEADER, out);
+    fprintf(out, " %s [options] <socket>\n", program_name);
+
+    fputs(USAGE_SEPARATOR, out);
+    fputs("Merge discard requests arriving on a Unix socket into large UNMAP commands.\n", out);
+    fputs("Every line a client sends, \"<id> <device> <offset> <length>\", is answered\n"
+          "with \"<id> ok\" once the commands covering it completed, or with\n"
+          "\"<id> error <reason>\". Offsets are relative to <device>, which must be\n"
+          "a SCSI or NVMe disk or a partition of one; device-mapper, md and other\n"
+          "stacked devices are answered with an error.\n", out);
+
+    fputs(USAGE_OPTIONS, out);
+    fputs(" -b, --backend <name>\n"
+          "                     sg (default), or mock[:key=value,...] to discard\n"
+          "                     an in-process emulated disk instead of <device>\n", out);
+    fputs(" -q, --queue-depth <num>\n"
+          "                     number of UNMAP commands in flight per device\n", out);
+    fputs(" -s, --flush-bytes <num>\n"
+          "                     send the requests of a device once they add up to\n"
+          "                     <num> bytes, default 64 MiB\n", out);
+    fputs(" -t, --flush-interval <ms>\n"
+          "                     send the requests of a device at most <ms>\n"
+          "                     milliseconds after the first one, default 100\n", out);
+    fputs(" -v, --verbose       print how many requests every batch merged\n", out);
+
+    fputs(USAGE_SEPARATOR, out);
+    printf(USAGE_HELP_OPTIONS(21));
+
+    fputs(USAGE_ARGUMENTS, out);
+    printf(USAGE_ARG_SIZE("<num>"));
+
+    exit(EXIT_SUCCESS);
+}
+
+static void request_stop(int signo)
+{
+    (void)signo;
+    stop_requested = 1;
+}
+
+static daemon_client_t *find_client(discard_daemon_t *daemon, uint64_t serial)
+{
+    for (size_t i = 0; i < daemon->client_count; i++)
+    {
+        if (daemon->clients[i].serial == serial)
+        {
+            return &daemon->clients[i];
+        }
+    }
+    return NULL;
+}
+
+static void drop_client(discard_daemon_t *daemon, daemon_client_t *client)
+{
+    close(client->fd);
+    free(client->out);
+    *client = daemon->clients[--daemon->client_count];
+}
+
+/*
+ * Send as many buffered replies as the socket takes.
+ * Returns	0  success
+ * 		<0 the client is gone and was dropped
+ */
+static int send_replies(discard_daemon_t *daemon, daemon_client_t *client)
+{
+    size_t sent = 0;
+    while (sent < client->out_len)
+    {
+        ssize_t len = send(client->fd, client->out + sent, client->out_len - sent, MSG_NOSIGNAL);
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len < 0 && errno == EAGAIN)
+        {
+            break;
+        }
+        if (len <= 0)
+        {
+            drop_client(daemon, client);
+            return -1;
+        }
+        sent += len;
+    }
+
+    client->out_len -= sent;
+    memmove(client->out, client->out + sent, client->out_len);
+    return 0;
+}
+
+/*
+ * Send one reply line, buffering what the socket does not take.
+ * Returns	0  success
+ * 		<0 the client is gone and was dropped
+ */
+static int reply(discard_daemon_t *daemon, daemon_client_t *client, const char *id, const char *status)
+{
+    char line[DAEMON_ID_LEN + 256];
+    int len = snprintf(line, sizeof(line), "%s %s\n", id, status);
+    if (len >= (int)sizeof(line))
+    {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    if (client->out_len + len > client->out_capacity)
+    {
+        size_t capacity = client->out_capacity ? client->out_capacity : 4096;
+        while (capacity < client->out_len + len)
+        {
+            capacity *= 2;
+        }
+        char *out = realloc(client->out, capacity);
+        if (out == NULL)
+        {
+            warn("cannot buffer replies, dropping a client");
+            drop_client(daemon, client);
+            return -1;
+        }
+        client->out = out;
+        client->out_capacity = capacity;
+    }
+    memcpy(client->out + client->out_len, line, len);
+    client->out_len += len;
+
+    return send_replies(daemon, client);
+}
+
+/* send the merged requests of a device and answer everyone who waits for them */
+static void flush_device(discard_daemon_t *daemon, daemon_device_t *device)
+{
+    const device_info_t *info = sgd_info(device->device);
+    uint64_t commands = sgd_unmap_state(device->device)->commands;
+    int ret = 0;
+
+    plan_t plan;
+    plan_init(&plan, info, device->pending.extents, device->pending.count, 0, false);
+
+    size_t batch_count = 0;
+    while (true)
+    {
+        bool more = plan_next(&plan, &device->batch[batch_count]);
+        if (more && ++batch_count < device->descriptors)
+        {
+            continue;
+        }
+        if (batch_count && sgd_submit_batch(device->device, device->batch, batch_count))
+        {
+            ret = -1;
+            break;
+        }
+        batch_count = 0;
+        if (!more)
+        {
+            break;
+        }
+    }
+    if (sgd_drain(device->device))
+    {
+        ret = -1;
+    }
+
+    char status[192] = "ok";
+    if (ret)
+    {
+        const sg_unmap_state_t *state = sgd_unmap_state(device->device);
+        char description[128];
+        snprintf(status, sizeof(status), "error %s",
+                 state->failure_valid ? sg_result_describe(&state->failure, description, sizeof(description))
+                                      : strerror(errno));
+        warnx("%s: %s", device->path, status);
+    }
+    else if (daemon->options->verbose)
+    {
+        printf("%s: %zu requests merged into %zu extents, sent with %" PRIu64 " commands\n", device->path,
+               device->waiter_count, device->pending.count, sgd_unmap_state(device->device)->commands - commands);
+        fflush(stdout);
+    }
+
+    for (size_t i = 0; i < device->waiter_count; i++)
+    {
+        daemon_client_t *client = find_client(daemon, device->waiters[i].client);
+        if (client)
+        {
+            reply(daemon, client, device->waiters[i].id, status);
+        }
+    }
+
+    device->pending.count = 0;
+    device->pending_bytes = 0;
+    device->waiter_count = 0;
+}
+
+static void close_device(daemon_device_t *device)
+{
+    sgd_close(device->device);
+    free(device->path);
+    free(device->batch);
+    free(device->waiters);
+    extent_list_free(&device->pending);
+}
+
+/*
+ * Find the device of a request, opening it on first use.
+ * Returns	the device
+ * 		NULL error, reason describes it
+ */
+static daemon_device_t *get_device(discard_daemon_t *daemon, const char *path, const char **reason)
+{
+    for (size_t i = 0; i < daemon->device_count; i++)
+    {
+        if (strcmp(daemon->devices[i].path, path) == 0)
+        {
+            return &daemon->devices[i];
+        }
+    }
+
+    daemon_device_t *devices = realloc(daemon->devices, (daemon->device_count + 1) * sizeof(*devices));
+    if (devices == NULL)
+    {
+        *reason = strerror(errno);
+        return NULL;
+    }
+    daemon->devices = devices;
+    daemon_device_t *device = &devices[daemon->device_count];
+    memset(device, 0, sizeof(*device));
+
+    /* mounted filesystems hand their freed extents over, so no exclusive open */
+    sgd_options_t device_options = {
+        .queue_depth = daemon->options->queue_depth,
+        .backend = daemon->options->backend,
+    };
+    int device_ret = sgd_open(&device->device, path, &device_options);
+    if (device_ret)
+    {
+        /* a stacked device would have its offsets unmapped on the disk below */
+        *reason = sgd_strerror(device_ret);
+        if (device_ret == SGD_ERR_NOT_DISK)
+        {
+            warnx("%s: %s, refusing its requests", path, *reason);
+        }
+        return NULL;
+    }
+
+    const device_info_t *info = sgd_info(device->device);
+    if (!info->support_unmap && !info->support_write_same)
+    {
+        *reason = "not support unmap";
+        sgd_close(device->device);
+        return NULL;
+    }
+
+    /* commands address the whole disk, a partition node only covers its part of it */
+    dev_t devno = sgd_devno(device->device);
+    dev_t disk;
+    device->node_size = info->device_size;
+    if (devno && (sysfs_whole_disk(devno, &disk, &device->node_start) ||
+                  (disk != devno && sysfs_size(devno, &device->node_size))))
+    {
+        *reason = "cannot find the whole disk";
+        sgd_close(device->device);
+        return NULL;
+    }
+
+    device->descriptors = sg_unmap_block_descriptor_limit(info);
+    device->batch = calloc(device->descriptors, sizeof(*device->batch));
+    device->path = strdup(path);
+    if (device->batch == NULL || device->path == NULL)
+    {
+        *reason = strerror(ENOMEM);
+        close_device(device);
+        return NULL;
+    }
+
+    daemon->device_count++;
+    return device;
+}
+
+/*
+ * Parse and queue one request line.
+ * Returns	0  success, the reply may still be pending
+ * 		<0 the client was dropped
+ */
+static int handle_request(discard_daemon_t *daemon, daemon_client_t *client, char *line)
+{
+    char *save = NULL;
+    char *id = strtok_r(line, " \t", &save);
+    if (id == NULL)
+    {
+        /* blank lines are fine */
+        return 0;
+    }
+
+    const char *reason = NULL;
+    char *path = strtok_r(NULL, " \t", &save);
+    char *offset_str = strtok_r(NULL, " \t", &save);
+    char *length_str = strtok_r(NULL, " \t", &save);
+    uint64_t offset, length;
+    if (strlen(id) > DAEMON_ID_LEN)
+    {
+        /* the id must not be cut, or the client could not match the reply */
+        return reply(daemon, client, "-", "error id too long");
+    }
+    if (path == NULL || length_str == NULL || strtok_r(NULL, " \t", &save) || strtosize(offset_str, &offset) ||
+        strtosize(length_str, &length))
+    {
+        return reply(daemon, client, id, "error expected <id> <device> <offset> <length>");
+    }
+
+    daemon_device_t *device = get_device(daemon, path, &reason);
+    if (device == NULL)
+    {
+        char status[192];
+        snprintf(status, sizeof(status), "error %s", reason);
+        return reply(daemon, client, id, status);
+    }
+
+    const device_info_t *info = sgd_info(device->device);
+    if (offset % info->sector_size || length % info->sector_size)
+    {
+        return reply(daemon, client, id, "error not aligned to the sector size");
+    }
+    if (offset > device->node_size || length > device->node_size - offset)
+    {
+        return reply(daemon, client, id, "error behind the end of the device");
+    }
+    if (length == 0)
+    {
+        return reply(daemon, client, id, "ok");
+    }
+
+    if (device->waiter_count == device->waiter_capacity)
+    {
+        size_t capacity = device->waiter_capacity ? device->waiter_capacity * 2 : 64;
+        daemon_waiter_t *waiters = realloc(device->waiters, capacity * sizeof(*waiters));
+        if (waiters == NULL)
+        {
+            return reply(daemon, client, id, "error out of memory");
+        }
+        device->waiters = waiters;
+        device->waiter_capacity = capacity;
+    }
+    if (extent_list_insert(&device->pending, device->node_start + offset, length))
+    {
+        return reply(daemon, client, id, "error out of memory");
+    }
+
+    daemon_waiter_t *waiter = &device->waiters[device->waiter_count++];
+    waiter->client = client->serial;
+    strcpy(waiter->id, id);
+
+    /* the first request starts the clock */
+    if (device->pending_bytes == 0)
+    {
+        struct timeval interval = {
+            .tv_sec = daemon->options->flush_interval / 1000,
+            .tv_usec = daemon->options->flush_interval % 1000 * 1000,
+        };
+        gettime_monotonic(&device->deadline);
+        timeradd(&device->deadline, &interval, &device->deadline);
+    }
+    device->pending_bytes += length;
+
+    if (device->pending_bytes >= daemon->options->flush_bytes)
+    {
+        uint64_t serial = client->serial;
+        flush_device(daemon, device);
+        /* the flush answers this client too, which may have dropped it */
+        return find_client(daemon, serial) ? 0 : -1;
+    }
+    return 0;
+}
+
+/*
+ * Read what a client sent and handle every complete line.
+ * Returns	0  success
+ * 		<0 the client was dropped
+ */
+static int read_client(discard_daemon_t *daemon, daemon_client_t *client)
+{
+    ssize_t len = read(client->fd, client->line + client->line_len, sizeof(client->line) - client->line_len);
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+        return 0;
+    }
+    if (len <= 0)
+    {
+        drop_client(daemon, client);
+        return -1;
+    }
+    client->line_len += len;
+
+    uint64_t serial = client->serial;
+    size_t start = 0;
+    char *newline;
+    while ((newline = memchr(client->line + start, '\n', client->line_len - start)) != NULL)
+    {
+        size_t end = newline - client->line;
+        *newline = '\0';
+        if (handle_request(daemon, client, client->line + start))
+        {
+            return -1;
+        }
+        /* a flush may have dropped other clients and moved this one, so the line is addressed by index */
+        client = find_client(daemon, serial);
+        start = end + 1;
+    }
+
+    client->line_len -= start;
+    memmove(client->line, client->line + start, client->line_len);
+    if (client->line_len == sizeof(client->line))
+    {
+        warnx("dropping a client sending a line of more than %zu bytes", sizeof(client->line));
+        drop_client(daemon, client);
+        return -1;
+    }
+    return 0;
+}
+
+static void accept_client(discard_daemon_t *daemon)
+{
+    int fd = accept4(daemon->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+        {
+            warn("cannot accept a client");
+        }
+        return;
+    }
+    if (daemon->client_count == DAEMON_MAX_CLIENTS)
+    {
+        warnx("more than %d clients, refusing another one", DAEMON_MAX_CLIENTS);
+        close(fd);
+        return;
+    }
+
+    daemon_client_t *client = &daemon->clients[daemon->client_count++];
+    memset(client, 0, sizeof(*client));
+    client->fd = fd;
+    client->serial = ++daemon->next_serial;
+}
+
+/* milliseconds until the next batch is due, -1 if nothing is pending */
+static int next_timeout(const discard_daemon_t *daemon)
+{
+    struct timeval now;
+    gettime_monotonic(&now);
+
+    int timeout = -1;
+    for (size_t i = 0; i < daemon->device_count; i++)
+    {
+        const daemon_device_t *device = &daemon->devices[i];
+        if (device->pending_bytes == 0)
+        {
+            continue;
+        }
+
+        struct timeval left = {0};
+        if (timercmp(&device->deadline, &now, >))
+        {
+            timersub(&device->deadline, &now, &left);
+        }
+        /* round up, waking up early only to sleep again is no use */
+        int ms = left.tv_sec * 1000 + (left.tv_usec + 999) / 1000;
+        if (timeout < 0 || ms < timeout)
+        {
+            timeout = ms;
+        }
+    }
+    return timeout;
+}
+
+static void flush_due(discard_daemon_t *daemon, bool all)
+{
+    struct timeval now;
+    gettime_monotonic(&now);
+
+    for (size_t i = 0; i < daemon->device_count; i++)
+    {
+        daemon_device_t *device = &daemon->devices[i];
+        if (device->pending_bytes && (all || !timercmp(&device->deadline, &now, >)))
+        {
+            flush_device(daemon, device);
+        }
+    }
+}
+
+/*
+ * Create the socket only the owner may connect to.
+ * Returns	>=0 the listening socket
+ * 		<0  error, errno is set
+ */
+static int listen_on(const char *path)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    /* a socket left behind by an earlier run is replaced, any other file is not */
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+
+    mode_t mask = umask(0077);
+    int ret = bind(fd, (struct sockaddr *)&address, sizeof(address));
+    umask(mask);
+    if (ret || listen(fd, SOMAXCONN))
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+static void run_daemon(discard_daemon_t *daemon, const sigset_t *wait_mask)
+{
+    struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+
+    while (!stop_requested)
+    {
+        fds[0].fd = daemon->listen_fd;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < daemon->client_count; i++)
+        {
+            const daemon_client_t *client = &daemon->clients[i];
+            fds[i + 1].fd = client->fd;
+            fds[i + 1].events = (client->out_len < DAEMON_REPLY_BACKLOG ? POLLIN : 0) | (client->out_len ? POLLOUT : 0);
+        }
+        size_t count = daemon->client_count;
+
+        /* the stop signals only arrive while waiting, so none is missed */
+        int timeout = next_timeout(daemon);
+        struct timespec wait = {.tv_sec = timeout / 1000, .tv_nsec = timeout % 1000 * 1000000L};
+        int ready = ppoll(fds, count + 1, timeout < 0 ? NULL : &wait, wait_mask);
+        if (ready < 0)
+        {
+            if (errno != EINTR)
+            {
+                warn("poll failed");
+                break;
+            }
+            continue;
+        }
+
+        /* remember the clients by serial, reading one may drop others */
+        uint64_t serials[DAEMON_MAX_CLIENTS];
+        for (size_t i = 0; i < count; i++)
+        {
+            serials[i] = daemon->clients[i].serial;
+        }
+        for (size_t i = 0; ready > 0 && i < count; i++)
+        {
+            if (fds[i + 1].revents == 0)
+            {
+                continue;
+            }
+            daemon_client_t *client = find_client(daemon, serials[i]);
+            if (client && (fds[i + 1].revents & POLLOUT) && send_replies(daemon, client))
+            {
+                continue;
+            }
+            if (client && (fds[i + 1].revents & ~POLLOUT))
+            {
+                read_client(daemon, client);
+            }
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            accept_client(daemon);
+        }
+
+        flush_due(daemon, false);
+    }
+
+    /* nothing requested is left behind */
+    flush_due(daemon, true);
+}
+
+int main(int argc, char **argv)
+{
+    const char *program_name = argv[0];
+
+    static const struct option longopts[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"version", no_argument, NULL, 'V'},
+        {"backend", required_argument, NULL, 'b'},
+        {"queue-depth", required_argument, NULL, 'q'},
+        {"flush-bytes", required_argument, NULL, 's'},
+        {"flush-interval", required_argument, NULL, 't'},
+        {"verbose", no_argument, NULL, 'v'},
+        {NULL, 0, NULL, 0}};
+
+    setlocale(LC_ALL, "");
+
+    daemon_options_t options = {
+        .queue_depth = 1,
+        .flush_bytes = DAEMON_DEFAULT_FLUSH_BYTES,
+        .flush_interval = DAEMON_DEFAULT_FLUSH_INTERVAL,
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "hVvb:q:s:t:", longopts, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'b':
+            options.backend = optarg;
+            break;
+        case 'q':
+            options.queue_depth = strtosize_or_err(optarg, "failed to parse queue depth");
+            if (options.queue_depth == 0 || options.queue_depth > NVME_URING_DEPTH)
+            {
+                errx(EXIT_FAILURE, "queue depth must be between 1 and %d", NVME_URING_DEPTH);
+            }
+            break;
+        case 's':
+            options.flush_bytes = strtosize_or_err(optarg, "failed to parse flush bytes");
+            break;
+        case 't':
+            options.flush_interval = strtosize_or_err(optarg, "failed to parse flush interval");
+            if (options.flush_interval > INT_MAX / 2)
+            {
+                errx(EXIT_FAILURE, "flush interval too long");
+            }
+            break;
+        case 'v':
+            options.verbose = true;
+            break;
+        case 'h':
+            usage(program_name);
+            break;
+        case 'V':
+            printf("%s version %d.%d", DAEMON_NAME, PROJECT_VERSION_MAJOR, PROJECT_VERSION_MINOR);
+            exit(EXIT_SUCCESS);
+            break;
+        default:
+            errtryhelp(program_name, EXIT_FAILURE);
+        }
+    }
+
+    if (optind + 1 != argc)
+    {
+        warnx(optind == argc ? "no socket specified" : "unexpected number of arguments");
+        errtryhelp(program_name, EXIT_FAILURE);
+    }
+    const char *socket_path = argv[optind];
+
+    struct sigaction action = {.sa_handler = request_stop};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    sigset_t stop_signals, wait_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop_signals, &wait_mask);
+
+    discard_daemon_t *daemon = calloc(1, sizeof(*daemon));
+    if (daemon == NULL)
+    {
+        err(EXIT_FAILURE, "cannot allocate the daemon");
+    }
+    daemon->options = &options;
+    daemon->listen_fd = listen_on(socket_path);
+    if (daemon->listen_fd < 0)
+    {
+        err(EXIT_FAILURE, "%s: cannot listen", socket_path);
+    }
+
+    run_daemon(daemon, &wait_mask);
+
+    while (daemon->client_count)
+    {
+        drop_client(daemon, &daemon->clients[0]);
+    }
+    for (size_t i = 0; i < daemon->device_count; i++)
+    {
+        close_device(&daemon->devices[i]);
+    }
+    free(daemon->devices);
+    close(daemon->listen_fd);
+    unlink(socket_path);
+    free(daemon);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,532 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sgdiscard.h"
+#include "sg_queue.h"
+#include "mock.h"
+#include "nvme.h"
+#include "sysfs.h"
+
+struct sgd_device
+{
+    int fd;
+    dev_t devno;
+    device_info_t info;
+    /* limits learned from rejected commands, shared by the queue and synchronous commands */
+    sg_unmap_state_t unmap_state;
+    sg_transport_t *transport;
+    /* scsi generic node of the sg backend, the queue runs on it */
+    sg_transport_t *queue_transport;
+    /* NVMe generic node the queue is opened on, NULL to look it up from devno */
+    char *nvme_path;
+    bool nvme;
+    sg_queue_t *queue;
+    uint8_t *parameter;
+    sg_deallocate_t method;
+    /* data-out block of synchronous WRITE SAME commands */
+    uint8_t *zero_block;
+    /* how sgd_zero() writes, settled by its first command */
+    sg_zero_t zero_method;
+    bool zero_method_valid;
+    /* data-out of every command of sgd_zero(), allocated on first use */
+    uint8_t *zero_buffer;
+    size_t zero_buffer_len;
+    histogram_t *latency;
+    bool quirk_valid;
+    quirk_t quirk;
+};
+
+static const sgd_options_t sgd_default_options = {
+    .exclusive = true,
+    .queue_depth = 1,
+};
+
+/* time the commands of a transport if the handle measures latencies */
+static sg_transport_t *sgd_measure(sgd_device_t *dev, sg_transport_t *transport)
+{
+    if (transport == NULL || dev->latency == NULL)
+    {
+        return transport;
+    }
+
+    sg_transport_t *timed = sg_transport_timed(transport, dev->latency);
+    if (timed == NULL)
+    {
+        sg_transport_close(transport);
+    }
+    return timed;
+}
+
+/* correct the limits a bridge misreports */
+static void sgd_apply_quirks(sgd_device_t *dev, const quirk_table_t *table)
+{
+    sg_inquiry_t inquiry;
+    if (sg_get_inquiry(dev->transport, &inquiry))
+    {
+        /* nothing to match against */
+        return;
+    }
+
+    uint16_t usb_vendor = 0;
+    uint16_t usb_product = 0;
+    if (dev->devno && sysfs_usb_id(dev->devno, &usb_vendor, &usb_product))
+    {
+        usb_vendor = usb_product = 0;
+    }
+
+    const quirk_t *quirk = quirk_lookup(table, &inquiry, usb_vendor, usb_product);
+    if (quirk)
+    {
+        dev->quirk = *quirk;
+        dev->quirk_valid = true;
+        quirk_apply(quirk, &dev->info);
+    }
+}
+
+static int sgd_open_mock(sgd_device_t *dev, const char *params)
+{
+    sg_mock_config_t config;
+    sg_mock_default_config(&config);
+    if (sg_mock_parse_config(params, &config))
+    {
+        return SGD_ERR_BACKEND;
+    }
+
+    sg_transport_t *transport = config.nvme ? sg_transport_nvme(nvme_mock_open(&config)) : sg_mock_open(&config);
+    if ((dev->transport = sgd_measure(dev, transport)) == NULL)
+    {
+        return SGD_ERR_OPEN;
+    }
+    dev->fd = dev->transport->fd;
+    return SGD_OK;
+}
+
+static int sgd_open_sg(sgd_device_t *dev, const char *path, const sgd_options_t *options)
+{
+    dev->fd = open(path, O_RDWR | (options->exclusive ? O_EXCL : 0));
+    if (dev->fd < 0)
+    {
+        return SGD_ERR_OPEN;
+    }
+
+    struct stat sb;
+    if (fstat(dev->fd, &sb) == -1)
+    {
+        return SGD_ERR_OPEN;
+    }
+    /* NVMe namespaces are also reachable through their generic node */
+    uint32_t nsid = nvme_namespace_id(dev->fd);
+    if (!S_ISBLK(sb.st_mode) && !(S_ISCHR(sb.st_mode) && nsid))
+    {
+        errno = ENOTBLK;
+        return SGD_ERR_NOT_BLOCK;
+    }
+    if (S_ISBLK(sb.st_mode))
+    {
+        dev->devno = sb.st_rdev;
+        int is_disk = sysfs_is_disk(dev->devno);
+        if (is_disk != 1)
+        {
+            if (is_disk == 0)
+            {
+                errno = ENODEV;
+            }
+            return SGD_ERR_NOT_DISK;
+        }
+    }
+    else if ((dev->nvme_path = strdup(path)) == NULL)
+    {
+        return SGD_ERR_NO_MEMORY;
+    }
+
+    sg_transport_t *transport;
+    if (nsid)
+    {
+        dev->nvme = true;
+        nvme_device_t *nvme = nvme_device_wrap(dev->fd, nsid);
+        if (nvme == NULL)
+        {
+            return SGD_ERR_NO_MEMORY;
+        }
+        /* the fd went with the device, Identify may still fail */
+        dev->fd = -1;
+        if ((transport = sg_transport_nvme(nvme)) == NULL)
+        {
+            nvme_device_close(nvme);
+            return SGD_ERR_DEVICE_INFO;
+        }
+    }
+    else if ((transport = sg_transport_wrap(dev->fd)) == NULL)
+    {
+        return SGD_ERR_NO_MEMORY;
+    }
+    if ((dev->transport = sgd_measure(dev, transport)) == NULL)
+    {
+        /* the fd went with the transport */
+        dev->fd = -1;
+        return SGD_ERR_NO_MEMORY;
+    }
+    dev->fd = dev->transport->fd;
+    return SGD_OK;
+}
+
+int sgd_open(sgd_device_t **device, const char *path, const sgd_options_t *options)
+{
+    if (options == NULL)
+    {
+        options = &sgd_default_options;
+    }
+
+    sgd_device_t *dev = calloc(1, sizeof(*dev));
+    if (dev == NULL)
+    {
+        return SGD_ERR_NO_MEMORY;
+    }
+
+    dev->fd = -1;
+    dev->latency = options->latency;
+
+    const char *backend = options->backend;
+    if (backend == NULL)
+    {
+        backend = getenv(SGD_BACKEND_ENV);
+    }
+    if (backend == NULL || *backend == '\0')
+    {
+        backend = "sg";
+    }
+
+    int ret;
+    if (strcmp(backend, "sg") == 0)
+    {
+        ret = sgd_open_sg(dev, path, options);
+    }
+    else if (strcmp(backend, "mock") == 0 || strncmp(backend, "mock:", 5) == 0)
+    {
+        ret = sgd_open_mock(dev, backend[4] ? backend + 5 : NULL);
+    }
+    else
+    {
+        errno = EINVAL;
+        ret = SGD_ERR_BACKEND;
+    }
+    if (ret)
+    {
+        goto err;
+    }
+
+    if (sg_get_device_info(dev->transport, &dev->info))
+    {
+        ret = SGD_ERR_DEVICE_INFO;
+        goto err;
+    }
+    sgd_apply_quirks(dev, options->quirks);
+    sg_unmap_state_init(&dev->unmap_state, &dev->info);
+    /* UNMAP unless the device only deallocates through WRITE SAME */
+    dev->method = !dev->info.support_unmap && dev->info.support_write_same ? SG_DEALLOCATE_WRITE_SAME
+                                                                          : SG_DEALLOCATE_UNMAP;
+
+    dev->parameter = malloc(SG_UNMAP_PARAMETER_LEN(sg_unmap_block_descriptor_limit(&dev->info)));
+    dev->zero_block = calloc(1, dev->info.sector_size);
+    if (dev->parameter == NULL || dev->zero_block == NULL)
+    {
+        ret = SGD_ERR_NO_MEMORY;
+        goto err;
+    }
+
+    sgd_set_queue_depth(dev, options->queue_depth);
+
+    *device = dev;
+    return SGD_OK;
+
+err:
+    {
+        int saved_errno = errno;
+        sgd_close(dev);
+        errno = saved_errno;
+    }
+    return ret;
+}
+
+int sgd_close(sgd_device_t *device)
+{
+    int ret = 0;
+    if (device->queue)
+    {
+        ret = sg_queue_close(device->queue);
+    }
+    if (device->queue_transport)
+    {
+        sg_transport_close(device->queue_transport);
+    }
+    /* the transport owns the fd once it exists */
+    if (device->transport)
+    {
+        sg_transport_close(device->transport);
+    }
+    else if (device->fd >= 0)
+    {
+        close(device->fd);
+    }
+    free(device->nvme_path);
+    free(device->parameter);
+    free(device->zero_block);
+    if (device->zero_buffer)
+    {
+        munlock(device->zero_buffer, device->zero_buffer_len);
+        free(device->zero_buffer);
+    }
+    free(device);
+    return ret;
+}
+
+const char *sgd_strerror(int code)
+{
+    switch (code)
+    {
+    case SGD_OK:
+        return "success";
+    case SGD_ERR_OPEN:
+        return "cannot open";
+    case SGD_ERR_NOT_BLOCK:
+        return "not a block device";
+    case SGD_ERR_DEVICE_INFO:
+        return "failed to get device info";
+    case SGD_ERR_NO_MEMORY:
+        return "out of memory";
+    case SGD_ERR_BACKEND:
+        return "invalid backend";
+    case SGD_ERR_NOT_DISK:
+        return "not a SCSI or NVMe disk or a partition of one";
+    default:
+        return "unknown error";
+    }
+}
+
+const device_info_t *sgd_info(const sgd_device_t *device)
+{
+    return &device->info;
+}
+
+const quirk_t *sgd_quirk(const sgd_device_t *device)
+{
+    return device->quirk_valid ? &device->quirk : NULL;
+}
+
+sg_transport_t *sgd_transport(const sgd_device_t *device)
+{
+    return device->transport;
+}
+
+int sgd_fd(const sgd_device_t *device)
+{
+    return device->fd;
+}
+
+dev_t sgd_devno(const sgd_device_t *device)
+{
+    return device->devno;
+}
+
+unsigned int sgd_queue_depth(const sgd_device_t *device)
+{
+    return device->queue ? sg_queue_depth(device->queue) : 1;
+}
+
+int sgd_set_queue_depth(sgd_device_t *device, unsigned int depth)
+{
+    int ret = 0;
+    if (device->queue)
+    {
+        ret = sg_queue_close(device->queue);
+        device->queue = NULL;
+    }
+    if (depth <= 1)
+    {
+        return ret;
+    }
+
+    /* block devices take no queued commands, their scsi or NVMe generic node does */
+    sg_transport_t *queue_transport = device->transport->depth > 0 ? device->transport : device->queue_transport;
+    char generic_path[PATH_MAX];
+    if (queue_transport == NULL && device->nvme)
+    {
+        if (device->nvme_path == NULL && nvme_generic_path(device->devno, generic_path, sizeof(generic_path)) == 0)
+        {
+            device->nvme_path = strdup(generic_path);
+        }
+        nvme_device_t *nvme = device->nvme_path ? nvme_device_open_uring(device->nvme_path) : NULL;
+        if (nvme)
+        {
+            sg_transport_t *transport = sg_transport_nvme(nvme);
+            if (transport == NULL)
+            {
+                nvme_device_close(nvme);
+            }
+            queue_transport = device->queue_transport = sgd_measure(device, transport);
+        }
+    }
+    else if (queue_transport == NULL && sg_generic_path(device->devno, generic_path, sizeof(generic_path)) == 0)
+    {
+        queue_transport = device->queue_transport = sgd_measure(device, sg_transport_open(generic_path));
+    }
+
+    if (queue_transport)
+    {
+        if (depth > queue_transport->depth)
+        {
+            depth = queue_transport->depth;
+        }
+        device->queue = sg_queue_open(queue_transport, &device->info, &device->unmap_state, depth);
+    }
+
+    return ret;
+}
+
+int sgd_submit(sgd_device_t *device, uint64_t offset, uint64_t length)
+{
+    unmap_extent_t extent = {offset, length};
+    return sgd_submit_batch(device, &extent, 1);
+}
+
+sg_deallocate_t sgd_method(const sgd_device_t *device)
+{
+    return device->method;
+}
+
+int sgd_set_method(sgd_device_t *device, sg_deallocate_t method)
+{
+    if ((method == SG_DEALLOCATE_UNMAP && !device->info.support_unmap) ||
+        (method == SG_DEALLOCATE_WRITE_SAME && !device->info.support_write_same))
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    /* commands of the old method complete first */
+    int ret = sgd_drain(device);
+    device->method = method;
+    return ret;
+}
+
+int sgd_submit_batch(sgd_device_t *device, const unmap_extent_t *extents, size_t count)
+{
+    if (device->method == SG_DEALLOCATE_WRITE_SAME)
+    {
+        if (device->queue)
+        {
+            return sg_queue_write_same_extents(device->queue, extents, count);
+        }
+        return sg_write_same_extents_buffered(device->transport, &device->info, &device->unmap_state, extents, count,
+                                              device->zero_block);
+    }
+
+    if (device->queue)
+    {
+        return sg_queue_unmap_extents(device->queue, extents, count);
+    }
+
+    return sg_unmap_extents_buffered(device->transport, &device->info, &device->unmap_state, extents, count,
+                                     device->parameter);
+}
+
+int sgd_zero(sgd_device_t *device, const unmap_extent_t *extents, size_t count)
+{
+    const device_info_t *info = &device->info;
+    if (device->zero_buffer == NULL)
+    {
+        long page_size = sysconf(_SC_PAGESIZE);
+        size_t len = device->unmap_state.zero_limit * info->sector_size;
+        if (posix_memalign((void **)&device->zero_buffer, page_size > 0 ? page_size : 4096, len))
+        {
+            device->zero_buffer = NULL;
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(device->zero_buffer, 0, len);
+        /* every command reads it, keep it resident; without the privilege it is only slower */
+        mlock(device->zero_buffer, len);
+        device->zero_buffer_len = len;
+    }
+
+    /* the first command finds the method, one transfer at most goes out synchronously */
+    while (!device->zero_method_valid && count > 0)
+    {
+        if (extents[0].length == 0)
+        {
+            extents++;
+            count--;
+            continue;
+        }
+
+        uint64_t probe_len = device->unmap_state.zero_limit * info->sector_size;
+        unmap_extent_t probe = {extents[0].offset, extents[0].length < probe_len ? extents[0].length : probe_len};
+        if (sgd_drain(device) || sg_zero_extents_buffered(device->transport, info, &device->unmap_state,
+                                                          &device->zero_method, &probe, 1, device->zero_buffer))
+        {
+            return -1;
+        }
+        device->zero_method_valid = true;
+
+        unmap_extent_t rest = {probe.offset + probe.length, extents[0].length - probe.length};
+        if (rest.length && sgd_zero(device, &rest, 1))
+        {
+            return -1;
+        }
+        extents++;
+        count--;
+    }
+
+    if (device->queue)
+    {
+        return sg_queue_zero_extents(device->queue, &device->zero_method, extents, count, device->zero_buffer);
+    }
+    return sg_zero_extents_buffered(device->transport, info, &device->unmap_state, &device->zero_method, extents, count,
+                                    device->zero_buffer);
+}
+
+sg_zero_t sgd_zero_method(const sgd_device_t *device)
+{
+    return device->zero_method;
+}
+
+const sg_unmap_state_t *sgd_unmap_state(const sgd_device_t *device)
+{
+    return &device->unmap_state;
+}
+
+void sgd_restore_limits(sgd_device_t *device, uint64_t lba_limit, uint32_t descriptor_limit,
+                        uint64_t write_same_limit)
+{
+    sg_unmap_state_t *state = &device->unmap_state;
+    if (lba_limit && lba_limit < state->lba_limit)
+    {
+        state->lba_limit = lba_limit;
+    }
+    if (descriptor_limit && descriptor_limit < state->descriptor_limit)
+    {
+        state->descriptor_limit = descriptor_limit;
+    }
+    if (write_same_limit && write_same_limit < state->write_same_limit)
+    {
+        state->write_same_limit = write_same_limit;
+    }
+}
+
+int sgd_poll(sgd_device_t *device, int timeout)
+{
+    return device->queue ? sg_queue_poll(device->queue, timeout) : 0;
+}
+
+int sgd_drain(sgd_device_t *device)
+{
+    return device->queue ? sg_queue_drain(device->queue) : 0;
+}
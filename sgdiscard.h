@@ -0,0 +1,261 @@
+#ifndef SGDISCARD_H
+#define SGDISCARD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "utils.h"
+#include "histogram.h"
+#include "quirks.h"
+
+#define SGD_OK 0
+#define SGD_ERR_OPEN -1
+#define SGD_ERR_NOT_BLOCK -2
+#define SGD_ERR_DEVICE_INFO -3
+#define SGD_ERR_NO_MEMORY -4
+#define SGD_ERR_BACKEND -5
+#define SGD_ERR_NOT_DISK -6
+
+/* environment variable naming the backend when the options do not */
+#define SGD_BACKEND_ENV "SGDISCARD_BACKEND"
+
+typedef struct sgd_device sgd_device_t;
+
+typedef struct sgd_options
+{
+    /* open the device with O_EXCL */
+    bool exclusive;
+    /* number of UNMAP commands in flight, 1 issues them synchronously */
+    unsigned int queue_depth;
+    /*
+     * "sg" for the device itself or "mock[:key=value,...]" for an
+     * in-process target, see sg_mock_parse_config(). NULL reads
+     * SGD_BACKEND_ENV and falls back to "sg". "sg" talks NVMe to NVMe
+     * namespaces, through the passthrough ioctls and io_uring on the
+     * generic node for queued commands.
+     */
+    const char *backend;
+    /* record the latency of every command in nanoseconds, NULL to not measure */
+    histogram_t *latency;
+    /* quirks read from a file, NULL for the built-in ones only, see sgd_quirk() */
+    const quirk_table_t *quirks;
+} sgd_options_t;
+
+/**
+ * @brief open a device and cache everything needed to discard it.
+ *
+ * The handle keeps the open fd, the device info and preallocated
+ * command and parameter buffers. If a queue depth above 1 cannot be
+ * honoured because there is no scsi or NVMe generic node, the handle falls back
+ * to synchronous commands; see sgd_queue_depth().
+ *
+ * Block devices must be a SCSI or NVMe disk or a partition of one, see
+ * sysfs_is_disk(). Device-mapper, md and other stacked devices pass the
+ * commands to the disk below without remapping them and are refused with
+ * SGD_ERR_NOT_DISK.
+ *
+ * With the mock backend the path only names the handle and nothing is
+ * opened.
+ *
+ * A handle must not be used by more than one thread at a time.
+ *
+ * @param device the new handle.
+ * @param path block device, or the generic node of an NVMe namespace.
+ * @param options open options, NULL for the defaults.
+ * @return SGD_OK, or one of the SGD_ERR_* codes with errno set.
+ */
+int sgd_open(sgd_device_t **device, const char *path, const sgd_options_t *options);
+
+/**
+ * @brief wait for outstanding commands and release the handle.
+ *
+ * @param device the handle.
+ * @return returns 0 if every command completed without error.
+ */
+int sgd_close(sgd_device_t *device);
+
+/**
+ * @brief describe an SGD_ERR_* code.
+ *
+ * @param code error code.
+ * @return static string.
+ */
+const char *sgd_strerror(int code);
+
+/**
+ * @brief get the cached device info.
+ *
+ * @param device the handle.
+ * @return device info, valid until the handle is closed.
+ */
+const device_info_t *sgd_info(const sgd_device_t *device);
+
+/**
+ * @brief get the quirk that corrected the device info.
+ *
+ * The quirk is picked by the INQUIRY vendor and product and the USB ids
+ * of the bridge when the handle is opened.
+ *
+ * @param device the handle.
+ * @return the quirk, NULL if none matched.
+ */
+const quirk_t *sgd_quirk(const sgd_device_t *device);
+
+/**
+ * @brief get the file descriptor of the block device.
+ *
+ * @param device the handle.
+ * @return file descriptor, owned by the handle.
+ */
+int sgd_fd(const sgd_device_t *device);
+
+/**
+ * @brief get the transport SCSI commands of the handle go through.
+ *
+ * @param device the handle.
+ * @return transport, owned by the handle.
+ */
+sg_transport_t *sgd_transport(const sgd_device_t *device);
+
+/**
+ * @brief get the device number of the block device.
+ *
+ * @param device the handle.
+ * @return device number, 0 with the mock backend or an NVMe generic node.
+ */
+dev_t sgd_devno(const sgd_device_t *device);
+
+/**
+ * @brief get the number of commands the handle keeps in flight.
+ *
+ * @param device the handle.
+ * @return queue depth, 1 when commands are synchronous.
+ */
+unsigned int sgd_queue_depth(const sgd_device_t *device);
+
+/**
+ * @brief change the number of commands the handle keeps in flight.
+ *
+ * Outstanding commands are completed first. A depth the device cannot
+ * honour is lowered, see sgd_queue_depth().
+ *
+ * @param device the handle.
+ * @param depth number of commands in flight, 1 issues them synchronously.
+ * @return returns 0 if the commands of the old queue completed without error.
+ */
+int sgd_set_queue_depth(sgd_device_t *device, unsigned int depth);
+
+/**
+ * @brief get the command areas are deallocated with.
+ *
+ * A new handle uses UNMAP, or WRITE SAME(16) with the UNMAP bit if the
+ * device supports only that.
+ *
+ * @param device the handle.
+ * @return the method.
+ */
+sg_deallocate_t sgd_method(const sgd_device_t *device);
+
+/**
+ * @brief change the command areas are deallocated with.
+ *
+ * Outstanding commands are completed first.
+ *
+ * @param device the handle.
+ * @param method the method, it must be supported by the device.
+ * @return returns 0 if there is no error, errno is EOPNOTSUPP for an unsupported method.
+ */
+int sgd_set_method(sgd_device_t *device, sg_deallocate_t method);
+
+/**
+ * @brief discard one area.
+ *
+ * With a queue the commands are only submitted; errors of earlier
+ * commands are reported by later calls, sgd_poll() or sgd_drain().
+ *
+ * @param device the handle.
+ * @param offset offset in byte.
+ * @param length length in byte.
+ * @return returns 0 if there is no error.
+ */
+int sgd_submit(sgd_device_t *device, uint64_t offset, uint64_t length);
+
+/**
+ * @brief discard a list of areas, packing them into as few commands as possible.
+ *
+ * @param device the handle.
+ * @param extents areas, offset and length in byte.
+ * @param count number of extents.
+ * @return returns 0 if there is no error.
+ */
+int sgd_submit_batch(sgd_device_t *device, const unmap_extent_t *extents, size_t count);
+
+/**
+ * @brief write zeroes to a list of areas instead of deallocating them.
+ *
+ * The first command finds the cheapest way the device takes: WRITE
+ * SAME(16) with NDOB, WRITE SAME(16) of one block of zeroes, or WRITE(16)
+ * from a page aligned zero buffer the handle shares between all its
+ * commands. Like sgd_submit_batch() the commands are only submitted
+ * with a queue.
+ *
+ * @param device the handle.
+ * @param extents areas, offset and length in byte.
+ * @param count number of extents.
+ * @return returns 0 if there is no error.
+ */
+int sgd_zero(sgd_device_t *device, const unmap_extent_t *extents, size_t count);
+
+/**
+ * @brief get the command sgd_zero() writes zeroes with.
+ *
+ * @param device the handle.
+ * @return the method, SG_ZERO_WRITE_SAME_NDOB until sgd_zero() found the one that works.
+ */
+sg_zero_t sgd_zero_method(const sgd_device_t *device);
+
+/**
+ * @brief get the command limits and the error statistics of the handle.
+ *
+ * The limits start at the ones of the device info and are lowered
+ * whenever the device rejects a command as too large. After a failed
+ * discard the decoded status of the failing command is kept here.
+ *
+ * @param device the handle.
+ * @return the state, valid until the handle is closed.
+ */
+const sg_unmap_state_t *sgd_unmap_state(const sgd_device_t *device);
+
+/**
+ * @brief start from command limits learned by an earlier handle.
+ *
+ * Limits are only ever lowered, 0 keeps the current one.
+ *
+ * @param device the handle.
+ * @param lba_limit logical blocks in one UNMAP command.
+ * @param descriptor_limit block descriptors in one UNMAP command.
+ * @param write_same_limit blocks in one WRITE SAME command.
+ */
+void sgd_restore_limits(sgd_device_t *device, uint64_t lba_limit, uint32_t descriptor_limit,
+                        uint64_t write_same_limit);
+
+/**
+ * @brief reap completed commands.
+ *
+ * @param device the handle.
+ * @param timeout milliseconds to wait for a completion, -1 for no limit.
+ * @return number of commands still in flight, -1 on error.
+ */
+int sgd_poll(sgd_device_t *device, int timeout);
+
+/**
+ * @brief wait until every submitted command has completed.
+ *
+ * @param device the handle.
+ * @return returns 0 if every command completed without error.
+ */
+int sgd_drain(sgd_device_t *device);
+
+#endif /* SGDISCARD_H */
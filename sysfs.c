@@ -0,0 +1,242 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <dirent.h>
+
+#include <sys/sysmacros.h>
+
+#include "sysfs.h"
+
+/* partition offsets and sizes in sysfs are always in 512-byte sectors */
+#define SYSFS_SECTOR_SIZE 512
+
+static int sysfs_read_file(const char *path, char *buf, size_t len)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    int ret = 0;
+    if (fgets(buf, len, file) == NULL)
+    {
+        errno = EIO;
+        ret = -1;
+    }
+    else
+    {
+        buf[strcspn(buf, "\n")] = '\0';
+    }
+
+    fclose(file);
+    return ret;
+}
+
+int sysfs_read_string(dev_t devno, const char *attr, char *buf, size_t len)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s", major(devno), minor(devno), attr);
+    return sysfs_read_file(path, buf, len);
+}
+
+/* read a 16-bit hexadecimal attribute like idVendor */
+static int sysfs_read_id(const char *dir, const char *attr, uint16_t *value)
+{
+    char path[PATH_MAX];
+    char buf[16];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, attr) >= (int)sizeof(path) ||
+        sysfs_read_file(path, buf, sizeof(buf)))
+    {
+        return -1;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long id = strtoul(buf, &end, 16);
+    if (errno || end == buf || *end || id > UINT16_MAX)
+    {
+        errno = errno ? errno : EINVAL;
+        return -1;
+    }
+    *value = id;
+    return 0;
+}
+
+int sysfs_read_u64(dev_t devno, const char *attr, uint64_t *value)
+{
+    char buf[64];
+    if (sysfs_read_string(devno, attr, buf, sizeof(buf)))
+    {
+        return -1;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    *value = strtoull(buf, &end, 10);
+    if (errno || end == buf)
+    {
+        errno = errno ? errno : EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int sysfs_size(dev_t devno, uint64_t *size)
+{
+    uint64_t sectors;
+    if (sysfs_read_u64(devno, "size", &sectors))
+    {
+        return -1;
+    }
+    *size = sectors * SYSFS_SECTOR_SIZE;
+    return 0;
+}
+
+int sysfs_whole_disk(dev_t devno, dev_t *disk, uint64_t *start)
+{
+    uint64_t sector;
+    if (sysfs_read_u64(devno, "partition", &sector))
+    {
+        /* not a partition */
+        *disk = devno;
+        *start = 0;
+        return 0;
+    }
+
+    char buf[64];
+    unsigned int disk_major, disk_minor;
+    if (sysfs_read_u64(devno, "start", &sector) ||
+        sysfs_read_string(devno, "../dev", buf, sizeof(buf)) ||
+        sscanf(buf, "%u:%u", &disk_major, &disk_minor) != 2)
+    {
+        return -1;
+    }
+
+    *disk = makedev(disk_major, disk_minor);
+    *start = sector * SYSFS_SECTOR_SIZE;
+    return 0;
+}
+
+/*
+ * Check whether a block device is built on top of others.
+ * Returns	1  it has slaves
+ * 		0  it has none
+ * 		<0 error
+ */
+static int sysfs_has_slaves(dev_t devno)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/slaves", major(devno), minor(devno));
+
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    int ret = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+        {
+            ret = 1;
+            break;
+        }
+    }
+    closedir(dir);
+    return ret;
+}
+
+int sysfs_is_disk(dev_t devno)
+{
+    dev_t disk;
+    uint64_t start;
+    if (sysfs_whole_disk(devno, &disk, &start))
+    {
+        return -1;
+    }
+
+    int slaves = sysfs_has_slaves(devno);
+    if (slaves == 0 && disk != devno)
+    {
+        slaves = sysfs_has_slaves(disk);
+    }
+    if (slaves)
+    {
+        return slaves < 0 ? -1 : 0;
+    }
+
+    /* dm, md, loop and the like have no device below them in sysfs */
+    char link[PATH_MAX];
+    char path[PATH_MAX];
+    snprintf(link, sizeof(link), "/sys/dev/block/%u:%u/device/subsystem", major(disk), minor(disk));
+    if (realpath(link, path) == NULL)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    const char *subsystem = strrchr(path, '/') + 1;
+    return strcmp(subsystem, "scsi") == 0 || strcmp(subsystem, "nvme") == 0 ||
+           strcmp(subsystem, "nvme-subsystem") == 0;
+}
+
+int sysfs_devname(dev_t devno, char *path, size_t len)
+{
+    char path_uevent[PATH_MAX];
+    snprintf(path_uevent, sizeof(path_uevent), "/sys/dev/block/%u:%u/uevent", major(devno), minor(devno));
+
+    FILE *file = fopen(path_uevent, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    int ret = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        if (strncmp(line, "DEVNAME=", 8) == 0)
+        {
+            line[strcspn(line, "\n")] = '\0';
+            ret = snprintf(path, len, "/dev/%s", line + 8) < (int)len ? 0 : -1;
+            break;
+        }
+    }
+
+    fclose(file);
+    if (ret)
+    {
+        errno = ENOENT;
+    }
+    return ret;
+}
+
+int sysfs_usb_id(dev_t devno, uint16_t *vendor, uint16_t *product)
+{
+    char link[PATH_MAX];
+    char path[PATH_MAX];
+    snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(devno), minor(devno));
+    if (realpath(link, path) == NULL)
+    {
+        return -1;
+    }
+
+    /* the USB device is one of the ancestors of the block device */
+    for (char *slash = strrchr(path, '/'); slash && slash != path; slash = strrchr(path, '/'))
+    {
+        *slash = '\0';
+        if (sysfs_read_id(path, "idVendor", vendor) == 0 && sysfs_read_id(path, "idProduct", product) == 0)
+        {
+            return 0;
+        }
+    }
+
+    errno = ENODEV;
+    return -1;
+}
@@ -0,0 +1,83 @@
+#ifndef SYSFS_H
+#define SYSFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * @brief read an attribute of a block device from sysfs.
+ *
+ * Trailing newlines are removed.
+ *
+ * @param devno device number.
+ * @param attr attribute path relative to /sys/dev/block/<major>:<minor>.
+ * @param buf buffer for the value.
+ * @param len size of the buffer.
+ * @return returns 0 if there is no error.
+ */
+int sysfs_read_string(dev_t devno, const char *attr, char *buf, size_t len);
+
+/**
+ * @brief read a numeric attribute of a block device from sysfs.
+ *
+ * @param devno device number.
+ * @param attr attribute path relative to /sys/dev/block/<major>:<minor>.
+ * @param value parsed value.
+ * @return returns 0 if there is no error.
+ */
+int sysfs_read_u64(dev_t devno, const char *attr, uint64_t *value);
+
+/**
+ * @brief get the size of a block device.
+ *
+ * @param devno device number of a disk or a partition.
+ * @param size size in byte.
+ * @return returns 0 if there is no error.
+ */
+int sysfs_size(dev_t devno, uint64_t *size);
+
+/**
+ * @brief get the whole disk a block device belongs to.
+ *
+ * @param devno device number of a disk or a partition.
+ * @param disk device number of the disk.
+ * @param start start of the partition in byte, 0 for a disk.
+ * @return returns 0 if there is no error.
+ */
+int sysfs_whole_disk(dev_t devno, dev_t *disk, uint64_t *start);
+
+/**
+ * @brief check that a block device is a SCSI or NVMe disk or a partition of one.
+ *
+ * Stacked devices like device-mapper or md pass SG_IO to the disk below
+ * without remapping the LBAs, so their offsets would address other
+ * blocks of that disk. Devices with slaves and disks not on the SCSI or
+ * NVMe bus are therefore refused.
+ *
+ * @param devno device number.
+ * @return 1 for a SCSI or NVMe disk or a partition of one, 0 for any other device, <0 on error.
+ */
+int sysfs_is_disk(dev_t devno);
+
+/**
+ * @brief get the device node of a block device.
+ *
+ * @param devno device number.
+ * @param path buffer for the path, e.g. "/dev/sdb".
+ * @param len size of the buffer.
+ * @return returns 0 if there is no error.
+ */
+int sysfs_devname(dev_t devno, char *path, size_t len);
+
+/**
+ * @brief get the ids of the USB device a block device is attached through.
+ *
+ * @param devno device number of a disk or a partition.
+ * @param vendor USB vendor id, e.g. of the bridge.
+ * @param product USB product id.
+ * @return returns 0 if there is no error, errno is ENODEV if the device is not on USB.
+ */
+int sysfs_usb_id(dev_t devno, uint16_t *vendor, uint16_t *product);
+
+#endif /* SYSFS_H */
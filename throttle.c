@@ -0,0 +1,122 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "throttle.h"
+#include "sysfs.h"
+
+/* fields of /sys/block/<dev>/stat, see Documentation/block/stat.rst */
+#define THROTTLE_STAT_READ_IOS 0
+#define THROTTLE_STAT_WRITE_IOS 4
+#define THROTTLE_STAT_IN_FLIGHT 8
+#define THROTTLE_STAT_FIELDS 9
+
+/*
+ * Count the foreground requests of the disk.
+ * UNMAP through SG_IO is a passthrough command, the block layer does
+ * not account it, so only other users of the disk show up here.
+ * Returns	0  success
+ * 		<0 error
+ */
+static int throttle_read_stat(dev_t disk, uint64_t *requests, uint64_t *in_flight)
+{
+    char buf[256];
+    if (sysfs_read_string(disk, "stat", buf, sizeof(buf)))
+    {
+        return -1;
+    }
+
+    uint64_t fields[THROTTLE_STAT_FIELDS];
+    const char *p = buf;
+    for (int i = 0; i < THROTTLE_STAT_FIELDS; i++)
+    {
+        int len;
+        if (sscanf(p, "%" SCNu64 "%n", &fields[i], &len) != 1)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        p += len;
+    }
+
+    *requests = fields[THROTTLE_STAT_READ_IOS] + fields[THROTTLE_STAT_WRITE_IOS];
+    *in_flight = fields[THROTTLE_STAT_IN_FLIGHT];
+    return 0;
+}
+
+static void throttle_sleep(double seconds)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+}
+
+int throttle_init(throttle_t *throttle, uint64_t rate, bool idle, dev_t disk)
+{
+    memset(throttle, 0, sizeof(*throttle));
+    throttle->rate = rate;
+    throttle->tokens = rate;
+    throttle->idle = idle;
+    throttle->disk = disk;
+    clock_gettime(CLOCK_MONOTONIC, &throttle->last);
+
+    uint64_t in_flight;
+    if (idle && throttle_read_stat(disk, &throttle->requests, &in_flight))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int throttle_wait(throttle_t *throttle, uint64_t bytes)
+{
+    while (throttle->idle)
+    {
+        uint64_t requests, in_flight;
+        if (throttle_read_stat(throttle->disk, &requests, &in_flight))
+        {
+            return -1;
+        }
+
+        bool busy = in_flight > 0 || requests != throttle->requests;
+        throttle->requests = requests;
+        if (!busy)
+        {
+            break;
+        }
+        throttle_sleep(THROTTLE_IDLE_POLL / 1000.0);
+    }
+
+    if (throttle->rate == 0)
+    {
+        return 0;
+    }
+
+    /* token bucket holding at most one second worth of bytes */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - throttle->last.tv_sec) + (now.tv_nsec - throttle->last.tv_nsec) / 1e9;
+    throttle->last = now;
+    throttle->tokens += elapsed * throttle->rate;
+    if (throttle->tokens > throttle->rate)
+    {
+        throttle->tokens = throttle->rate;
+    }
+
+    /* a command larger than the bucket leaves it in debt */
+    throttle->tokens -= bytes;
+    if (throttle->tokens < 0)
+    {
+        double wait = -throttle->tokens / throttle->rate;
+        throttle_sleep(wait);
+        throttle->tokens = 0;
+        clock_gettime(CLOCK_MONOTONIC, &throttle->last);
+    }
+
+    return 0;
+}
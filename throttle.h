@@ -0,0 +1,48 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* how long a busy device is left alone before it is checked again, in milliseconds */
+#define THROTTLE_IDLE_POLL 100
+
+typedef struct throttle
+{
+    /* bytes per second, 0 for no limit */
+    uint64_t rate;
+    double tokens;
+    struct timespec last;
+    /* disk whose foreground I/O pauses the discard */
+    bool idle;
+    dev_t disk;
+    uint64_t requests;
+} throttle_t;
+
+/**
+ * @brief set up the pacing of a discard.
+ *
+ * @param throttle throttle to initialize.
+ * @param rate bytes per second, 0 for no limit. Up to one second worth
+ *        of bytes may be sent in a burst.
+ * @param idle wait for the disk to be idle before every command.
+ * @param disk whole disk to watch, used if idle is set.
+ * @return returns 0 if there is no error.
+ */
+int throttle_init(throttle_t *throttle, uint64_t rate, bool idle, dev_t disk);
+
+/**
+ * @brief wait until a command of the given size may be sent.
+ *
+ * The disk counts as busy while it has foreground requests in flight
+ * or completed any since the last check.
+ *
+ * @param throttle the throttle.
+ * @param bytes size of the command.
+ * @return returns 0 if there is no error.
+ */
+int throttle_wait(throttle_t *throttle, uint64_t bytes);
+
+#endif /* THROTTLE_H */
@@ -0,0 +1,350 @@
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <scsi/sg.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "transport.h"
+
+typedef struct sg_ioctl_mapping
+{
+    /* a node opened again, every file descriptor has one reserved buffer */
+    int fd;
+    uint8_t *buffer;
+    size_t len;
+} sg_ioctl_mapping_t;
+
+typedef struct sg_ioctl_transport
+{
+    sg_transport_t transport;
+    /* the scsi generic node, NULL if the transport was wrapped around an fd */
+    char *path;
+    /* mapped reserved buffers, at most one per command in flight */
+    sg_ioctl_mapping_t mappings[SG_MAX_QUEUE];
+    unsigned int mapping_count;
+} sg_ioctl_transport_t;
+
+typedef struct sg_timed_command
+{
+    void *usr_ptr;
+    struct timespec submitted;
+    bool busy;
+} sg_timed_command_t;
+
+typedef struct sg_timed_transport
+{
+    sg_transport_t transport;
+    sg_transport_t *inner;
+    histogram_t *histogram;
+    sg_timed_command_t *commands;
+} sg_timed_transport_t;
+
+/* the file descriptor a command goes to, a mapped buffer only works on its own */
+static int sg_ioctl_fd(sg_transport_t *transport, const sg_io_hdr_t *io_hdr)
+{
+    sg_ioctl_transport_t *sg = (sg_ioctl_transport_t *)transport;
+    if (io_hdr->flags & SG_FLAG_MMAP_IO)
+    {
+        const uint8_t *data = io_hdr->dxferp;
+        for (unsigned int i = 0; i < sg->mapping_count; i++)
+        {
+            const sg_ioctl_mapping_t *mapping = &sg->mappings[i];
+            if (data >= mapping->buffer && data < mapping->buffer + mapping->len)
+            {
+                return mapping->fd;
+            }
+        }
+    }
+    return transport->fd;
+}
+
+static int sg_ioctl_execute(sg_transport_t *transport, sg_io_hdr_t *io_hdr)
+{
+    return ioctl(sg_ioctl_fd(transport, io_hdr), SG_IO, io_hdr);
+}
+
+static int sg_ioctl_submit(sg_transport_t *transport, sg_io_hdr_t *io_hdr)
+{
+    int fd = sg_ioctl_fd(transport, io_hdr);
+    ssize_t ret;
+    do
+    {
+        ret = write(fd, io_hdr, sizeof(*io_hdr));
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -1 : 0;
+}
+
+static int sg_ioctl_receive(sg_transport_t *transport, sg_io_hdr_t *io_hdr, int timeout)
+{
+    sg_ioctl_transport_t *sg = (sg_ioctl_transport_t *)transport;
+    struct pollfd pfds[1 + SG_MAX_QUEUE];
+    nfds_t count = 0;
+
+    pfds[count++] = (struct pollfd){.fd = transport->fd, .events = POLLIN};
+    for (unsigned int i = 0; i < sg->mapping_count; i++)
+    {
+        pfds[count++] = (struct pollfd){.fd = sg->mappings[i].fd, .events = POLLIN};
+    }
+
+    int ret;
+    do
+    {
+        ret = poll(pfds, count, timeout);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret <= 0)
+    {
+        return ret;
+    }
+
+    int fd = transport->fd;
+    for (nfds_t i = 0; i < count; i++)
+    {
+        if (pfds[i].revents)
+        {
+            fd = pfds[i].fd;
+            break;
+        }
+    }
+
+    memset(io_hdr, 0, sizeof(*io_hdr));
+    io_hdr->interface_id = 'S';
+    io_hdr->pack_id = -1;
+
+    ssize_t len;
+    do
+    {
+        len = read(fd, io_hdr, sizeof(*io_hdr));
+    } while (len < 0 && errno == EINTR);
+
+    return len < 0 ? -1 : 1;
+}
+
+static void *sg_ioctl_map(sg_transport_t *transport, size_t len)
+{
+    sg_ioctl_transport_t *sg = (sg_ioctl_transport_t *)transport;
+    if (sg->path == NULL || sg->mapping_count == SG_MAX_QUEUE)
+    {
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+
+    /* the driver maps whole pages of the reserved buffer */
+    long page_size = sysconf(_SC_PAGESIZE);
+    len = (len + page_size - 1) / page_size * page_size;
+    if (len > INT_MAX)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = open(sg->path, O_RDWR);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    int reserved = (int)len;
+    void *buffer = MAP_FAILED;
+    if (ioctl(fd, SG_SET_RESERVED_SIZE, &reserved) == 0 && ioctl(fd, SG_GET_RESERVED_SIZE, &reserved) == 0)
+    {
+        if ((size_t)reserved < len)
+        {
+            /* the driver caps the buffer, see /proc/scsi/sg/def_reserved_size */
+            errno = ENOMEM;
+        }
+        else
+        {
+            buffer = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+    }
+    if (buffer == MAP_FAILED)
+    {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    sg->mappings[sg->mapping_count++] = (sg_ioctl_mapping_t){fd, buffer, len};
+    return buffer;
+}
+
+static void sg_ioctl_close(sg_transport_t *transport)
+{
+    sg_ioctl_transport_t *sg = (sg_ioctl_transport_t *)transport;
+    for (unsigned int i = 0; i < sg->mapping_count; i++)
+    {
+        munmap(sg->mappings[i].buffer, sg->mappings[i].len);
+        close(sg->mappings[i].fd);
+    }
+    close(transport->fd);
+    free(sg->path);
+    free(sg);
+}
+
+static const sg_transport_ops_t sg_ioctl_ops = {
+    .name = "sg",
+    .execute = sg_ioctl_execute,
+    .submit = sg_ioctl_submit,
+    .receive = sg_ioctl_receive,
+    .map = sg_ioctl_map,
+    .close = sg_ioctl_close,
+};
+
+sg_transport_t *sg_transport_wrap(int fd)
+{
+    sg_ioctl_transport_t *sg = calloc(1, sizeof(*sg));
+    if (sg == NULL)
+    {
+        return NULL;
+    }
+
+    sg->transport.ops = &sg_ioctl_ops;
+    sg->transport.fd = fd;
+    return &sg->transport;
+}
+
+sg_transport_t *sg_transport_open(const char *path)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    sg_transport_t *transport = sg_transport_wrap(fd);
+    if (transport == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    sg_ioctl_transport_t *sg = (sg_ioctl_transport_t *)transport;
+    if ((sg->path = strdup(path)) == NULL)
+    {
+        sg_transport_close(transport);
+        return NULL;
+    }
+    transport->depth = SG_MAX_QUEUE;
+    return transport;
+}
+
+static uint64_t sg_timed_elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+}
+
+static int sg_timed_execute(sg_transport_t *transport, sg_io_hdr_t *io_hdr)
+{
+    sg_timed_transport_t *timed = (sg_timed_transport_t *)transport;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = sg_transport_execute(timed->inner, io_hdr);
+    histogram_record(timed->histogram, sg_timed_elapsed(&start));
+    return ret;
+}
+
+static int sg_timed_submit(sg_transport_t *transport, sg_io_hdr_t *io_hdr)
+{
+    sg_timed_transport_t *timed = (sg_timed_transport_t *)transport;
+    sg_timed_command_t *command = NULL;
+    for (unsigned int i = 0; i < transport->depth; i++)
+    {
+        if (!timed->commands[i].busy)
+        {
+            command = &timed->commands[i];
+            break;
+        }
+    }
+    if (command == NULL)
+    {
+        /* every slot is in flight, like a full reader queue */
+        errno = EBUSY;
+        return -1;
+    }
+
+    /* the completion finds its submission time through usr_ptr */
+    sg_io_hdr_t timed_io_hdr = *io_hdr;
+    timed_io_hdr.usr_ptr = command;
+    command->usr_ptr = io_hdr->usr_ptr;
+    clock_gettime(CLOCK_MONOTONIC, &command->submitted);
+
+    int ret = sg_transport_submit(timed->inner, &timed_io_hdr);
+    if (ret == 0)
+    {
+        command->busy = true;
+    }
+    return ret;
+}
+
+static int sg_timed_receive(sg_transport_t *transport, sg_io_hdr_t *io_hdr, int timeout)
+{
+    sg_timed_transport_t *timed = (sg_timed_transport_t *)transport;
+    int ret = sg_transport_receive(timed->inner, io_hdr, timeout);
+    if (ret == 1)
+    {
+        sg_timed_command_t *command = io_hdr->usr_ptr;
+        histogram_record(timed->histogram, sg_timed_elapsed(&command->submitted));
+        io_hdr->usr_ptr = command->usr_ptr;
+        command->busy = false;
+    }
+    return ret;
+}
+
+static void *sg_timed_map(sg_transport_t *transport, size_t len)
+{
+    sg_timed_transport_t *timed = (sg_timed_transport_t *)transport;
+    return sg_transport_map(timed->inner, len);
+}
+
+static void sg_timed_close(sg_transport_t *transport)
+{
+    sg_timed_transport_t *timed = (sg_timed_transport_t *)transport;
+    sg_transport_close(timed->inner);
+    free(timed->commands);
+    free(timed);
+}
+
+static const sg_transport_ops_t sg_timed_ops = {
+    .name = "timed",
+    .execute = sg_timed_execute,
+    .submit = sg_timed_submit,
+    .receive = sg_timed_receive,
+    .map = sg_timed_map,
+    .close = sg_timed_close,
+};
+
+sg_transport_t *sg_transport_timed(sg_transport_t *inner, histogram_t *histogram)
+{
+    sg_timed_transport_t *timed = calloc(1, sizeof(*timed));
+    if (timed == NULL)
+    {
+        return NULL;
+    }
+
+    timed->transport.ops = &sg_timed_ops;
+    timed->transport.fd = inner->fd;
+    timed->transport.depth = inner->depth;
+    timed->inner = inner;
+    timed->histogram = histogram;
+    if (inner->depth > 0 && (timed->commands = calloc(inner->depth, sizeof(*timed->commands))) == NULL)
+    {
+        free(timed);
+        return NULL;
+    }
+
+    return &timed->transport;
+}
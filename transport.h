@@ -0,0 +1,151 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <scsi/sg.h>
+
+#include "histogram.h"
+
+/* the C library's <scsi/sg.h> lags behind the kernel's */
+#ifndef SG_FLAG_MMAP_IO
+#define SG_FLAG_MMAP_IO 0x20
+#endif
+
+typedef struct sg_transport sg_transport_t;
+
+typedef struct sg_transport_ops
+{
+    const char *name;
+    /* run one command to completion, like the SG_IO ioctl */
+    int (*execute)(sg_transport_t *transport, sg_io_hdr_t *io_hdr);
+    /* start one command, like write() on a scsi generic node */
+    int (*submit)(sg_transport_t *transport, sg_io_hdr_t *io_hdr);
+    /* collect one completed command, like poll() and read() on a scsi generic node */
+    int (*receive)(sg_transport_t *transport, sg_io_hdr_t *io_hdr, int timeout);
+    /* map a buffer commands flagged SG_FLAG_MMAP_IO transfer from, NULL if there is none */
+    void *(*map)(sg_transport_t *transport, size_t len);
+    void (*close)(sg_transport_t *transport);
+} sg_transport_ops_t;
+
+struct sg_transport
+{
+    const sg_transport_ops_t *ops;
+    /* file descriptor for everything that is not a SCSI command, e.g. pread() */
+    int fd;
+    /* number of commands that may be submitted at once, 0 if only execute works */
+    unsigned int depth;
+};
+
+/**
+ * @brief issue SCSI commands with the SG_IO ioctl on an open file descriptor.
+ *
+ * The transport takes over the file descriptor and closes it. It has
+ * no queue, only sg_transport_execute() is used on it.
+ *
+ * @param fd block device or scsi generic node.
+ * @return the transport, NULL on error.
+ */
+sg_transport_t *sg_transport_wrap(int fd);
+
+/**
+ * @brief open a scsi generic node for synchronous and queued commands.
+ *
+ * The transport can map reserved buffers, see sg_transport_map().
+ *
+ * @param path scsi generic node, e.g. "/dev/sg2".
+ * @return the transport, NULL on error.
+ */
+sg_transport_t *sg_transport_open(const char *path);
+
+/**
+ * @brief record the latency of every command of another transport.
+ *
+ * Queued commands are timed from submission to their completion.
+ *
+ * @param inner the transport to measure, owned by the new transport on success.
+ * @param histogram latencies in nanoseconds are recorded here, it must
+ *        outlive the transport.
+ * @return the transport, NULL on error.
+ */
+sg_transport_t *sg_transport_timed(sg_transport_t *inner, histogram_t *histogram);
+
+/**
+ * @brief run one command to completion.
+ *
+ * @param transport the transport.
+ * @param io_hdr command, status and sense are filled in on return.
+ * @return returns 0 if the command was delivered, the SCSI status is in io_hdr.
+ */
+static inline int sg_transport_execute(sg_transport_t *transport, sg_io_hdr_t *io_hdr)
+{
+    return transport->ops->execute(transport, io_hdr);
+}
+
+/**
+ * @brief start one command without waiting for it.
+ *
+ * The header is copied, but the buffers it points to must stay valid
+ * until the command is received.
+ *
+ * @param transport the transport, its depth must not be 0.
+ * @param io_hdr command.
+ * @return returns 0 if there is no error.
+ */
+static inline int sg_transport_submit(sg_transport_t *transport, sg_io_hdr_t *io_hdr)
+{
+    return transport->ops->submit(transport, io_hdr);
+}
+
+/**
+ * @brief collect one completed command.
+ *
+ * @param transport the transport.
+ * @param io_hdr filled with the header of the completed command,
+ *        including its usr_ptr.
+ * @param timeout milliseconds to wait, -1 for no limit.
+ * @return 1 if a command completed, 0 on timeout, -1 on error.
+ */
+static inline int sg_transport_receive(sg_transport_t *transport, sg_io_hdr_t *io_hdr, int timeout)
+{
+    return transport->ops->receive(transport, io_hdr, timeout);
+}
+
+/**
+ * @brief map a buffer the driver transfers from without copying.
+ *
+ * On a scsi generic node this is the reserved buffer of another open
+ * file descriptor of the node. A command whose dxferp points into the
+ * buffer and has SG_FLAG_MMAP_IO set in its flags goes through that
+ * file descriptor, and the kernel reads the data where it was written.
+ * Only one command per buffer may be in flight.
+ *
+ * @param transport the transport.
+ * @param len size of the buffer in byte.
+ * @return the buffer, valid until the transport is closed; NULL with
+ *         errno set if the transport cannot map one.
+ */
+static inline void *sg_transport_map(sg_transport_t *transport, size_t len)
+{
+    if (transport->ops->map == NULL)
+    {
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+    return transport->ops->map(transport, len);
+}
+
+/**
+ * @brief release the transport.
+ *
+ * Commands still in flight are abandoned.
+ *
+ * @param transport the transport.
+ */
+static inline void sg_transport_close(sg_transport_t *transport)
+{
+    transport->ops->close(transport);
+}
+
+#endif /* TRANSPORT_H */
@@ -11,11 +11,11 @@
 #include <scsi/sg.h>
 #include <fcntl.h>
 #include <linux/fs.h>
-#include <sys/ioctl.h>
 #include <time.h>
 #include <inttypes.h>
 
 #include "utils.h"
+#include "byteorder.h"
 
 static int do_scale_by_power(uint64_t *x, int base, int power)
 {
@@ -197,57 +197,33 @@ err:
     return rc;
 }
 
-static inline void u16_to_big_endian_bytes(uint16_t val, void *p)
-{
-    ((uint8_t *)p)[0] = (uint8_t)(val >> 8);
-    ((uint8_t *)p)[1] = (uint8_t)val;
-}
-
-static inline void u32_to_big_endian_bytes(uint32_t val, void *p)
-{
-    u16_to_big_endian_bytes(val >> 16, p);
-    u16_to_big_endian_bytes(val, (uint8_t *)p + 2);
-}
-
-static inline void u64_to_big_endian_bytes(uint64_t val, void *p)
-{
-    u32_to_big_endian_bytes(val >> 32, p);
-    u32_to_big_endian_bytes(val, (uint8_t *)p + 4);
-}
-
-static inline uint16_t u16_from_big_endian_bytes(const void *p)
-{
-    return ((const uint8_t *)p)[0] << 8 | ((const uint8_t *)p)[1];
-}
-
-static inline uint32_t u32_from_big_endian_bytes(const void *p)
-{
-    return (uint32_t)u16_from_big_endian_bytes(p) << 16 |
-           u16_from_big_endian_bytes((const uint8_t *)p + 2);
-}
-
-static inline uint64_t u64_from_big_endian_bytes(const void *p)
-{
-    return (uint64_t)u32_from_big_endian_bytes(p) << 32 |
-           u32_from_big_endian_bytes((const uint8_t *)p + 4);
-}
-
-#define SG_TIMEOUT 60000
 #define SG_INQUIRY_CMD 0x12
 #define SG_INQUIRY_CMD_LEN 6
+/* vendor, product and revision end at byte 36 */
+#define SG_STANDARD_INQUIRY_LEN 36
 #define SG_READ_CAPACITY16_CMD 0x9e
 #define SG_READ_CAPACITY16_CMD_LEN 16
 #define SG_READ_CAPACITY16_SERVICE_ACTION 0x10
 #define SG_READ_CAPACITY16_REPLY_LEN 32
+#define SG_UNIT_SERIAL_NUMBER_VPD_PAGE_CODE 0x80
+#define SG_UNIT_SERIAL_NUMBER_VPD_PAGE_LEN 256
 #define SG_BLOCK_LIMITS_VPD_PAGE_CODE 0xb0
 #define SG_BLOCK_LIMITS_VPD_PAGE_LEN 64
+#define SG_LOGICAL_BLOCK_PROVISIONING_VPD_PAGE_CODE 0xb2
+#define SG_LOGICAL_BLOCK_PROVISIONING_VPD_PAGE_LEN 8
+#define SG_WRITE_SAME16_CMD 0x93
+#define SG_WRITE_SAME_UNMAP 0x08
+#define SG_WRITE_SAME_NDOB 0x01
+#define SG_WRITE16_CMD 0x8a
+/* CDB byte of the NUMBER OF LOGICAL BLOCKS of WRITE SAME(16) and WRITE(16) */
+#define SG_ZERO_BLOCKS_OFFSET 10
 #define SG_UNMAP_CMD 0x42
-#define SG_UNMAP_CMD_LEN 10
-#define SG_UNMAP_PARAMETER_LEN (8 + 16) // length info + block descriptor
+// the parameter list length field of the UNMAP CDB is 16 bits wide
+#define SG_UNMAP_MAX_BLOCK_DESCRIPTORS ((UINT16_MAX - SG_UNMAP_PARAMETER_HEADER_LEN) / SG_UNMAP_BLOCK_DESCRIPTOR_LEN)
 
-static int sg_read_capacity16(int fd, device_info_t *info)
+static int sg_read_capacity16(sg_transport_t *transport, device_info_t *info)
 {
-    uint8_t sense_buffer[UINT8_MAX] = {0};
+    uint8_t sense_buffer[SG_SENSE_BUFFER_LEN] = {0};
     sg_io_hdr_t io_hdr;
     uint8_t command[SG_READ_CAPACITY16_CMD_LEN] = {SG_READ_CAPACITY16_CMD, SG_READ_CAPACITY16_SERVICE_ACTION};
     uint8_t reply[SG_READ_CAPACITY16_REPLY_LEN] = {0};
@@ -263,22 +239,23 @@ static int sg_read_capacity16(int fd, device_info_t *info)
     io_hdr.mx_sb_len = sizeof(sense_buffer);
     io_hdr.timeout = SG_TIMEOUT;
 
-    int ret = ioctl(fd, SG_IO, &io_hdr);
-    if (ret)
+    if (sg_execute_retry(transport, &io_hdr, NULL, NULL) != SG_DISPOSITION_OK)
     {
-        return ret;
+        return -1;
     }
 
     info->last_block_address = u64_from_big_endian_bytes(reply);
     info->sector_size = u32_from_big_endian_bytes(reply + 8);
     info->device_size = (info->last_block_address + 1) * info->sector_size;
+    info->lbpme = reply[14] & 0x80;
+    info->lbprz = reply[14] & 0x40;
 
-    return ret;
+    return 0;
 }
 
-static int sg_inquiry_limits_vdp(int fd, device_info_t *info)
+static int sg_inquiry_limits_vdp(sg_transport_t *transport, device_info_t *info)
 {
-    uint8_t sense_buffer[UINT8_MAX] = {0};
+    uint8_t sense_buffer[SG_SENSE_BUFFER_LEN] = {0};
     sg_io_hdr_t io_hdr;
     uint8_t command[SG_INQUIRY_CMD_LEN] = {SG_INQUIRY_CMD, 1, SG_BLOCK_LIMITS_VPD_PAGE_CODE};
     uint8_t reply[SG_BLOCK_LIMITS_VPD_PAGE_LEN] = {0};
@@ -294,10 +271,9 @@ static int sg_inquiry_limits_vdp(int fd, device_info_t *info)
     io_hdr.mx_sb_len = sizeof(sense_buffer);
     io_hdr.timeout = SG_TIMEOUT;
 
-    int ret = ioctl(fd, SG_IO, &io_hdr);
-    if (ret)
+    if (sg_execute_retry(transport, &io_hdr, NULL, NULL) != SG_DISPOSITION_OK)
     {
-        return ret;
+        return -1;
     }
 
     info->maximum_transfer_length = u32_from_big_endian_bytes(reply + 8);
@@ -305,36 +281,173 @@ static int sg_inquiry_limits_vdp(int fd, device_info_t *info)
     info->maximum_unmap_lba_count = u32_from_big_endian_bytes(reply + 20);
     info->maximum_unmap_block_descriptor_count = u32_from_big_endian_bytes(reply + 24);
     info->optimal_unmap_granularity = u32_from_big_endian_bytes(reply + 28);
-    info->support_unmap = info->maximum_unmap_lba_count != 0;
+    /* UNMAP GRANULARITY ALIGNMENT is only meaningful if UGAVALID is set */
+    info->unmap_granularity_alignment = (reply[32] & 0x80) ? u32_from_big_endian_bytes(reply + 32) & 0x7fffffff : 0;
+    info->maximum_write_same_length = u64_from_big_endian_bytes(reply + 36);
 
-    return ret;
+    return 0;
 }
 
-static int sg_unmap_scsi(int fd, uint64_t offset_lba, uint64_t length_lba)
+static int sg_inquiry_provisioning_vpd(sg_transport_t *transport, device_info_t *info)
 {
-    uint8_t sense_buffer[UINT8_MAX] = {0};
+    uint8_t sense_buffer[SG_SENSE_BUFFER_LEN] = {0};
     sg_io_hdr_t io_hdr;
-    uint8_t unmap_command[SG_UNMAP_CMD_LEN] = {SG_UNMAP_CMD};
-    u16_to_big_endian_bytes(SG_UNMAP_PARAMETER_LEN, unmap_command + 7);
-    uint8_t parameter[SG_UNMAP_PARAMETER_LEN] = {0};
+    uint8_t command[SG_INQUIRY_CMD_LEN] = {SG_INQUIRY_CMD, 1, SG_LOGICAL_BLOCK_PROVISIONING_VPD_PAGE_CODE};
+    uint8_t reply[SG_LOGICAL_BLOCK_PROVISIONING_VPD_PAGE_LEN] = {0};
+    u16_to_big_endian_bytes(sizeof(reply), command + 3);
     memset(&io_hdr, 0, sizeof(io_hdr));
     io_hdr.interface_id = 'S';
-    io_hdr.dxfer_direction = SG_DXFER_TO_DEV;
-    io_hdr.cmd_len = SG_UNMAP_CMD_LEN;
-    io_hdr.mx_sb_len = sizeof(sense_buffer);
-    io_hdr.iovec_count = 0;
-    io_hdr.dxfer_len = sizeof(parameter);
-    io_hdr.dxferp = parameter;
-    io_hdr.cmdp = unmap_command;
+    io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+    io_hdr.cmdp = command;
+    io_hdr.cmd_len = SG_INQUIRY_CMD_LEN;
+    io_hdr.dxferp = reply;
+    io_hdr.dxfer_len = sizeof(reply);
     io_hdr.sbp = sense_buffer;
+    io_hdr.mx_sb_len = sizeof(sense_buffer);
     io_hdr.timeout = SG_TIMEOUT;
 
-    u16_to_big_endian_bytes(SG_UNMAP_PARAMETER_LEN - 2, parameter);
-    u16_to_big_endian_bytes(SG_UNMAP_PARAMETER_LEN - 8, parameter + 2);
-    u64_to_big_endian_bytes(offset_lba, parameter + 8);
-    u32_to_big_endian_bytes(length_lba, parameter + 16);
+    if (sg_execute_retry(transport, &io_hdr, NULL, NULL) != SG_DISPOSITION_OK ||
+        reply[1] != SG_LOGICAL_BLOCK_PROVISIONING_VPD_PAGE_CODE)
+    {
+        return -1;
+    }
+
+    info->lbp_valid = true;
+    info->lbpu = reply[5] & 0x80;
+    info->lbpws = reply[5] & 0x40;
+    info->lbpws10 = reply[5] & 0x20;
+
+    return 0;
+}
+
+void sg_unmap_prepare(sg_io_hdr_t *io_hdr, uint8_t *command, uint8_t *sense_buffer,
+                      uint8_t *parameter, uint32_t block_descriptor_count)
+{
+    memset(command, 0, SG_UNMAP_CMD_LEN);
+    command[0] = SG_UNMAP_CMD;
+    memset(io_hdr, 0, sizeof(*io_hdr));
+    io_hdr->interface_id = 'S';
+    io_hdr->dxfer_direction = SG_DXFER_TO_DEV;
+    io_hdr->cmd_len = SG_UNMAP_CMD_LEN;
+    io_hdr->mx_sb_len = SG_SENSE_BUFFER_LEN;
+    io_hdr->iovec_count = 0;
+    io_hdr->dxferp = parameter;
+    io_hdr->cmdp = command;
+    io_hdr->sbp = sense_buffer;
+    io_hdr->timeout = SG_TIMEOUT;
+
+    memset(parameter + 4, 0, SG_UNMAP_PARAMETER_HEADER_LEN - 4);
+    sg_unmap_patch(io_hdr, block_descriptor_count);
+}
+
+void sg_unmap_patch(sg_io_hdr_t *io_hdr, uint32_t block_descriptor_count)
+{
+    uint16_t parameter_len = SG_UNMAP_PARAMETER_LEN(block_descriptor_count);
+    uint8_t *parameter = io_hdr->dxferp;
+
+    u16_to_big_endian_bytes(parameter_len, io_hdr->cmdp + 7);
+    io_hdr->dxfer_len = parameter_len;
+    u16_to_big_endian_bytes(parameter_len - 2, parameter);
+    u16_to_big_endian_bytes(parameter_len - SG_UNMAP_PARAMETER_HEADER_LEN, parameter + 2);
+}
 
-    return ioctl(fd, SG_IO, &io_hdr);
+void sg_write_same_prepare(sg_io_hdr_t *io_hdr, uint8_t *command, uint8_t *sense_buffer, const uint8_t *block,
+                           uint32_t sector_size, uint64_t lba, uint32_t blocks)
+{
+    memset(command, 0, SG_WRITE_SAME16_CMD_LEN);
+    command[0] = SG_WRITE_SAME16_CMD;
+    command[1] = SG_WRITE_SAME_UNMAP;
+    memset(io_hdr, 0, sizeof(*io_hdr));
+    io_hdr->interface_id = 'S';
+    io_hdr->dxfer_direction = SG_DXFER_TO_DEV;
+    io_hdr->cmd_len = SG_WRITE_SAME16_CMD_LEN;
+    io_hdr->mx_sb_len = SG_SENSE_BUFFER_LEN;
+    io_hdr->dxfer_len = sector_size;
+    /* the device only reads the block */
+    io_hdr->dxferp = (void *)block;
+    io_hdr->cmdp = command;
+    io_hdr->sbp = sense_buffer;
+    io_hdr->timeout = SG_TIMEOUT;
+
+    sg_write_same_patch(io_hdr, lba, blocks);
+}
+
+void sg_write_same_patch(sg_io_hdr_t *io_hdr, uint64_t lba, uint32_t blocks)
+{
+    u64_to_big_endian_bytes(lba, io_hdr->cmdp + 2);
+    u32_to_big_endian_bytes(blocks, io_hdr->cmdp + 10);
+}
+
+void sg_zero_prepare(sg_io_hdr_t *io_hdr, uint8_t *command, uint8_t *sense_buffer, sg_zero_t method,
+                     const uint8_t *buffer, uint32_t sector_size, uint64_t lba, uint32_t blocks)
+{
+    memset(command, 0, SG_WRITE16_CMD_LEN);
+    command[0] = method == SG_ZERO_WRITE ? SG_WRITE16_CMD : SG_WRITE_SAME16_CMD;
+    command[1] = method == SG_ZERO_WRITE_SAME_NDOB ? SG_WRITE_SAME_NDOB : 0;
+    memset(io_hdr, 0, sizeof(*io_hdr));
+    io_hdr->interface_id = 'S';
+    io_hdr->cmd_len = SG_WRITE16_CMD_LEN;
+    io_hdr->mx_sb_len = SG_SENSE_BUFFER_LEN;
+    io_hdr->cmdp = command;
+    io_hdr->sbp = sense_buffer;
+    io_hdr->timeout = SG_TIMEOUT;
+
+    switch (method)
+    {
+    case SG_ZERO_WRITE_SAME_NDOB:
+        io_hdr->dxfer_direction = SG_DXFER_NONE;
+        break;
+    case SG_ZERO_WRITE_SAME:
+        io_hdr->dxfer_direction = SG_DXFER_TO_DEV;
+        io_hdr->dxfer_len = sector_size;
+        break;
+    case SG_ZERO_WRITE:
+        io_hdr->dxfer_direction = SG_DXFER_TO_DEV;
+        io_hdr->dxfer_len = blocks * sector_size;
+        break;
+    }
+    /* the device only reads the buffer */
+    io_hdr->dxferp = io_hdr->dxfer_len ? (void *)buffer : NULL;
+
+    /* both CDBs keep the LBA and the number of blocks in the same place */
+    sg_write_same_patch(io_hdr, lba, blocks);
+}
+
+uint64_t sg_zero_limit(const sg_unmap_state_t *state, sg_zero_t method)
+{
+    return method == SG_ZERO_WRITE ? state->zero_limit : state->write_same_limit;
+}
+
+int sg_zero_state_shrink(sg_unmap_state_t *state, sg_zero_t method, uint64_t blocks)
+{
+    if (blocks <= 1)
+    {
+        return -1;
+    }
+
+    if (method == SG_ZERO_WRITE)
+    {
+        state->zero_limit = blocks / 2;
+    }
+    else
+    {
+        state->write_same_limit = blocks / 2;
+    }
+    return 0;
+}
+
+static inline void sg_unmap_set_block_descriptor(uint8_t *parameter, uint32_t index,
+                                                 uint64_t offset_lba, uint32_t length_lba)
+{
+    uint8_t *descriptor = parameter + SG_UNMAP_PARAMETER_HEADER_LEN + index * SG_UNMAP_BLOCK_DESCRIPTOR_LEN;
+    u64_to_big_endian_bytes(offset_lba, descriptor);
+    u32_to_big_endian_bytes(length_lba, descriptor + 8);
+    memset(descriptor + 12, 0, SG_UNMAP_BLOCK_DESCRIPTOR_LEN - 12);
+}
+
+int strtosize(const char *str, uint64_t *result)
+{
+    return parse_size(str, result, NULL) ? -1 : 0;
 }
 
 uint64_t strtosize_or_err(const char *str, const char *errmesg)
@@ -350,59 +463,559 @@ uint64_t strtosize_or_err(const char *str, const char *errmesg)
     errx(EXIT_FAILURE, "%s: '%s'", errmesg, str);
 }
 
-int sg_get_device_info(int fd, device_info_t *info)
+int sg_get_device_info(sg_transport_t *transport, device_info_t *info)
 {
     if (info == NULL)
     {
         return -1;
     }
 
-    int ret = 0;
-    if ((ret = sg_read_capacity16(fd, info)) || (ret = sg_inquiry_limits_vdp(fd, info)))
+    memset(info, 0, sizeof(*info));
+    if (sg_read_capacity16(transport, info))
     {
-        return ret;
+        return -1;
     }
 
-    return ret;
+    /*
+     * Both pages are optional, bridges that only pass WRITE SAME through
+     * often lack the Block Limits page. A missing page leaves its fields 0.
+     */
+    sg_inquiry_limits_vdp(transport, info);
+    sg_inquiry_provisioning_vpd(transport, info);
+
+    /* without the provisioning page the block limits are all there is to go by */
+    info->support_unmap = info->maximum_unmap_lba_count != 0 && (!info->lbp_valid || info->lbpu);
+    info->support_write_same = info->lbpws;
+
+    return 0;
 }
 
-int sg_unmap(int fd, const device_info_t *info, uint64_t offset, uint64_t length)
+int sg_get_serial(sg_transport_t *transport, char *serial, size_t len)
 {
-    uint64_t offset_lba = offset / info->sector_size;
-    uint64_t length_lba = length / info->sector_size;
-    uint32_t maximum_unmap_lba_count = info->maximum_unmap_lba_count;
+    uint8_t sense_buffer[SG_SENSE_BUFFER_LEN] = {0};
+    sg_io_hdr_t io_hdr;
+    uint8_t command[SG_INQUIRY_CMD_LEN] = {SG_INQUIRY_CMD, 1, SG_UNIT_SERIAL_NUMBER_VPD_PAGE_CODE};
+    uint8_t reply[SG_UNIT_SERIAL_NUMBER_VPD_PAGE_LEN] = {0};
+    u16_to_big_endian_bytes(sizeof(reply), command + 3);
+    memset(&io_hdr, 0, sizeof(io_hdr));
+    io_hdr.interface_id = 'S';
+    io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+    io_hdr.cmdp = command;
+    io_hdr.cmd_len = SG_INQUIRY_CMD_LEN;
+    io_hdr.dxferp = reply;
+    io_hdr.dxfer_len = sizeof(reply);
+    io_hdr.sbp = sense_buffer;
+    io_hdr.mx_sb_len = sizeof(sense_buffer);
+    io_hdr.timeout = SG_TIMEOUT;
 
-    uint64_t block_descriptor_count = length_lba / maximum_unmap_lba_count;
-    if (length_lba % maximum_unmap_lba_count > 0)
+    if (sg_execute_retry(transport, &io_hdr, NULL, NULL) != SG_DISPOSITION_OK ||
+        reply[1] != SG_UNIT_SERIAL_NUMBER_VPD_PAGE_CODE)
     {
-        block_descriptor_count++;
+        errno = EIO;
+        return -1;
     }
 
-    for (uint64_t i = 0; i < block_descriptor_count; i++)
+    size_t serial_len = u16_from_big_endian_bytes(reply + 2);
+    if (serial_len > sizeof(reply) - 4)
+    {
+        serial_len = sizeof(reply) - 4;
+    }
+    const char *start = (const char *)reply + 4;
+    while (serial_len > 0 && isspace((unsigned char)*start))
+    {
+        start++;
+        serial_len--;
+    }
+    while (serial_len > 0 && (isspace((unsigned char)start[serial_len - 1]) || start[serial_len - 1] == '\0'))
+    {
+        serial_len--;
+    }
+    if (serial_len == 0 || serial_len >= len)
+    {
+        errno = serial_len ? ENAMETOOLONG : ENODATA;
+        return -1;
+    }
+
+    memcpy(serial, start, serial_len);
+    serial[serial_len] = '\0';
+    return 0;
+}
+
+/* copy a blank padded INQUIRY field into a string */
+static void sg_inquiry_field(char *dst, const uint8_t *src, size_t len)
+{
+    while (len > 0 && (src[len - 1] == ' ' || src[len - 1] == '\0'))
+    {
+        len--;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        /* the fields are ASCII, anything else would only garble matching and output */
+        dst[i] = isprint(src[i]) ? src[i] : '?';
+    }
+    dst[len] = '\0';
+}
+
+int sg_get_inquiry(sg_transport_t *transport, sg_inquiry_t *inquiry)
+{
+    uint8_t sense_buffer[SG_SENSE_BUFFER_LEN] = {0};
+    sg_io_hdr_t io_hdr;
+    uint8_t command[SG_INQUIRY_CMD_LEN] = {SG_INQUIRY_CMD};
+    uint8_t reply[SG_STANDARD_INQUIRY_LEN] = {0};
+    u16_to_big_endian_bytes(sizeof(reply), command + 3);
+    memset(&io_hdr, 0, sizeof(io_hdr));
+    io_hdr.interface_id = 'S';
+    io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+    io_hdr.cmdp = command;
+    io_hdr.cmd_len = SG_INQUIRY_CMD_LEN;
+    io_hdr.dxferp = reply;
+    io_hdr.dxfer_len = sizeof(reply);
+    io_hdr.sbp = sense_buffer;
+    io_hdr.mx_sb_len = sizeof(sense_buffer);
+    io_hdr.timeout = SG_TIMEOUT;
+
+    if (sg_execute_retry(transport, &io_hdr, NULL, NULL) != SG_DISPOSITION_OK ||
+        io_hdr.dxfer_len - io_hdr.resid < SG_STANDARD_INQUIRY_LEN)
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    sg_inquiry_field(inquiry->vendor, reply + 8, sizeof(inquiry->vendor) - 1);
+    sg_inquiry_field(inquiry->product, reply + 16, sizeof(inquiry->product) - 1);
+    sg_inquiry_field(inquiry->revision, reply + 32, sizeof(inquiry->revision) - 1);
+    return 0;
+}
+
+uint32_t sg_unmap_block_descriptor_limit(const device_info_t *info)
+{
+    uint32_t limit = info->maximum_unmap_block_descriptor_count;
+
+    /* a device that supports unmap accepts at least one descriptor */
+    if (limit == 0)
+    {
+        limit = 1;
+    }
+    if (limit > SG_UNMAP_MAX_BLOCK_DESCRIPTORS)
+    {
+        limit = SG_UNMAP_MAX_BLOCK_DESCRIPTORS;
+    }
+
+    return limit;
+}
+
+void sg_unmap_state_init(sg_unmap_state_t *state, const device_info_t *info)
+{
+    memset(state, 0, sizeof(*state));
+    state->write_same_limit = info->maximum_write_same_length;
+    if (state->write_same_limit == 0)
+    {
+        state->write_same_limit = SG_WRITE_SAME_DEFAULT_BLOCKS;
+    }
+    /* the NUMBER OF LOGICAL BLOCKS field is 32 bits wide */
+    if (state->write_same_limit > UINT32_MAX)
+    {
+        state->write_same_limit = UINT32_MAX;
+    }
+
+    /* zeroes go out in transfers of the size the device prefers */
+    state->zero_limit = info->optimal_transfer_length ? info->optimal_transfer_length : info->maximum_transfer_length;
+    if (state->zero_limit == 0)
+    {
+        state->zero_limit = SG_ZERO_DEFAULT_BYTES / info->sector_size;
+    }
+    if (info->maximum_transfer_length && state->zero_limit > info->maximum_transfer_length)
+    {
+        state->zero_limit = info->maximum_transfer_length;
+    }
+    if (state->zero_limit > SG_ZERO_MAX_BYTES / info->sector_size)
+    {
+        state->zero_limit = SG_ZERO_MAX_BYTES / info->sector_size;
+    }
+    if (state->zero_limit == 0)
     {
-        uint64_t current_offset = offset_lba;
-        uint64_t current_length = 0;
-        if (length_lba > maximum_unmap_lba_count)
+        state->zero_limit = 1;
+    }
+
+    state->descriptor_limit = sg_unmap_block_descriptor_limit(info);
+
+    /* FFFFFFFFh means there is no limit */
+    state->lba_limit = info->maximum_unmap_lba_count;
+    if (state->lba_limit == UINT32_MAX)
+    {
+        state->lba_limit = UINT64_MAX;
+    }
+}
+
+static uint64_t sg_unmap_parameter_lba_count(const uint8_t *parameter, uint32_t block_descriptor_count)
+{
+    uint64_t lba_count = 0;
+    for (uint32_t i = 0; i < block_descriptor_count; i++)
+    {
+        lba_count += u32_from_big_endian_bytes(parameter + SG_UNMAP_PARAMETER_LEN(i) + 8);
+    }
+    return lba_count;
+}
+
+static uint64_t sg_unmap_granularity_lba(const device_info_t *info)
+{
+    return info->optimal_unmap_granularity ? info->optimal_unmap_granularity : 1;
+}
+
+int sg_unmap_state_shrink(sg_unmap_state_t *state, const device_info_t *info, const uint8_t *parameter,
+                          uint32_t block_descriptor_count)
+{
+    if (block_descriptor_count > 1)
+    {
+        if (state->descriptor_rejected == 0 || block_descriptor_count < state->descriptor_rejected)
         {
-            current_length = maximum_unmap_lba_count;
-            offset_lba += maximum_unmap_lba_count;
-            length_lba -= maximum_unmap_lba_count;
+            state->descriptor_rejected = block_descriptor_count;
         }
-        else
+        /* fall back to the largest count that worked, or halve until one does */
+        state->descriptor_limit = state->descriptor_accepted && state->descriptor_accepted < block_descriptor_count
+                                      ? state->descriptor_accepted
+                                      : block_descriptor_count / 2;
+        return 0;
+    }
+
+    uint64_t lba_count = sg_unmap_parameter_lba_count(parameter, block_descriptor_count);
+    uint64_t granularity = sg_unmap_granularity_lba(info);
+    if (lba_count <= granularity)
+    {
+        return -1;
+    }
+
+    if (state->lba_rejected == 0 || lba_count < state->lba_rejected)
+    {
+        state->lba_rejected = lba_count;
+    }
+    if (state->lba_accepted && state->lba_accepted < lba_count)
+    {
+        state->lba_limit = state->lba_accepted;
+    }
+    else
+    {
+        /* a command of whole granules stays aligned if its start was */
+        uint64_t lba_limit = lba_count / 2 / granularity * granularity;
+        state->lba_limit = lba_limit ? lba_limit : granularity;
+    }
+    return 0;
+}
+
+int sg_write_same_state_shrink(sg_unmap_state_t *state, const device_info_t *info, uint64_t blocks)
+{
+    uint64_t granularity = sg_unmap_granularity_lba(info);
+    if (blocks <= granularity)
+    {
+        return -1;
+    }
+
+    uint64_t limit = blocks / 2 / granularity * granularity;
+    state->write_same_limit = limit ? limit : granularity;
+    return 0;
+}
+
+void sg_unmap_state_accepted(sg_unmap_state_t *state, const device_info_t *info, const uint8_t *parameter,
+                             uint32_t block_descriptor_count)
+{
+    /* only ever grows back after a rejection, limits of the device info are never exceeded */
+    if (state->descriptor_rejected)
+    {
+        if (block_descriptor_count > state->descriptor_accepted)
+        {
+            state->descriptor_accepted = block_descriptor_count;
+        }
+        if (block_descriptor_count == state->descriptor_limit &&
+            state->descriptor_rejected > state->descriptor_limit + 1)
+        {
+            state->descriptor_limit += (state->descriptor_rejected - state->descriptor_limit) / 2;
+        }
+    }
+
+    if (state->lba_rejected)
+    {
+        uint64_t lba_count = sg_unmap_parameter_lba_count(parameter, block_descriptor_count);
+        uint64_t granularity = sg_unmap_granularity_lba(info);
+        if (lba_count > state->lba_accepted)
+        {
+            state->lba_accepted = lba_count;
+        }
+        if (lba_count >= state->lba_limit && state->lba_rejected > state->lba_limit + granularity)
+        {
+            uint64_t step = (state->lba_rejected - state->lba_limit) / 2 / granularity * granularity;
+            state->lba_limit += step ? step : granularity;
+        }
+    }
+}
+
+void sg_unmap_parameter_extents(const device_info_t *info, const uint8_t *parameter,
+                                uint32_t block_descriptor_count, unmap_extent_t *extents)
+{
+    for (uint32_t i = 0; i < block_descriptor_count; i++)
+    {
+        const uint8_t *descriptor = parameter + SG_UNMAP_PARAMETER_LEN(i);
+        extents[i].offset = u64_from_big_endian_bytes(descriptor) * info->sector_size;
+        extents[i].length = (uint64_t)u32_from_big_endian_bytes(descriptor + 8) * info->sector_size;
+    }
+}
+
+void unmap_cursor_init(unmap_cursor_t *cursor, const device_info_t *info, const sg_unmap_state_t *state,
+                       const unmap_extent_t *extents, size_t count)
+{
+    memset(cursor, 0, sizeof(*cursor));
+    cursor->info = info;
+    cursor->state = state;
+    cursor->extents = extents;
+    cursor->count = count;
+}
+
+uint32_t unmap_cursor_fill(unmap_cursor_t *cursor, uint8_t *parameter)
+{
+    const device_info_t *info = cursor->info;
+    sg_unmap_state_t limits;
+    const sg_unmap_state_t *state = cursor->state;
+    if (state == NULL)
+    {
+        sg_unmap_state_init(&limits, info);
+        state = &limits;
+    }
+
+    /* MAXIMUM UNMAP LBA COUNT limits the sum of all descriptors in one command */
+    uint32_t descriptor_limit = state->descriptor_limit;
+    uint64_t lba_limit = state->lba_limit;
+
+    uint32_t descriptor_count = 0;
+    uint64_t command_lba_count = 0;
+    while (descriptor_count < descriptor_limit && command_lba_count < lba_limit)
+    {
+        if (cursor->length_lba == 0)
+        {
+            if (cursor->index == cursor->count)
+            {
+                break;
+            }
+            cursor->offset_lba = cursor->extents[cursor->index].offset / info->sector_size;
+            cursor->length_lba = cursor->extents[cursor->index].length / info->sector_size;
+            cursor->index++;
+            continue;
+        }
+
+        uint64_t current_length = lba_limit - command_lba_count;
+        if (current_length > cursor->length_lba)
+        {
+            current_length = cursor->length_lba;
+        }
+        if (current_length > UINT32_MAX)
+        {
+            current_length = UINT32_MAX;
+        }
+
+        sg_unmap_set_block_descriptor(parameter, descriptor_count++, cursor->offset_lba, current_length);
+        command_lba_count += current_length;
+        cursor->offset_lba += current_length;
+        cursor->length_lba -= current_length;
+    }
+
+    return descriptor_count;
+}
+
+int sg_unmap_extents_buffered(sg_transport_t *transport, const device_info_t *info, sg_unmap_state_t *state,
+                              const unmap_extent_t *extents, size_t count, uint8_t *parameter)
+{
+    sg_unmap_state_t local_state;
+    if (state == NULL)
+    {
+        sg_unmap_state_init(&local_state, info);
+        state = &local_state;
+    }
+
+    unmap_cursor_t cursor;
+    unmap_cursor_init(&cursor, info, state, extents, count);
+
+    /* every command only differs in its lengths */
+    uint8_t sense_buffer[SG_SENSE_BUFFER_LEN];
+    uint8_t command[SG_UNMAP_CMD_LEN];
+    sg_io_hdr_t io_hdr;
+    sg_unmap_prepare(&io_hdr, command, sense_buffer, parameter, 0);
+
+    while (true)
+    {
+        /* a rejected command is sent again from here */
+        unmap_cursor_t command_start = cursor;
+        uint32_t descriptor_count = unmap_cursor_fill(&cursor, parameter);
+        if (descriptor_count == 0)
+        {
+            return 0;
+        }
+
+        sg_unmap_patch(&io_hdr, descriptor_count);
+        state->commands++;
+        sg_result_t result;
+        sg_disposition_t disposition = sg_execute_retry(transport, &io_hdr, &result, &state->retries);
+        if (disposition == SG_DISPOSITION_OK)
+        {
+            sg_unmap_state_accepted(state, info, parameter, descriptor_count);
+            continue;
+        }
+        if (disposition == SG_DISPOSITION_REJECTED &&
+            sg_unmap_state_shrink(state, info, parameter, descriptor_count) == 0)
         {
-            current_length = length_lba;
+            state->splits++;
+            cursor = command_start;
+            continue;
         }
 
-        int ret = sg_unmap_scsi(fd, current_offset, current_length);
-        if (ret)
+        /* a command that never got a status keeps the errno of the transport */
+        if (result.status || result.host_status || result.driver_status)
         {
-            return ret;
+            state->failure_valid = true;
+            state->failure = result;
+        }
+        return -1;
+    }
+}
+
+int sg_write_same_extents_buffered(sg_transport_t *transport, const device_info_t *info, sg_unmap_state_t *state,
+                                   const unmap_extent_t *extents, size_t count, const uint8_t *block)
+{
+    sg_unmap_state_t local_state;
+    if (state == NULL)
+    {
+        sg_unmap_state_init(&local_state, info);
+        state = &local_state;
+    }
+
+    /* every command only differs in its range */
+    uint8_t sense_buffer[SG_SENSE_BUFFER_LEN];
+    uint8_t command[SG_WRITE_SAME16_CMD_LEN];
+    sg_io_hdr_t io_hdr;
+    sg_write_same_prepare(&io_hdr, command, sense_buffer, block, info->sector_size, 0, 0);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t lba = extents[i].offset / info->sector_size;
+        uint64_t end_lba = lba + extents[i].length / info->sector_size;
+        while (lba < end_lba)
+        {
+            uint64_t blocks = end_lba - lba;
+            if (blocks > state->write_same_limit)
+            {
+                blocks = state->write_same_limit;
+            }
+
+            sg_write_same_patch(&io_hdr, lba, blocks);
+            state->commands++;
+
+            sg_result_t result;
+            sg_disposition_t disposition = sg_execute_retry(transport, &io_hdr, &result, &state->retries);
+            if (disposition == SG_DISPOSITION_OK)
+            {
+                lba += blocks;
+                continue;
+            }
+            if (disposition == SG_DISPOSITION_REJECTED && sg_write_same_state_shrink(state, info, blocks) == 0)
+            {
+                state->splits++;
+                continue;
+            }
+
+            if (result.status || result.host_status || result.driver_status)
+            {
+                state->failure_valid = true;
+                state->failure = result;
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int sg_zero_extents_buffered(sg_transport_t *transport, const device_info_t *info, sg_unmap_state_t *state,
+                             sg_zero_t *method, const unmap_extent_t *extents, size_t count, const uint8_t *buffer)
+{
+    uint8_t sense_buffer[SG_SENSE_BUFFER_LEN];
+    uint8_t command[SG_WRITE16_CMD_LEN];
+    sg_io_hdr_t io_hdr;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t lba = extents[i].offset / info->sector_size;
+        uint64_t end_lba = lba + extents[i].length / info->sector_size;
+        while (lba < end_lba)
+        {
+            uint64_t blocks = end_lba - lba;
+            if (blocks > sg_zero_limit(state, *method))
+            {
+                blocks = sg_zero_limit(state, *method);
+            }
+
+            sg_zero_prepare(&io_hdr, command, sense_buffer, *method, buffer, info->sector_size, lba, blocks);
+            state->commands++;
+
+            sg_result_t result;
+            sg_disposition_t disposition = sg_execute_retry(transport, &io_hdr, &result, &state->retries);
+            if (disposition == SG_DISPOSITION_OK)
+            {
+                lba += blocks;
+                continue;
+            }
+            /*
+             * Only a refused length is bisected. WRITE SAME refused for anything
+             * else, e.g. the NDOB bit, moves on to the next method, and the
+             * method stays with the caller for the rest of the run.
+             */
+            if (disposition == SG_DISPOSITION_REJECTED &&
+                (*method == SG_ZERO_WRITE || sg_result_length_rejected(&result, SG_ZERO_BLOCKS_OFFSET, 4)) &&
+                sg_zero_state_shrink(state, *method, blocks) == 0)
+            {
+                state->splits++;
+                continue;
+            }
+            if (sg_result_unsupported(&result) && *method != SG_ZERO_WRITE)
+            {
+                /* without WRITE SAME(16) neither variant of it works */
+                *method = SG_ZERO_WRITE;
+                continue;
+            }
+            if (disposition == SG_DISPOSITION_REJECTED && *method != SG_ZERO_WRITE)
+            {
+                (*method)++;
+                continue;
+            }
+
+            if (result.status || result.host_status || result.driver_status)
+            {
+                state->failure_valid = true;
+                state->failure = result;
+            }
+            return -1;
         }
     }
 
     return 0;
 }
 
+int sg_unmap_extents(sg_transport_t *transport, const device_info_t *info, const unmap_extent_t *extents, size_t count)
+{
+    uint8_t *parameter = malloc(SG_UNMAP_PARAMETER_LEN(sg_unmap_block_descriptor_limit(info)));
+    if (parameter == NULL)
+    {
+        return -1;
+    }
+
+    int ret = sg_unmap_extents_buffered(transport, info, NULL, extents, count, parameter);
+
+    free(parameter);
+    return ret;
+}
+
+int sg_unmap(sg_transport_t *transport, const device_info_t *info, uint64_t offset, uint64_t length)
+{
+    unmap_extent_t extent = {offset, length};
+    return sg_unmap_extents(transport, info, &extent, 1);
+}
+
 void errtryhelp(const char *program_name, int exit_code)
 {
     fprintf(stderr, "Try '%s --help' for more information.\n", program_name);
@@ -1,5 +1,14 @@
+#ifndef UTILS_H
+#define UTILS_H
+
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <scsi/sg.h>
+#include <sys/time.h>
+
+#include "transport.h"
+#include "sense.h"
 
 #define USAGE_HEADER "\nUsage:\n"
 #define USAGE_OPTIONS "\nOptions:\n"
@@ -19,6 +28,22 @@
     "   GiB, TiB, PiB, EiB, ZiB, and YiB (the \"iB\" is optional)\n", \
         _name
 
+#define SG_TIMEOUT 60000
+#define SG_SENSE_BUFFER_LEN UINT8_MAX
+#define SG_UNMAP_CMD_LEN 10
+#define SG_UNMAP_PARAMETER_HEADER_LEN 8
+#define SG_UNMAP_BLOCK_DESCRIPTOR_LEN 16
+#define SG_UNMAP_PARAMETER_LEN(_count) \
+    (SG_UNMAP_PARAMETER_HEADER_LEN + (_count) * SG_UNMAP_BLOCK_DESCRIPTOR_LEN)
+#define SG_WRITE_SAME16_CMD_LEN 16
+/* blocks per WRITE SAME when the device reports no MAXIMUM WRITE SAME LENGTH, like the Linux sd driver */
+#define SG_WRITE_SAME_DEFAULT_BLOCKS 0x7fffff
+#define SG_WRITE16_CMD_LEN 16
+/* bytes per WRITE(16) of zeroes when the device reports no transfer length */
+#define SG_ZERO_DEFAULT_BYTES (1U << 20)
+/* bytes per WRITE(16) of zeroes at most, the zero buffer is this large */
+#define SG_ZERO_MAX_BYTES (8U << 20)
+
 typedef struct device_info
 {
     uint64_t last_block_address;
@@ -29,9 +54,95 @@ typedef struct device_info
     uint32_t maximum_unmap_lba_count;
     uint32_t maximum_unmap_block_descriptor_count;
     uint32_t optimal_unmap_granularity;
+    uint32_t unmap_granularity_alignment;
+    /* blocks in one WRITE SAME command, 0 if not reported */
+    uint64_t maximum_write_same_length;
     bool support_unmap;
+    /* WRITE SAME(16) with the UNMAP bit deallocates */
+    bool support_write_same;
+    /* logical block provisioning management enabled */
+    bool lbpme;
+    /* unmapped blocks read back as zeroes */
+    bool lbprz;
+    /* the Logical Block Provisioning VPD page was read */
+    bool lbp_valid;
+    /* UNMAP, WRITE SAME(16) and WRITE SAME(10) with the UNMAP bit are supported */
+    bool lbpu;
+    bool lbpws;
+    bool lbpws10;
 } device_info_t;
 
+/* identification from the standard INQUIRY data, trailing blanks removed */
+typedef struct sg_inquiry
+{
+    char vendor[9];
+    char product[17];
+    char revision[5];
+} sg_inquiry_t;
+
+typedef enum sg_deallocate
+{
+    SG_DEALLOCATE_UNMAP,
+    SG_DEALLOCATE_WRITE_SAME,
+} sg_deallocate_t;
+
+/* ways to write zeroes, from the least to the most data sent to the device */
+typedef enum sg_zero
+{
+    /* WRITE SAME(16) with NDOB, no data-out at all */
+    SG_ZERO_WRITE_SAME_NDOB,
+    /* WRITE SAME(16) of one block of zeroes */
+    SG_ZERO_WRITE_SAME,
+    /* WRITE(16) from a buffer of zeroes */
+    SG_ZERO_WRITE,
+} sg_zero_t;
+
+typedef struct unmap_extent
+{
+    uint64_t offset;
+    uint64_t length;
+} unmap_extent_t;
+
+typedef struct sg_unmap_state
+{
+    /* block descriptors in one command, lowered when the device rejects more */
+    uint32_t descriptor_limit;
+    /* logical blocks in one command, lowered when the device rejects more */
+    uint64_t lba_limit;
+    /*
+     * Smallest rejected and largest accepted command, the limits are
+     * bisected between them. 0 until the device rejected a command.
+     */
+    uint32_t descriptor_rejected;
+    uint32_t descriptor_accepted;
+    uint64_t lba_rejected;
+    uint64_t lba_accepted;
+    /* blocks in one WRITE SAME command, halved when the device rejects more */
+    uint64_t write_same_limit;
+    /* blocks in one WRITE(16) of zeroes, halved when the device rejects more */
+    uint64_t zero_limit;
+    /* commands sent, not counting repetitions */
+    uint64_t commands;
+    /* commands repeated after a transient failure */
+    uint64_t retries;
+    /* rejected commands that were split */
+    uint64_t splits;
+    /* the command that failed for good, if it got a SCSI status */
+    bool failure_valid;
+    sg_result_t failure;
+} sg_unmap_state_t;
+
+typedef struct unmap_cursor
+{
+    const device_info_t *info;
+    const sg_unmap_state_t *state;
+    const unmap_extent_t *extents;
+    size_t count;
+    size_t index;
+    uint64_t offset_lba;
+    uint64_t length_lba;
+} unmap_cursor_t;
+
 /**
  * @brief convert string to size (uint64_t)
  *
@@ -64,28 +175,311 @@ typedef struct device_info
  */
 uint64_t strtosize_or_err(const char *str, const char *errmesg);
 
+/**
+ * @brief convert string to size (uint64_t) without exiting on errors.
+ *
+ * Accepts the same suffixes as strtosize_or_err().
+ *
+ * @param str string for parsing
+ * @param result parsed size
+ * @return returns 0 if there is no error, errno is set otherwise.
+ */
+int strtosize(const char *str, uint64_t *result);
+
 /**
  * @brief get device info
  * 
- * @param fd file descriptor
+ * @param transport SCSI transport
  * @param info pointer to info
  * @return returns 0 if there is no error. 
  */
-int sg_get_device_info(int fd, device_info_t *info);
+int sg_get_device_info(sg_transport_t *transport, device_info_t *info);
+
+/**
+ * @brief get the unit serial number of a device.
+ *
+ * Leading and trailing blanks of the serial are removed.
+ *
+ * @param transport SCSI transport.
+ * @param serial buffer for the serial number.
+ * @param len size of the buffer.
+ * @return returns 0 if there is no error.
+ */
+int sg_get_serial(sg_transport_t *transport, char *serial, size_t len);
+
+/**
+ * @brief get the vendor, product and revision of a device.
+ *
+ * @param transport SCSI transport.
+ * @param inquiry identification of the device.
+ * @return returns 0 if there is no error.
+ */
+int sg_get_inquiry(sg_transport_t *transport, sg_inquiry_t *inquiry);
 
 /**
  * @brief unmap certain area of a device.
  * 
- * @param fd file descriptor.
+ * @param transport SCSI transport.
  * @param info device info.
  * @param offset offset in byte.
  * @param length length in byte.
  * @return returns 0 if there is no error.
  */
-int sg_unmap(int fd, const device_info_t *info, uint64_t offset, uint64_t length);
+int sg_unmap(sg_transport_t *transport, const device_info_t *info, uint64_t offset, uint64_t length);
+
+/**
+ * @brief unmap a list of areas of a device.
+ *
+ * Block descriptors are packed into as few UNMAP commands as the
+ * device limits allow.
+ *
+ * @param transport SCSI transport.
+ * @param info device info.
+ * @param extents areas to unmap, offset and length in byte.
+ * @param count number of extents.
+ * @return returns 0 if there is no error.
+ */
+int sg_unmap_extents(sg_transport_t *transport, const device_info_t *info, const unmap_extent_t *extents, size_t count);
+
+/**
+ * @brief unmap a list of areas of a device with a caller-provided parameter list.
+ *
+ * Commands failing with a transient condition are repeated. A command
+ * the device rejects as too large lowers the limits of the state and
+ * its range is sent again in smaller commands.
+ *
+ * @param transport SCSI transport.
+ * @param info device info.
+ * @param state command limits and statistics, NULL to start from the device info.
+ * @param extents areas to unmap, offset and length in byte.
+ * @param count number of extents.
+ * @param parameter parameter list, at least
+ *        SG_UNMAP_PARAMETER_LEN(sg_unmap_block_descriptor_limit()) bytes.
+ * @return returns 0 if there is no error.
+ */
+int sg_unmap_extents_buffered(sg_transport_t *transport, const device_info_t *info, sg_unmap_state_t *state,
+                              const unmap_extent_t *extents, size_t count, uint8_t *parameter);
+
+/**
+ * @brief deallocate a list of areas with WRITE SAME(16) and the UNMAP bit.
+ *
+ * Every area takes one or more commands of at most the WRITE SAME limit
+ * of the state. Transient failures are repeated, a command the device
+ * rejects as too large halves the limit.
+ *
+ * @param transport SCSI transport.
+ * @param info device info.
+ * @param state command limits and statistics, NULL to start from the device info.
+ * @param extents areas to deallocate, offset and length in byte.
+ * @param count number of extents.
+ * @param block one logical block of zeroes.
+ * @return returns 0 if there is no error.
+ */
+int sg_write_same_extents_buffered(sg_transport_t *transport, const device_info_t *info, sg_unmap_state_t *state,
+                                   const unmap_extent_t *extents, size_t count, const uint8_t *block);
+
+/**
+ * @brief start with the command limits of the device info.
+ *
+ * @param state state to initialize.
+ * @param info device info.
+ */
+void sg_unmap_state_init(sg_unmap_state_t *state, const device_info_t *info);
+
+/**
+ * @brief lower the command limits after the device rejected a command.
+ *
+ * A command of several descriptors lowers the descriptor limit, one of
+ * a single descriptor the block limit, down to the unmap granularity.
+ * The limit drops to the largest command accepted so far or is halved
+ * if there is none.
+ *
+ * @param state command limits.
+ * @param info device info.
+ * @param parameter parameter list of the rejected command.
+ * @param block_descriptor_count number of block descriptors in it.
+ * @return returns 0 if the limits were lowered, -1 if the command was already minimal.
+ */
+int sg_unmap_state_shrink(sg_unmap_state_t *state, const device_info_t *info, const uint8_t *parameter,
+                          uint32_t block_descriptor_count);
+
+/**
+ * @brief lower the WRITE SAME limit after the device rejected a command.
+ *
+ * @param state command limits.
+ * @param info device info.
+ * @param blocks number of blocks of the rejected command.
+ * @return returns 0 if the limit was lowered, -1 if the command was already minimal.
+ */
+int sg_write_same_state_shrink(sg_unmap_state_t *state, const device_info_t *info, uint64_t blocks);
+
+/**
+ * @brief note a command the device accepted.
+ *
+ * Once a command was rejected, every accepted command of the current
+ * limit raises it halfway towards the smallest rejected one, so the
+ * limits settle at the largest command the device accepts.
+ *
+ * @param state command limits.
+ * @param info device info.
+ * @param parameter parameter list of the accepted command.
+ * @param block_descriptor_count number of block descriptors in it.
+ */
+void sg_unmap_state_accepted(sg_unmap_state_t *state, const device_info_t *info, const uint8_t *parameter,
+                             uint32_t block_descriptor_count);
+
+/**
+ * @brief turn the block descriptors of a parameter list back into extents.
+ *
+ * @param info device info.
+ * @param parameter parameter list.
+ * @param block_descriptor_count number of block descriptors.
+ * @param extents block_descriptor_count extents, offset and length in byte.
+ */
+void sg_unmap_parameter_extents(const device_info_t *info, const uint8_t *parameter,
+                                uint32_t block_descriptor_count, unmap_extent_t *extents);
+
+/**
+ * @brief get the number of block descriptors in one UNMAP command.
+ *
+ * @param info device info.
+ * @return descriptor count, at least 1.
+ */
+uint32_t sg_unmap_block_descriptor_limit(const device_info_t *info);
+
+/**
+ * @brief start walking a list of extents as UNMAP block descriptors.
+ *
+ * @param cursor cursor to initialize.
+ * @param info device info, must outlive the cursor.
+ * @param state command limits, NULL for the limits of the device info;
+ *        must outlive the cursor.
+ * @param extents areas to unmap, must outlive the cursor.
+ * @param count number of extents.
+ */
+void unmap_cursor_init(unmap_cursor_t *cursor, const device_info_t *info, const sg_unmap_state_t *state,
+                       const unmap_extent_t *extents, size_t count);
+
+/**
+ * @brief fill the block descriptors of the next UNMAP command.
+ *
+ * @param cursor extent cursor.
+ * @param parameter parameter list, at least
+ *        SG_UNMAP_PARAMETER_LEN(sg_unmap_block_descriptor_limit()) bytes.
+ * @return number of descriptors written, 0 once all extents are consumed.
+ */
+uint32_t unmap_cursor_fill(unmap_cursor_t *cursor, uint8_t *parameter);
+
+/**
+ * @brief set up an UNMAP command without issuing it.
+ *
+ * @param io_hdr header to fill.
+ * @param command CDB buffer, SG_UNMAP_CMD_LEN bytes.
+ * @param sense_buffer sense buffer, SG_SENSE_BUFFER_LEN bytes.
+ * @param parameter parameter list with the block descriptors filled in.
+ * @param block_descriptor_count number of block descriptors.
+ */
+void sg_unmap_prepare(sg_io_hdr_t *io_hdr, uint8_t *command, uint8_t *sense_buffer,
+                      uint8_t *parameter, uint32_t block_descriptor_count);
+
+/**
+ * @brief change the number of block descriptors of a prepared UNMAP command.
+ *
+ * Only the lengths in the CDB, the header and the parameter list header
+ * are written, so a command prepared once can be reused for every
+ * parameter list built in the same buffer.
+ *
+ * @param io_hdr header set up by sg_unmap_prepare().
+ * @param block_descriptor_count number of block descriptors.
+ */
+void sg_unmap_patch(sg_io_hdr_t *io_hdr, uint32_t block_descriptor_count);
+
+/**
+ * @brief set up a WRITE SAME(16) command with the UNMAP bit without issuing it.
+ *
+ * @param io_hdr header to fill.
+ * @param command CDB buffer, SG_WRITE_SAME16_CMD_LEN bytes.
+ * @param sense_buffer sense buffer, SG_SENSE_BUFFER_LEN bytes.
+ * @param block one logical block of zeroes.
+ * @param sector_size logical block size in byte.
+ * @param lba first logical block.
+ * @param blocks number of logical blocks.
+ */
+void sg_write_same_prepare(sg_io_hdr_t *io_hdr, uint8_t *command, uint8_t *sense_buffer, const uint8_t *block,
+                           uint32_t sector_size, uint64_t lba, uint32_t blocks);
+
+/**
+ * @brief change the range of a prepared WRITE SAME(16) command.
+ *
+ * @param io_hdr header set up by sg_write_same_prepare().
+ * @param lba first logical block.
+ * @param blocks number of logical blocks.
+ */
+void sg_write_same_patch(sg_io_hdr_t *io_hdr, uint64_t lba, uint32_t blocks);
+
+/**
+ * @brief set up a command writing zeroes without issuing it.
+ *
+ * Nothing is deallocated, the blocks read back as zeroes whether or not
+ * the device supports logical block provisioning.
+ *
+ * @param io_hdr header to fill.
+ * @param command CDB buffer, SG_WRITE16_CMD_LEN bytes.
+ * @param sense_buffer sense buffer, SG_SENSE_BUFFER_LEN bytes.
+ * @param method the command to build.
+ * @param buffer zeroes, one block for SG_ZERO_WRITE_SAME and blocks
+ *        blocks for SG_ZERO_WRITE, unused for SG_ZERO_WRITE_SAME_NDOB.
+ * @param sector_size logical block size in byte.
+ * @param lba first logical block.
+ * @param blocks number of logical blocks.
+ */
+void sg_zero_prepare(sg_io_hdr_t *io_hdr, uint8_t *command, uint8_t *sense_buffer, sg_zero_t method,
+                     const uint8_t *buffer, uint32_t sector_size, uint64_t lba, uint32_t blocks);
+
+/**
+ * @brief get the number of blocks in one command writing zeroes.
+ *
+ * @param state command limits.
+ * @param method the command.
+ * @return blocks, at least 1.
+ */
+uint64_t sg_zero_limit(const sg_unmap_state_t *state, sg_zero_t method);
+
+/**
+ * @brief lower the limit of a command writing zeroes after the device rejected it.
+ *
+ * @param state command limits.
+ * @param method the rejected command.
+ * @param blocks number of blocks of the rejected command.
+ * @return returns 0 if the limit was lowered, -1 if the command was a single block.
+ */
+int sg_zero_state_shrink(sg_unmap_state_t *state, sg_zero_t method, uint64_t blocks);
+
+/**
+ * @brief write zeroes to a list of areas.
+ *
+ * A device that does not take a method gets the next one of sg_zero_t,
+ * so the first command finds the cheapest method the device supports;
+ * without WRITE SAME(16) at all it goes straight to WRITE(16). Transient
+ * failures are repeated. Only a command the device rejects for its
+ * length, or any rejected WRITE(16), halves the limit of its method.
+ *
+ * @param transport SCSI transport.
+ * @param info device info.
+ * @param state command limits and statistics.
+ * @param method method to start with, updated to the one that worked.
+ * @param extents areas to zero, offset and length in byte.
+ * @param count number of extents.
+ * @param buffer zeroes, sg_zero_limit() of SG_ZERO_WRITE blocks.
+ * @return returns 0 if there is no error.
+ */
+int sg_zero_extents_buffered(sg_transport_t *transport, const device_info_t *info, sg_unmap_state_t *state,
+                             sg_zero_t *method, const unmap_extent_t *extents, size_t count, const uint8_t *buffer);
 
 void errtryhelp(const char *program_name, int exit_code);
 
 int gettime_monotonic(struct timeval *tv);
 
-bool ask_for_yn(const char *message);
\ No newline at end of file
+bool ask_for_yn(const char *message);
+
+#endif /* UTILS_H */
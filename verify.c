@@ -0,0 +1,196 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "verify.h"
+#include "reader.h"
+#include "zero.h"
+
+typedef struct verify_cursor
+{
+    const device_info_t *info;
+    const unmap_extent_t *extents;
+    size_t count;
+    uint64_t granularity;
+    uint64_t alignment;
+    unsigned int samples;
+    /* extent and sample to read next */
+    size_t index;
+    unsigned int sample;
+    /* the whole granularities of the current extent and their strata */
+    uint64_t start;
+    uint64_t blocks;
+    unsigned int strata;
+    uint64_t random;
+} verify_cursor_t;
+
+/* xorshift64*, a sample needs no better randomness */
+static uint64_t verify_random(verify_cursor_t *cursor)
+{
+    cursor->random ^= cursor->random >> 12;
+    cursor->random ^= cursor->random << 25;
+    cursor->random ^= cursor->random >> 27;
+    return cursor->random * 0x2545f4914f6cdd1dULL;
+}
+
+/* first granularity boundary at or after offset, the last at or before end */
+static void verify_aligned(const verify_cursor_t *cursor, const unmap_extent_t *extent, uint64_t *start,
+                           uint64_t *end)
+{
+    uint64_t offset = extent->offset;
+    uint64_t end_offset = extent->offset + extent->length;
+
+    *start = cursor->alignment;
+    if (offset > cursor->alignment)
+    {
+        uint64_t remainder = (offset - cursor->alignment) % cursor->granularity;
+        *start = remainder ? offset + cursor->granularity - remainder : offset;
+    }
+    *end = end_offset < cursor->alignment ? 0 : end_offset - (end_offset - cursor->alignment) % cursor->granularity;
+}
+
+/*
+ * Pick the next block to read.
+ * Returns	true  offset and extent are set
+ * 		false every extent is done
+ */
+static bool verify_next(verify_cursor_t *cursor, uint64_t *offset, size_t *extent)
+{
+    uint32_t sector_size = cursor->info->sector_size;
+
+    while (cursor->sample == cursor->strata)
+    {
+        if (cursor->index == cursor->count)
+        {
+            return false;
+        }
+
+        uint64_t start, end;
+        verify_aligned(cursor, &cursor->extents[cursor->index++], &start, &end);
+        cursor->start = start;
+        cursor->blocks = end > start ? (end - start) / sector_size : 0;
+        cursor->strata = cursor->blocks < cursor->samples ? cursor->blocks : cursor->samples;
+        cursor->sample = 0;
+    }
+
+    /* strata of equal size, the first blocks % strata of them one block larger */
+    uint64_t size = cursor->blocks / cursor->strata;
+    uint64_t larger = cursor->blocks % cursor->strata;
+    unsigned int sample = cursor->sample++;
+    uint64_t first = size * sample + (sample < larger ? sample : larger);
+    if (sample < larger)
+    {
+        size++;
+    }
+
+    *offset = cursor->start + (first + verify_random(cursor) % size) * sector_size;
+    *extent = cursor->index - 1;
+    return true;
+}
+
+int verify_extents(int fd, const device_info_t *info, const unmap_extent_t *extents, size_t count,
+                   uint64_t granularity, uint64_t alignment, unsigned int samples, unsigned int depth,
+                   verify_extent_t *per_extent, verify_result_t *result)
+{
+    memset(result, 0, sizeof(*result));
+    if (per_extent)
+    {
+        memset(per_extent, 0, count * sizeof(*per_extent));
+    }
+    if (granularity == 0 || granularity % info->sector_size || samples == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    verify_cursor_t cursor = {
+        .info = info,
+        .extents = extents,
+        .count = count,
+        .granularity = granularity,
+        .alignment = alignment % granularity,
+        .samples = samples,
+        .random = ((uint64_t)now.tv_sec << 32 ^ now.tv_nsec ^ (uint64_t)getpid() << 16) | 1,
+    };
+
+    reader_t reader;
+    if (reader_open(&reader, fd, info->sector_size, depth))
+    {
+        return -1;
+    }
+
+    /* reads complete in submission order, so the extents of the reads in flight form a queue */
+    size_t owners[READER_MAX_DEPTH];
+    unsigned int head = 0;
+    size_t last_sampled = SIZE_MAX;
+    size_t last_failed = SIZE_MAX;
+    int ret = -1;
+    while (true)
+    {
+        uint64_t offset;
+        size_t extent;
+        while (reader_pending(&reader) < depth && verify_next(&cursor, &offset, &extent))
+        {
+            if (reader_submit(&reader, offset, info->sector_size))
+            {
+                goto out;
+            }
+            owners[(head + reader_pending(&reader) - 1) % READER_MAX_DEPTH] = extent;
+            if (extent != last_sampled)
+            {
+                result->extents++;
+                last_sampled = extent;
+            }
+        }
+
+        const uint8_t *data;
+        size_t length;
+        int read_ret = reader_next(&reader, &data, &offset, &length);
+        if (read_ret < 0)
+        {
+            goto out;
+        }
+        if (read_ret == 0)
+        {
+            break;
+        }
+        if (length != info->sector_size)
+        {
+            errno = EIO;
+            goto out;
+        }
+
+        extent = owners[head];
+        head = (head + 1) % READER_MAX_DEPTH;
+        result->samples++;
+        if (per_extent)
+        {
+            per_extent[extent].samples++;
+        }
+        if (!zero_check(data, length))
+        {
+            result->failed_samples++;
+            if (per_extent)
+            {
+                per_extent[extent].failures++;
+            }
+            if (extent != last_failed)
+            {
+                result->failed_extents++;
+                last_failed = extent;
+            }
+        }
+    }
+    ret = 0;
+
+out:;
+    int saved_errno = errno;
+    reader_close(&reader);
+    errno = saved_errno;
+    return ret;
+}
@@ -0,0 +1,53 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/* blocks sampled per extent when the command line does not say */
+#define VERIFY_DEFAULT_SAMPLES 16
+
+typedef struct verify_extent
+{
+    unsigned int samples;
+    /* samples that did not read back as zeroes */
+    unsigned int failures;
+} verify_extent_t;
+
+typedef struct verify_result
+{
+    /* extents with at least one block sampled */
+    size_t extents;
+    /* extents with at least one block that did not read back as zeroes */
+    size_t failed_extents;
+    uint64_t samples;
+    uint64_t failed_samples;
+} verify_result_t;
+
+/**
+ * @brief read back a random sample of discarded blocks.
+ *
+ * Only whole granularities inside an extent are sampled, the partial
+ * ones at its edges may not have been deallocated. Every extent is cut
+ * into samples strata of equal size and one random block is read from
+ * each, all extents at once with up to depth reads in flight.
+ *
+ * @param fd the whole disk, opened with O_DIRECT so no cache answers.
+ * @param info device info.
+ * @param extents discarded areas, offset and length in byte.
+ * @param count number of extents.
+ * @param granularity bytes the device deallocates at once, a multiple of the sector size.
+ * @param alignment offset of the first granularity in byte.
+ * @param samples blocks to read per extent.
+ * @param depth reads in flight at most, up to READER_MAX_DEPTH.
+ * @param per_extent if not NULL, receives the samples of each extent.
+ * @param result totals.
+ * @return returns 0 if there is no error.
+ */
+int verify_extents(int fd, const device_info_t *info, const unmap_extent_t *extents, size_t count,
+                   uint64_t granularity, uint64_t alignment, unsigned int samples, unsigned int depth,
+                   verify_extent_t *per_extent, verify_result_t *result);
+
+#endif /* VERIFY_H */
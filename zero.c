@@ -0,0 +1,115 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "zero.h"
+
+typedef bool (*zero_check_fn)(const uint8_t *buf, size_t len);
+
+static bool zero_check_scalar(const uint8_t *buf, size_t len)
+{
+    uint64_t acc = 0;
+    size_t i = 0;
+    for (; i + 4 * sizeof(uint64_t) <= len; i += 4 * sizeof(uint64_t))
+    {
+        uint64_t words[4];
+        memcpy(words, buf + i, sizeof(words));
+        acc |= words[0] | words[1] | words[2] | words[3];
+        /* stop at the first data instead of reading the whole block */
+        if (acc)
+        {
+            return false;
+        }
+    }
+    for (; i < len; i++)
+    {
+        acc |= buf[i];
+    }
+    return acc == 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static bool zero_check_sse2(const uint8_t *buf, size_t len)
+{
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m128i acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i)),
+                                                _mm_loadu_si128((const __m128i *)(buf + i + 16))),
+                                   _mm_or_si128(_mm_loadu_si128((const __m128i *)(buf + i + 32)),
+                                                _mm_loadu_si128((const __m128i *)(buf + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+        {
+            return false;
+        }
+    }
+    return zero_check_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2"))) static bool zero_check_avx2(const uint8_t *buf, size_t len)
+{
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128)
+    {
+        __m256i acc = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i)),
+                                                      _mm256_loadu_si256((const __m256i *)(buf + i + 32))),
+                                      _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i + 64)),
+                                                      _mm256_loadu_si256((const __m256i *)(buf + i + 96))));
+        if (!_mm256_testz_si256(acc, acc))
+        {
+            return false;
+        }
+    }
+    return zero_check_scalar(buf + i, len - i);
+}
+#endif
+
+static zero_check_fn zero_check_select(const char **name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        *name = "avx2";
+        return zero_check_avx2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        *name = "sse2";
+        return zero_check_sse2;
+    }
+#endif
+    *name = "scalar";
+    return zero_check_scalar;
+}
+
+/* every thread selects the same kernel, a race only repeats the selection */
+static zero_check_fn zero_check_impl;
+static const char *zero_check_name;
+
+static zero_check_fn zero_check_get(void)
+{
+    zero_check_fn fn = __atomic_load_n(&zero_check_impl, __ATOMIC_ACQUIRE);
+    if (fn == NULL)
+    {
+        const char *name;
+        fn = zero_check_select(&name);
+        __atomic_store_n(&zero_check_name, name, __ATOMIC_RELAXED);
+        __atomic_store_n(&zero_check_impl, fn, __ATOMIC_RELEASE);
+    }
+    return fn;
+}
+
+bool zero_check(const void *buf, size_t len)
+{
+    return zero_check_get()(buf, len);
+}
+
+const char *zero_check_kernel(void)
+{
+    zero_check_get();
+    return __atomic_load_n(&zero_check_name, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,26 @@
+#ifndef ZERO_H
+#define ZERO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * @brief check whether a buffer holds nothing but zeroes.
+ *
+ * The check uses AVX2 or SSE2 when the CPU has it and compares 64 bit
+ * words otherwise.
+ *
+ * @param buf the buffer.
+ * @param len length of the buffer in byte.
+ * @return true if every byte is 0.
+ */
+bool zero_check(const void *buf, size_t len);
+
+/**
+ * @brief get the name of the kernel zero_check() uses.
+ *
+ * @return "avx2", "sse2" or "scalar".
+ */
+const char *zero_check_kernel(void);
+
+#endif /* ZERO_H */